@@ -0,0 +1,488 @@
+/*
+ * bench - time the native tools on large synthetic inputs
+ *
+ * See LICENSE for details.
+ *
+ * usage: bench [-n lines] [-m megabytes] [-T tooldir] [-w workdir]
+ *              [-o results.json] [-b baseline.json] [-t tolerance]
+ *
+ * -n lines      size of the generated 8080 source (default 200000)
+ * -m megabytes  size of the generated hex file and PRL images (default 8)
+ * -T tooldir    where asm/, hexcom/, genhex/ and genprlmap/ are (../tools)
+ * -w workdir    where the inputs are generated (work)
+ * -o file       write the results there as well as to stdout
+ * -b file       compare with a baseline written by an earlier -o; exits 1
+ *               if anything is slower by more than the tolerance
+ * -t tolerance  in percent (default 20)
+ *
+ * The inputs are:
+ *
+ *  - an 8080 source with a label every fourth line, every label referred to
+ *    from elsewhere (forwards and backwards), EQUs, DBs, DWs and comments;
+ *    half the labels start with the same letter.  It's split into files of
+ *    up to 10000 lines, assembled together, so that each one's output fits
+ *    in 64K from a single ORG 100H and --onepass never has to fall back
+ *  - an Intel hex file of 32 byte records in random order, covering three
+ *    pages in four of the 64K over and over
+ *  - 32 copies of a 60K .com file for genhex to encode at once
+ *  - a pair of images a page apart for genprlmap's bitmap
+ *
+ * Every input is made from the same seed, so runs are comparable.  Each
+ * tool is run until it's had a second (at least three times, at most ten)
+ * and the best time is kept.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define LABEL_EVERY 4
+#define FILE_LINES 10000        /* at most 5.5 bytes a line, so inside 64K */
+#define MAX_FILES 1000          /* BENCHnnn.ASM */
+#define HEX_RECORD 32
+#define COM_SIZE (60 * 1024)
+#define COM_COPIES 32
+
+struct result {
+    const char *name;
+    int runs;
+    double seconds;
+    uint64_t input_bytes;
+    uint64_t lines;             /* 0 if not a source */
+};
+
+static uint64_t seed = 0x9e3779b97f4a7c15ULL;
+static const char *tooldir = "../tools";
+static const char *workdir = "work";
+
+static struct result results[8];
+static int result_count;
+
+static uint64_t next_random(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *path(const char *dir, const char *name) {
+    char *s = malloc(strlen(dir) + strlen(name) + 2);
+    if (!s) {
+        fprintf(stderr, "error: out of memory\n");
+        exit(1);
+    }
+    sprintf(s, "%s/%s", dir, name);
+    return s;
+}
+
+static FILE *create(const char *name) {
+    char *p = path(workdir, name);
+    FILE *f = fopen(p, "wb");
+    if (!f) {
+        fprintf(stderr, "error: unable to create %s\n", p);
+        exit(1);
+    }
+    free(p);
+    return f;
+}
+
+static void finish(FILE *f, const char *name) {
+    if (ferror(f) || fclose(f) != 0) {
+        fprintf(stderr, "error: unable to write %s\n", name);
+        exit(1);
+    }
+}
+
+static uint64_t file_size(const char *name) {
+    struct stat st;
+    char *p = path(workdir, name);
+    uint64_t size = stat(p, &st) == 0 ? (uint64_t) st.st_size : 0;
+    free(p);
+    return size;
+}
+
+/* Label n's name: half start with X, to load up a single first letter. */
+static void label(char *buf, unsigned long n) {
+    static const char letters[] = "ABCDEFGHIJKLMNOPQRSTUVWYZ";
+    uint64_t h = n * 0x9e3779b97f4a7c15ULL;
+    char first = (h >> 60) < 8 ? 'X' : letters[(h >> 32) % 25];
+
+    sprintf(buf, "%c%c%c%05lu", first, 'A' + (int) ((h >> 40) % 26),
+            'A' + (int) ((h >> 48) % 26), n);
+}
+
+static uint64_t gen_source(const char *name, unsigned long lines) {
+    static const char *ops[] = { "MOV\tA,B", "ADD\tC", "XRA\tA", "INX\tH", "DCR\tE", "RLC" };
+    unsigned long labels = (lines - 2) / LABEL_EVERY;  /* defined below */
+    FILE *f = create(name);
+    char a[16], b[16];
+
+    fprintf(f, "; synthetic benchmark source, %lu lines\n", lines);
+    for (unsigned long i=1; i<lines-1; i++) {
+        unsigned long r = next_random();
+
+        if (i == 1) {
+            fprintf(f, "\tORG\t100H\n");
+            continue;
+        }
+        label(a, r % labels);
+        switch (i % LABEL_EVERY) {
+        case 0:
+            label(b, i / LABEL_EVERY - 1);
+            fprintf(f, "%s:\tLXI\tH,%s\t; refer to another label\n", b, a);
+            break;
+        case 1:
+            switch ((r >> 20) % 5) {
+            case 0: fprintf(f, "\tJMP\t%s\n", a); break;
+            case 1: fprintf(f, "\tDB\t'SOME TEXT %lu',0DH,0AH,'$'\n", r % 1000); break;
+            case 2: fprintf(f, "\tDW\t%s,%s+2,%luH\n", a, a, (r >> 8) & 0xfff); break;
+            case 3: fprintf(f, "E%06lu\tEQU\t%lu*2+%lu\n", i, (r >> 8) & 0xff, (r >> 16) & 0xff); break;
+            default: fprintf(f, "; a comment line with some words in it %lu\n", r % 99991); break;
+            }
+            break;
+        case 2:
+            fprintf(f, "\tMVI\tA,0%02lXH\n", (r >> 12) & 0x7f);
+            break;
+        default:
+            fprintf(f, "\t%s\n", ops[(r >> 24) % 6]);
+            break;
+        }
+    }
+    fprintf(f, "\tEND\n");
+    finish(f, name);
+    return file_size(name);
+}
+
+/* The source, as BENCH000.ASM, BENCH001.ASM..., with about as many lines in
+ * each; their names go in names (as asm is given them, to write no .prn) and
+ * the number of files is returned. */
+static unsigned gen_sources(unsigned long lines, char **names, uint64_t *bytes) {
+    unsigned files = (lines + FILE_LINES - 1) / FILE_LINES;
+    char name[16];
+
+    *bytes = 0;
+    for (unsigned k=0; k<files; k++) {
+        sprintf(name, "BENCH%03u.ASM", k);
+        *bytes += gen_source(name, lines / files + (k < lines % files));
+        sprintf(name, "BENCH%03u.@@Z", k);
+        names[k] = strdup(name);
+    }
+    return files;
+}
+
+static uint64_t gen_hex(const char *name, unsigned long megabytes) {
+    enum { RECORDS = 0x10000 / HEX_RECORD };
+    static unsigned order[RECORDS];
+    uint64_t target = (uint64_t) megabytes << 20, written = 0;
+    FILE *f = create(name);
+    int n = 0;
+
+    for (unsigned i=0; i<RECORDS; i++)
+        if ((i * HEX_RECORD >> 8) % 4 != 3)    /* leave gaps */
+            order[n++] = i * HEX_RECORD;
+
+    while (written < target) {
+        for (int i=n-1; i>0; i--) {
+            int j = next_random() % (i + 1);
+            unsigned t = order[i];
+            order[i] = order[j];
+            order[j] = t;
+        }
+        for (int i=0; i<n; i++) {
+            unsigned char chk = HEX_RECORD + (order[i] >> 8) + (order[i] & 0xff);
+            int k = fprintf(f, ":%02X%04X00", HEX_RECORD, order[i]);
+            for (int j=0; j<HEX_RECORD; j++) {
+                unsigned char v = next_random();
+                chk += v;
+                k += fprintf(f, "%02X", v);
+            }
+            k += fprintf(f, "%02X\r\n", (unsigned char) -chk);
+            written += k;
+        }
+    }
+    fprintf(f, ":00000001FF\r\n");
+    finish(f, name);
+    return file_size(name);
+}
+
+static void gen_random(const char *name, size_t size) {
+    FILE *f = create(name);
+    for (size_t i=0; i<size; i++)
+        putc((unsigned char) next_random(), f);
+    finish(f, name);
+}
+
+/* Two images, one with about one byte in ten the high byte of an address. */
+static void gen_prl_pair(const char *at0, const char *at100, size_t size) {
+    FILE *f = create(at0), *g = create(at100);
+
+    for (size_t i=0; i<size; i++) {
+        uint64_t r = next_random();
+        unsigned char v = r;
+        putc(v, f);
+        putc((r >> 32) % 10 == 0 ? (unsigned char) (v + 1) : v, g);
+    }
+    finish(f, at0);
+    finish(g, at100);
+}
+
+/* How many lines of a file in the work directory contain text. */
+static unsigned count_lines(const char *name, const char *text) {
+    char *p = path(workdir, name), line[256];
+    FILE *f = fopen(p, "r");
+    unsigned n = 0;
+
+    free(p);
+    while (f && fgets(line, sizeof(line), f))
+        n += strstr(line, text) != NULL;
+    if (f)
+        fclose(f);
+    return n;
+}
+
+/* Runs a tool in the work directory, from stdin and to stdout as given (in
+ * the work directory, or /dev/null), and returns how long it took.  What it
+ * says on stderr is kept for if it fails. */
+static double run(char **argv, const char *in, const char *out) {
+    double start = now();
+    pid_t pid = fork();
+    int status;
+
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        int i, o, e;
+        if (chdir(workdir) < 0)
+            _exit(127);
+        i = open(in ? in : "/dev/null", O_RDONLY);
+        o = open(out ? out : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        e = open("stderr.txt", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (i < 0 || o < 0 || e < 0 || dup2(i, 0) < 0 || dup2(o, 1) < 0 || dup2(e, 2) < 0)
+            _exit(127);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        char *p = path(workdir, "stderr.txt");
+        fprintf(stderr, "error: %s failed; see %s\n", argv[0], p);
+        exit(1);
+    }
+    return now() - start;
+}
+
+static void bench(const char *name, char **argv, const char *in, const char *out,
+                  uint64_t input_bytes, uint64_t lines) {
+    struct result *r = &results[result_count++];
+    double total = 0;
+
+    r->name = name;
+    r->input_bytes = input_bytes;
+    r->lines = lines;
+    r->seconds = 1e30;
+    for (r->runs = 0; r->runs < 10 && (r->runs < 3 || total < 1.0); r->runs++) {
+        double t = run(argv, in, out);
+        total += t;
+        if (t < r->seconds)
+            r->seconds = t;
+    }
+    fprintf(stderr, "%-16s %8.3f s  %8.1f MB/s\n", name, r->seconds,
+            input_bytes / r->seconds / 1e6);
+}
+
+static void write_results(FILE *f, unsigned long lines, unsigned long megabytes) {
+    fprintf(f, "{\n  \"lines\": %lu,\n  \"megabytes\": %lu,\n  \"benchmarks\": [\n",
+            lines, megabytes);
+    for (int i=0; i<result_count; i++) {
+        const struct result *r = &results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"runs\": %d, \"seconds\": %.6f, "
+                "\"input_bytes\": %llu, \"mb_per_s\": %.2f",
+                r->name, r->runs, r->seconds, (unsigned long long) r->input_bytes,
+                r->input_bytes / r->seconds / 1e6);
+        if (r->lines)
+            fprintf(f, ", \"lines_per_s\": %.0f", r->lines / r->seconds);
+        fprintf(f, "}%s\n", i < result_count - 1 ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+/* Reads back what write_results() wrote; returns 0 if name isn't there. */
+static double baseline_speed(const char *text, const char *name) {
+    char key[64];
+    const char *p;
+
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+    p = strstr(text, key);
+    if (!p || !(p = strstr(p, "\"mb_per_s\": ")))
+        return 0;
+    return atof(p + 12);
+}
+
+static bool compare(const char *filename, double tolerance, unsigned long lines,
+                    unsigned long megabytes) {
+    FILE *f = fopen(filename, "rb");
+    char *text;
+    const char *p, *q;
+    long size;
+    bool ok = true;
+
+    if (!f || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0) {
+        fprintf(stderr, "error: unable to read %s\n", filename);
+        exit(1);
+    }
+    rewind(f);
+    text = calloc(size + 1, 1);
+    if (!text || fread(text, 1, size, f) != (size_t) size) {
+        fprintf(stderr, "error: unable to read %s\n", filename);
+        exit(1);
+    }
+    fclose(f);
+
+    /* Speeds on inputs of other sizes aren't comparable. */
+    p = strstr(text, "\"lines\": ");
+    q = strstr(text, "\"megabytes\": ");
+    if (!p || !q || strtoul(p + 9, NULL, 10) != lines || strtoul(q + 13, NULL, 10) != megabytes) {
+        fprintf(stderr, "error: %s isn't for -n %lu -m %lu\n", filename, lines, megabytes);
+        free(text);
+        return false;
+    }
+
+    for (int i=0; i<result_count; i++) {
+        const struct result *r = &results[i];
+        double speed = r->input_bytes / r->seconds / 1e6;
+        double base = baseline_speed(text, r->name);
+        double change;
+
+        if (base <= 0) {
+            fprintf(stderr, "%-16s not in %s\n", r->name, filename);
+            continue;
+        }
+        change = (speed / base - 1) * 100;
+        fprintf(stderr, "%-16s %8.1f MB/s against %8.1f  %+6.1f%%%s\n", r->name,
+                speed, base, change, change < -tolerance ? "  SLOWER" : "");
+        if (change < -tolerance)
+            ok = false;
+    }
+    free(text);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    unsigned long lines = 200000, megabytes = 8;
+    const char *output = NULL, *baseline = NULL;
+    double tolerance = 20;
+    char *asm_tool, *hexcom, *genhex, *genprlmap;
+    char *asm_args[3 + MAX_FILES];
+    uint64_t source_bytes, hex_bytes;
+    unsigned files;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:m:T:w:o:b:t:")) != -1) {
+        switch (c) {
+        case 'n': lines = strtoul(optarg, NULL, 10); break;
+        case 'm': megabytes = strtoul(optarg, NULL, 10); break;
+        case 'T': tooldir = optarg; break;
+        case 'w': workdir = optarg; break;
+        case 'o': output = optarg; break;
+        case 'b': baseline = optarg; break;
+        case 't': tolerance = atof(optarg); break;
+        default:
+            fprintf(stderr, "usage: bench [-n lines] [-m megabytes] [-T tooldir] [-w workdir] "
+                    "[-o results.json] [-b baseline.json] [-t tolerance]\n");
+            return 1;
+        }
+    }
+    if (lines < LABEL_EVERY * 2 || megabytes < 1) {
+        fprintf(stderr, "error: inputs too small\n");
+        return 1;
+    }
+    if (lines > (unsigned long) FILE_LINES * MAX_FILES) {
+        fprintf(stderr, "error: source too big\n");
+        return 1;
+    }
+
+    /* The tools are run from the work directory. */
+    {
+        char cwd[4096], *tools;
+        if (!getcwd(cwd, sizeof(cwd))) {
+            perror("getcwd");
+            return 1;
+        }
+        tools = tooldir[0] == '/' ? (char *) tooldir : path(cwd, tooldir);
+        asm_tool = path(tools, "asm/asm");
+        hexcom = path(tools, "hexcom/hexcom");
+        genhex = path(tools, "genhex/genhex");
+        genprlmap = path(tools, "genprlmap/genprlmap");
+    }
+    mkdir(workdir, 0777);
+
+    fprintf(stderr, "generating inputs in %s\n", workdir);
+    files = gen_sources(lines, asm_args + 2, &source_bytes);
+    asm_args[2 + files] = NULL;
+    hex_bytes = gen_hex("bench.hex", megabytes);
+    gen_random("bench.com", COM_SIZE);
+    gen_prl_pair("at0.com", "at100.com", (size_t) megabytes << 20);
+
+    /* asm doesn't give an exit status for one file, so look at what it said;
+     * --onepass mustn't have needed the second pass. */
+    asm_args[1] = asm_tool;
+    bench("asm", asm_args + 1, NULL, "asm.txt", source_bytes, lines);
+    if (count_lines("asm.txt", "Assembly successful") != files) {
+        fprintf(stderr, "error: BENCH*.ASM didn't assemble; see %s/asm.txt\n", workdir);
+        return 1;
+    }
+    asm_args[0] = asm_tool;
+    asm_args[1] = "--onepass";
+    bench("asm-onepass", asm_args, NULL, "asm.txt", source_bytes, lines);
+    if (count_lines("asm.txt", "Assembly successful") != files
+        || count_lines("asm.txt", "second pass")) {
+        fprintf(stderr, "error: BENCH*.ASM didn't assemble in one pass; see %s/asm.txt\n",
+                workdir);
+        return 1;
+    }
+    {
+        char *args[] = { hexcom, NULL };
+        bench("hexcom", args, "bench.hex", NULL, hex_bytes, 0);
+    }
+    {
+        char *args[2 + 2 * COM_COPIES] = { genhex };
+        for (int i=0; i<COM_COPIES; i++) {
+            args[1 + 2*i] = "bench.com";
+            args[2 + 2*i] = "100";
+        }
+        bench("genhex", args, NULL, NULL, (uint64_t) COM_SIZE * COM_COPIES, 0);
+    }
+    {
+        char *args[] = { genprlmap, "at0.com", "at100.com", "bench.map", NULL };
+        bench("genprlmap", args, NULL, NULL, (uint64_t) megabytes << 21, 0);
+    }
+
+    write_results(stdout, lines, megabytes);
+    if (output) {
+        FILE *f = fopen(output, "w");
+        if (!f) {
+            fprintf(stderr, "error: unable to create %s\n", output);
+            return 1;
+        }
+        write_results(f, lines, megabytes);
+        finish(f, output);
+    }
+    fflush(stdout);
+    if (baseline && !compare(baseline, tolerance, lines, megabytes))
+        return 1;
+    return 0;
+}
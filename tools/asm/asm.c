@@ -26,18 +26,45 @@
  *  - the .prn file syntax is quite different (and very crude), and defaults
  *    to Z: (i.e. no output) if you don't explicitly ask for it.
  *
- *  - if...endif supports else (but still doesn't support nesting)
- * 
+ *  - if...endif supports else, and nests
+ *
+ *  - MAC's macros: MACRO, ENDM, REPT, IRP, IRPC, EXITM, LOCAL and MACLIB,
+ *    along with its relational operators, NUL, PAGE, and ? and @ in names
+ *
+ *  - --symstats reports symbol table load factor and probe counts
+ *
+ *  - --stats reports where the time went, and --stats=json does the same as
+ *    one line of JSON
+ *
+ *  - --onepass assembles in a single pass where it can, patching forward
+ *    references at the end (not when writing a listing)
+ *
+ *  - org may move backwards, overlaying what was assembled there before
+ *
+ *  - --hex[=N] writes an Intel hex file (N bytes per record) rather than a
+ *    .bin; --prl writes a page relocatable .prl, by assembling the program
+ *    twice a page apart
+ *
  *  - bugs
+ *
+ * The assembler itself is built as a library, libasm8080.a, which can also
+ * assemble from a buffer into memory; see asm8080.h.  The command line tool
+ * is in main.c.
  */
 
 #include <cpm.h>
+#include <asm8080.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
-#include <unistd.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 typedef uint16_t token_t;
 
@@ -51,21 +78,31 @@ enum
     TOKEN_STRING
 };
 
+/* A growable buffer for output kept in memory. */
+struct byte_buffer
+{
+    char* data;
+    size_t length;
+    size_t size;
+};
+
 struct output_file
 {
-    uint8_t fill;
+    uint8_t fill; /* bytes into the last record */
     FCB fcb;
-    uint8_t buffer[128];
     bool opened : 1;
+    struct byte_buffer memory;
 };
 
 struct symbol
 {
     uint8_t namelen;
     uint16_t value;
+    uint32_t hash;
     void (*callback)(void);
-    struct symbol* next;
-    char* name; /* not zero terminated */
+    char* name;
+    struct fixup* definition; /* EQU/SET waiting on a forward reference */
+    struct macro* macro;
 };
 
 struct operator
@@ -87,6 +124,12 @@ uint16_t shl_cb(uint16_t left, uint16_t right) { return left << right; }
 uint16_t shr_cb(uint16_t left, uint16_t right) { return left >> right; }
 uint16_t sub_cb(uint16_t left, uint16_t right) { return left - right; }
 uint16_t xor_cb(uint16_t left, uint16_t right) { return left ^ right; }
+uint16_t eq_cb(uint16_t left, uint16_t right)  { return (left == right) ? 0xffff : 0; }
+uint16_t ne_cb(uint16_t left, uint16_t right)  { return (left != right) ? 0xffff : 0; }
+uint16_t lt_cb(uint16_t left, uint16_t right)  { return (left < right) ? 0xffff : 0; }
+uint16_t le_cb(uint16_t left, uint16_t right)  { return (left <= right) ? 0xffff : 0; }
+uint16_t gt_cb(uint16_t left, uint16_t right)  { return (left > right) ? 0xffff : 0; }
+uint16_t ge_cb(uint16_t left, uint16_t right)  { return (left >= right) ? 0xffff : 0; }
 
 enum
 {
@@ -102,226 +145,521 @@ enum
     OP_SHR,
     OP_SUB,
     OP_XOR,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
     OP_PAR
 };
 
 const struct operator operators[] =
 {
     { add_cb, 2, true },
-    { and_cb, 4, true },
+    { and_cb, 5, true },
     { div_cb, 1, true },
     { mod_cb, 1, true },
     { mul_cb, 1, true },
     { neg_cb, 0, false },
-    { not_cb, 3, false },
-    { or_cb,  5, true},
+    { not_cb, 4, false },
+    { or_cb,  6, true},
     { shl_cb, 1, true },
     { shr_cb, 1, true },
     { sub_cb, 2, true },
     { xor_cb, 2, true },
+    { eq_cb,  3, true },
+    { ne_cb,  3, true },
+    { lt_cb,  3, true },
+    { le_cb,  3, true },
+    { gt_cb,  3, true },
+    { ge_cb,  3, true },
     { NULL,   0xff, false },
 };
 
 #define CONSOLE_DRIVE ('X' - '@') /* FCB drive number representing console */
+#define MEMORY_DRIVE  ('Y' - '@') /* FCB drive number representing a buffer */
 #define SKIP_DRIVE    ('Z' - '@') /* FCB drive number representing /dev/null */
 
-#define asm_fcb cpm_fcb
-struct output_file bin_file;
-struct output_file prn_file;
-int pass;
-bool eol;
-uint16_t lineno;
-uint16_t program_counter;
-bool db_string_constant_hack = false;
-
-uint8_t input_buffer_read_count;
-uint8_t token_length;
-uint8_t token_buffer[64];
-uint16_t token_number;
-struct symbol* token_symbol;
-
 #define PRN_BUFFER_LEFT_COLUMN_WIDTH 15
-uint8_t prn_buffer[120];
-uint8_t prn_buffer_left_fill;
-uint8_t prn_buffer_right_fill;
+#define PRN_LINE_LENGTH 120 /* longest listing line, before the CR LF */
+#define OUTPUT_CHUNK_SIZE 65536 /* .prn files are written this much at a time */
+#define STACK_DEPTH 32
+
+/* The symbol table is open addressed with linear probing, keyed on a hash of
+ * the whole name, and doubles whenever it becomes half full. */
+#define SYMTAB_INITIAL_SIZE 512
+struct symbol_table
+{
+    struct symbol** slots;
+    uint32_t size;
+    uint32_t count;
+    uint32_t lookups;
+    uint32_t probes;
+    uint32_t max_probes;
+    uint32_t resizes;
+};
+
+/* Symbols (and their names, which immediately follow each node) are bump
+ * allocated from a chain of chunks.  Resetting the arena just rewinds to the
+ * first chunk; the chunks themselves are kept for the next assembly. */
+#define ARENA_CHUNK_SIZE 65536
+struct arena_chunk
+{
+    struct arena_chunk* next;
+    size_t fill;
+    uint8_t data[ARENA_CHUNK_SIZE];
+};
+
+/* The program is assembled into a 64K image covering the whole address
+ * space, plus a record of zeroes to pad the last one.  The .bin file is the
+ * range between the lowest and highest addresses written, rounded up to a
+ * whole record, written in one go at the end.
+ *
+ * In one-pass mode pass 0 builds the output image itself.  Each expression
+ * is also recorded in postfix form, and if it refers to a symbol which isn't
+ * known yet, the place it was used goes on a fixup list to be patched once
+ * the whole source has been read.  An EQU or SET with such an expression
+ * keeps it as the symbol's definition, and later uses of the symbol copy the
+ * definition in place, so they see the value the second pass would have
+ * given the symbol at that point.  Anything which affects the layout of the
+ * program (ORG, DS, IF, register operands) must be known when it's seen; if
+ * it isn't, assembly falls back to the ordinary second pass. */
+#define EXPR_CODE_SIZE 32
+
+enum
+{
+    EXPR_VALUE,
+    EXPR_SYMBOL,
+    EXPR_OPERATOR
+};
+
+struct expr_op
+{
+    uint8_t kind;
+    uint8_t opid;
+    uint16_t value;
+    struct symbol* symbol;
+};
+
+struct fixup
+{
+    struct fixup* next;
+    struct symbol* symbol; /* deferred EQU/SET, or NULL to patch the image */
+    uint16_t address;
+    uint8_t width;
+    uint8_t length;
+    struct expr_op code[];
+};
+
+/* A macro body is kept with its parameters already found, so expanding it
+ * never has to look for them again: the text between them is copied as it
+ * is, and each MACRO_PARAM byte is followed by the number of the parameter
+ * (or, after those, the LOCAL name) which goes there. */
+#define MACRO_PARAM 0x01
+#define MACRO_NAMES 64 /* parameters and LOCALs */
+#define MACRO_NAME_LENGTH 32
+#define INPUT_DEPTH 64
+
+struct macro
+{
+    uint8_t params;
+    uint8_t locals;
+    uint32_t length;
+    uint8_t body[];
+};
+
+struct macro_names
+{
+    uint8_t count;
+    uint8_t params; /* the rest are LOCALs */
+    uint8_t length[MACRO_NAMES];
+    uint8_t name[MACRO_NAMES][MACRO_NAME_LENGTH]; /* upper case, without $s */
+};
+
+struct text_span
+{
+    uint32_t start;
+    uint32_t length;
+};
+
+/* Input read in place of the source file for a while: a macro expansion
+ * (an iteration at a time, for REPT, IRP and IRPC) or a macro library.  What
+ * it covers up is put back when it runs out, or at EXITM. */
+struct input_source
+{
+    const struct macro* macro; /* NULL if text is read as it is */
+    bool irp;                  /* parameter 0 takes each argument in turn */
+    uint16_t iteration;
+    uint16_t iterations;
+    uint16_t locals;           /* number of the first LOCAL name */
+    struct byte_buffer text;
+    struct byte_buffer body;   /* the macro, for REPT, IRP and IRPC */
+    struct byte_buffer args;   /* argument texts, one after another */
+    struct byte_buffer spans;  /* a text_span for each argument */
+
+    const uint8_t* ptr;
+    const uint8_t* end;
+    bool eol;
+    bool listing_input;
+    uint16_t if_depth;
+};
+
+/* A use of a symbol, for the cross-reference. */
+struct reference
+{
+    const struct symbol* symbol;
+    uint16_t line;
+    bool definition;
+};
+
+/* Everything belonging to one assembly.  Each thread works on one context at
+ * a time, found through ctx. */
+struct asm_context
+{
+    bool symstats;
+    bool onepass;
+    uint16_t origin;
+    bool report_stats;
+    bool stats_json;
+    bool xref;
+    bool noting_references; /* ...during the pass which makes the listing */
+    struct byte_buffer references;
+    struct asm8080_stats stats;
+    double start_time;
+
+    jmp_buf abort;
+    bool console_buffered;
+    struct byte_buffer console;
+
+    FCB asm_fcb;
+    uint8_t dma[128];
+    struct output_file bin_file;
+    struct output_file prn_file;
+    int pass;
+    bool eol;
+    uint16_t lineno;
+    uint16_t if_depth; /* IFs whose ENDIF is still to come */
+    bool listing_input; /* input is copied into the listing as it's read */
+    bool listing_line;  /* ...and was when this statement started */
+    uint16_t program_counter;
+    bool db_string_constant_hack;
+
+    /* The lexer reads from a window of input: either the whole source,
+     * mapped into memory, or the current 128-byte record in dma. */
+    const uint8_t* input_map;
+    size_t input_map_length;
+    const uint8_t* input_window; /* start of the current window */
+    const uint8_t* input_ptr;
+    const uint8_t* input_end;
+    struct input_source inputs[INPUT_DEPTH];
+    unsigned input_depth;
+    unsigned input_ends; /* inputs (and iterations) which have finished */
+    uint16_t local_count; /* LOCAL names made this pass */
+    struct byte_buffer operand; /* raw operand text of a macro statement */
+    struct byte_buffer line;    /* a line of a macro being defined */
+    struct byte_buffer body;    /* ...and the body so far */
+    struct byte_buffer expression;
+
+    uint8_t token_length;
+    uint8_t token_buffer[64];
+    uint16_t token_number;
+    struct symbol* token_symbol;
+
+    uint8_t prn_buffer[PRN_LINE_LENGTH + 3];
+    uint8_t prn_buffer_left_fill;
+    uint8_t prn_buffer_right_fill;
+
+    struct symbol* current_label;
+    struct symbol* current_insn;
+
+    uint16_t value_stack[STACK_DEPTH];
+    uint8_t operator_stack[STACK_DEPTH];
+    uint8_t value_sp;
+    uint8_t operator_sp;
+
+    struct symbol_table symbols;
+    struct arena_chunk* arena_first;
+    struct arena_chunk* arena_current;
+
+    bool recording;
+    bool onepass_failed;
+    bool expr_unresolved;
+    bool expr_overflow;
+    uint8_t expr_length;
+    struct expr_op expr_code[EXPR_CODE_SIZE];
+    struct fixup* fixups;
+
+    uint8_t image[0x10000 + 128];
+    uint8_t image_written[0x10000 / 8]; /* bytes actually assembled */
+    bool image_used;
+    uint16_t image_start;
+    uint32_t image_end;
+
+    /* Any output other than a plain .bin is built in memory. */
+    uint8_t hex_record_length; /* nonzero for .hex */
+    bool prl;
+    uint16_t bias; /* added to every origin */
+    uint8_t* prl_image; /* the program assembled a page higher */
+    struct byte_buffer output;
+
+    struct asm8080_symbol* symbol_list;
+    size_t symbol_list_size;
+};
+
+__thread struct asm_context* ctx;
+
+/* Character classes used by the lexer. */
+enum
+{
+    CC_SPACE       = 1<<0, /* whitespace other than newline */
+    CC_DIGIT       = 1<<1,
+    CC_ALPHA       = 1<<2, /* letters, ? and @ */
+    CC_IDENT       = 1<<3, /* letters, digits, _, ? and @ */
+    CC_CNTRL       = 1<<4,
+    CC_COMMENT_END = 1<<5, /* !, newline or ^Z */
+    CC_STATEMENT_END = 1<<6 /* anything a skipped statement stops at */
+};
 
-struct symbol* current_label;
-struct symbol* current_insn;
+/* Shared, read-only once initialised. */
+struct symbol_table builtin_table;
+uint8_t eof_record[128];
+uint8_t char_class[256];
+uint8_t char_upper[256];
+uint8_t char_digit[256]; /* value of 0-9 and A-Z as a digit */
+uint8_t char_listed[256]; /* how a byte of source shows in the listing */
 
 extern token_t read_expression(void);
 extern void close_output_file(struct output_file* f);
 
-#define INSN(id, name, value, cb, next) \
+#define INSN(id, name, value, cb) \
     extern void cb(void); \
-    struct symbol id = { sizeof(name)-1, value, cb, next, name }
+    struct symbol id = { sizeof(name)-1, value, 0, cb, name, NULL, NULL }
 
-#define VALUE(id, name, value, next) \
-    struct symbol id = { sizeof(name)-1, value, equlabel_cb, next, name }
+#define VALUE(id, name, value) \
+    struct symbol id = { sizeof(name)-1, value, 0, equlabel_cb, name, NULL, NULL }
 
 extern void operator_cb(void);
 extern void undeflabel_cb(void);
 extern void setlabel_cb(void);
 extern void equlabel_cb(void);
-
-INSN(and_symbol,   "AND",   OP_AND, operator_cb, NULL);
-VALUE(a_symbol,    "A",     7,                   &and_symbol);
-INSN(ana_symbol,   "ANA",   0xa0,   alusrc_cb,   &a_symbol);
-INSN(add_symbol,   "ADD",   0x80,   alusrc_cb,   &ana_symbol);
-INSN(adc_symbol,   "ADC",   0x88,   alusrc_cb,   &add_symbol);
-INSN(ani_symbol,   "ANI",   0xe6,   simple2b_cb, &adc_symbol);
-INSN(adi_symbol,   "ADI",   0xc6,   simple2b_cb, &ani_symbol);
-INSN(aci_symbol,   "ACI",   0xce,   simple2b_cb, &adi_symbol);
-
-VALUE(b_symbol,    "B",     0,                   NULL);
-
-VALUE(c_symbol,    "C",     1,                   NULL);
-INSN(call_symbol,  "CALL",  0xcd,   simple3b_cb, &c_symbol);
-INSN(cmp_symbol,   "CMP",   0xb8,   alusrc_cb,   &call_symbol);
-INSN(cpi_symbol,   "CPI",   0xfe,   simple2b_cb, &cmp_symbol);
-INSN(cnz_symbol,   "CNZ",   0xc4,   simple3b_cb, &cpi_symbol);
-INSN(cz_symbol,    "CZ",    0xcc,   simple3b_cb, &cnz_symbol);
-INSN(cnc_symbol,   "CNC",   0xd4,   simple3b_cb, &cz_symbol);
-INSN(cc_symbol,    "CC",    0xdc,   simple3b_cb, &cnc_symbol);
-INSN(cpo_symbol,   "CPO",   0xe4,   simple3b_cb, &cc_symbol);
-INSN(cpe_symbol,   "CPE",   0xec,   simple3b_cb, &cpo_symbol);
-INSN(cp_symbol,    "CP",    0xf4,   simple3b_cb, &cpe_symbol);
-INSN(cm_symbol,    "CM",    0xfc,   simple3b_cb, &cp_symbol);
-INSN(cma_symbol,   "CMA",   0x2f,   simple1b_cb, &cm_symbol);
-INSN(cmc_symbol,   "CMC",   0x3f,   simple1b_cb, &cma_symbol);
-
-INSN(db_symbol,    "DB",    0,      db_cb,       NULL);
-INSN(ds_symbol,    "DS",    0,      ds_cb,       &db_symbol);
-INSN(dw_symbol,    "DW",    0,      dw_cb,       &ds_symbol);
-VALUE(d_symbol,    "D",     2,                   &dw_symbol);
-INSN(dcx_symbol,   "DCX",   0x0b,   rp_cb,       &d_symbol);
-INSN(dad_symbol,   "DAD",   0x09,   rp_cb,       &dcx_symbol);
-INSN(dcr_symbol,   "DCR",   0x05,   aludst_cb,   &dad_symbol);
-INSN(daa_symbol,   "DAA",   0x27,   simple1b_cb, &dcr_symbol);
-INSN(di_symbol,    "DI",    0xf3,   simple1b_cb, &daa_symbol);
-
-INSN(equ_symbol,   "EQU",   0,      equ_cb,      NULL);
-INSN(else_symbol,  "ELSE",  0,      else_cb,     &equ_symbol);
-INSN(endif_symbol, "ENDIF", 0,      endif_cb,    &else_symbol);
-VALUE(e_symbol,    "E",     3,                   &endif_symbol);
-INSN(end_symbol,   "END",   0,      end_cb,      &e_symbol);
-INSN(ei_symbol,    "EI",    0xfb,   simple1b_cb, &end_symbol);
-
-VALUE(h_symbol,    "H",     4,                   NULL);
-INSN(hlt_symbol,   "HLT",   0x76,   simple1b_cb, &h_symbol);
-
-INSN(if_symbol,    "IF",    0,      if_cb,       NULL);
-INSN(inx_symbol,   "INX",   0x03,   rp_cb,       &if_symbol);
-INSN(inr_symbol,   "INR",   0x04,   aludst_cb,   &inx_symbol);
-INSN(in_symbol,    "IN",    0xdb,   simple2b_cb, &inr_symbol);
-
-INSN(jmp_symbol,   "JMP",   0xc3,   simple3b_cb, NULL);
-INSN(jnz_symbol,   "JNZ",   0xc2,   simple3b_cb, &jmp_symbol);
-INSN(jz_symbol,    "JZ",    0xca,   simple3b_cb, &jnz_symbol);
-INSN(jnc_symbol,   "JNC",   0xd2,   simple3b_cb, &jz_symbol);
-INSN(jc_symbol,    "JC",    0xda,   simple3b_cb, &jnc_symbol);
-INSN(jpo_symbol,   "JPO",   0xe2,   simple3b_cb, &jc_symbol);
-INSN(jpe_symbol,   "JPE",   0xea,   simple3b_cb, &jpo_symbol);
-INSN(jp_symbol,    "JP",    0xf2,   simple3b_cb, &jpe_symbol);
-INSN(jm_symbol,    "JM",    0xfa,   simple3b_cb, &jp_symbol);
-
-VALUE(l_symbol,    "L",     5,                   NULL);
-INSN(ldax_symbol,  "LDAX",  0x0a,   rp_cb,       &l_symbol);
-INSN(lda_symbol,   "LDA",   0x3a,   simple3b_cb, &ldax_symbol);
-INSN(lxi_symbol,   "LXI",   0,      lxi_cb,      &lda_symbol);
-INSN(lhld_symbol,  "LHLD",  0x2a,   simple3b_cb, &lxi_symbol);
-
-INSN(mod_symbol,   "MOD",   OP_MOD, operator_cb, NULL);
-VALUE(m_symbol,    "M",     6,                   &mod_symbol);
-INSN(mov_symbol,   "MOV",   0,      mov_cb,      &m_symbol);
-INSN(mvi_symbol,   "MVI",   0,      mvi_cb,      &mov_symbol);
-
-INSN(not_symbol,   "NOT",   OP_NOT, operator_cb, NULL);
-INSN(nop_symbol,   "NOP",   0x00,   simple1b_cb, &not_symbol);
-
-INSN(or_symbol,    "OR",    OP_OR,  operator_cb, NULL);
-INSN(org_symbol,   "ORG",   0,      org_cb,      &or_symbol);
-INSN(ora_symbol,   "ORA",   0xb0,   alusrc_cb,   &org_symbol);
-INSN(ori_symbol,   "ORI",   0xf6,   simple2b_cb, &ora_symbol);
-INSN(out_symbol,   "OUT",   0xd3,   simple2b_cb, &ori_symbol);
-
-VALUE(psw_symbol,  "PSW",   6,                   NULL);
-INSN(push_symbol,  "PUSH",  0xc5,   rp_cb,       &psw_symbol);
-INSN(pop_symbol,   "POP",   0xc1,   rp_cb,       &push_symbol);
-INSN(pchl_symbol,  "PCHL",  0xe9,   simple1b_cb, &pop_symbol);
-
-INSN(ret_symbol,   "RET",   0xc9,   simple1b_cb, NULL);
-INSN(rnz_symbol,   "RNZ",   0xc0,   simple1b_cb, &ret_symbol);
-INSN(rz_symbol,    "RZ",    0xc8,   simple1b_cb, &rnz_symbol);
-INSN(rnc_symbol,   "RNC",   0xd0,   simple1b_cb, &rz_symbol);
-INSN(rc_symbol,    "RC",    0xd8,   simple1b_cb, &rnc_symbol);
-INSN(rpo_symbol,   "RPO",   0xe0,   simple1b_cb, &rc_symbol);
-INSN(rpe_symbol,   "RPE",   0xe8,   simple1b_cb, &rpo_symbol);
-INSN(rp_symbol,    "RP",    0xf0,   simple1b_cb, &rpe_symbol);
-INSN(rm_symbol,    "RM",    0xf8,   simple1b_cb, &rp_symbol);
-INSN(rst_symbol,   "RST",   0xc7,   aludst_cb,   &rm_symbol);
-INSN(ral_symbol,   "RAL",   0x17,   simple1b_cb, &rst_symbol);
-INSN(rar_symbol,   "RAR",   0x1f,   simple1b_cb, &ral_symbol);
-INSN(rlc_symbol,   "RLC",   0x07,   simple1b_cb, &rar_symbol);
-INSN(rrc_symbol,   "RRC",   0x0f,   simple1b_cb, &rlc_symbol);
-
-INSN(shl_symbol,   "SHL",   OP_SHL, operator_cb, NULL);
-INSN(shr_symbol,   "SHR",   OP_SHR, operator_cb, &shl_symbol);
-INSN(set_symbol,   "SET",   0,      set_cb,      &shr_symbol);
-VALUE(sp_symbol,   "SP",    6,                   &set_symbol);
-INSN(stax_symbol,  "STAX",  0x02,   rp_cb,       &sp_symbol);
-INSN(sta_symbol,   "STA",   0x32,   simple3b_cb, &stax_symbol);
-INSN(sub_symbol,   "SUB",   0x90,   alusrc_cb,   &sta_symbol);
-INSN(sbb_symbol,   "SBB",   0x98,   alusrc_cb,   &sub_symbol);
-INSN(sbi_symbol,   "SBI",   0xde,   simple2b_cb, &sbb_symbol);
-INSN(sui_symbol,   "SUI",   0xd6,   simple2b_cb, &sbi_symbol);
-INSN(shld_symbol,  "SHLD",  0x22,   simple3b_cb, &sui_symbol);
-INSN(sphl_symbol,  "SPHL",  0xf9,   simple1b_cb, &shld_symbol);
-INSN(stc_symbol,   "STC",   0x37,   simple1b_cb, &sphl_symbol);
-
-INSN(title_symbol, "TITLE", 0,      title_cb, NULL);
-
-INSN(xor_symbol,   "XOR",   OP_XOR, operator_cb, NULL);
-INSN(xra_symbol,   "XRA",   0xa8,   alusrc_cb,   &xor_symbol);
-INSN(xri_symbol,   "XRI",   0xee,   simple2b_cb, &xra_symbol);
-INSN(xchg_symbol,  "XCHG",  0xeb,   simple1b_cb, &xri_symbol);
-INSN(xthl_symbol,  "XTHL",  0xe3,   simple1b_cb, &xchg_symbol);
-
-struct symbol* hashtable[32] =
-{
-    0, /* @ */
-    &aci_symbol,
-    &b_symbol,
-    &cmc_symbol,
-    &di_symbol,
-    &ei_symbol,
-    0, /* F */
-    0, /* G */
-    &hlt_symbol,
-    &in_symbol,
-    &jm_symbol,
-    0, /* K */
-    &lhld_symbol,
-    &mvi_symbol,
-    &nop_symbol,
-    &out_symbol,
-    &pchl_symbol,
-    0, /* Q */
-    &rrc_symbol,
-    &stc_symbol,
-    &title_symbol,
-    0, /* U */
-    0, /* V */
-    0, /* W */
-    &xthl_symbol,
-    0, /* Y */
-    0, /* Z */
-    0, /* [ */
-    0, /* \ */
-    0, /* ] */
-    0, /* ^ */
-    0, /* _ */
+extern void macro_call_cb(void);
+
+INSN(and_symbol,   "AND",   OP_AND, operator_cb);
+VALUE(a_symbol,    "A",     7);
+INSN(ana_symbol,   "ANA",   0xa0,   alusrc_cb);
+INSN(add_symbol,   "ADD",   0x80,   alusrc_cb);
+INSN(adc_symbol,   "ADC",   0x88,   alusrc_cb);
+INSN(ani_symbol,   "ANI",   0xe6,   simple2b_cb);
+INSN(adi_symbol,   "ADI",   0xc6,   simple2b_cb);
+INSN(aci_symbol,   "ACI",   0xce,   simple2b_cb);
+
+VALUE(b_symbol,    "B",     0);
+
+VALUE(c_symbol,    "C",     1);
+INSN(call_symbol,  "CALL",  0xcd,   simple3b_cb);
+INSN(cmp_symbol,   "CMP",   0xb8,   alusrc_cb);
+INSN(cpi_symbol,   "CPI",   0xfe,   simple2b_cb);
+INSN(cnz_symbol,   "CNZ",   0xc4,   simple3b_cb);
+INSN(cz_symbol,    "CZ",    0xcc,   simple3b_cb);
+INSN(cnc_symbol,   "CNC",   0xd4,   simple3b_cb);
+INSN(cc_symbol,    "CC",    0xdc,   simple3b_cb);
+INSN(cpo_symbol,   "CPO",   0xe4,   simple3b_cb);
+INSN(cpe_symbol,   "CPE",   0xec,   simple3b_cb);
+INSN(cp_symbol,    "CP",    0xf4,   simple3b_cb);
+INSN(cm_symbol,    "CM",    0xfc,   simple3b_cb);
+INSN(cma_symbol,   "CMA",   0x2f,   simple1b_cb);
+INSN(cmc_symbol,   "CMC",   0x3f,   simple1b_cb);
+
+INSN(db_symbol,    "DB",    0,      db_cb);
+INSN(ds_symbol,    "DS",    0,      ds_cb);
+INSN(dw_symbol,    "DW",    0,      dw_cb);
+VALUE(d_symbol,    "D",     2);
+INSN(dcx_symbol,   "DCX",   0x0b,   rp_cb);
+INSN(dad_symbol,   "DAD",   0x09,   rp_cb);
+INSN(dcr_symbol,   "DCR",   0x05,   aludst_cb);
+INSN(daa_symbol,   "DAA",   0x27,   simple1b_cb);
+INSN(di_symbol,    "DI",    0xf3,   simple1b_cb);
+
+INSN(equ_symbol,   "EQU",   0,      equ_cb);
+INSN(else_symbol,  "ELSE",  0,      else_cb);
+INSN(endif_symbol, "ENDIF", 0,      endif_cb);
+VALUE(e_symbol,    "E",     3);
+INSN(end_symbol,   "END",   0,      end_cb);
+INSN(ei_symbol,    "EI",    0xfb,   simple1b_cb);
+INSN(eq_symbol,    "EQ",    OP_EQ,  operator_cb);
+INSN(endm_symbol,  "ENDM",  0,      endm_cb);
+INSN(exitm_symbol, "EXITM", 0,      exitm_cb);
+
+INSN(ge_symbol,    "GE",    OP_GE,  operator_cb);
+INSN(gt_symbol,    "GT",    OP_GT,  operator_cb);
+
+VALUE(h_symbol,    "H",     4);
+INSN(hlt_symbol,   "HLT",   0x76,   simple1b_cb);
+
+INSN(if_symbol,    "IF",    0,      if_cb);
+INSN(inx_symbol,   "INX",   0x03,   rp_cb);
+INSN(inr_symbol,   "INR",   0x04,   aludst_cb);
+INSN(in_symbol,    "IN",    0xdb,   simple2b_cb);
+INSN(irp_symbol,   "IRP",   0,      irp_cb);
+INSN(irpc_symbol,  "IRPC",  0,      irpc_cb);
+
+INSN(jmp_symbol,   "JMP",   0xc3,   simple3b_cb);
+INSN(jnz_symbol,   "JNZ",   0xc2,   simple3b_cb);
+INSN(jz_symbol,    "JZ",    0xca,   simple3b_cb);
+INSN(jnc_symbol,   "JNC",   0xd2,   simple3b_cb);
+INSN(jc_symbol,    "JC",    0xda,   simple3b_cb);
+INSN(jpo_symbol,   "JPO",   0xe2,   simple3b_cb);
+INSN(jpe_symbol,   "JPE",   0xea,   simple3b_cb);
+INSN(jp_symbol,    "JP",    0xf2,   simple3b_cb);
+INSN(jm_symbol,    "JM",    0xfa,   simple3b_cb);
+
+VALUE(l_symbol,    "L",     5);
+INSN(ldax_symbol,  "LDAX",  0x0a,   rp_cb);
+INSN(lda_symbol,   "LDA",   0x3a,   simple3b_cb);
+INSN(lxi_symbol,   "LXI",   0x01,   lxi_cb);
+INSN(lhld_symbol,  "LHLD",  0x2a,   simple3b_cb);
+INSN(le_symbol,    "LE",    OP_LE,  operator_cb);
+INSN(lt_symbol,    "LT",    OP_LT,  operator_cb);
+INSN(local_symbol, "LOCAL", 0,      local_cb);
+
+INSN(mod_symbol,   "MOD",   OP_MOD, operator_cb);
+VALUE(m_symbol,    "M",     6);
+INSN(mov_symbol,   "MOV",   0x40,   mov_cb);
+INSN(mvi_symbol,   "MVI",   0x06,   mvi_cb);
+INSN(macro_symbol, "MACRO", 0,      macro_cb);
+INSN(maclib_symbol,"MACLIB",0,      maclib_cb);
+
+INSN(not_symbol,   "NOT",   OP_NOT, operator_cb);
+INSN(nop_symbol,   "NOP",   0x00,   simple1b_cb);
+INSN(ne_symbol,    "NE",    OP_NE,  operator_cb);
+INSN(nul_symbol,   "NUL",   0,      nul_cb);
+
+INSN(or_symbol,    "OR",    OP_OR,  operator_cb);
+INSN(org_symbol,   "ORG",   0,      org_cb);
+INSN(ora_symbol,   "ORA",   0xb0,   alusrc_cb);
+INSN(ori_symbol,   "ORI",   0xf6,   simple2b_cb);
+INSN(out_symbol,   "OUT",   0xd3,   simple2b_cb);
+
+VALUE(psw_symbol,  "PSW",   6);
+INSN(push_symbol,  "PUSH",  0xc5,   rp_cb);
+INSN(pop_symbol,   "POP",   0xc1,   rp_cb);
+INSN(pchl_symbol,  "PCHL",  0xe9,   simple1b_cb);
+INSN(page_symbol,  "PAGE",  0,      page_cb);
+
+INSN(ret_symbol,   "RET",   0xc9,   simple1b_cb);
+INSN(rnz_symbol,   "RNZ",   0xc0,   simple1b_cb);
+INSN(rz_symbol,    "RZ",    0xc8,   simple1b_cb);
+INSN(rnc_symbol,   "RNC",   0xd0,   simple1b_cb);
+INSN(rc_symbol,    "RC",    0xd8,   simple1b_cb);
+INSN(rpo_symbol,   "RPO",   0xe0,   simple1b_cb);
+INSN(rpe_symbol,   "RPE",   0xe8,   simple1b_cb);
+INSN(rp_symbol,    "RP",    0xf0,   simple1b_cb);
+INSN(rm_symbol,    "RM",    0xf8,   simple1b_cb);
+INSN(rst_symbol,   "RST",   0xc7,   aludst_cb);
+INSN(ral_symbol,   "RAL",   0x17,   simple1b_cb);
+INSN(rar_symbol,   "RAR",   0x1f,   simple1b_cb);
+INSN(rlc_symbol,   "RLC",   0x07,   simple1b_cb);
+INSN(rrc_symbol,   "RRC",   0x0f,   simple1b_cb);
+INSN(rept_symbol,  "REPT",  0,      rept_cb);
+
+INSN(shl_symbol,   "SHL",   OP_SHL, operator_cb);
+INSN(shr_symbol,   "SHR",   OP_SHR, operator_cb);
+INSN(set_symbol,   "SET",   0,      set_cb);
+VALUE(sp_symbol,   "SP",    6);
+INSN(stax_symbol,  "STAX",  0x02,   rp_cb);
+INSN(sta_symbol,   "STA",   0x32,   simple3b_cb);
+INSN(sub_symbol,   "SUB",   0x90,   alusrc_cb);
+INSN(sbb_symbol,   "SBB",   0x98,   alusrc_cb);
+INSN(sbi_symbol,   "SBI",   0xde,   simple2b_cb);
+INSN(sui_symbol,   "SUI",   0xd6,   simple2b_cb);
+INSN(shld_symbol,  "SHLD",  0x22,   simple3b_cb);
+INSN(sphl_symbol,  "SPHL",  0xf9,   simple1b_cb);
+INSN(stc_symbol,   "STC",   0x37,   simple1b_cb);
+
+INSN(title_symbol, "TITLE", 0,      title_cb);
+
+INSN(xor_symbol,   "XOR",   OP_XOR, operator_cb);
+INSN(xra_symbol,   "XRA",   0xa8,   alusrc_cb);
+INSN(xri_symbol,   "XRI",   0xee,   simple2b_cb);
+INSN(xchg_symbol,  "XCHG",  0xeb,   simple1b_cb);
+INSN(xthl_symbol,  "XTHL",  0xe3,   simple1b_cb);
+
+/* Seeded into the symbol table on startup. */
+struct symbol* const builtin_symbols[] =
+{
+    &and_symbol, &a_symbol, &ana_symbol, &add_symbol, &adc_symbol,
+    &ani_symbol, &adi_symbol, &aci_symbol, &b_symbol, &c_symbol, &call_symbol,
+    &cmp_symbol, &cpi_symbol, &cnz_symbol, &cz_symbol, &cnc_symbol,
+    &cc_symbol, &cpo_symbol, &cpe_symbol, &cp_symbol, &cm_symbol, &cma_symbol,
+    &cmc_symbol, &db_symbol, &ds_symbol, &dw_symbol, &d_symbol, &dcx_symbol,
+    &dad_symbol, &dcr_symbol, &daa_symbol, &di_symbol, &equ_symbol,
+    &else_symbol, &endif_symbol, &e_symbol, &end_symbol, &ei_symbol,
+    &eq_symbol, &endm_symbol, &exitm_symbol, &ge_symbol, &gt_symbol,
+    &h_symbol, &hlt_symbol, &if_symbol, &inx_symbol, &inr_symbol, &in_symbol,
+    &irp_symbol, &irpc_symbol, &jmp_symbol, &jnz_symbol, &jz_symbol, &jnc_symbol, &jc_symbol,
+    &jpo_symbol, &jpe_symbol, &jp_symbol, &jm_symbol, &l_symbol, &ldax_symbol,
+    &lda_symbol, &lxi_symbol, &lhld_symbol, &le_symbol, &lt_symbol,
+    &local_symbol, &mod_symbol, &m_symbol, &mov_symbol, &mvi_symbol,
+    &macro_symbol, &maclib_symbol, &not_symbol, &nop_symbol, &ne_symbol,
+    &nul_symbol, &or_symbol, &org_symbol, &ora_symbol, &ori_symbol,
+    &out_symbol, &psw_symbol, &push_symbol, &pop_symbol, &pchl_symbol,
+    &page_symbol, &ret_symbol, &rnz_symbol, &rz_symbol, &rnc_symbol,
+    &rc_symbol, &rpo_symbol, &rpe_symbol, &rp_symbol, &rm_symbol,
+    &rst_symbol, &ral_symbol, &rar_symbol, &rlc_symbol, &rrc_symbol,
+    &rept_symbol, &shl_symbol, &shr_symbol, &set_symbol, &sp_symbol,
+    &stax_symbol, &sta_symbol, &sub_symbol, &sbb_symbol, &sbi_symbol,
+    &sui_symbol, &shld_symbol, &sphl_symbol, &stc_symbol, &title_symbol,
+    &xor_symbol, &xra_symbol, &xri_symbol, &xchg_symbol, &xthl_symbol,
 };
 
+/* Returns false (and drops the byte) if the buffer can't grow. */
+bool buffer_append(struct byte_buffer* buf, uint8_t b)
+{
+    if (buf->length == buf->size)
+    {
+        size_t size = buf->size ? (buf->size * 2) : 256;
+        char* p = realloc(buf->data, size);
+        if (!p)
+            return false;
+        buf->data = p;
+        buf->size = size;
+    }
+    buf->data[buf->length++] = b;
+    return true;
+}
+
+/* Returns false if the buffer can't grow. */
+bool buffer_append_bytes(struct byte_buffer* buf, const void* data, size_t length)
+{
+    if ((buf->size - buf->length) < length)
+    {
+        size_t size = buf->size ? buf->size : 256;
+        char* p;
+
+        while ((size - buf->length) < length)
+            size *= 2;
+        p = realloc(buf->data, size);
+        if (!p)
+            return false;
+        buf->data = p;
+        buf->size = size;
+    }
+    memcpy(buf->data + buf->length, data, length);
+    buf->length += length;
+    return true;
+}
+
+/* When several files are assembled at once, or the assembler is being used
+ * as a library, console output is collected rather than printed. */
+void conout(uint8_t b)
+{
+    if (ctx && ctx->console_buffered)
+        buffer_append(&ctx->console, b);
+    else
+        cpm_conout(b);
+}
+
 void printn(const char* s, unsigned len)
 {
     while (len--)
@@ -329,7 +667,7 @@ void printn(const char* s, unsigned len)
         uint8_t b = *s++;
         if (!b)
             return;
-        cpm_conout(b);
+        conout(b);
     }
 }
 
@@ -340,7 +678,7 @@ void print(const char* s)
         uint8_t b = *s++;
         if (!b)
             return;
-        cpm_conout(b);
+        conout(b);
     }
 }
 
@@ -362,7 +700,7 @@ void printhex4(uint8_t nibble)
         nibble += '0';
     else
         nibble += 'a' - 10;
-    cpm_conout(nibble);
+    conout(nibble);
 }
 
 void printhex8(uint8_t b) 
@@ -389,18 +727,310 @@ void printi(uint16_t v)
         if ((d != 0) || (precision == 0) || !zerosup)
         {
             zerosup = false;
-            cpm_conout('0' + d);
+            conout('0' + d);
         }
     }
 }
 
 void fatal(const char* s) 
 {
-    printi(lineno);
+    if (!ctx)
+    {
+        printx(s);
+        exit(1);
+    }
+
+    printi(ctx->lineno);
     print(": ");
     printx(s);
-    close_output_file(&prn_file);
-    cpm_exit();
+    close_output_file(&ctx->prn_file);
+    longjmp(ctx->abort, 1);
+}
+
+double clock_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME        16777619u
+#define FNV_STEP(h, c)   (((h) ^ (uint8_t)(c)) * FNV_PRIME)
+
+uint32_t hash_name(const uint8_t* name, uint8_t len)
+{
+    uint32_t h = FNV_OFFSET_BASIS;
+    while (len--)
+        h = FNV_STEP(h, *name++);
+    return h;
+}
+
+void* arena_alloc(size_t size)
+{
+    struct arena_chunk* c = ctx->arena_current;
+    void* p;
+
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    if (!c || (c->fill + size > ARENA_CHUNK_SIZE))
+    {
+        if (c && c->next)
+            c = c->next;
+        else
+        {
+            struct arena_chunk* n = malloc(sizeof(struct arena_chunk));
+            if (!n)
+                fatal("out of memory");
+            n->next = NULL;
+            if (c)
+                c->next = n;
+            else
+                ctx->arena_first = n;
+            c = n;
+        }
+        c->fill = 0;
+        ctx->arena_current = c;
+    }
+
+    p = c->data + c->fill;
+    c->fill += size;
+    return p;
+}
+
+void arena_reset(void)
+{
+    ctx->arena_current = ctx->arena_first;
+    if (ctx->arena_current)
+        ctx->arena_current->fill = 0;
+}
+
+struct symbol* new_symbol(const uint8_t* name, uint8_t len, uint32_t hash)
+{
+    struct symbol* sym = arena_alloc(sizeof(struct symbol) + len + 1);
+    sym->namelen = len;
+    sym->value = 0;
+    sym->hash = hash;
+    sym->callback = undeflabel_cb;
+    sym->name = (char*) (sym + 1);
+    sym->definition = NULL;
+    sym->macro = NULL;
+    memcpy(sym->name, name, len);
+    sym->name[len] = '\0';
+    return sym;
+}
+
+extern void symtab_insert(struct symbol_table* t, struct symbol* sym);
+
+void symtab_grow(struct symbol_table* t)
+{
+    struct symbol** old = t->slots;
+    uint32_t oldsize = t->size;
+    uint32_t i;
+
+    t->size = oldsize ? (oldsize * 2) : SYMTAB_INITIAL_SIZE;
+    t->slots = calloc(t->size, sizeof(struct symbol*));
+    if (!t->slots)
+        fatal("out of memory");
+
+    t->count = 0;
+    for (i=0; i<oldsize; i++)
+    {
+        if (old[i])
+            symtab_insert(t, old[i]);
+    }
+    if (old)
+        t->resizes++;
+    free(old);
+}
+
+/* sym->hash must already be set. */
+void symtab_insert(struct symbol_table* t, struct symbol* sym)
+{
+    uint32_t mask;
+    uint32_t slot;
+
+    if ((t->count + 1) * 2 > t->size)
+        symtab_grow(t);
+
+    mask = t->size - 1;
+    slot = sym->hash & mask;
+    while (t->slots[slot])
+        slot = (slot + 1) & mask;
+    t->slots[slot] = sym;
+    t->count++;
+}
+
+struct symbol* symtab_lookup(struct symbol_table* t,
+    const uint8_t* name, uint8_t len, uint32_t hash)
+{
+    uint32_t mask = t->size - 1;
+    uint32_t slot = hash & mask;
+    uint32_t probes = 1;
+    struct symbol* sym;
+
+    while ((sym = t->slots[slot]) != NULL)
+    {
+        if ((sym->hash == hash) && (sym->namelen == len) &&
+            (memcmp(sym->name, name, len) == 0))
+            break;
+        slot = (slot + 1) & mask;
+        probes++;
+    }
+
+    t->lookups++;
+    t->probes += probes;
+    if (probes > t->max_probes)
+        t->max_probes = probes;
+    return sym;
+}
+
+/* Builds the table of builtins which every assembly starts from. */
+void init_builtin_table(void)
+{
+    unsigned i;
+
+    symtab_grow(&builtin_table);
+    for (i=0; i<sizeof(builtin_symbols)/sizeof(*builtin_symbols); i++)
+    {
+        struct symbol* sym = builtin_symbols[i];
+        sym->hash = hash_name((const uint8_t*) sym->name, sym->namelen);
+        symtab_insert(&builtin_table, sym);
+    }
+}
+
+/* Empties the symbol table back to just the builtins; user symbols from any
+ * previous assembly are discarded along with the arena. */
+void symtab_reset(void)
+{
+    struct symbol_table* t = &ctx->symbols;
+
+    if (t->size != builtin_table.size)
+    {
+        free(t->slots);
+        t->slots = malloc(builtin_table.size * sizeof(struct symbol*));
+        if (!t->slots)
+            fatal("out of memory");
+        t->size = builtin_table.size;
+    }
+    memcpy(t->slots, builtin_table.slots, t->size * sizeof(struct symbol*));
+    t->count = builtin_table.count;
+    t->lookups = t->probes = t->max_probes = t->resizes = 0;
+    arena_reset();
+}
+
+void print_symstats(void)
+{
+    const struct symbol_table* t = &ctx->symbols;
+    char buffer[128];
+
+    snprintf(buffer, sizeof(buffer),
+        "Symbols: %u in %u slots, load factor %.2f, %u resizes",
+        t->count, t->size, (double)t->count / t->size, t->resizes);
+    printx(buffer);
+    snprintf(buffer, sizeof(buffer),
+        "Lookups: %u, probes: %u (%.2f per lookup, max %u)",
+        t->lookups, t->probes,
+        t->lookups ? (double)t->probes / t->lookups : 0.0, t->max_probes);
+    printx(buffer);
+}
+
+/* Fills in the parts of the stats which are only known at the end. */
+void finish_stats(void)
+{
+    const struct symbol_table* t = &ctx->symbols;
+    struct asm8080_stats* s = &ctx->stats;
+    uint32_t run = 0;
+    uint32_t i;
+
+    s->symbols = t->count - builtin_table.count;
+    s->lookups = t->lookups;
+    s->probes = t->probes;
+    s->max_probes = t->max_probes;
+    s->longest_cluster = 0;
+    for (i=0; i<t->size; i++)
+    {
+        run = t->slots[i] ? (run + 1) : 0;
+        if (run > s->longest_cluster)
+            s->longest_cluster = run;
+    }
+    s->total_seconds = clock_seconds() - ctx->start_time;
+}
+
+double per_second(double n, double seconds)
+{
+    return (seconds > 0) ? (n / seconds) : 0;
+}
+
+void print_stats(void)
+{
+    const struct asm8080_stats* s = &ctx->stats;
+    char buffer[512];
+    unsigned i;
+
+    if (ctx->stats_json)
+    {
+        int n = snprintf(buffer, sizeof(buffer), "{\"passes\":[");
+        for (i=0; i<s->passes; i++)
+            n += snprintf(buffer + n, sizeof(buffer) - n,
+                "%s{\"seconds\":%.6f,\"lines\":%u,\"bytes\":%llu,"
+                "\"lines_per_second\":%.0f,\"bytes_per_second\":%.0f}",
+                i ? "," : "", s->pass_seconds[i], s->lines[i],
+                (unsigned long long) s->bytes_lexed[i],
+                per_second(s->lines[i], s->pass_seconds[i]),
+                per_second(s->bytes_lexed[i], s->pass_seconds[i]));
+        print(buffer);
+
+        snprintf(buffer, sizeof(buffer),
+            "],\"tokens\":{\"identifier\":%llu,\"number\":%llu,\"string\":%llu,"
+            "\"operator\":%llu,\"newline\":%llu,\"eof\":%llu},",
+            (unsigned long long) s->tokens[ASM8080_TOKEN_IDENTIFIER],
+            (unsigned long long) s->tokens[ASM8080_TOKEN_NUMBER],
+            (unsigned long long) s->tokens[ASM8080_TOKEN_STRING],
+            (unsigned long long) s->tokens[ASM8080_TOKEN_OPERATOR],
+            (unsigned long long) s->tokens[ASM8080_TOKEN_NEWLINE],
+            (unsigned long long) s->tokens[ASM8080_TOKEN_EOF]);
+        print(buffer);
+
+        snprintf(buffer, sizeof(buffer),
+            "\"symbols\":{\"count\":%u,\"lookups\":%u,\"probes\":%u,"
+            "\"max_probes\":%u,\"longest_cluster\":%u},"
+            "\"bytes_emitted\":%llu,\"output_seconds\":%.6f,\"total_seconds\":%.6f}",
+            s->symbols, s->lookups, s->probes, s->max_probes, s->longest_cluster,
+            (unsigned long long) s->bytes_emitted, s->output_seconds, s->total_seconds);
+        printx(buffer);
+        return;
+    }
+
+    for (i=0; i<s->passes; i++)
+    {
+        snprintf(buffer, sizeof(buffer),
+            "Pass %u: %.3f ms, %u lines (%.0f/s), %llu bytes (%.1f MB/s)",
+            i + 1, s->pass_seconds[i] * 1e3, s->lines[i],
+            per_second(s->lines[i], s->pass_seconds[i]),
+            (unsigned long long) s->bytes_lexed[i],
+            per_second(s->bytes_lexed[i], s->pass_seconds[i]) / 1e6);
+        printx(buffer);
+    }
+
+    snprintf(buffer, sizeof(buffer),
+        "Tokens: %llu identifiers, %llu numbers, %llu strings, %llu operators, %llu newlines",
+        (unsigned long long) s->tokens[ASM8080_TOKEN_IDENTIFIER],
+        (unsigned long long) s->tokens[ASM8080_TOKEN_NUMBER],
+        (unsigned long long) s->tokens[ASM8080_TOKEN_STRING],
+        (unsigned long long) s->tokens[ASM8080_TOKEN_OPERATOR],
+        (unsigned long long) s->tokens[ASM8080_TOKEN_NEWLINE]);
+    printx(buffer);
+
+    snprintf(buffer, sizeof(buffer),
+        "Symbols: %u, %u lookups, %u probes (max %u), longest cluster %u",
+        s->symbols, s->lookups, s->probes, s->max_probes, s->longest_cluster);
+    printx(buffer);
+
+    snprintf(buffer, sizeof(buffer),
+        "Emitted %llu bytes; output took %.3f ms, %.3f ms in all",
+        (unsigned long long) s->bytes_emitted, s->output_seconds * 1e3,
+        s->total_seconds * 1e3);
+    printx(buffer);
 }
 
 uint8_t get_drive_or_default(uint8_t dr) 
@@ -410,300 +1040,783 @@ uint8_t get_drive_or_default(uint8_t dr)
     return dr - '@';
 }
 
-void emit8_to_output_file(struct output_file* f, uint8_t b)
+void append_text(struct byte_buffer* buf, const void* data, size_t length)
+{
+    if (!buffer_append_bytes(buf, data, length))
+        fatal("out of memory");
+}
+
+void append_decimal(struct byte_buffer* buf, uint16_t value)
 {
-    if (f->fcb.dr <= 16)
+    uint8_t digits[5];
+    unsigned i = sizeof(digits);
+
+    do
     {
-        f->buffer[f->fill++] = b;
-        if (f->fill == sizeof(f->buffer))
-        {
-            /* Flush to disk. */
+        digits[--i] = '0' + (value % 10);
+        value /= 10;
+    }
+    while (value);
+    append_text(buf, digits + i, sizeof(digits) - i);
+}
 
-            cpm_set_dma(f->buffer);
-            if (cpm_write_sequential(&f->fcb) != 0)
-                fatal("Error writing output file");
+/* Output files are collected in memory.  The .prn file can be large, so on
+ * disk it's written out a chunk at a time as it grows. */
+void flush_output_file(struct output_file* f)
+{
+    double t;
 
-            f->fill = 0;
-        }
+    if ((f->fcb.dr > 16) || (f->memory.length == 0))
+        return;
+
+    t = clock_seconds();
+    if (cpm_write_block(&f->fcb, f->memory.data, f->memory.length) != 0)
+        fatal("Error writing output file");
+    ctx->stats.output_seconds += clock_seconds() - t;
+    f->memory.length = 0;
+}
+
+void write_to_output_file(struct output_file* f, const void* data, size_t length)
+{
+    if (f->fcb.dr == CONSOLE_DRIVE)
+    {
+        const uint8_t* p = data;
+        while (length--)
+            conout(*p++);
+    }
+    else if ((f->fcb.dr <= 16) || (f->fcb.dr == MEMORY_DRIVE))
+    {
+        append_text(&f->memory, data, length);
+        f->fill = (f->fill + length) % 128;
+        if ((f->fcb.dr <= 16) && (f->memory.length >= OUTPUT_CHUNK_SIZE))
+            flush_output_file(f);
     }
-    else if (f->fcb.dr == CONSOLE_DRIVE)
-        cpm_conout(b);
 }
 
 void open_output_file(struct output_file* f) 
 {
+    double t;
+
     if (f->fcb.dr > 16)
         return;
     
+    t = clock_seconds();
     cpm_delete_file(&f->fcb);
     if (cpm_make_file(&f->fcb) == 0xff)
         fatal("Cannot create output file");
+    ctx->stats.output_seconds += clock_seconds() - t;
     f->fcb.cr = 0;
     f->fill = 0;
+    f->memory.length = 0;
     f->opened = true;
 }
 
 void close_output_file(struct output_file* f) 
 {
+    static const uint8_t zeroes[128];
+    double t;
+
     if (!f->opened)
         return;
+    f->opened = false;
     if (f->fcb.dr > 16)
         return;
 
-    while (f->fill != 0)
-        emit8_to_output_file(f, 0);
+    /* Like the CP/M original, the file ends with a whole record. */
+    if (f->fill != 0)
+        write_to_output_file(f, zeroes, sizeof(zeroes) - f->fill);
+    flush_output_file(f);
 
+    t = clock_seconds();
     if (cpm_close_file(&f->fcb) == 0xff)
         fatal("Cannot close output file");
+    ctx->stats.output_seconds += clock_seconds() - t;
 }
 
-void emit_char_to_left_prn_buffer(uint8_t b)
+const char hex_digits[] = "0123456789abcdef";
+
+/* The left column of the listing holds the address and the bytes generated
+ * (or a value); anything which doesn't fit is left out. */
+void list_left(const char* text, unsigned length)
 {
-    if (prn_file.fcb.dr == SKIP_DRIVE)
-        return;
-    
-    if (prn_buffer_left_fill != PRN_BUFFER_LEFT_COLUMN_WIDTH)
-        prn_buffer[prn_buffer_left_fill++] = b;
+    unsigned room = PRN_BUFFER_LEFT_COLUMN_WIDTH - ctx->prn_buffer_left_fill;
+
+    if (length > room)
+        length = room;
+    memcpy(ctx->prn_buffer + ctx->prn_buffer_left_fill, text, length);
+    ctx->prn_buffer_left_fill += length;
 }
 
-void emit_char_to_right_prn_buffer(uint8_t b)
+void list_hex16(uint16_t w)
 {
-    if (prn_file.fcb.dr == SKIP_DRIVE)
-        return;
-    
-    if (prn_buffer_right_fill != sizeof(prn_buffer))
+    char text[4] =
     {
-        if (iscntrl(b))
-            b = ' ';
-        if ((prn_buffer_right_fill != PRN_BUFFER_LEFT_COLUMN_WIDTH+2) ||
-            !isspace(b) ||
-            !isspace(prn_buffer[PRN_BUFFER_LEFT_COLUMN_WIDTH+1]))
-            prn_buffer[prn_buffer_right_fill++] = b;
+        hex_digits[w >> 12], hex_digits[(w >> 8) & 15],
+        hex_digits[(w >> 4) & 15], hex_digits[w & 15]
+    };
+    list_left(text, sizeof(text));
+}
+
+/* Lists a byte of code, after its address if it's the statement's first. */
+void list_byte(uint8_t b)
+{
+    char text[2] = { hex_digits[b >> 4], hex_digits[b & 15] };
+
+    if (ctx->prn_buffer_left_fill == 0)
+    {
+        list_hex16(ctx->program_counter);
+        ctx->prn_buffer_left_fill++;
     }
+    list_left(text, sizeof(text));
 }
 
-void emit_hex4_to_left_prn_buffer(uint8_t nibble)
+/* Copies a byte of source into the right of the listing line.  Control
+ * characters show as spaces, and blanks at the start of the line are
+ * squeezed to one. */
+void list_source_byte(uint8_t b)
 {
-    if (prn_file.fcb.dr == SKIP_DRIVE)
+    uint8_t fill = ctx->prn_buffer_right_fill;
+
+    if (fill == PRN_LINE_LENGTH)
         return;
-    
-    nibble &= 0x0f;
-    if (nibble < 10)
-        nibble += '0';
-    else
-        nibble += 'a' - 10;
-    emit_char_to_left_prn_buffer(nibble);
+    b = char_listed[b];
+    if ((b != ' ') || (fill != PRN_BUFFER_LEFT_COLUMN_WIDTH+2) ||
+        (ctx->prn_buffer[PRN_BUFFER_LEFT_COLUMN_WIDTH+1] != ' '))
+        ctx->prn_buffer[ctx->prn_buffer_right_fill++] = b;
 }
 
-void emit_hex8_to_left_prn_buffer(uint8_t b)
+/* Counts what's been read from the current window. */
+void account_input(void)
 {
-    if (prn_file.fcb.dr == SKIP_DRIVE)
-        return;
-    
-    emit_hex4_to_left_prn_buffer(b >> 4);
-    emit_hex4_to_left_prn_buffer(b);
+    ctx->stats.bytes_lexed[ctx->pass] += ctx->input_ptr - ctx->input_window;
+    ctx->input_window = ctx->input_ptr;
 }
 
-void emit_hex16_to_left_prn_buffer(uint16_t w)
+/* Writes the text of the current iteration of a macro, and starts reading
+ * it. */
+void start_iteration(struct input_source* s)
 {
-    if (prn_file.fcb.dr == SKIP_DRIVE)
-        return;
-    
-    emit_hex8_to_left_prn_buffer(w >> 8);
-    emit_hex8_to_left_prn_buffer(w);
+    const struct macro* m = s->macro;
+    const uint8_t* p = m->body;
+    const uint8_t* end = p + m->length;
+    const struct text_span* spans = (const struct text_span*) s->spans.data;
+    unsigned count = s->spans.length / sizeof(struct text_span);
+
+    s->locals = ctx->local_count;
+    ctx->local_count += m->locals;
+
+    s->text.length = 0;
+    for (;;)
+    {
+        const uint8_t* q = memchr(p, MACRO_PARAM, end - p);
+        unsigned n;
+
+        if (!q)
+            q = end;
+        append_text(&s->text, p, q - p);
+        if (q == end)
+            break;
+
+        n = q[1];
+        p = q + 2;
+        if (n >= m->params)
+        {
+            /* LOCAL names become ??0001 and so on, new each time. */
+            uint16_t v = s->locals + n - m->params + 1;
+            uint8_t name[6] = { '?', '?' };
+            unsigned i;
+
+            for (i=5; i>=2; i--)
+            {
+                name[i] = '0' + (v % 10);
+                v /= 10;
+            }
+            append_text(&s->text, name, sizeof(name));
+        }
+        else
+        {
+            if (s->irp)
+                n = s->iteration;
+            if (n < count)
+                append_text(&s->text, s->args.data + spans[n].start, spans[n].length);
+        }
+    }
+
+    ctx->input_ptr = ctx->input_window = (const uint8_t*) s->text.data;
+    ctx->input_end = ctx->input_ptr + s->text.length;
+    ctx->if_depth = s->if_depth; /* an iteration can't leave an IF open */
 }
 
-void emit_program_counter_to_left_prn_buffer(void)
+/* Returns the slot for the next input to be pushed. */
+struct input_source* next_input(void)
 {
-    if (prn_file.fcb.dr == SKIP_DRIVE)
-        return;
-    
-    if (prn_buffer_left_fill == 0)
+    if (ctx->input_depth == INPUT_DEPTH)
+        fatal("macros nested too deeply");
+    return &ctx->inputs[ctx->input_depth];
+}
+
+/* Starts reading from s, which has its text, or macro and arguments, ready. */
+void push_input(struct input_source* s, bool listed)
+{
+    account_input();
+    s->ptr = ctx->input_ptr;
+    s->end = ctx->input_end;
+    s->eol = ctx->eol;
+    s->listing_input = ctx->listing_input;
+    s->if_depth = ctx->if_depth;
+    ctx->input_depth++;
+    ctx->listing_input = ctx->listing_input && listed;
+
+    s->iteration = 0;
+    if (s->macro)
+        start_iteration(s);
+    else
     {
-        emit_hex16_to_left_prn_buffer(program_counter);
-        prn_buffer_left_fill++;
+        ctx->input_ptr = ctx->input_window = (const uint8_t*) s->text.data;
+        ctx->input_end = ctx->input_ptr + s->text.length;
     }
 }
 
-uint8_t read_byte(void)
+void pop_input(void)
 {
-    uint8_t b;
+    struct input_source* s = &ctx->inputs[--ctx->input_depth];
+
+    ctx->input_ptr = ctx->input_window = s->ptr;
+    ctx->input_end = s->end;
+    ctx->eol = s->eol;
+    ctx->listing_input = s->listing_input;
+    ctx->if_depth = s->if_depth;
+    ctx->input_ends++;
+}
+
+void refill_input(void)
+{
+    account_input();
+
+    /* The end of a pushed input goes on to its next iteration, or back to
+     * whatever it covered up (which may itself have run out). */
+    while (ctx->input_depth)
+    {
+        struct input_source* s = &ctx->inputs[ctx->input_depth - 1];
+
+        ctx->input_ends++;
+        if (s->macro && (++s->iteration < s->iterations))
+            start_iteration(s);
+        else
+            pop_input();
+        if (ctx->input_ptr != ctx->input_end)
+            return;
+    }
 
-    if (input_buffer_read_count == 0x80)
+    if (ctx->input_map)
+    {
+        /* Past the end of the mapped file; keep returning ^Z. */
+        ctx->input_ptr = eof_record;
+        ctx->input_end = eof_record + sizeof(eof_record);
+    }
+    else
     {
-        cpm_set_dma(cpm_default_dma);
-        if (cpm_read_sequential(&asm_fcb) != 0)
-            memset(cpm_default_dma, 26, 128);
-        input_buffer_read_count = 0;
+        cpm_set_dma(ctx->dma);
+        if (cpm_read_sequential(&ctx->asm_fcb) != 0)
+            memset(ctx->dma, 26, 128);
+        ctx->input_ptr = ctx->dma;
+        ctx->input_end = ctx->dma + 128;
     }
+    ctx->input_window = ctx->input_ptr;
+}
+
+uint8_t read_byte(void)
+{
+    uint8_t b;
 
-    b = cpm_default_dma[input_buffer_read_count++];
-    if ((pass == 1) && (b != '\n') && (b != '\r'))
-        emit_char_to_right_prn_buffer(b);
+    if (ctx->input_ptr == ctx->input_end)
+        refill_input();
+
+    b = *ctx->input_ptr++;
+    if (ctx->listing_input && (b != '\n') && (b != '\r'))
+        list_source_byte(b);
     return b;
 }
 
 void unread_byte(uint8_t b)
 {
-    /* Safe because input_buffer_read_count is guaranteed never to be 0. */
-    cpm_default_dma[--input_buffer_read_count] = b;
-    if (pass == 1)
-        prn_buffer_right_fill--;
+    /* Safe because at least one byte has always been read from the current
+     * window, and b is always the byte that was read (the mapped input is
+     * read-only, so it can't be stored back). */
+    (void)b;
+    ctx->input_ptr--;
+    if (ctx->listing_input)
+        ctx->prn_buffer_right_fill--;
 }
 void emit8(uint8_t b) 
 {
-    static bool program_counter_fixed = false;
-    static uint16_t old_program_counter = 0;
-
-    if (pass == 1)
+    if ((ctx->pass == 1) || ctx->recording)
     {
-        uint16_t delta;
+        if (ctx->listing_line)
+            list_byte(b);
 
-        if (!program_counter_fixed)
+        if (!ctx->image_used)
         {
-            program_counter_fixed = true;
-            old_program_counter = program_counter;
+            ctx->image_used = true;
+            ctx->image_start = ctx->program_counter;
+            ctx->image_end = ctx->program_counter;
         }
+        else if (ctx->program_counter < ctx->image_start)
+            ctx->image_start = ctx->program_counter;
+        ctx->image[ctx->program_counter] = b;
+        ctx->image_written[ctx->program_counter >> 3] |= 1 << (ctx->program_counter & 7);
+        ctx->stats.bytes_emitted++;
+        if (ctx->program_counter >= ctx->image_end)
+            ctx->image_end = ctx->program_counter + 1;
+    }
 
-        delta = program_counter - old_program_counter;
-        while (delta--)
-            emit8_to_output_file(&bin_file, 0);
+    ctx->program_counter++;
+}
 
-        emit_program_counter_to_left_prn_buffer();
-        emit_hex8_to_left_prn_buffer(b);
-        emit8_to_output_file(&bin_file, b);
+void clear_image(void)
+{
+    if (ctx->image_used)
+    {
+        memset(ctx->image + ctx->image_start, 0, ctx->image_end - ctx->image_start);
+        memset(ctx->image_written + (ctx->image_start >> 3), 0,
+            ((ctx->image_end + 7) >> 3) - (ctx->image_start >> 3));
     }
+    ctx->image_used = false;
+}
 
-    program_counter++;
-    old_program_counter = program_counter;
+bool image_byte_written(uint32_t address)
+{
+    return ctx->image_written[address >> 3] & (1 << (address & 7));
 }
 
-void emit16(uint16_t w) 
+void output_byte(uint8_t b)
 {
-    emit8(w);
-    emit8(w >> 8);
+    if (!buffer_append(&ctx->output, b))
+        fatal("out of memory");
 }
 
-bool isident(uint8_t c) 
+void output_hex8(uint8_t b)
 {
-    return isalnum(c) || (c == '_');
+    static const char hex[] = "0123456789ABCDEF";
+    output_byte(hex[b >> 4]);
+    output_byte(hex[b & 15]);
 }
 
-void check_token_buffer_size(void)
+/* Pads the output to a whole number of records. */
+void output_pad(uint8_t b)
 {
-    if (token_length == sizeof(token_buffer))
-        fatal("token too long");
+    while (ctx->output.length & 127)
+        output_byte(b);
 }
 
-token_t read_token(void)
+/* Only bytes which were actually assembled go into the hex file, so DS and
+ * gaps between ORGs are left out, as with the original. */
+void build_hex(void)
 {
-    uint8_t c;
+    uint32_t address = ctx->image_start;
+    const char* p;
 
-    if (eol)
+    while (ctx->image_used && (address < ctx->image_end))
     {
-        lineno++;
-        eol = false;
+        uint8_t count = 0;
+        uint8_t checksum;
+        uint8_t i;
+
+        if (!image_byte_written(address))
+        {
+            address++;
+            continue;
+        }
+
+        while ((count < ctx->hex_record_length) &&
+                ((address + count) < ctx->image_end) &&
+                image_byte_written(address + count))
+            count++;
+
+        output_byte(':');
+        output_hex8(count);
+        output_hex8(address >> 8);
+        output_hex8(address);
+        output_hex8(0);
+        checksum = count + (address >> 8) + address;
+        for (i=0; i<count; i++)
+        {
+            uint8_t b = ctx->image[address + i];
+            output_hex8(b);
+            checksum += b;
+        }
+        output_hex8(-checksum);
+        output_byte('\r');
+        output_byte('\n');
+
+        address += count;
     }
 
-    do
-        c = read_byte();
-    while ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\f') || (c == '\v'));
+    for (p = ":00000001FF\r\n"; *p; p++)
+        output_byte(*p);
+    output_byte(26);
+    output_pad(26);
+}
+
+/* The .prl file is a page of header, holding the length of the program, then
+ * the program as assembled at 0000H, then a bitmap with a bit set for each
+ * byte which changed when it was assembled a page higher. */
+void build_prl(void)
+{
+    uint32_t length = ctx->image_used ? ctx->image_end : 0;
+    uint32_t i;
+    uint8_t bits = 0;
+
+    output_byte(0);
+    output_byte(length);
+    output_byte(length >> 8);
+    while (ctx->output.length < 256)
+        output_byte(0);
+
+    for (i=0; i<length; i++)
+        output_byte(ctx->image[i]);
+
+    for (i=0; i<length; i++)
+    {
+        uint8_t a = ctx->image[i];
+        uint8_t b = ctx->prl_image[i];
+
+        bits <<= 1;
+        if (a != b)
+        {
+            /* Only high bytes of addresses can be relocated. */
+            if (b != (uint8_t)(a + 1))
+            {
+                char buffer[64];
+                snprintf(buffer, sizeof(buffer),
+                    "program is not page relocatable at %04X", i);
+                fatal(buffer);
+            }
+            bits |= 1;
+        }
+        if ((i & 7) == 7)
+            output_byte(bits);
+    }
+    if (length & 7)
+        output_byte(bits << (8 - (length & 7)));
+
+    output_pad(0);
+}
+
+/* Writes the .bin, .hex or .prl file, depending on the mode; the latter two
+ * are also left in ctx->output. */
+void write_output(void)
+{
+    const uint8_t* data;
+    uint32_t length;
+
+    ctx->output.length = 0;
+    if (ctx->prl)
+        build_prl();
+    else if (ctx->hex_record_length)
+        build_hex();
+
+    if (ctx->prl || ctx->hex_record_length)
+    {
+        data = (const uint8_t*) ctx->output.data;
+        length = ctx->output.length;
+    }
+    else
+    {
+        if (!ctx->image_used)
+            return;
+        data = ctx->image + ctx->image_start;
+        length = (ctx->image_end - ctx->image_start + 127) & ~127;
+    }
+
+    if (ctx->bin_file.fcb.dr <= 16)
+    {
+        double t = clock_seconds();
+        if (cpm_write_block(&ctx->bin_file.fcb, data, length) != 0)
+            fatal("Error writing output file");
+        ctx->stats.output_seconds += clock_seconds() - t;
+    }
+    else if (ctx->bin_file.fcb.dr == CONSOLE_DRIVE)
+    {
+        uint32_t i;
+
+        for (i=0; i<length; i++)
+            conout(data[i]);
+    }
+}
+
+void emit16(uint16_t w) 
+{
+    emit8(w);
+    emit8(w >> 8);
+}
+
+/* Returns the first byte in [p, end) which isn't whitespace. */
+const uint8_t* scan_spaces(const uint8_t* p, const uint8_t* end)
+{
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t' - 1);
+    const __m128i cr = _mm_set1_epi8('\r' + 1);
+    const __m128i nl = _mm_set1_epi8('\n');
+    int n;
+
+    /* Most runs are a single space or tab, so look at that much first. */
+    for (n=0; (n < 2) && (p != end); n++, p++)
+    {
+        if (!(char_class[*p] & CC_SPACE))
+            return p;
+    }
+
+    while ((end - p) >= 16)
+    {
+        /* \t, \v, \f and \r are all in the range 9 to 13, along with \n. */
+        __m128i v = _mm_loadu_si128((const __m128i*) p);
+        __m128i m = _mm_and_si128(_mm_cmpgt_epi8(v, tab), _mm_cmplt_epi8(v, cr));
+        m = _mm_andnot_si128(_mm_cmpeq_epi8(v, nl), m);
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, space));
+
+        unsigned mask = ~_mm_movemask_epi8(m) & 0xffff;
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while ((p != end) && (char_class[*p] & CC_SPACE))
+        p++;
+    return p;
+}
+
+/* Returns the first byte in [p, end) which ends a comment. */
+const uint8_t* scan_comment(const uint8_t* p, const uint8_t* end)
+{
+#ifdef __SSE2__
+    const __m128i bang = _mm_set1_epi8('!');
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i eof = _mm_set1_epi8(26);
+
+    while ((end - p) >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*) p);
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, bang), _mm_cmpeq_epi8(v, nl)),
+            _mm_cmpeq_epi8(v, eof));
+
+        unsigned mask = _mm_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while ((p != end) && !(char_class[*p] & CC_COMMENT_END))
+        p++;
+    return p;
+}
+
+/* Skips input for as long as scan() allows, a window at a time, copying what's
+ * skipped into the listing just as read_byte() would have. */
+void skip_input(const uint8_t* (*scan)(const uint8_t* p, const uint8_t* end))
+{
+    for (;;)
+    {
+        const uint8_t* p = scan(ctx->input_ptr, ctx->input_end);
+
+        if (ctx->listing_input)
+        {
+            const uint8_t* q;
+            for (q = ctx->input_ptr; q != p; q++)
+            {
+                if ((*q != '\n') && (*q != '\r'))
+                    list_source_byte(*q);
+            }
+        }
+
+        ctx->input_ptr = p;
+        if (p != ctx->input_end)
+            return;
+        refill_input();
+    }
+}
+
+/* Returns the first byte in [p, end) which could end a skipped statement:
+ * a separator, the start of a comment or string, or the end of the file. */
+const uint8_t* scan_statement(const uint8_t* p, const uint8_t* end)
+{
+#ifdef __SSE2__
+    const __m128i bang = _mm_set1_epi8('!');
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i semi = _mm_set1_epi8(';');
+    const __m128i quote = _mm_set1_epi8('\'');
+    const __m128i eof = _mm_set1_epi8(26);
+    const __m128i nul = _mm_setzero_si128();
+
+    while ((end - p) >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*) p);
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, bang), _mm_cmpeq_epi8(v, nl)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, semi), _mm_cmpeq_epi8(v, quote)));
+        m = _mm_or_si128(m,
+            _mm_or_si128(_mm_cmpeq_epi8(v, eof), _mm_cmpeq_epi8(v, nul)));
+
+        unsigned mask = _mm_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while ((p != end) && !(char_class[*p] & CC_STATEMENT_END))
+        p++;
+    return p;
+}
+
+/* Returns the first byte in [p, end) which ends a skipped string. */
+const uint8_t* scan_string(const uint8_t* p, const uint8_t* end)
+{
+    while ((p != end) && (*p != '\'') && (*p != '\n') && (*p != 26))
+        p++;
+    return p;
+}
+
+/* Like skip_input(), but for input which never reaches the listing. */
+void skip_unlisted_input(const uint8_t* (*scan)(const uint8_t* p, const uint8_t* end))
+{
+    for (;;)
+    {
+        const uint8_t* p = scan(ctx->input_ptr, ctx->input_end);
+
+        ctx->input_ptr = p;
+        if (p != ctx->input_end)
+            return;
+        refill_input();
+    }
+}
+
+uint8_t peek_unlisted_byte(void)
+{
+    if (ctx->input_ptr == ctx->input_end)
+        refill_input();
+    return *ctx->input_ptr;
+}
+
+void check_token_buffer_size(void)
+{
+    if (ctx->token_length == sizeof(ctx->token_buffer))
+        fatal("token too long");
+}
+
+/* Starts a new line if the last one has ended.  Lines from macros and
+ * libraries don't count, so errors in them are reported at the line which
+ * used them. */
+void count_line(void)
+{
+    if (ctx->eol)
+    {
+        if (ctx->input_depth == 0)
+            ctx->lineno++;
+        ctx->eol = false;
+    }
+}
+
+token_t lex_token(void)
+{
+    uint8_t c;
+
+    count_line();
+
+    skip_input(scan_spaces);
+    c = read_byte();
 
     if (c == ';')
     {
-        do
-            c = read_byte();
-        while ((c != '!') && (c != '\n') && (c != 26));
+        skip_input(scan_comment);
+        c = read_byte();
     }
 
-    c = toupper(c);
-    token_length = 0;
-    if (isdigit(c))
+    c = char_upper[c];
+    ctx->token_length = 0;
+    if (char_class[c] & CC_DIGIT)
     {
+        /* The base comes from the suffix, which isn't known until the end, so
+         * the value is accumulated in every base at once.  The accumulators
+         * lag one digit behind, so that the suffix doesn't get included. */
+        uint16_t v2 = 0, v8 = 0, v10 = 0, v16 = 0;
+        uint8_t maxdigit = 0;
+        uint8_t last = c;
         uint8_t base;
-        unsigned i;
+        uint8_t d;
 
         for (;;)
         {
             check_token_buffer_size();
-            token_buffer[token_length++] = c;
+            ctx->token_length++;
 
             do
-                c = toupper(read_byte());
+                c = char_upper[read_byte()];
             while (c == '$');
-            if (!isalnum(c))
+            if (!(char_class[c] & (CC_ALPHA | CC_DIGIT)))
                 break;
+
+            d = char_digit[last];
+            if (d > maxdigit)
+                maxdigit = d;
+            v2 = (v2 * 2) + d;
+            v8 = (v8 * 8) + d;
+            v10 = (v10 * 10) + d;
+            v16 = (v16 * 16) + d;
+            last = c;
         }
         unread_byte(c);
 
-        base = 10;
-        c = token_buffer[--token_length];
-        switch (c)
+        switch (last)
         {
-            case 'B': base = 2; break;
-            case 'O': case 'Q': base = 8; break;
-            case 'D': base = 10; break;
-            case 'H': base = 16; break;
+            case 'B': base = 2; ctx->token_number = v2; break;
+            case 'O': case 'Q': base = 8; ctx->token_number = v8; break;
+            case 'H': base = 16; ctx->token_number = v16; break;
             default:
-                if (isdigit(c))
-                    token_length++;
-        }
-
-        token_number = 0;
-        for (i=0; i<token_length; i++)
-        {
-            c = token_buffer[i];
-            if (c >= 'A')
-                c = c - 'A' + 10;
-            else
-                c = c - '0';
-            if (c >= base)
-                fatal("invalid digit in character constant");
-
-            token_number = (token_number * base) + c;
+                base = 10;
+                ctx->token_number = v10;
+                if (char_class[last] & CC_DIGIT)
+                {
+                    d = char_digit[last];
+                    if (d > maxdigit)
+                        maxdigit = d;
+                    ctx->token_number = (v10 * 10) + d;
+                }
         }
+        if (maxdigit >= base)
+            fatal("invalid digit in character constant");
 
+        ctx->token_length = 0;
         return TOKEN_NUMBER;
     }
-    else if (isupper(c))
+    else if (char_class[c] & CC_ALPHA)
     {
-        uint8_t slot;
+        uint32_t hash = FNV_OFFSET_BASIS;
 
         for (;;)
         {
             check_token_buffer_size();
-            token_buffer[token_length++] = c;
+            ctx->token_buffer[ctx->token_length++] = c;
+            hash = FNV_STEP(hash, c);
 
             do
-                c = toupper(read_byte());
+                c = char_upper[read_byte()];
             while (c == '$');
-            if (!isident(c))
+            if (!(char_class[c] & CC_IDENT))
                 break;
         }
         unread_byte(c);
 
         /* Search for this identifier in the symbol table. */
 
-        slot = token_buffer[0] & 0x1f;
-        token_symbol = hashtable[slot];
-        while (token_symbol)
-        {
-            if (token_symbol->namelen == token_length)
-            {
-                if (memcmp(token_symbol->name, token_buffer, token_length) == 0)
-                    return TOKEN_IDENTIFIER;
-            }
-            token_symbol = token_symbol->next;
-        }
+        ctx->token_symbol = symtab_lookup(&ctx->symbols,
+            ctx->token_buffer, ctx->token_length, hash);
+        if (ctx->token_symbol)
+            return TOKEN_IDENTIFIER;
 
-        token_symbol = (struct symbol*) sbrk(sizeof(struct symbol));
-        token_symbol->value = 0;
-        token_symbol->callback = undeflabel_cb;
-        token_symbol->namelen = token_length;
-        token_symbol->name = sbrk(token_length);
-        memcpy(token_symbol->name, token_buffer, token_length);
-        token_symbol->next = hashtable[slot];
-        hashtable[slot] = token_symbol;
+        ctx->token_symbol = new_symbol(ctx->token_buffer, ctx->token_length, hash);
+        symtab_insert(&ctx->symbols, ctx->token_symbol);
 
         return TOKEN_IDENTIFIER;
     }
@@ -712,7 +1825,7 @@ token_t read_token(void)
         for (;;)
         {
             c = read_byte();
-            if (iscntrl(c))
+            if (char_class[c] & CC_CNTRL)
                 fatal("unterminated string constant");
             if (c == '\'')
             {
@@ -722,14 +1835,14 @@ token_t read_token(void)
             }
 
             check_token_buffer_size();
-            token_buffer[token_length++] = c;
+            ctx->token_buffer[ctx->token_length++] = c;
         }
         unread_byte(c);
 
         return TOKEN_STRING;
     }
     else if (c == '\n')
-        eol = true;
+        ctx->eol = true;
     else if (c == '!')
         c = TOKEN_NL;
     else if (c == 0)
@@ -739,12 +1852,76 @@ token_t read_token(void)
     return c;
 }
 
+/* Only symbols from the arena have their name straight after them; the
+ * builtins don't. */
+bool is_user_symbol(const struct symbol* sym)
+{
+    return sym->name == (const char*) (sym + 1);
+}
+
+void note_reference(const struct symbol* sym)
+{
+    struct reference r;
+
+    if (!is_user_symbol(sym))
+        return;
+    r.symbol = sym;
+    r.line = ctx->lineno;
+    r.definition = false;
+    append_text(&ctx->references, &r, sizeof(r));
+}
+
+/* Marks the label just read as being defined here. */
+void note_definition(void)
+{
+    struct reference* r;
+
+    if (!ctx->noting_references || !ctx->references.length)
+        return;
+    r = (struct reference*) (ctx->references.data + ctx->references.length) - 1;
+    if (r->symbol == ctx->current_label)
+        r->definition = true;
+}
+
+token_t read_token(void)
+{
+    token_t t = lex_token();
+    uint8_t kind;
+
+    switch (t)
+    {
+        case TOKEN_IDENTIFIER:
+            kind = ASM8080_TOKEN_IDENTIFIER;
+            if (ctx->noting_references)
+                note_reference(ctx->token_symbol);
+            break;
+        case TOKEN_NUMBER:     kind = ASM8080_TOKEN_NUMBER; break;
+        case TOKEN_STRING:     kind = ASM8080_TOKEN_STRING; break;
+        case TOKEN_NL:         kind = ASM8080_TOKEN_NEWLINE; break;
+        case TOKEN_EOF:        kind = ASM8080_TOKEN_EOF; break;
+        default:               kind = ASM8080_TOKEN_OPERATOR; break;
+    }
+    ctx->stats.tokens[kind]++;
+    return t;
+}
+
 /* Tests if the current symbol is a label or not. */
 bool islabel(void)
 {
-    return (token_symbol->callback == undeflabel_cb)
-        || (token_symbol->callback == equlabel_cb)
-        || (token_symbol->callback == setlabel_cb);
+    return (ctx->token_symbol->callback == undeflabel_cb)
+        || (ctx->token_symbol->callback == equlabel_cb)
+        || (ctx->token_symbol->callback == setlabel_cb);
+}
+
+/* An instruction used as a value stands for its opcode, with any register
+ * fields zero (MVI is 06h). */
+bool isopcode(void)
+{
+    void (*cb)(void) = ctx->token_symbol->callback;
+
+    return (cb == simple1b_cb) || (cb == simple2b_cb) || (cb == simple3b_cb)
+        || (cb == alusrc_cb) || (cb == aludst_cb) || (cb == rp_cb)
+        || (cb == mov_cb) || (cb == lxi_cb) || (cb == mvi_cb);
 }
 
 void syntax_error(void)
@@ -758,30 +1935,80 @@ void expect(token_t wanted)
         syntax_error();
 }
 
-#define STACK_DEPTH 32
-uint16_t value_stack[STACK_DEPTH];
-uint8_t operator_stack[STACK_DEPTH];
-uint8_t value_sp = 1;
-uint8_t operator_sp = 1;
-
 void push_value(uint16_t value) 
 {
-    if (value_sp == STACK_DEPTH)
+    if (ctx->value_sp == STACK_DEPTH)
         fatal("expression stack overflow");
-    value_stack[value_sp++] = value;
+    ctx->value_stack[ctx->value_sp++] = value;
 }
 
 uint16_t pop_value(void)
 {
-    if (value_sp == 0)
+    if (ctx->value_sp == 0)
         fatal("expression stack underflow");
-    return value_stack[--value_sp];
+    return ctx->value_stack[--ctx->value_sp];
+}
+
+void record_expr_op(uint8_t kind, uint8_t opid, uint16_t value, struct symbol* sym)
+{
+    struct expr_op* op;
+
+    if (ctx->expr_length == EXPR_CODE_SIZE)
+    {
+        ctx->expr_overflow = true;
+        return;
+    }
+
+    op = &ctx->expr_code[ctx->expr_length++];
+    op->kind = kind;
+    op->opid = opid;
+    op->value = value;
+    op->symbol = sym;
+}
+
+void push_constant(uint16_t value)
+{
+    if (ctx->recording)
+        record_expr_op(EXPR_VALUE, 0, value, NULL);
+    push_value(value);
+}
+
+void push_label_value(struct symbol* sym)
+{
+    if (ctx->recording)
+    {
+        if (sym->definition)
+        {
+            const struct fixup* f = sym->definition;
+            unsigned i;
+
+            for (i=0; i<f->length; i++)
+            {
+                const struct expr_op* op = &f->code[i];
+                record_expr_op(op->kind, op->opid, op->value, op->symbol);
+            }
+            ctx->expr_unresolved = true;
+        }
+        else if (sym->callback == undeflabel_cb)
+        {
+            record_expr_op(EXPR_SYMBOL, 0, 0, sym);
+            ctx->expr_unresolved = true;
+        }
+        /* A defined symbol is taken as it stands now; a SET one may have
+           another value by the time the fixup is resolved. */
+        else
+            record_expr_op(EXPR_VALUE, 0, sym->value, NULL);
+    }
+    push_value(sym->value);
 }
 
 void apply_operator(uint8_t opid) 
 {
     const struct operator* op = &operators[opid];
 
+    if (ctx->recording)
+        record_expr_op(EXPR_OPERATOR, opid, 0, NULL);
+
     #if defined EXPR_DEBUG
         print("applying ");
         printhex8(opid);
@@ -800,22 +2027,22 @@ void apply_operator(uint8_t opid)
 
 void push_operator(uint8_t opid) 
 {
-    if (operator_sp == STACK_DEPTH)
+    if (ctx->operator_sp == STACK_DEPTH)
         fatal("operator stack overflow");
-    operator_stack[operator_sp++] = opid;
+    ctx->operator_stack[ctx->operator_sp++] = opid;
 }
 
 void push_and_apply_operator(uint8_t opid) 
 {
     const struct operator* op = &operators[opid];
-    while (operator_sp != 0)
+    while (ctx->operator_sp != 0)
     {
-        uint8_t topopid = operator_stack[operator_sp-1];
+        uint8_t topopid = ctx->operator_stack[ctx->operator_sp-1];
         const struct operator* topop = &operators[topopid];
         if (topop->precedence <= op->precedence)
         {
             apply_operator(topopid);
-            operator_sp--;
+            ctx->operator_sp--;
         }
         else
             break;
@@ -828,18 +2055,18 @@ void push_and_apply_operator(uint8_t opid)
     void printstacks(void)
     {
         print("v: ");
-        for (unsigned i=0; i<value_sp; i++)
+        for (unsigned i=0; i<ctx->value_sp; i++)
         {
-            printhex16(value_stack[i]);
-            cpm_conout(' ');
+            printhex16(ctx->value_stack[i]);
+            conout(' ');
         }
         crlf();
 
         print("o: ");
-        for (unsigned i=0; i<operator_sp; i++)
+        for (unsigned i=0; i<ctx->operator_sp; i++)
         {
-            printhex8(operator_stack[i]);
-            cpm_conout(' ');
+            printhex8(ctx->operator_stack[i]);
+            conout(' ');
         }
         crlf();
     }
@@ -867,8 +2094,10 @@ token_t read_expression(void)
         printx("read expression");
     #endif
 
-    value_sp = operator_sp = 0;
+    ctx->value_sp = ctx->operator_sp = 0;
     seenvalue = false;
+    ctx->expr_length = 0;
+    ctx->expr_unresolved = ctx->expr_overflow = false;
     for (;;)
     {
         #if defined EXPR_DEBUG
@@ -889,7 +2118,7 @@ token_t read_expression(void)
                 if (seenvalue)
                     wanted_operator();
 
-                push_value(program_counter);
+                push_constant(ctx->program_counter);
                 seenvalue = true;
                 break;
 
@@ -897,7 +2126,7 @@ token_t read_expression(void)
                 if (seenvalue)
                     wanted_operator();
 
-                push_value(token_number);
+                push_constant(ctx->token_number);
                 seenvalue = true;
                 break;
             
@@ -905,17 +2134,27 @@ token_t read_expression(void)
                 if (seenvalue)
                     wanted_operator();
 
-                /* Special hack for db */
-                if (db_string_constant_hack && (value_sp == 0) && (operator_sp == 0))
-                    return t;
+                /* Special hack for db: a string is emitted as it is, unless
+                 * it's one character with more of the expression after it
+                 * ('Y'+80H). */
+                if (ctx->db_string_constant_hack && (ctx->value_sp == 0) && (ctx->operator_sp == 0))
+                {
+                    uint8_t c;
+
+                    skip_input(scan_spaces);
+                    c = *ctx->input_ptr;
+                    if ((ctx->token_length != 1) || (c == ',') || (c == ';') ||
+                        (char_class[c] & CC_COMMENT_END))
+                        return t;
+                }
 
-                v = token_buffer[0];
-                if (token_length == 2)
-                    v = (v<<8) | token_buffer[1];
-                if ((token_length != 1) && (token_length != 2))
+                v = ctx->token_buffer[0];
+                if (ctx->token_length == 2)
+                    v = (v<<8) | ctx->token_buffer[1];
+                if ((ctx->token_length != 1) && (ctx->token_length != 2))
                     fatal("invalid character constant");
 
-                push_value(v);
+                push_constant(v);
                 seenvalue = true;
                 break;
 
@@ -947,6 +2186,35 @@ token_t read_expression(void)
                 seenvalue = false;
                 break;
 
+            case '=':
+                if (!seenvalue)
+                    wanted_value();
+                push_and_apply_operator(OP_EQ);
+                seenvalue = false;
+                break;
+
+            case '<':
+            case '>':
+            {
+                uint8_t c = read_byte();
+                uint8_t opid;
+
+                if (!seenvalue)
+                    wanted_value();
+                if (c == '=')
+                    opid = (t == '<') ? OP_LE : OP_GE;
+                else if ((c == '>') && (t == '<'))
+                    opid = OP_NE;
+                else
+                {
+                    unread_byte(c);
+                    opid = (t == '<') ? OP_LT : OP_GT;
+                }
+                push_and_apply_operator(opid);
+                seenvalue = false;
+                break;
+            }
+
             case '(':
                 if (seenvalue)
                     wanted_operator();
@@ -963,9 +2231,9 @@ token_t read_expression(void)
                 {
                     uint8_t opid;
 
-                    if (operator_sp == 0)
+                    if (ctx->operator_sp == 0)
                         fatal("unbalanced parentheses");
-                    opid = operator_stack[--operator_sp];
+                    opid = ctx->operator_stack[--ctx->operator_sp];
                     if (opid == OP_PAR)
                         break;
                     apply_operator(opid);
@@ -973,21 +2241,44 @@ token_t read_expression(void)
                 break;
 
             case TOKEN_IDENTIFIER:
-                if (token_symbol->callback == operator_cb)
+                if (ctx->token_symbol->callback == operator_cb)
                 {
-                    const struct operator* op = &operators[token_symbol->value];
+                    const struct operator* op = &operators[ctx->token_symbol->value];
                     if (op->binary != seenvalue)
                         syntax_error();
                         
-                    push_and_apply_operator(token_symbol->value);
+                    push_and_apply_operator(ctx->token_symbol->value);
                     seenvalue = false;
                 }
+                else if (ctx->token_symbol->callback == nul_cb)
+                {
+                    /* True if nothing else is left in the statement (usually
+                     * because a macro argument was empty); whatever is there
+                     * is skipped. */
+                    if (seenvalue)
+                        wanted_operator();
+
+                    t = read_token();
+                    push_constant(((t == TOKEN_NL) || (t == TOKEN_EOF)) ? 0xffff : 0);
+                    while ((t != TOKEN_NL) && (t != TOKEN_EOF))
+                        t = read_token();
+                    seenvalue = true;
+                    goto terminate;
+                }
                 else if (islabel())
                 {
                     if (seenvalue)
                         wanted_operator();
 
-                    push_value(token_symbol->value);
+                    push_label_value(ctx->token_symbol);
+                    seenvalue = true;
+                }
+                else if (isopcode())
+                {
+                    if (seenvalue)
+                        wanted_operator();
+
+                    push_constant(ctx->token_symbol->value);
                     seenvalue = true;
                 }
                 else
@@ -1004,23 +2295,23 @@ terminate:
         printx("unstacking");
     #endif
 
-    while (operator_sp != 0)
+    while (ctx->operator_sp != 0)
     {
         #if defined EXPR_DEBUG
             printstacks();
         #endif
 
-        uint8_t opid = operator_stack[--operator_sp];
+        uint8_t opid = ctx->operator_stack[--ctx->operator_sp];
         apply_operator(opid);
     }
 
-    if (value_sp != 1)
+    if (ctx->value_sp != 1)
         fatal("missing expression");
-    token_number = value_stack[0];
+    ctx->token_number = ctx->value_stack[0];
 
     #if defined EXPR_DEBUG
         print("result: ");
-        printhex16(token_number);
+        printhex16(ctx->token_number);
         crlf();
     #endif
 
@@ -1033,133 +2324,1136 @@ void expect_expression(void)
         fatal("expected a single expression");
 }
 
-void operator_cb(void)   { fatal("operators are not instructions"); }
-void setlabel_cb(void)   { fatal("values are not instructions"); }
-void equlabel_cb(void)   { setlabel_cb(); }
-void undeflabel_cb(void) { fatal("unrecognised instruction"); }
-
-void set_implicit_label(void)
+/* The expression just read must have a final value now. */
+void require_resolved(void)
 {
-    if (!current_label)
-        return;
-
-    if ((current_label->value != program_counter) &&
-        (current_label->callback != undeflabel_cb))
-        fatal("label already defined");
-
-    current_label->value = program_counter;
-    current_label->callback = equlabel_cb;
+    if (ctx->recording && ctx->expr_unresolved)
+        ctx->onepass_failed = true;
 }
 
-void title_cb(void)
+/* Remembers the expression just read so it can be evaluated at the end of
+ * the pass: either patched into the image at address, or assigned to sym. */
+struct fixup* defer_expression(uint16_t address, uint8_t width, struct symbol* sym)
 {
-    expect(TOKEN_STRING);
-    if (pass == 0)
+    struct fixup* f;
+
+    if (ctx->expr_overflow)
     {
-        print("Title: ");
-        printn((char*) token_buffer, token_length);
-        crlf();
+        ctx->onepass_failed = true;
+        return NULL;
     }
 
-    expect(TOKEN_NL);
+    f = arena_alloc(sizeof(struct fixup) + ctx->expr_length*sizeof(struct expr_op));
+    f->symbol = sym;
+    f->address = address;
+    f->width = width;
+    f->length = ctx->expr_length;
+    memcpy(f->code, ctx->expr_code, ctx->expr_length*sizeof(struct expr_op));
+    f->next = ctx->fixups;
+    ctx->fixups = f;
+    return f;
 }
 
-void emit_left_column_label_data(void)
+/* Called after the value of an EQU or SET has been read. */
+void define_label_expression(void)
 {
-    if (pass == 1)
+    if (ctx->recording)
     {
-        emit_hex16_to_left_prn_buffer(token_number);
-        emit_char_to_left_prn_buffer(' ');
-        emit_char_to_left_prn_buffer('=');
+        ctx->current_label->definition = NULL;
+        if (ctx->expr_unresolved)
+            ctx->current_label->definition = defer_expression(0, 0, ctx->current_label);
     }
 }
 
-void equ_cb(void)
+void emit8_expression(void)
 {
-    if (!current_label)
-        fatal("equ with no label");
-    expect_expression();
-
-    if ((current_label->value != token_number) &&
-        (current_label->callback != undeflabel_cb))
-        fatal("label already defined");
-
-    current_label->value = token_number;
-    current_label->callback = equlabel_cb;
-
-    emit_left_column_label_data();
+    if (ctx->recording && ctx->expr_unresolved)
+        defer_expression(ctx->program_counter, 1, NULL);
+    emit8(ctx->token_number);
 }
 
-void set_cb(void)
+void emit16_expression(void)
 {
-    if (!current_label)
-        fatal("set with no label");
-
-    if (current_label->callback == equlabel_cb)
-        fatal("label already defined");
-
-    expect_expression();
-    current_label->value = token_number;
-    current_label->callback = setlabel_cb;
-
-    emit_left_column_label_data();
+    if (ctx->recording && ctx->expr_unresolved)
+        defer_expression(ctx->program_counter, 2, NULL);
+    emit16(ctx->token_number);
 }
 
-void if_cb(void)
+uint16_t evaluate_fixup(const struct fixup* f)
 {
-    expect_expression();
+    uint16_t stack[EXPR_CODE_SIZE];
+    unsigned sp = 0;
+    unsigned i;
 
-    if (token_number)
+    for (i=0; i<f->length; i++)
     {
-        /* true case; do nothing */
-    }
-    else
-    {
-        pass += 10; /* Suppress prn logging */
-        for (;;)
+        const struct expr_op* op = &f->code[i];
+        switch (op->kind)
         {
-            token_t t = read_token();
-            if (t == TOKEN_EOF)
-                fatal("unexpected end of file");
-            if ((t == TOKEN_IDENTIFIER) &&
-                ((token_symbol->callback == endif_cb) || (token_symbol->callback == else_cb)))
+            case EXPR_VALUE:
+                stack[sp++] = op->value;
                 break;
-        }
-        expect(TOKEN_NL);
-        pass -= 10; /* Enable prn logging again */
-    }
+
+            case EXPR_SYMBOL:
+                stack[sp++] = op->symbol->value;
+                break;
+
+            case EXPR_OPERATOR:
+            {
+                const struct operator* o = &operators[op->opid];
+                if (o->binary)
+                {
+                    sp--;
+                    stack[sp-1] = o->callback(stack[sp-1], stack[sp]);
+                }
+                else
+                    stack[sp-1] = o->callback(stack[sp-1], 0);
+                break;
+            }
+        }
+    }
+    return stack[0];
+}
+
+/* Patches every recorded site in the image.  A forward reference takes the
+ * value its symbol had at the end of the pass, which is exactly what the
+ * second pass would have seen.  Returns false if an EQU would come out
+ * differently in a second pass, so that one is run to report it. */
+bool resolve_fixups(void)
+{
+    struct fixup* f;
+
+    for (f = ctx->fixups; f; f = f->next)
+    {
+        uint16_t v = evaluate_fixup(f);
+
+        if (f->symbol)
+        {
+            if ((f->symbol->callback == equlabel_cb) && (f->symbol->value != v))
+                return false;
+            continue;
+        }
+        ctx->image[f->address] = v;
+        if (f->width == 2)
+            ctx->image[(uint16_t)(f->address + 1)] = v >> 8;
+    }
+    return true;
+}
+
+/* Forgets the deferred definitions so the second pass checks them afresh. */
+void discard_fixups(void)
+{
+    struct fixup* f;
+
+    for (f = ctx->fixups; f; f = f->next)
+    {
+        if (f->symbol)
+            f->symbol->definition = NULL;
+    }
+    ctx->fixups = NULL;
+}
+
+void operator_cb(void)   { fatal("operators are not instructions"); }
+void setlabel_cb(void)   { fatal("values are not instructions"); }
+void equlabel_cb(void)   { setlabel_cb(); }
+void undeflabel_cb(void) { fatal("unrecognised instruction"); }
+
+void set_implicit_label(void)
+{
+    if (!ctx->current_label)
+        return;
+
+    if ((ctx->current_label->value != ctx->program_counter) &&
+        (ctx->current_label->callback != undeflabel_cb))
+        fatal("label already defined");
+
+    ctx->current_label->value = ctx->program_counter;
+    ctx->current_label->callback = equlabel_cb;
+}
+
+void title_cb(void)
+{
+    expect(TOKEN_STRING);
+    if (ctx->pass == 0)
+    {
+        print("Title: ");
+        printn((char*) ctx->token_buffer, ctx->token_length);
+        crlf();
+    }
+
+    expect(TOKEN_NL);
+}
+
+void emit_left_column_label_data(void)
+{
+    if (ctx->listing_line)
+    {
+        list_hex16(ctx->token_number);
+        list_left(" =", 2);
+    }
+}
+
+void equ_cb(void)
+{
+    if (!ctx->current_label)
+        fatal("equ with no label");
+    expect_expression();
+
+    /* A deferred value can't be compared yet; let the second pass do it. */
+    if (ctx->current_label->definition)
+        ctx->onepass_failed = true;
+    else if ((ctx->current_label->value != ctx->token_number) &&
+        (ctx->current_label->callback != undeflabel_cb))
+        fatal("label already defined");
+
+    ctx->current_label->value = ctx->token_number;
+    ctx->current_label->callback = equlabel_cb;
+    define_label_expression();
+
+    emit_left_column_label_data();
+}
+
+void set_cb(void)
+{
+    if (!ctx->current_label)
+        fatal("set with no label");
+
+    if (ctx->current_label->callback == equlabel_cb)
+        fatal("label already defined");
+
+    expect_expression();
+    ctx->current_label->value = ctx->token_number;
+    ctx->current_label->callback = setlabel_cb;
+    define_label_expression();
+
+    emit_left_column_label_data();
+}
+
+/* Pseudoops which are looked for without the lexer, when skipping
+ * conditionals and reading macro bodies. */
+enum
+{
+    KEYWORD_NONE,
+    KEYWORD_IF,
+    KEYWORD_ELSE,
+    KEYWORD_ENDIF,
+    KEYWORD_MACRO,
+    KEYWORD_REPT,
+    KEYWORD_IRP,
+    KEYWORD_IRPC,
+    KEYWORD_ENDM,
+    KEYWORD_LOCAL
+};
+
+const char* const keywords[] =
+{
+    NULL, "IF", "ELSE", "ENDIF", "MACRO", "REPT", "IRP", "IRPC", "ENDM", "LOCAL"
+};
+
+#define KEYWORD_LENGTH 5
+
+/* The word is in upper case, without $s. */
+int find_keyword(const char* word, unsigned length)
+{
+    unsigned i;
+
+    if (length > KEYWORD_LENGTH)
+        return KEYWORD_NONE;
+    for (i=1; i<sizeof(keywords)/sizeof(*keywords); i++)
+    {
+        if ((strlen(keywords[i]) == length) && !memcmp(keywords[i], word, length))
+            return i;
+    }
+    return KEYWORD_NONE;
+}
+
+/* Returns true for a keyword which starts a macro body. */
+bool opens_macro(int keyword)
+{
+    return (keyword == KEYWORD_MACRO) || (keyword == KEYWORD_REPT) ||
+        (keyword == KEYWORD_IRP) || (keyword == KEYWORD_IRPC);
+}
+
+/* Reads a word of a skipped statement without interning it, and returns which
+ * keyword (if any) it is. */
+int read_skipped_word(void)
+{
+    char word[KEYWORD_LENGTH];
+    unsigned length = 0;
+
+    for (;;)
+    {
+        uint8_t c = peek_unlisted_byte();
+
+        if (c != '$')
+        {
+            if (!(char_class[c] & CC_IDENT))
+                break;
+            if (length < sizeof(word))
+                word[length] = char_upper[c];
+            length++;
+        }
+        ctx->input_ptr++;
+    }
+
+    return find_keyword(word, length);
+}
+
+/* Skips the rest of a statement, up to and including its separator. */
+void skip_statement(void)
+{
+    for (;;)
+    {
+        uint8_t c;
+
+        skip_unlisted_input(scan_statement);
+        c = *ctx->input_ptr++;
+        switch (c)
+        {
+            case '\'':
+                /* A doubled quote just looks like two strings. */
+                skip_unlisted_input(scan_string);
+                if (peek_unlisted_byte() == '\'')
+                    ctx->input_ptr++;
+                break;
+
+            case ';':
+                skip_unlisted_input(scan_comment);
+                break;
+
+            case '\n':
+                ctx->eol = true;
+                return;
+
+            case '!':
+                return;
+
+            default:
+                fatal("unexpected end of file");
+        }
+    }
+}
+
+/* Skips the body of a false conditional (or the ELSE part of a true one)
+ * without lexing it: each statement is only looked at for long enough to see
+ * if it starts, perhaps after a label, with one of the keywords.  Nested
+ * conditionals, and macro bodies, are counted, and skipping stops after the
+ * ENDIF, or ELSE if stop_at_else, which matches.  Returns whichever that was;
+ * or KEYWORD_NONE if the macro expansion the conditional was in ended first,
+ * which closes it. */
+int skip_conditional(bool stop_at_else)
+{
+    unsigned ends = ctx->input_ends;
+    unsigned depth = 0;
+    unsigned macro_depth = 0;
+
+    for (;;)
+    {
+        int word = KEYWORD_NONE;
+
+        /* Stop before the input which follows is touched. */
+        if (ctx->input_depth && (ctx->input_ptr == ctx->input_end))
+        {
+            refill_input();
+            if (ctx->input_ends != ends)
+                return KEYWORD_NONE;
+        }
+
+        /* Keep the line count the same as if the lexer had done this. */
+        count_line();
+
+        skip_unlisted_input(scan_spaces);
+        if (char_class[peek_unlisted_byte()] & CC_ALPHA)
+        {
+            word = read_skipped_word();
+            if (word == KEYWORD_NONE)
+            {
+                /* Might have been a label. */
+                skip_unlisted_input(scan_spaces);
+                if (peek_unlisted_byte() == ':')
+                {
+                    ctx->input_ptr++;
+                    skip_unlisted_input(scan_spaces);
+                }
+                if (char_class[peek_unlisted_byte()] & CC_ALPHA)
+                    word = read_skipped_word();
+            }
+        }
+
+        if (opens_macro(word))
+            macro_depth++;
+        else if (word == KEYWORD_ENDM)
+        {
+            if (macro_depth)
+                macro_depth--;
+        }
+        else if (macro_depth)
+        {
+            /* Conditionals in a macro body belong to its expansions. */
+        }
+        else if (word == KEYWORD_IF)
+            depth++;
+        else if ((depth == 0) &&
+                 ((word == KEYWORD_ENDIF) || ((word == KEYWORD_ELSE) && stop_at_else)))
+        {
+            /* The rest of the line may only be a comment. */
+            skip_unlisted_input(scan_spaces);
+            if (peek_unlisted_byte() == ';')
+                skip_unlisted_input(scan_comment);
+            if (!(char_class[peek_unlisted_byte()] & CC_COMMENT_END) ||
+                (*ctx->input_ptr == 26))
+                syntax_error();
+            if (*ctx->input_ptr++ == '\n')
+                ctx->eol = true;
+            return word;
+        }
+        else if (word == KEYWORD_ENDIF)
+            depth--;
+
+        skip_statement();
+    }
+}
+
+void if_cb(void)
+{
+    expect_expression();
+    require_resolved();
+
+    /* Skipping stops after the ELSE or ENDIF; only an ELSE leaves the
+     * conditional open. */
+    if (ctx->token_number || (skip_conditional(true) == KEYWORD_ELSE))
+        ctx->if_depth++;
+}
+
+void else_cb(void)
+{
+    /* If this pseudoop actually gets executed, then we've been executing the
+     * true branch of the if...endif. Skip to the end. */
+    if (ctx->if_depth == 0)
+        fatal("ELSE without IF");
+    if (skip_conditional(false) == KEYWORD_ENDIF)
+        ctx->if_depth--;
+}
+
+void endif_cb(void)
+{
+    if (ctx->if_depth == 0)
+        fatal("ENDIF without IF");
+    ctx->if_depth--;
+    expect(TOKEN_NL);
+}
+
+/* Starts the listing line for a statement (or a line of a macro body). */
+void begin_listing_line(void)
+{
+    ctx->listing_line = ctx->listing_input;
+    if (ctx->listing_line)
+    {
+        memset(ctx->prn_buffer, ' ', sizeof(ctx->prn_buffer));
+        ctx->prn_buffer_left_fill = 0;
+        ctx->prn_buffer_right_fill = PRN_BUFFER_LEFT_COLUMN_WIDTH + 1;
+    }
+}
+
+/* The line goes out with one more byte than was filled: usually a blank, but
+ * the last character of the line if it was read past and unread. */
+void end_listing_line(void)
+{
+    if (ctx->listing_line)
+    {
+        uint8_t* p = ctx->prn_buffer + ctx->prn_buffer_right_fill + 1;
+        p[0] = '\r';
+        p[1] = '\n';
+        write_to_output_file(&ctx->prn_file, ctx->prn_buffer, p + 2 - ctx->prn_buffer);
+    }
+}
+
+/* Returns the end of the word at p (which must start one).  $s are part of
+ * words in the program, but not in strings. */
+const uint8_t* find_word_end(const uint8_t* p, const uint8_t* end, bool dollars)
+{
+    while ((p != end) && ((char_class[*p] & CC_IDENT) || (dollars && (*p == '$'))))
+        p++;
+    return p;
+}
+
+/* Returns the keyword the first (or, if words is 2, perhaps the second) word
+ * of a line is, and sets *rest to what follows it. */
+int find_line_keyword(const uint8_t* p, const uint8_t* end, unsigned words,
+    const uint8_t** rest)
+{
+    while (words--)
+    {
+        char word[KEYWORD_LENGTH];
+        unsigned length = 0;
+        int keyword;
+
+        while ((p != end) && (char_class[*p] & CC_SPACE))
+            p++;
+        if ((p == end) || !(char_class[*p] & CC_ALPHA))
+            break;
+        for (; (p != end) && ((char_class[*p] & CC_IDENT) || (*p == '$')); p++)
+        {
+            if (*p == '$')
+                continue;
+            if (length < sizeof(word))
+                word[length] = char_upper[*p];
+            length++;
+        }
+
+        keyword = find_keyword(word, length);
+        if (keyword != KEYWORD_NONE)
+        {
+            *rest = p;
+            return keyword;
+        }
+
+        while ((p != end) && (char_class[*p] & CC_SPACE))
+            p++;
+        if ((p != end) && (*p == ':'))
+            p++;
+    }
+    return KEYWORD_NONE;
+}
+
+/* Returns the number of the name (in upper case, without $s) at p, or -1. */
+int find_macro_name(const struct macro_names* names, const uint8_t* p, const uint8_t* end)
+{
+    uint8_t name[MACRO_NAME_LENGTH];
+    unsigned length = 0;
+    unsigned i;
+
+    for (; p != end; p++)
+    {
+        if (*p == '$')
+            continue;
+        if (length == sizeof(name))
+            return -1;
+        name[length++] = char_upper[*p];
+    }
+
+    for (i=0; i<names->count; i++)
+    {
+        if ((names->length[i] == length) && !memcmp(names->name[i], name, length))
+            return i;
+    }
+    return -1;
+}
+
+/* Adds a list of names, separated by commas, to names. */
+void parse_macro_names(struct macro_names* names, const uint8_t* p, const uint8_t* end)
+{
+    for (;;)
+    {
+        const uint8_t* q;
+        unsigned length = 0;
+
+        while ((p != end) && (char_class[*p] & CC_SPACE))
+            p++;
+        if ((p == end) || !(char_class[*p] & CC_ALPHA))
+            syntax_error();
+        if (names->count == MACRO_NAMES)
+            fatal("too many macro parameters");
+
+        q = find_word_end(p, end, true);
+        for (; p != q; p++)
+        {
+            if (*p == '$')
+                continue;
+            if (length == MACRO_NAME_LENGTH)
+                fatal("macro parameter name too long");
+            names->name[names->count][length++] = char_upper[*p];
+        }
+        names->length[names->count++] = length;
+
+        while ((p != end) && (char_class[*p] & CC_SPACE))
+            p++;
+        if (p == end)
+            return;
+        if (*p != ',')
+            syntax_error();
+        p++;
+    }
+}
+
+/* Adds a line of a macro body to ctx->body, with the names in it replaced by
+ * MACRO_PARAM references.  Names are found as words in the program, and after
+ * an & in strings; any & joining a name to its neighbours goes.  ;; comments
+ * aren't kept. */
+void add_macro_line(const struct macro_names* names, const uint8_t* p, const uint8_t* end)
+{
+    struct byte_buffer* body = &ctx->body;
+    const uint8_t* start = p;
+    bool quoted = false;
+
+    while ((p != end) && (char_class[*p] & CC_SPACE))
+        p++;
+    if (((end - p) >= 2) && (p[0] == ';') && (p[1] == ';'))
+        return;
+
+    p = start;
+    while (p != end)
+    {
+        uint8_t c = *p;
+
+        if (c == MACRO_PARAM)
+            p++;
+        else if (quoted)
+        {
+            if ((c == '&') && ((p + 1) != end) && (char_class[p[1]] & CC_ALPHA))
+            {
+                const uint8_t* q = find_word_end(p + 1, end, false);
+                int n = find_macro_name(names, p + 1, q);
+                if (n >= 0)
+                {
+                    uint8_t ref[2] = { MACRO_PARAM, n };
+                    append_text(body, ref, 2);
+                    /* An & after it goes too, unless it starts another. */
+                    if ((q != end) && (*q == '&'))
+                    {
+                        if (((q + 1) == end) || !(char_class[q[1]] & CC_ALPHA) ||
+                            (find_macro_name(names, q + 1,
+                                find_word_end(q + 1, end, false)) < 0))
+                            q++;
+                    }
+                    p = q;
+                    continue;
+                }
+            }
+            if (c == '\'')
+                quoted = false;
+            append_text(body, p++, 1);
+        }
+        else if (c == ';')
+        {
+            if (((p + 1) != end) && (p[1] == ';'))
+                break;
+            append_text(body, p, end - p);
+            break;
+        }
+        else if (char_class[c] & CC_ALPHA)
+        {
+            const uint8_t* q = find_word_end(p, end, true);
+            int n = find_macro_name(names, p, q);
+            if (n >= 0)
+            {
+                uint8_t ref[2] = { MACRO_PARAM, n };
+                if ((p != start) && (p[-1] == '&') &&
+                    (body->data[body->length - 1] == '&'))
+                    body->length--;
+                append_text(body, ref, 2);
+                if ((q != end) && (*q == '&'))
+                    q++;
+            }
+            else
+                append_text(body, p, q - p);
+            p = q;
+        }
+        else if (char_class[c] & CC_DIGIT)
+        {
+            const uint8_t* q = find_word_end(p, end, true);
+            append_text(body, p, q - p);
+            p = q;
+        }
+        else
+        {
+            if (c == '\'')
+                quoted = true;
+            append_text(body, p++, 1);
+        }
+    }
+    append_text(body, "\n", 1);
+}
+
+/* Reads a line of a macro body, as it is. */
+void read_macro_line(void)
+{
+    struct byte_buffer* line = &ctx->line;
+
+    count_line();
+    line->length = 0;
+    for (;;)
+    {
+        uint8_t c = read_byte();
+
+        if (c == '\n')
+            break;
+        if ((c == 26) || (c == 0))
+            fatal("ENDM missing");
+        if (c != '\r')
+            append_text(line, &c, 1);
+    }
+    ctx->eol = true;
+}
+
+/* Reads the body of a MACRO, REPT, IRP or IRPC up to its ENDM, into out.
+ * Any LOCAL names are added to names.  The listing gets each line as it's
+ * read; the ENDM line is left for the statement to finish. */
+struct macro* read_macro_body(struct macro_names* names, struct byte_buffer* out)
+{
+    struct byte_buffer* body = &ctx->body;
+    unsigned depth = 0;
+    struct macro m;
+
+    body->length = 0;
+    end_listing_line();
+    for (;;)
+    {
+        const uint8_t* p;
+        const uint8_t* end;
+        const uint8_t* rest;
+        int keyword;
+
+        begin_listing_line();
+        read_macro_line();
+        p = (const uint8_t*) ctx->line.data;
+        end = p + ctx->line.length;
+
+        keyword = find_line_keyword(p, end, 2, &rest);
+        if (keyword == KEYWORD_ENDM)
+        {
+            if (depth == 0)
+            {
+                /* A label on the ENDM is defined at the end of each
+                 * expansion (PFCB: ENDM in SEQIO.LIB). */
+                const uint8_t* q = p;
+                while ((q != end) && (char_class[*q] & CC_SPACE))
+                    q++;
+                if (find_line_keyword(q, end, 1, &rest) != KEYWORD_ENDM)
+                {
+                    q = find_word_end(q, end, true);
+                    if ((q != end) && (*q == ':'))
+                        q++;
+                    add_macro_line(names, p, q);
+                }
+                break;
+            }
+            depth--;
+        }
+        else if (opens_macro(keyword))
+            depth++;
+        else if ((keyword == KEYWORD_LOCAL) && (depth == 0))
+        {
+            const uint8_t* q = rest;
+            while ((q != end) && (*q != ';') && (*q != '!'))
+                q++;
+            while ((q != rest) && (char_class[q[-1]] & CC_SPACE))
+                q--;
+            parse_macro_names(names, rest, q);
+            end_listing_line();
+            continue;
+        }
+
+        add_macro_line(names, p, end);
+        end_listing_line();
+    }
+
+    m.params = names->params;
+    m.locals = names->count - names->params;
+    m.length = body->length;
+    out->length = 0;
+    append_text(out, &m, sizeof(m));
+    append_text(out, body->data, body->length);
+    return (struct macro*) out->data;
 }
 
-void else_cb(void)
+/* Reads the rest of the statement as text, for the pseudoops which don't take
+ * expressions: without the comment, and with no blanks either end.  A < at
+ * the start of an argument brackets text up to its > (where ; and ! are just
+ * text). */
+void read_operand_text(void)
 {
-    /* If this pseudoop actually gets executed, then we've been executing the
-     * true branch of the if...endif. Skip to the end. */
+    struct byte_buffer* buf = &ctx->operand;
+    bool quoted = false;
+    bool arg_start = true;
+    unsigned brackets = 0;
 
-    pass += 10; /* Suppress prn logging */
+    buf->length = 0;
+    skip_input(scan_spaces);
     for (;;)
     {
-        token_t t = read_token();
-        if (t == TOKEN_EOF)
-            fatal("unexpected end of file");
-        if ((t == TOKEN_IDENTIFIER) && (token_symbol->callback == endif_cb))
+        uint8_t c = read_byte();
+
+        if ((c == ';') && !quoted && !brackets)
+        {
+            skip_input(scan_comment);
+            c = read_byte();
+        }
+        if (c == '\n')
+        {
+            ctx->eol = true;
+            break;
+        }
+        if ((c == 26) || (c == 0))
+        {
+            unread_byte(c);
             break;
+        }
+        if ((c == '!') && !quoted && !brackets)
+            break;
+
+        if (c == '\'')
+            quoted = !quoted;
+        else if (!quoted)
+        {
+            if ((c == '<') && (arg_start || brackets))
+                brackets++;
+            else if ((c == '>') && brackets)
+                brackets--;
+            else if ((c == ',') && !brackets)
+                arg_start = true;
+            else if (!(char_class[c] & CC_SPACE))
+                arg_start = false;
+        }
+        append_text(buf, &c, 1);
     }
-    expect(TOKEN_NL);
-    pass -= 10; /* Enable prn logging again */
+
+    while (buf->length && isspace((uint8_t) buf->data[buf->length - 1]))
+        buf->length--;
 }
 
-void endif_cb(void)
+/* Evaluates an expression given as text, such as a %argument. */
+uint16_t evaluate_text(const uint8_t* p, size_t length)
+{
+    const uint8_t* ptr = ctx->input_ptr;
+    const uint8_t* end = ctx->input_end;
+    bool eol = ctx->eol;
+    bool listing_input = ctx->listing_input;
+    uint16_t lineno = ctx->lineno;
+    struct byte_buffer* buf = &ctx->expression;
+
+    buf->length = 0;
+    append_text(buf, p, length);
+    append_text(buf, "\n", 1);
+
+    /* The newline ends the expression, so nothing past it is read. */
+    account_input();
+    ctx->input_ptr = ctx->input_window = (const uint8_t*) buf->data;
+    ctx->input_end = ctx->input_ptr + buf->length;
+    ctx->listing_input = false;
+    expect_expression();
+    require_resolved();
+
+    ctx->input_ptr = ctx->input_window = ptr;
+    ctx->input_end = end;
+    ctx->eol = eol;
+    ctx->listing_input = listing_input;
+    ctx->lineno = lineno;
+    return ctx->token_number;
+}
+
+void add_macro_arg(struct input_source* s, const void* data, size_t length)
+{
+    struct text_span span;
+
+    span.start = s->args.length;
+    span.length = length;
+    append_text(&s->args, data, length);
+    append_text(&s->spans, &span, sizeof(span));
+}
+
+/* Splits text into macro arguments, separated by commas.  Each is either
+ * <bracketed> and taken as it is, commas and all; or %expression, replaced by
+ * its value in decimal; or anything else up to the next comma, with quoted
+ * strings kept whole. */
+void parse_macro_args(struct input_source* s, const uint8_t* p, const uint8_t* end)
+{
+    s->args.length = s->spans.length = 0;
+    if (p == end)
+        return;
+
+    for (;;)
+    {
+        const uint8_t* q;
+
+        while ((p != end) && (char_class[*p] & CC_SPACE))
+            p++;
+
+        if ((p != end) && (*p == '<'))
+        {
+            unsigned depth = 0;
+
+            for (q = p; q != end; q++)
+            {
+                if (*q == '<')
+                    depth++;
+                else if ((*q == '>') && !--depth)
+                    break;
+            }
+            if (q == end)
+                fatal("missing >");
+            add_macro_arg(s, p + 1, q - p - 1);
+            p = q + 1;
+        }
+        else
+        {
+            bool percent = (p != end) && (*p == '%');
+            bool quoted = false;
+            const uint8_t* r;
+
+            if (percent)
+                p++;
+            for (q = p; q != end; q++)
+            {
+                if (*q == '\'')
+                    quoted = !quoted;
+                else if ((*q == ',') && !quoted)
+                    break;
+            }
+            for (r = q; (r != p) && (char_class[r[-1]] & CC_SPACE); r--)
+                ;
+
+            if (percent)
+            {
+                size_t start = s->args.length;
+                struct text_span span;
+
+                append_decimal(&s->args, evaluate_text(p, r - p));
+                span.start = start;
+                span.length = s->args.length - start;
+                append_text(&s->spans, &span, sizeof(span));
+            }
+            else
+                add_macro_arg(s, p, r - p);
+            p = q;
+        }
+
+        while ((p != end) && (char_class[*p] & CC_SPACE))
+            p++;
+        if (p == end)
+            return;
+        if (*p != ',')
+            syntax_error();
+        p++;
+    }
+}
+
+/* Defines (or redefines) sym as a macro, whose parameter list is the text
+ * from p to end; the body follows. */
+void define_macro(struct symbol* sym, const uint8_t* p, const uint8_t* end)
+{
+    struct macro_names names;
+    struct macro* m;
+
+    names.count = 0;
+    while ((p != end) && (char_class[*p] & CC_SPACE))
+        p++;
+    if (p != end)
+        parse_macro_names(&names, p, end);
+    names.params = names.count;
+
+    m = read_macro_body(&names, &ctx->line);
+    if (ctx->line.length > (ARENA_CHUNK_SIZE / 2))
+        fatal("macro too long");
+    sym->macro = arena_alloc(ctx->line.length);
+    memcpy(sym->macro, m, ctx->line.length);
+    sym->callback = macro_call_cb;
+}
+
+void macro_cb(void)
+{
+    struct symbol* sym = ctx->current_label;
+
+    if (!sym)
+        fatal("macro with no name");
+    if ((sym->callback != undeflabel_cb) && (sym->callback != macro_call_cb))
+        fatal("label already defined");
+
+    read_operand_text();
+    define_macro(sym, (const uint8_t*) ctx->operand.data,
+        (const uint8_t*) ctx->operand.data + ctx->operand.length);
+}
+
+void macro_call_cb(void)
+{
+    struct symbol* sym = ctx->current_insn;
+    struct input_source* s = next_input();
+    const uint8_t* p;
+    const uint8_t* end;
+    const uint8_t* rest;
+
+    read_operand_text();
+    p = (const uint8_t*) ctx->operand.data;
+    end = p + ctx->operand.length;
+
+    /* Macros may redefine themselves, often while they're being expanded. */
+    if (find_line_keyword(p, end, 1, &rest) == KEYWORD_MACRO)
+    {
+        if (ctx->current_label)
+            fatal("label already defined");
+        define_macro(sym, rest, end);
+        return;
+    }
+
+    s->macro = sym->macro;
+    s->irp = false;
+    s->iterations = 1;
+    parse_macro_args(s, p, end);
+    push_input(s, true);
+}
+
+void rept_cb(void)
+{
+    struct input_source* s = next_input();
+    struct macro_names names;
+
+    expect_expression();
+    require_resolved();
+
+    names.count = names.params = 0;
+    s->iterations = ctx->token_number;
+    s->irp = false;
+    s->args.length = s->spans.length = 0;
+    s->macro = read_macro_body(&names, &s->body);
+    if (s->iterations)
+        push_input(s, true);
+}
+
+/* IRP and IRPC repeat their body for each of a list of arguments, or each
+ * character of some text. */
+void read_irp(bool characters)
+{
+    struct input_source* s = next_input();
+    struct macro_names names;
+    const uint8_t* p;
+    const uint8_t* q;
+    const uint8_t* end;
+
+    read_operand_text();
+    p = (const uint8_t*) ctx->operand.data;
+    end = p + ctx->operand.length;
+    for (q = p; (q != end) && (*q != ','); q++)
+        ;
+    if (q == end)
+        syntax_error();
+
+    names.count = 0;
+    parse_macro_names(&names, p, q);
+    if (names.count != 1)
+        syntax_error();
+    names.params = 1;
+
+    for (p = q + 1; (p != end) && (char_class[*p] & CC_SPACE); p++)
+        ;
+    if ((p != end) && (*p == '<') && (end[-1] == '>'))
+    {
+        p++;
+        end--;
+    }
+
+    if (characters)
+    {
+        s->args.length = s->spans.length = 0;
+        append_text(&s->args, p, end - p);
+        for (q = p; q != end; q++)
+        {
+            struct text_span span = { q - p, 1 };
+            append_text(&s->spans, &span, sizeof(span));
+        }
+    }
+    else
+        parse_macro_args(s, p, end);
+
+    /* Nothing to repeat over still gives one, empty, iteration. */
+    if (s->spans.length == 0)
+        add_macro_arg(s, "", 0);
+
+    s->iterations = s->spans.length / sizeof(struct text_span);
+    s->irp = true;
+    s->macro = read_macro_body(&names, &s->body);
+    push_input(s, true);
+}
+
+void irp_cb(void)  { read_irp(false); }
+void irpc_cb(void) { read_irp(true); }
+
+void exitm_cb(void)
 {
     expect(TOKEN_NL);
+    if ((ctx->input_depth == 0) || !ctx->inputs[ctx->input_depth - 1].macro)
+        fatal("EXITM outside a macro");
+    account_input();
+    pop_input();
+}
+
+void endm_cb(void)  { fatal("ENDM without MACRO"); }
+void local_cb(void) { fatal("LOCAL outside a macro"); }
+void nul_cb(void)   { operator_cb(); }
+
+/* MACLIB reads NAME.LIB, from the same drive as the source, as if it were
+ * part of it (but without listing it). */
+void maclib_cb(void)
+{
+    struct input_source* s = next_input();
+    char filename[13];
+    uint8_t record[128];
+    const uint8_t* p;
+    size_t length;
+    unsigned i;
+    FCB fcb;
+
+    read_operand_text();
+    length = ctx->operand.length;
+    if ((length == 0) || (length > 8))
+        syntax_error();
+    for (i=0; i<length; i++)
+    {
+        uint8_t c = ctx->operand.data[i];
+        if (!(char_class[c] & CC_IDENT))
+            syntax_error();
+        filename[i] = char_upper[c];
+    }
+    memcpy(filename + length, ".LIB", 5);
+
+    memset(&fcb, 0, sizeof(FCB));
+    cpm_set_filename(&fcb, filename);
+    fcb.dr = ctx->asm_fcb.dr;
+
+    s->text.length = 0;
+    p = cpm_map_file(&fcb, &length);
+    if (p)
+    {
+        append_text(&s->text, p, length);
+        cpm_unmap_file(&fcb);
+    }
+    else
+    {
+        if (cpm_open_file(&fcb) == 0xff)
+            fatal("cannot open macro library");
+        cpm_set_dma(record);
+        while (cpm_read_sequential(&fcb) == 0)
+            append_text(&s->text, record, sizeof(record));
+        cpm_close_file(&fcb);
+    }
+
+    /* Like any CP/M text file, it ends at the first ^Z. */
+    p = memchr(s->text.data, 26, s->text.length);
+    if (p)
+        s->text.length = p - (const uint8_t*) s->text.data;
+    if ((s->text.length == 0) || (s->text.data[s->text.length - 1] != '\n'))
+        append_text(&s->text, "\n", 1);
+
+    s->macro = NULL;
+    push_input(s, false);
+}
+
+/* The listing isn't paginated, so PAGE is ignored. */
+void page_cb(void)
+{
+    read_operand_text();
 }
 
 void org_cb(void)
 {
     expect_expression();
-    if (token_number < program_counter)
-        fatal("program counter moved backwards");
+    require_resolved();
 
-    program_counter = token_number;
+    /* Going backwards overlays what's already there, which would happen
+     * before rather than after patching forward references. */
+    if ((uint16_t)(ctx->token_number + ctx->bias) < ctx->program_counter)
+        ctx->onepass_failed = true;
+
+    ctx->program_counter = ctx->token_number + ctx->bias;
 }
 
 void bad_separator(void)
@@ -1171,7 +3465,7 @@ void db_cb(void)
 {
     token_t t;
 
-    db_string_constant_hack = true;
+    ctx->db_string_constant_hack = true;
 
     do
     {
@@ -1180,18 +3474,18 @@ void db_cb(void)
         t = read_expression();
         if (t == TOKEN_STRING)
         {
-            for (i=0; i<token_length; i++)
-                emit8(token_buffer[i]);
+            for (i=0; i<ctx->token_length; i++)
+                emit8(ctx->token_buffer[i]);
             t = read_token();
             if ((t != TOKEN_NL) && (t != ','))
                 bad_separator();
         }
         else
-            emit8(token_number);
+            emit8_expression();
     }
     while (t == ',');
 
-    db_string_constant_hack = false;
+    ctx->db_string_constant_hack = false;
 }
 
 void dw_cb(void)
@@ -1200,7 +3494,7 @@ void dw_cb(void)
     do
     {
         t = read_expression();
-        emit16(token_number);
+        emit16_expression();
     }
     while (t == ',');
 }
@@ -1208,44 +3502,48 @@ void dw_cb(void)
 void ds_cb(void)
 {
     expect_expression();
-    program_counter += token_number;
+    require_resolved();
+    ctx->program_counter += ctx->token_number;
 }
 
 void simple1b_cb(void)
 {
-    emit8(current_insn->value);
+    emit8(ctx->current_insn->value);
 }
 
 void simple2b_cb(void)
 {
     expect_expression();
-    emit8(current_insn->value);
-    emit8(token_number);
+    emit8(ctx->current_insn->value);
+    emit8_expression();
 }
 
 void simple3b_cb(void)
 {
     expect_expression();
-    emit8(current_insn->value);
-    emit16(token_number);
+    emit8(ctx->current_insn->value);
+    emit16_expression();
 }
 
 void alusrc_cb(void)
 {
     expect_expression();
-    emit8(current_insn->value | token_number);
+    require_resolved();
+    emit8(ctx->current_insn->value | ctx->token_number);
 }
 
 void aludst_cb(void)
 {
     expect_expression();
-    emit8(current_insn->value | (token_number << 3));
+    require_resolved();
+    emit8(ctx->current_insn->value | (ctx->token_number << 3));
 }
 
 void rp_cb(void)
 {
     expect_expression();
-    emit8(current_insn->value | ((token_number & 6) << 3));
+    require_resolved();
+    emit8(ctx->current_insn->value | ((ctx->token_number & 6) << 3));
 }
 
 void mov_cb(void)
@@ -1255,21 +3553,24 @@ void mov_cb(void)
 
     if (read_expression() != ',')
         bad_separator();
-    dest = token_number;
+    require_resolved();
+    dest = ctx->token_number;
     expect_expression();
-    src = token_number;
+    require_resolved();
+    src = ctx->token_number;
 
-    emit8(0x40 | (dest<<3) | src);
+    emit8(ctx->current_insn->value | (dest<<3) | src);
 }
 
 void lxi_cb(void)
 {
     if (read_expression() != ',')
         bad_separator();
-    emit8(0x01 | ((token_number & 6) << 3));
+    require_resolved();
+    emit8(ctx->current_insn->value | ((ctx->token_number & 6) << 3));
 
     expect_expression();
-    emit16(token_number);
+    emit16_expression();
 }
 
 void mvi_cb(void)
@@ -1278,69 +3579,167 @@ void mvi_cb(void)
 
     if (read_expression() != ',')
         bad_separator();
-    dest = token_number;
+    require_resolved();
+    dest = ctx->token_number;
     expect_expression();
 
-    emit8(0x06 | (dest<<3));
-    emit8(token_number);
+    emit8(ctx->current_insn->value | (dest<<3));
+    emit8_expression();
 }
 
 void end_cb(void) {}
 
-int main(int argc, char **argv)
+void init_char_tables(void)
 {
-#ifndef IGNORE
-    uint8_t* rambottom;
-    uint16_t freeram;
-#endif
+    unsigned c;
 
-    cpm_set_args(argc, argv);
+    for (c=0; c<256; c++)
+    {
+        uint8_t cc = 0;
+
+        if (isspace(c) && (c != '\n'))
+            cc |= CC_SPACE;
+        if (isdigit(c))
+            cc |= CC_DIGIT;
+        if (isalpha(c) || (c == '?') || (c == '@'))
+            cc |= CC_ALPHA;
+        if (isalnum(c) || (c == '_') || (c == '?') || (c == '@'))
+            cc |= CC_IDENT;
+        if (iscntrl(c))
+            cc |= CC_CNTRL;
+        if ((c == '!') || (c == '\n') || (c == 26))
+            cc |= CC_COMMENT_END;
+        if ((c == '!') || (c == '\n') || (c == 26) || (c == 0) ||
+            (c == ';') || (c == '\''))
+            cc |= CC_STATEMENT_END;
+        char_class[c] = cc;
+
+        char_upper[c] = toupper(c);
+        char_listed[c] = iscntrl(c) ? ' ' : c;
+        if (isdigit(c))
+            char_digit[c] = c - '0';
+        else if (isalpha(c))
+            char_digit[c] = toupper(c) - 'A' + 10;
+    }
+}
 
-    cpm_overwrite_ccp();
-#ifndef IGNORE
-    rambottom = cpm_ram;
-    freeram = ((uint16_t)cpm_ramtop - (uint16_t)rambottom) / 1024;
-#endif
+void init_once(void)
+{
+    init_builtin_table();
+    init_char_tables();
+    memset(eof_record, 26, sizeof(eof_record));
+}
 
-    print("CP/M Assembler (C) 2019 David Given; ");
-#ifndef IGNORE
-    printi(freeram);
-    printx("kB free");
-#else
-    printx("");
-#endif
+void asm_init(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, init_once);
+}
+
+struct asm_context* asm8080_new(void)
+{
+    asm_init();
+    return calloc(1, sizeof(struct asm_context));
+}
 
-    memcpy(&bin_file.fcb, &cpm_fcb, sizeof(FCB));
-    bin_file.fcb.dr = get_drive_or_default(cpm_fcb.f[9]);
-    memcpy(&bin_file.fcb.f[8], "BIN", 3);
+void asm8080_free(struct asm_context* c)
+{
+    struct arena_chunk* p = c->arena_first;
+    unsigned i;
+
+    while (p)
+    {
+        struct arena_chunk* next = p->next;
+        free(p);
+        p = next;
+    }
+    free(c->symbols.slots);
+    free(c->console.data);
+    free(c->prn_file.memory.data);
+    free(c->symbol_list);
+    free(c->output.data);
+    free(c->prl_image);
+    for (i=0; i<INPUT_DEPTH; i++)
+    {
+        free(c->inputs[i].text.data);
+        free(c->inputs[i].body.data);
+        free(c->inputs[i].args.data);
+        free(c->inputs[i].spans.data);
+    }
+    free(c->operand.data);
+    free(c->line.data);
+    free(c->body.data);
+    free(c->expression.data);
+    free(c->references.data);
+    free(c);
+}
 
-    memcpy(&prn_file.fcb, &cpm_fcb, sizeof(FCB));
-    prn_file.fcb.dr = get_drive_or_default(cpm_fcb.f[10]);
-    if (prn_file.fcb.dr == 0)
-        prn_file.fcb.dr = SKIP_DRIVE;
-    memcpy(&prn_file.fcb.f[8], "PRN", 3);
+/* Forgets the program, ready to assemble it again. */
+void reset_assembly(void)
+{
+    ctx->onepass_failed = false;
+    ctx->fixups = NULL;
+    clear_image();
+    symtab_reset();
+}
 
-    asm_fcb.dr = get_drive_or_default(cpm_fcb.f[8]);
-    memcpy(&asm_fcb.f[8], "ASM", 3);
+void begin_assembly(const struct asm8080_options* options)
+{
+    ctx->onepass = options->onepass;
+    ctx->symstats = options->symstats;
+    ctx->origin = options->origin;
+    ctx->hex_record_length = options->hex_record_length;
+    ctx->report_stats = options->stats || options->stats_json;
+    ctx->stats_json = options->stats_json;
+    ctx->xref = options->xref;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->start_time = clock_seconds();
+    ctx->prl = options->prl;
+    ctx->bias = 0;
+    ctx->console.length = 0;
+    ctx->prn_file.memory.length = 0;
+    ctx->output.length = 0;
+    ctx->bin_file.opened = ctx->prn_file.opened = false;
+    reset_assembly();
+}
 
-    open_output_file(&bin_file);
-    open_output_file(&prn_file);
+void run_passes(void)
+{
+    /* The listing is written during the second pass, so it still needs one. */
+    ctx->recording = ctx->onepass && (ctx->prn_file.fcb.dr == SKIP_DRIVE);
 
-    for (pass=0; pass<2; pass++)
+    for (ctx->pass=0; ctx->pass<2; ctx->pass++)
     {
-        /* Rewinding files doesn't work on my PX-8, so just reoopen the file. */
-        asm_fcb.ex = asm_fcb.s1 = asm_fcb.s2 = asm_fcb.rc = asm_fcb.cr = 0;
-        if (cpm_open_file(&asm_fcb) == 0xff)
-            fatal("Cannot open input file");
-        asm_fcb.cr = 0;
+        double pass_start = clock_seconds();
 
-        input_buffer_read_count = 0x80;
-        program_counter = 0;
-        eol = true;
-        lineno = 0;
+        if (ctx->input_map)
+        {
+            ctx->input_ptr = ctx->input_map;
+            ctx->input_end = ctx->input_map + ctx->input_map_length;
+        }
+        else
+        {
+            /* Rewinding files doesn't work on my PX-8, so just reoopen the file. */
+            ctx->asm_fcb.ex = ctx->asm_fcb.s1 = ctx->asm_fcb.s2 = ctx->asm_fcb.rc = ctx->asm_fcb.cr = 0;
+            if (cpm_open_file(&ctx->asm_fcb) == 0xff)
+                fatal("Cannot open input file");
+            ctx->asm_fcb.cr = 0;
+            ctx->input_ptr = ctx->input_end = NULL;
+        }
+        ctx->input_window = ctx->input_ptr;
+
+        ctx->program_counter = ctx->origin + ctx->bias;
+        ctx->eol = true;
+        ctx->lineno = 0;
+        ctx->if_depth = 0;
+        ctx->input_depth = 0;
+        ctx->local_count = 0;
+        ctx->listing_input = (ctx->pass == 1) && (ctx->prn_file.fcb.dr != SKIP_DRIVE);
+        ctx->noting_references = ctx->listing_input && ctx->xref;
+        ctx->references.length = 0;
 
         print("Pass ");
-        printi(pass + 1);
+        printi(ctx->pass + 1);
         crlf();
 
         /* Each statement consists of:
@@ -1361,13 +3760,12 @@ int main(int argc, char **argv)
             if (cpm_const())
                 fatal("user abort");
 
-            if (prn_file.fcb.dr != SKIP_DRIVE)
-            {
-                memset(prn_buffer, ' ', sizeof(prn_buffer));
-                prn_buffer_left_fill = 0;
-                prn_buffer_right_fill = PRN_BUFFER_LEFT_COLUMN_WIDTH + 1;
-            }
+            /* Finish any expansion which has run out now, so that its
+             * listing state doesn't apply to the next statement. */
+            if (ctx->input_depth && (ctx->input_ptr == ctx->input_end))
+                refill_input();
 
+            begin_listing_line();
             t = read_token();
 
             if (t == TOKEN_EOF)
@@ -1377,15 +3775,16 @@ int main(int argc, char **argv)
 
             if (t != TOKEN_IDENTIFIER)
                 fatal("expected an identifier");
-            if (token_symbol->callback == end_cb)
+            if (ctx->token_symbol->callback == end_cb)
                 break;
 
-            current_label = NULL;
-            current_insn = NULL;
+            ctx->current_label = NULL;
+            ctx->current_insn = NULL;
 
             if (islabel())
             {
-                current_label = token_symbol;
+                ctx->current_label = ctx->token_symbol;
+                note_definition();
                 t = read_token();
                 if (t == ':')
                     t = read_token();
@@ -1396,44 +3795,317 @@ int main(int argc, char **argv)
                 if (t != TOKEN_IDENTIFIER)
                     fatal("expected an identifier 2");
 
-                current_insn = token_symbol;
+                ctx->current_insn = ctx->token_symbol;
             }
 
-            if (current_insn)
+            if (ctx->current_insn)
             {
-                void (*cb)(void) = current_insn->callback;
-                if ((cb != set_cb) && (cb != equ_cb))
+                void (*cb)(void) = ctx->current_insn->callback;
+                if ((cb != set_cb) && (cb != equ_cb) && (cb != macro_cb))
                     set_implicit_label();
                 cb();
             }
             else
                 set_implicit_label();
 
-            if ((pass == 1) && (prn_file.fcb.dr != SKIP_DRIVE))
+            end_listing_line();
+        }
+
+        /* An IF left open at the end of the file is fine by MAC (and
+         * SYSGEN relies on it), so it is here too. */
+
+        if (!ctx->input_map)
+            cpm_close_file(&ctx->asm_fcb);
+
+        account_input();
+        ctx->stats.lines[ctx->pass] += ctx->lineno;
+        ctx->stats.pass_seconds[ctx->pass] += clock_seconds() - pass_start;
+        ctx->stats.passes = ctx->pass + 1;
+
+        if (ctx->recording)
+        {
+            ctx->recording = false;
+            if (!ctx->onepass_failed && resolve_fixups())
+                break;
+            discard_fixups();
+            clear_image();
+            printx("Forward references need a second pass");
+        }
+    }
+}
+
+/* For a .prl, the program is first assembled a page higher without a listing,
+ * and that version kept, before the real assembly at 0000H. */
+void assemble_program(void)
+{
+    if (ctx->prl)
+    {
+        uint8_t prn_drive = ctx->prn_file.fcb.dr;
+
+        if (!ctx->prl_image)
+        {
+            ctx->prl_image = malloc(0x10000);
+            if (!ctx->prl_image)
+                fatal("out of memory");
+        }
+
+        ctx->bias = 0x100;
+        ctx->prn_file.fcb.dr = SKIP_DRIVE;
+        run_passes();
+        ctx->prn_file.fcb.dr = prn_drive;
+
+        memset(ctx->prl_image, 0, 0x10000);
+        if (ctx->image_used)
+        {
+            if (ctx->image_start < 0x100)
+                fatal("program is not page relocatable");
+            memcpy(ctx->prl_image, ctx->image + 0x100, ctx->image_end - 0x100);
+        }
+
+        ctx->bias = 0;
+        reset_assembly();
+    }
+
+    run_passes();
+}
+
+/* The symbols which are reported: the program's labels and values, but not
+ * its macros. */
+bool is_listed_symbol(const struct symbol* sym)
+{
+    return is_user_symbol(sym) &&
+        (sym->callback != undeflabel_cb) && (sym->callback != macro_call_cb);
+}
+
+void write_listing_text(const char* text, int length)
+{
+    while (length && (text[length - 1] == ' '))
+        length--;
+    write_to_output_file(&ctx->prn_file, text, length);
+    write_to_output_file(&ctx->prn_file, "\r\n", 2);
+}
+
+int compare_references(const void* a, const void* b)
+{
+    const struct reference* ra = a;
+    const struct reference* rb = b;
+    int i = strcmp(ra->symbol->name, rb->symbol->name);
+
+    if (i)
+        return i;
+    return (int) ra->line - (int) rb->line;
+}
+
+/* Ends the listing with each symbol's value and the lines which use it, the
+ * one defining it marked with a #. */
+void write_cross_reference(void)
+{
+    const struct reference* r = (const struct reference*) ctx->references.data;
+    const struct reference* end = r + (ctx->references.length / sizeof(*r));
+    char line[128];
+
+    if (!ctx->xref || (ctx->prn_file.fcb.dr == SKIP_DRIVE))
+        return;
+
+    qsort(ctx->references.data, end - r, sizeof(*r), compare_references);
+    write_to_output_file(&ctx->prn_file, "\r\n", 2);
+    while (r != end)
+    {
+        const struct symbol* sym = r->symbol;
+        unsigned numbers = 0;
+        int length;
+
+        if (!is_listed_symbol(sym))
+        {
+            while ((r != end) && (r->symbol == sym))
+                r++;
+            continue;
+        }
+
+        length = snprintf(line, sizeof(line), "%-15s %04x ", sym->name, sym->value);
+        while ((r != end) && (r->symbol == sym))
+        {
+            uint16_t lineno = r->line;
+            bool definition = false;
+
+            /* A line which uses the symbol more than once is listed once. */
+            for (; (r != end) && (r->symbol == sym) && (r->line == lineno); r++)
+                definition |= r->definition;
+
+            if (numbers && !(numbers % 8))
             {
-                uint8_t* p = prn_buffer;
-                prn_buffer_right_fill++;
-                while (prn_buffer_right_fill--)
-                    emit8_to_output_file(&prn_file, *p++);
-                emit8_to_output_file(&prn_file, '\r');
-                emit8_to_output_file(&prn_file, '\n');
+                write_listing_text(line, length);
+                length = snprintf(line, sizeof(line), "%21s", "");
             }
+            length += snprintf(line + length, sizeof(line) - length,
+                definition ? "%6u#" : "%6u ", lineno);
+            numbers++;
         }
+
+        write_listing_text(line, length);
+    }
+}
+
+int compare_symbols(const void* a, const void* b)
+{
+    return strcmp(((const struct asm8080_symbol*) a)->name,
+        ((const struct asm8080_symbol*) b)->name);
+}
+
+/* Copies the user's symbols out of the symbol table, sorted by name. */
+size_t collect_symbols(void)
+{
+    const struct symbol_table* t = &ctx->symbols;
+    size_t count = 0;
+    uint32_t i;
+
+    if (ctx->symbol_list_size < t->count)
+    {
+        free(ctx->symbol_list);
+        ctx->symbol_list = malloc(t->count * sizeof(struct asm8080_symbol));
+        ctx->symbol_list_size = 0;
+        if (!ctx->symbol_list)
+            fatal("out of memory");
+        ctx->symbol_list_size = t->count;
     }
 
-    close_output_file(&bin_file);
+    for (i=0; i<t->size; i++)
+    {
+        const struct symbol* sym = t->slots[i];
 
-    emit8_to_output_file(&prn_file, 26);
-    close_output_file(&prn_file);
+        if (!sym || !is_listed_symbol(sym))
+            continue;
+        ctx->symbol_list[count].name = sym->name;
+        ctx->symbol_list[count].value = sym->value;
+        count++;
+    }
 
-    print("Assembly successful; ");
-#ifndef IGNORE
-    printi(((uint16_t)cpm_ram - (uint16_t)rambottom) / 1024);
-    print("kB/");
-    printi(freeram);
-    printx("kB used");
-#else
-    printx("");
-    return 0;
-#endif
+    qsort(ctx->symbol_list, count, sizeof(struct asm8080_symbol), compare_symbols);
+    return count;
+}
+
+void fill_result(struct asm8080_result* r, bool ok, size_t symbol_count)
+{
+    if (!r)
+        return;
+
+    r->ok = ok;
+    r->error_line = ok ? 0 : ctx->lineno;
+    if (ctx->image_used)
+    {
+        r->image = ctx->image + ctx->image_start;
+        r->start = ctx->image_start;
+        r->length = ctx->image_end - ctx->image_start;
+    }
+    else
+    {
+        r->image = NULL;
+        r->start = 0;
+        r->length = 0;
+    }
+    r->symbols = ctx->symbol_list;
+    r->symbol_count = symbol_count;
+    r->listing = ctx->prn_file.memory.data;
+    r->listing_length = ctx->prn_file.memory.length;
+    r->output = (const uint8_t*) ctx->output.data;
+    r->output_length = ctx->output.length;
+    r->stats = &ctx->stats;
+    r->messages = ctx->console.data;
+    r->messages_length = ctx->console.length;
+}
+
+bool asm8080_assemble(struct asm_context* c,
+    const char* source, size_t length,
+    const struct asm8080_options* options, struct asm8080_result* result)
+{
+    ctx = c;
+    c->console_buffered = true;
+    if (setjmp(c->abort))
+    {
+        fill_result(result, false, 0);
+        ctx = NULL;
+        return false;
+    }
+
+    begin_assembly(options);
+    c->bin_file.fcb.dr = MEMORY_DRIVE;
+    c->prn_file.fcb.dr = options->listing ? MEMORY_DRIVE : SKIP_DRIVE;
+
+    /* The input window reads straight from the caller's buffer. */
+    c->input_map = length ? (const uint8_t*) source : eof_record;
+    c->input_map_length = length;
+
+    assemble_program();
+    write_cross_reference();
+    write_output();
+
+    if (c->symstats)
+        print_symstats();
+    finish_stats();
+    if (c->report_stats)
+        print_stats();
+
+    fill_result(result, true, collect_symbols());
+    ctx = NULL;
+    return true;
+}
+
+bool asm8080_assemble_file(struct asm_context* c, const char* filename,
+    const struct asm8080_options* options, struct asm8080_result* result)
+{
+    ctx = c;
+    c->console_buffered = options->buffer_messages;
+    if (setjmp(c->abort))
+    {
+        cpm_unmap_file(&c->asm_fcb);
+        if (c->bin_file.opened)
+            cpm_close_file(&c->bin_file.fcb);
+        fill_result(result, false, 0);
+        ctx = NULL;
+        return false;
+    }
+
+    begin_assembly(options);
+
+    memset(&ctx->asm_fcb, 0, sizeof(FCB));
+    cpm_set_filename(&ctx->asm_fcb, filename);
+
+    memcpy(&ctx->bin_file.fcb, &ctx->asm_fcb, sizeof(FCB));
+    ctx->bin_file.fcb.dr = get_drive_or_default(ctx->asm_fcb.f[9]);
+    memcpy(&ctx->bin_file.fcb.f[8],
+        ctx->prl ? "PRL" : ctx->hex_record_length ? "HEX" : "BIN", 3);
+
+    memcpy(&ctx->prn_file.fcb, &ctx->asm_fcb, sizeof(FCB));
+    ctx->prn_file.fcb.dr = get_drive_or_default(ctx->asm_fcb.f[10]);
+    if (ctx->prn_file.fcb.dr == 0)
+        ctx->prn_file.fcb.dr = SKIP_DRIVE;
+    memcpy(&ctx->prn_file.fcb.f[8], "PRN", 3);
+
+    ctx->asm_fcb.dr = get_drive_or_default(ctx->asm_fcb.f[8]);
+    memcpy(&ctx->asm_fcb.f[8], "ASM", 3);
+
+    open_output_file(&ctx->bin_file);
+    open_output_file(&ctx->prn_file);
+
+    ctx->input_map = cpm_map_file(&ctx->asm_fcb, &ctx->input_map_length);
+
+    assemble_program();
+    write_cross_reference();
+
+    cpm_unmap_file(&ctx->asm_fcb);
+    write_output();
+    close_output_file(&ctx->bin_file);
+
+    write_to_output_file(&ctx->prn_file, "\x1a", 1);
+    close_output_file(&ctx->prn_file);
+
+    if (ctx->symstats)
+        print_symstats();
+    finish_stats();
+    if (ctx->report_stats)
+        print_stats();
+
+    fill_result(result, true, collect_symbols());
+    ctx = NULL;
+    return true;
 }
@@ -0,0 +1,117 @@
+/* asm8080.h
+ * This software is redistributable under the terms of the MIT license.
+ * See the LICENSE file in the source of the repository for the full text.
+ *
+ * The assembler in asm.c, as a library (libasm8080.a).
+ *
+ * A context holds everything belonging to one assembly and may be reused for
+ * as many as you like; the symbol arena and output buffers are kept between
+ * them, so assembling lots of small snippets costs no allocation once it's
+ * warmed up.  A context must only be used by one thread at a time, but
+ * different threads may use different contexts at once.
+ *
+ * Everything a result points at belongs to the context and stays valid until
+ * the next assembly with it, or until it's freed.
+ */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct asm_context;
+
+struct asm8080_options
+{
+    uint16_t origin;        /* program counter at the start of each pass */
+    bool onepass;           /* as --onepass */
+    bool symstats;          /* as --symstats; reported with the messages */
+    bool listing;           /* asm8080_assemble: produce a listing */
+    bool xref;              /* as --xref: end the listing with a
+                               cross-reference */
+    uint8_t hex_record_length; /* nonzero for Intel hex output */
+    bool prl;               /* page relocatable output */
+    bool stats;             /* as --stats; reported with the messages */
+    bool stats_json;        /* ...as a single line of JSON */
+    bool buffer_messages;   /* asm8080_assemble_file: collect messages
+                               rather than printing them */
+};
+
+enum
+{
+    ASM8080_TOKEN_IDENTIFIER,
+    ASM8080_TOKEN_NUMBER,
+    ASM8080_TOKEN_STRING,
+    ASM8080_TOKEN_OPERATOR,     /* and any other punctuation */
+    ASM8080_TOKEN_NEWLINE,      /* including ! */
+    ASM8080_TOKEN_EOF,
+    ASM8080_TOKEN_KINDS
+};
+
+/* Where the time went.  Times are wall clock, in seconds; a .prl is
+ * assembled twice and the counts cover both. */
+struct asm8080_stats
+{
+    unsigned passes;            /* 1 if --onepass managed without a second */
+    double pass_seconds[2];
+    uint32_t lines[2];
+    uint64_t bytes_lexed[2];
+    uint64_t tokens[ASM8080_TOKEN_KINDS];
+    uint32_t symbols;           /* user symbols */
+    uint32_t lookups;
+    uint32_t probes;
+    uint32_t max_probes;        /* longest single lookup */
+    uint32_t longest_cluster;   /* longest run of occupied slots */
+    uint64_t bytes_emitted;
+    double output_seconds;      /* creating and writing the output files */
+    double total_seconds;
+};
+
+struct asm8080_symbol
+{
+    const char* name;       /* zero terminated, upper case */
+    uint16_t value;
+};
+
+struct asm8080_result
+{
+    bool ok;
+    uint16_t error_line;    /* line assembly stopped at, if !ok */
+
+    /* The bytes between the lowest and highest addresses written; length is
+     * 0 if nothing was. */
+    const uint8_t* image;
+    uint16_t start;
+    uint32_t length;
+
+    /* The .hex or .prl file, for those modes. */
+    const uint8_t* output;
+    size_t output_length;
+
+    /* User symbols, sorted by name. */
+    const struct asm8080_symbol* symbols;
+    size_t symbol_count;
+
+    /* The same text the .prn file would contain, if a listing was asked for. */
+    const char* listing;
+    size_t listing_length;
+
+    const struct asm8080_stats* stats;
+
+    /* Everything which would have gone to the console, including errors. */
+    const char* messages;
+    size_t messages_length;
+};
+
+extern struct asm_context* asm8080_new(void);
+extern void asm8080_free(struct asm_context* c);
+
+/* Assembles length bytes of source (which needn't end with a ^Z). */
+extern bool asm8080_assemble(struct asm_context* c,
+    const char* source, size_t length,
+    const struct asm8080_options* options, struct asm8080_result* result);
+
+/* Assembles a file the way the command line tool does, with the drive
+ * letters in its extension choosing where the .bin and .prn files go. */
+extern bool asm8080_assemble_file(struct asm_context* c, const char* filename,
+    const struct asm8080_options* options, struct asm8080_result* result);
@@ -11,6 +11,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "cpm.h"
 
@@ -20,12 +24,12 @@ uint16_t cpm_ramtop = 65535;
 static uint8_t default_dma[128];
 
 uint8_t *cpm_default_dma = default_dma;
-static uint8_t *dma;
+static __thread uint8_t *dma;
 
 FCB cpm_fcb;
 
 char *fcb_to_filename(FCB *fcb) {
-    static char fname[20];
+    static __thread char fname[20];
     int i, j = 0;
     for (i=0; i<11; i++) {
         if (fcb->f[i] != ' ') {
@@ -67,7 +71,11 @@ uint8_t cpm_delete_file(FCB* fcb) {
 }
 
 uint8_t cpm_read_sequential(FCB *fcb) {
-    int ret = fread(dma, 1, 128, fcb->fp);
+    size_t n = fread(dma, 1, 128, fcb->fp);
+    if (!n)
+        return 1;
+    if (n < 128)
+        memset(dma + n, 26, 128 - n);   /* CP/M pads the last record */
     return 0;
 }
 
@@ -75,6 +83,11 @@ uint8_t cpm_write_sequential(FCB *fcb) {
     return !(fwrite(dma, 128, 1, fcb->fp) == 1);
 }
 
+/* Not CP/M: write a whole number of records in one call. */
+uint8_t cpm_write_block(FCB *fcb, const void *data, size_t length) {
+    return !(fwrite(data, length, 1, fcb->fp) == 1);
+}
+
 uint8_t cpm_make_file(FCB* fcb) {
     char *filename = fcb_to_filename(fcb);
     fprintf(stderr, "make file: %s\n", filename);
@@ -85,29 +98,63 @@ void cpm_set_dma(void* ptr) {
     dma = ptr;
 }
 
-void cpm_overwrite_ccp(void) {
+/* Not CP/M: map the whole file read-only so it can be scanned in place.
+ * Returns NULL if that's not possible (empty file, not a regular file, ...),
+ * in which case the caller should fall back to cpm_read_sequential(). */
+const uint8_t *cpm_map_file(FCB *fcb, size_t *length) {
+    char *filename = fcb_to_filename(fcb);
+    struct stat st;
+    void *p;
+    int fd;
+
+    fcb->map = NULL;
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    fcb->map = p;
+    fcb->maplen = *length = st.st_size;
+    return fcb->map;
 }
 
-void cpm_set_args(int argc, char **argv) {
-    char *name, *ext;
+void cpm_unmap_file(FCB *fcb) {
+    if (fcb->map)
+        munmap((void *) fcb->map, fcb->maplen);
+    fcb->map = NULL;
+}
 
-    if (argc != 2) {
-        fprintf(stderr, "error: usage: asm filename.asm\n");
-        exit(1);
-    }
+void cpm_overwrite_ccp(void) {
+}
+
+void cpm_set_filename(FCB *fcb, const char *name) {
+    const char *ext;
 
-    memset(cpm_fcb.f, ' ', 11);
-    name = argv[1];
+    memset(fcb->f, ' ', 11);
     ext = strchr(name, '.');
     if (ext) {
-        strncpy(cpm_fcb.f, name, ext-name);
-        strncpy(cpm_fcb.f+8, ext+1, 3);
+        strncpy((char *) fcb->f, name, ext-name);
+        strncpy((char *) fcb->f+8, ext+1, 3);
     } else {
-        strncpy(cpm_fcb.f, name, 8);
+        strncpy((char *) fcb->f, name, 8);
     }
 
     for (int i=0; i<11; i++)
-        if (!cpm_fcb.f[i])
-            cpm_fcb.f[i] = ' ';
+        if (!fcb->f[i])
+            fcb->f[i] = ' ';
+}
+
+void cpm_set_args(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "error: usage: asm filename.asm\n");
+        exit(1);
+    }
+    cpm_set_filename(&cpm_fcb, argv[1]);
 }
 
@@ -13,6 +13,8 @@ typedef struct {
     uint8_t cr;
     uint8_t r[3];
     FILE *fp;
+    const uint8_t *map;
+    size_t maplen;
 } FCB;
 
 extern uint16_t cpm_ram;
@@ -28,8 +30,12 @@ extern uint8_t cpm_close_file(FCB *fcb);
 extern uint8_t cpm_delete_file(FCB *fcb);
 extern uint8_t cpm_read_sequential(FCB *fcb);
 extern uint8_t cpm_write_sequential(FCB *fcb);
+extern uint8_t cpm_write_block(FCB *fcb, const void *data, size_t length);
 extern uint8_t cpm_make_file(FCB *fcb);
 extern void cpm_set_dma(void *ptr);
+extern const uint8_t *cpm_map_file(FCB *fcb, size_t *length);
+extern void cpm_unmap_file(FCB *fcb);
 extern void cpm_overwrite_ccp(void);
 
 extern void cpm_set_args(int argc, char **argv);
+extern void cpm_set_filename(FCB *fcb, const char *name);
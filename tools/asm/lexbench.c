@@ -0,0 +1,316 @@
+/* lexbench.c
+ * This software is redistributable under the terms of the MIT license.
+ * See the LICENSE file in the source of the repository for the full text.
+ *
+ * Times read_token() against the old byte-at-a-time lexer it replaced, over
+ * whatever source files are named on the command line, and checks they both
+ * produce the same tokens.
+ *
+ *   make lexbench && ./lexbench ../../src/*.ASM
+ */
+
+#include "asm.c"
+#include <stdio.h>
+#include <time.h>
+
+token_t legacy_read_token(void)
+{
+    uint8_t c;
+
+    if (ctx->eol)
+    {
+        ctx->lineno++;
+        ctx->eol = false;
+    }
+
+    do
+        c = read_byte();
+    while ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\f') || (c == '\v'));
+
+    if (c == ';')
+    {
+        do
+            c = read_byte();
+        while ((c != '!') && (c != '\n') && (c != 26));
+    }
+
+    c = toupper(c);
+    ctx->token_length = 0;
+    if (isdigit(c))
+    {
+        uint8_t base;
+        unsigned i;
+
+        for (;;)
+        {
+            check_token_buffer_size();
+            ctx->token_buffer[ctx->token_length++] = c;
+
+            do
+                c = toupper(read_byte());
+            while (c == '$');
+            if (!isalnum(c))
+                break;
+        }
+        unread_byte(c);
+
+        base = 10;
+        c = ctx->token_buffer[--ctx->token_length];
+        switch (c)
+        {
+            case 'B': base = 2; break;
+            case 'O': case 'Q': base = 8; break;
+            case 'D': base = 10; break;
+            case 'H': base = 16; break;
+            default:
+                if (isdigit(c))
+                    ctx->token_length++;
+        }
+
+        ctx->token_number = 0;
+        for (i=0; i<ctx->token_length; i++)
+        {
+            c = ctx->token_buffer[i];
+            if (c >= 'A')
+                c = c - 'A' + 10;
+            else
+                c = c - '0';
+            if (c >= base)
+                fatal("invalid digit in character constant");
+
+            ctx->token_number = (ctx->token_number * base) + c;
+        }
+
+        return TOKEN_NUMBER;
+    }
+    else if (isupper(c))
+    {
+        uint32_t hash = FNV_OFFSET_BASIS;
+
+        for (;;)
+        {
+            check_token_buffer_size();
+            ctx->token_buffer[ctx->token_length++] = c;
+            hash = FNV_STEP(hash, c);
+
+            do
+                c = toupper(read_byte());
+            while (c == '$');
+            if (!(isalnum(c) || (c == '_')))
+                break;
+        }
+        unread_byte(c);
+
+        ctx->token_symbol = symtab_lookup(&ctx->symbols,
+            ctx->token_buffer, ctx->token_length, hash);
+        if (ctx->token_symbol)
+            return TOKEN_IDENTIFIER;
+
+        ctx->token_symbol = new_symbol(ctx->token_buffer, ctx->token_length, hash);
+        symtab_insert(&ctx->symbols, ctx->token_symbol);
+
+        return TOKEN_IDENTIFIER;
+    }
+    else if (c == '\'')
+    {
+        for (;;)
+        {
+            c = read_byte();
+            if (iscntrl(c))
+                fatal("unterminated string constant");
+            if (c == '\'')
+            {
+                c = read_byte();
+                if (c != '\'')
+                    break;
+            }
+
+            check_token_buffer_size();
+            ctx->token_buffer[ctx->token_length++] = c;
+        }
+        unread_byte(c);
+
+        return TOKEN_STRING;
+    }
+    else if (c == '\n')
+        ctx->eol = true;
+    else if (c == '!')
+        c = TOKEN_NL;
+    else if (c == 0)
+        c = TOKEN_EOF;
+
+    return c;
+}
+
+struct source
+{
+    const char* filename;
+    uint8_t* data;
+    size_t length;
+};
+
+struct lex_result
+{
+    unsigned long tokens;
+    uint32_t checksum;
+    bool stopped; /* on a lexer error */
+};
+
+/* Lexes the whole source, counting the tokens and making a checksum of what
+ * they were. */
+void lex(const struct source* s, token_t (*lexer)(void), struct lex_result* r)
+{
+    token_t t;
+
+    r->tokens = 0;
+    r->checksum = FNV_OFFSET_BASIS;
+    r->stopped = false;
+    if (setjmp(ctx->abort))
+    {
+        r->stopped = true;
+        return;
+    }
+
+    ctx->input_map = s->data;
+    ctx->input_map_length = s->length;
+    ctx->input_ptr = s->data;
+    ctx->input_end = s->data + s->length;
+    ctx->eol = true;
+    ctx->lineno = 0;
+
+    do
+    {
+        uint32_t h = r->checksum;
+
+        t = lexer();
+        h = FNV_STEP(FNV_STEP(h, t >> 8), t);
+        h = FNV_STEP(FNV_STEP(h, ctx->lineno >> 8), ctx->lineno);
+        if (t == TOKEN_NUMBER)
+            h = FNV_STEP(FNV_STEP(h, ctx->token_number >> 8), ctx->token_number);
+        else if (t == TOKEN_IDENTIFIER)
+            h = FNV_STEP(h, ctx->token_symbol->hash);
+        else if (t == TOKEN_STRING)
+        {
+            unsigned i;
+            for (i=0; i<ctx->token_length; i++)
+                h = FNV_STEP(h, ctx->token_buffer[i]);
+        }
+        r->checksum = h;
+        r->tokens++;
+    }
+    while (t != TOKEN_EOF);
+}
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+/* Lexes every source repeatedly for at least a quarter of a second, and
+ * returns the time taken for one go through them all. */
+double time_lexer(const struct source* sources, int count, token_t (*lexer)(void))
+{
+    double start = now();
+    double elapsed;
+    unsigned long rounds = 0;
+
+    do
+    {
+        int i;
+        struct lex_result r;
+
+        for (i=0; i<count; i++)
+            lex(&sources[i], lexer, &r);
+        rounds++;
+        elapsed = now() - start;
+    }
+    while (elapsed < 0.25);
+
+    return elapsed / rounds;
+}
+
+int main(int argc, char* argv[])
+{
+    const struct asm8080_options options = { 0 };
+    struct source* sources;
+    int count = argc - 1;
+    size_t bytes = 0;
+    unsigned long tokens = 0;
+    double legacy_time, new_time;
+    bool mismatch = false;
+    int i;
+
+    if (count < 1)
+    {
+        fprintf(stderr, "usage: lexbench file...\n");
+        return 1;
+    }
+
+    sources = calloc(count, sizeof(struct source));
+    ctx = asm8080_new();
+    if (!sources || !ctx)
+        return 1;
+    ctx->console_buffered = true;
+    if (setjmp(ctx->abort))
+        return 1;
+    begin_assembly(&options);
+    ctx->prn_file.fcb.dr = SKIP_DRIVE;
+
+    for (i=0; i<count; i++)
+    {
+        struct source* s = &sources[i];
+        FILE* fp;
+        long length;
+
+        s->filename = argv[i+1];
+        fp = fopen(s->filename, "rb");
+        if (!fp || (fseek(fp, 0, SEEK_END) != 0) || ((length = ftell(fp)) < 0))
+        {
+            perror(s->filename);
+            return 1;
+        }
+        rewind(fp);
+        s->length = length;
+        s->data = malloc(s->length ? s->length : 1);
+        if (!s->data || (fread(s->data, 1, s->length, fp) != s->length))
+        {
+            perror(s->filename);
+            return 1;
+        }
+        fclose(fp);
+        bytes += s->length;
+    }
+
+    for (i=0; i<count; i++)
+    {
+        struct lex_result legacy, new;
+
+        lex(&sources[i], legacy_read_token, &legacy);
+        lex(&sources[i], read_token, &new);
+        if ((legacy.tokens != new.tokens) || (legacy.checksum != new.checksum) ||
+            (legacy.stopped != new.stopped))
+        {
+            printf("%s: lexers disagree (%lu tokens against %lu)\n",
+                sources[i].filename, legacy.tokens, new.tokens);
+            mismatch = true;
+        }
+        if (new.stopped)
+            printf("%s: stopped on a lexer error at line %u\n",
+                sources[i].filename, ctx->lineno);
+        tokens += new.tokens;
+    }
+
+    legacy_time = time_lexer(sources, count, legacy_read_token);
+    new_time = time_lexer(sources, count, read_token);
+
+    printf("%d files, %zu bytes, %lu tokens\n", count, bytes, tokens);
+    printf("legacy: %8.1f us  %7.1f MB/s  %6.1f Mtokens/s\n",
+        legacy_time * 1e6, bytes / legacy_time / 1e6, tokens / legacy_time / 1e6);
+    printf("new:    %8.1f us  %7.1f MB/s  %6.1f Mtokens/s\n",
+        new_time * 1e6, bytes / new_time / 1e6, tokens / new_time / 1e6);
+    printf("speedup: %.2fx\n", legacy_time / new_time);
+
+    return mismatch ? 1 : 0;
+}
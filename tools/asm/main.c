@@ -0,0 +1,177 @@
+/* main.c
+ * © 2019 David Given
+ * This software is redistributable under the terms of the MIT license.
+ * See the LICENSE file in the source of the repository for the full text.
+ *
+ * The command line front end for the assembler, which lives in
+ * libasm8080.a (see asm.c and asm8080.h).
+ */
+
+#include <asm8080.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+struct job
+{
+    const char* filename;
+    struct asm_context* context;
+    struct asm8080_result result;
+};
+
+/* With several files, a pool of threads takes them in turn. */
+struct asm8080_options job_options;
+struct job* jobs;
+int job_count;
+int job_next;
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void* job_worker(void* arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        struct job* j;
+
+        pthread_mutex_lock(&job_lock);
+        j = (job_next < job_count) ? &jobs[job_next++] : NULL;
+        pthread_mutex_unlock(&job_lock);
+        if (!j)
+            return NULL;
+
+        asm8080_assemble_file(j->context, j->filename, &job_options, &j->result);
+    }
+}
+
+void usage(void)
+{
+    fprintf(stderr, "error: usage: asm [--symstats] [--onepass] [--xref] [--stats[=json]] [--hex[=N] | --prl] [-j N] filename...\n");
+    exit(1);
+}
+
+void out_of_memory(void)
+{
+    printf("out of memory\r\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int threads = 1;
+    int i;
+
+    while ((argc > 1) && (argv[1][0] == '-'))
+    {
+        if (strcmp(argv[1], "--symstats") == 0)
+            job_options.symstats = true;
+        else if (strcmp(argv[1], "--onepass") == 0)
+            job_options.onepass = true;
+        else if (strcmp(argv[1], "--xref") == 0)
+            job_options.xref = true;
+        else if (strcmp(argv[1], "--stats") == 0)
+            job_options.stats = true;
+        else if (strcmp(argv[1], "--stats=json") == 0)
+            job_options.stats_json = true;
+        else if (strcmp(argv[1], "--hex") == 0)
+            job_options.hex_record_length = 16;
+        else if (strncmp(argv[1], "--hex=", 6) == 0)
+        {
+            int n = atoi(argv[1] + 6);
+            if ((n < 1) || (n > 255))
+                usage();
+            job_options.hex_record_length = n;
+        }
+        else if (strcmp(argv[1], "--prl") == 0)
+            job_options.prl = true;
+        else if (strncmp(argv[1], "-j", 2) == 0)
+        {
+            const char* n = argv[1] + 2;
+            if (!*n)
+            {
+                if (argc < 3)
+                    usage();
+                n = argv[2];
+                argv++;
+                argc--;
+            }
+            threads = atoi(n);
+            if (threads < 1)
+                usage();
+        }
+        else
+        {
+            fprintf(stderr, "error: unknown option %s\n", argv[1]);
+            return 1;
+        }
+        argv++;
+        argc--;
+    }
+    if ((argc < 2) || (job_options.prl && job_options.hex_record_length))
+        usage();
+
+    printf("CP/M Assembler (C) 2019 David Given; \r\n");
+
+    job_count = argc - 1;
+    job_options.buffer_messages = (job_count > 1);
+    jobs = calloc(job_count, sizeof(struct job));
+    if (!jobs)
+        out_of_memory();
+    for (i=0; i<job_count; i++)
+    {
+        jobs[i].filename = argv[i+1];
+        jobs[i].context = asm8080_new();
+        if (!jobs[i].context)
+            out_of_memory();
+    }
+
+    if (job_count == 1)
+    {
+        /* Like the CP/M original, a failed assembly just stops; there's no
+         * exit status to report it with. */
+        job_worker(NULL);
+        if (jobs[0].result.ok)
+            printf("Assembly successful; \r\n");
+        return 0;
+    }
+    else
+    {
+        bool failed = false;
+
+        if (threads > job_count)
+            threads = job_count;
+        if (threads == 1)
+            job_worker(NULL);
+        else
+        {
+            pthread_t* pool = calloc(threads, sizeof(pthread_t));
+            if (!pool)
+                out_of_memory();
+            for (i=0; i<threads; i++)
+            {
+                if (pthread_create(&pool[i], NULL, job_worker, NULL) != 0)
+                {
+                    printf("cannot create thread\r\n");
+                    return 1;
+                }
+            }
+            for (i=0; i<threads; i++)
+                pthread_join(pool[i], NULL);
+            free(pool);
+        }
+
+        for (i=0; i<job_count; i++)
+        {
+            struct job* j = &jobs[i];
+
+            printf("%s:\r\n", j->filename);
+            fwrite(j->result.messages, 1, j->result.messages_length, stdout);
+            if (!j->result.ok)
+                failed = true;
+            else
+                printf("Assembly successful\r\n");
+            asm8080_free(j->context);
+        }
+        return failed ? 1 : 0;
+    }
+}
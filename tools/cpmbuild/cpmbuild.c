@@ -0,0 +1,443 @@
+/*
+ * cpmbuild - build the binaries in bin/ in one process
+ *
+ * See LICENSE for details.
+ *
+ * usage: cpmbuild [-C srcdir] [-o bindir] [-x] [target...]
+ *
+ * -C srcdir  where the sources are, as for make -C (default .)
+ * -o bindir  where the binaries go, relative to srcdir (default ../bin)
+ * -x         also write an Intel hex file next to each binary
+ *
+ * The targets are the same as src/Makefile's, by name (pip, bdos, ddt, ...);
+ * without any it builds them all.
+ *
+ * The DRI ASM sources are assembled in memory with libasm8080.  The ISIS-II
+ * tools (asm80, plm80c, link, locate, objhex) have no native equivalent and
+ * are still run as programs, writing their own .obj/.lnk/.loc/.hex files,
+ * but everything after them is done in memory: the hex is loaded with
+ * libhexcom, DDT's pieces are padded and joined and given their relocation
+ * bitmap with libgenprlmap, and -x hex comes from libgenhex.  Nothing is
+ * written but the final binaries.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <asm8080.h>
+#include <hexcom.h>
+#include <genhex.h>
+#include <genprlmap.h>
+
+#define ASM80   "../c-ports/Linux/Install/asm80"
+#define PLM80C  "../c-ports/Linux/Install/plm80c"
+#define LINK    "../c-ports/Linux/Install/link"
+#define LOCATE  "../c-ports/Linux/Install/locate"
+#define OBJHEX  "../c-ports/Linux/Install/objhex"
+
+#define PLM80LIB  "../intel80tools/itools/plm80.lib/plm80.lib"
+#define SYSTEMLIB "systemlib.obj"
+
+/* DDT's first part is padded to this before the second is appended. */
+#define DDT1ASM_SIZE 1664
+
+enum kind { PLM, DRIASM, ASMCOM, DDT };
+
+struct target {
+    const char *name;
+    enum kind kind;
+    const char *extension;
+};
+
+static const struct target targets[] = {
+    { "ed",     PLM,    "com" },
+    { "load",   PLM,    "com" },
+    { "pip",    PLM,    "com" },
+    { "stat",   PLM,    "com" },
+    { "submit", PLM,    "com" },
+    { "bdos",   DRIASM, "sys" },
+    { "ccp",    DRIASM, "sys" },
+    { "asm",    ASMCOM, "com" },
+    { "dump",   DRIASM, "com" },
+    { "mload",  DRIASM, "com" },
+    { "sd",     DRIASM, "com" },
+    { "ddt",    DDT,    "com" },
+};
+
+#define TARGETS (sizeof(targets) / sizeof(targets[0]))
+
+/* A binary in memory, loaded at addr. */
+struct image {
+    unsigned char *data;
+    size_t size;
+    unsigned long addr;
+};
+
+static const char *bindir = "../bin";
+static bool write_hex_too = false;
+static bool have_systemlib = false;
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        fprintf(stderr, "error: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/* Runs an ISIS-II tool, echoing it as make would. */
+static void run(const char *tool, ...) {
+    const char *argv[16];
+    int argc = 0;
+    va_list ap;
+    pid_t pid;
+    int status;
+
+    argv[argc++] = tool;
+    va_start(ap, tool);
+    while ((argv[argc] = va_arg(ap, const char *)) != NULL)
+        argc++;
+    va_end(ap);
+
+    for (int i=0; i<argc; i++)
+        printf("%s%s", i ? " " : "", argv[i]);
+    putchar('\n');
+    fflush(stdout);
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        execv(tool, (char **) argv);
+        fprintf(stderr, "error: unable to run %s\n", tool);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "error: %s failed\n", tool);
+        exit(1);
+    }
+}
+
+static const unsigned char *map_file(const char *filename, size_t *size) {
+    struct stat st;
+    void *p = NULL;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "error: unable to open %s\n", filename);
+        exit(1);
+    }
+    *size = st.st_size;
+    if (*size) {
+        p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "error: unable to read %s\n", filename);
+            exit(1);
+        }
+    }
+    close(fd);
+    return p;
+}
+
+static void write_file(const char *filename, const void *data, size_t size) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (fd < 0) {
+        fprintf(stderr, "error: unable to create %s\n", filename);
+        exit(1);
+    }
+    if (write(fd, data, size) != (ssize_t) size || close(fd) < 0) {
+        fprintf(stderr, "error: unable to write %s\n", filename);
+        exit(1);
+    }
+}
+
+static char *filename(const char *name, const char *extension) {
+    char *s = xmalloc(strlen(name) + strlen(extension) + 2);
+    sprintf(s, "%s.%s", name, extension);
+    return s;
+}
+
+/* Loads a .hex file the ISIS-II tools made, as hexcom would. */
+static struct image load_hex(const char *name) {
+    static struct hex_image hex;
+    struct image im;
+    char *hexname = filename(name, "hex");
+    size_t length;
+    const unsigned char *text = map_file(hexname, &length);
+    int status;
+
+    hex_init(&hex);
+    status = hex_load(&hex, text, length);
+    if (status != 0) {
+        fprintf(stderr, "%s: %s", hexname, hex.error);
+        exit(status);
+    }
+    munmap((void *) text, length);
+    free(hexname);
+
+    im.addr = hex.high > hex.low ? hex.low : 0;
+    im.size = hex.high > hex.low ? hex.high - hex.low : 0;
+    im.data = xmalloc(im.size);
+    memcpy(im.data, hex.data + im.addr, im.size);
+    return im;
+}
+
+static void save(const struct target *t, const struct image *im) {
+    char *path = xmalloc(strlen(bindir) + strlen(t->name) + 6);
+
+    sprintf(path, "%s/%s.%s", bindir, t->name, t->extension);
+    write_file(path, im->data, im->size);
+
+    if (write_hex_too) {
+        struct genhex_input in = { im->data, im->size, im->addr };
+        size_t size;
+        char *hex;
+
+        if (im->addr + im->size > 0x10000) {
+            fprintf(stderr, "error: %s is beyond 64K\n", path);
+            exit(1);
+        }
+        hex = genhex(&in, 1, GENHEX_RECORD_LENGTH, &size);
+        if (!hex) {
+            fprintf(stderr, "error: out of memory\n");
+            exit(1);
+        }
+        sprintf(path, "%s/%s.hex", bindir, t->name);
+        write_file(path, hex, size);
+        free(hex);
+    }
+    free(path);
+}
+
+static void systemlib(void) {
+    if (!have_systemlib) {
+        run(ASM80, "systemlib.asm", NULL);
+        have_systemlib = true;
+    }
+}
+
+/* .obj --> .lnk with the PL/M libraries, as src/Makefile's %.lnk rule. */
+static void link_with_libraries(const char *name) {
+    char *obj = filename(name, "obj"), *lnk = filename(name, "lnk");
+    char *args = xmalloc(strlen(obj) + sizeof(SYSTEMLIB) + sizeof(PLM80LIB) + 2);
+
+    systemlib();
+    sprintf(args, "%s,%s,%s", obj, SYSTEMLIB, PLM80LIB);
+    run(LINK, args, "to", lnk, NULL);
+    free(args);
+    free(obj);
+    free(lnk);
+}
+
+/* .lnk --> .loc --> .hex, the .loc named after out. */
+static void locate(const char *name, const char *out, const char *code, const char *stack) {
+    char *lnk = filename(name, "lnk"), *loc = filename(out, "loc"), *hex = filename(out, "hex");
+
+    if (code && stack)
+        run(LOCATE, lnk, "to", loc, code, stack, "map", NULL);
+    else if (code)
+        run(LOCATE, lnk, "to", loc, code, "map", NULL);
+    else
+        run(LOCATE, lnk, "to", loc, "map", NULL);
+    run(OBJHEX, loc, "to", hex, NULL);
+    free(lnk);
+    free(loc);
+    free(hex);
+}
+
+static struct image build_plm(const char *name) {
+    char *plm = filename(name, "plm");
+
+    systemlib();
+    run(PLM80C, plm, NULL);
+    link_with_libraries(name);
+    locate(name, name, "code(100h)", "stacksize(100)");
+    free(plm);
+    return load_hex(name);
+}
+
+/* Assembled as src/Makefile's DRI ASM rule does, and padded to a record
+ * like the .BIN. */
+static struct image build_driasm(const char *name) {
+    static struct asm_context *context;
+    struct asm8080_options options = { 0 };
+    struct asm8080_result result;
+    char *source = filename(name, "ASM");
+    size_t length;
+    const unsigned char *text = map_file(source, &length);
+    struct image im;
+
+    printf("asm %s (in memory)\n", source);
+    fflush(stdout);
+    if (!context && !(context = asm8080_new())) {
+        fprintf(stderr, "error: out of memory\n");
+        exit(1);
+    }
+    options.onepass = true;
+    if (!asm8080_assemble(context, (const char *) text, length, &options, &result)) {
+        fwrite(result.messages, 1, result.messages_length, stderr);
+        fprintf(stderr, "error: %s failed at line %u\n", source, result.error_line);
+        exit(1);
+    }
+    munmap((void *) text, length);
+
+    im.addr = result.start;
+    im.size = (result.length + 127) & ~127;
+    im.data = xmalloc(im.size);
+    memset(im.data, 0, im.size);
+    memcpy(im.data, result.image, result.length);
+    free(source);
+    return im;
+}
+
+static struct image build_asm(void) {
+    static const char *parts[] = {
+        "as0com", "as1io", "as2scan", "as3sym", "as4sear", "as5oper", "as6main"
+    };
+    char objs[128] = "";
+
+    for (size_t i=0; i<sizeof(parts)/sizeof(parts[0]); i++) {
+        char *source = filename(parts[i], "asm");
+        run(ASM80, source, NULL);
+        sprintf(objs + strlen(objs), "%s%s.obj", i ? "," : "", parts[i]);
+        free(source);
+    }
+    run(LINK, objs, "to", "asm.lnk", NULL);
+    locate("asm", "asm", NULL, NULL);
+    return load_hex("asm");
+}
+
+/* The two images of DDT's relocatable part: ddt1asm padded, then ddt2mon. */
+static struct image ddt12(const char *ddt1asm, const char *ddt2mon) {
+    struct image one = load_hex(ddt1asm), two = load_hex(ddt2mon), im;
+    size_t padded = one.size > DDT1ASM_SIZE ? one.size : DDT1ASM_SIZE;
+
+    im.addr = one.addr;
+    im.size = padded + two.size;
+    im.data = xmalloc(im.size);
+    memset(im.data, 0, padded);
+    memcpy(im.data, one.data, one.size);
+    memcpy(im.data + padded, two.data, two.size);
+    free(one.data);
+    free(two.data);
+    return im;
+}
+
+static struct image build_ddt(void) {
+    static const char *parts[] = { "ddt0mov", "ddt1asm", "ddt2mon" };
+    struct image mover, at0, at100, im;
+    size_t bad;
+
+    for (size_t i=0; i<sizeof(parts)/sizeof(parts[0]); i++) {
+        char *source = filename(parts[i], "asm");
+        run(ASM80, source, NULL);
+        link_with_libraries(parts[i]);
+        free(source);
+    }
+    locate("ddt0mov", "ddt0mov", NULL, NULL);
+    locate("ddt1asm", "ddt1asm", "code(0000H)", "stacksize(0)");
+    locate("ddt1asm", "ddt1asm-nextpage", "code(0100H)", "stacksize(0)");
+    locate("ddt2mon", "ddt2mon", "code(0000H)", NULL);
+    locate("ddt2mon", "ddt2mon-nextpage", "code(0100H)", "stacksize(0)");
+
+    mover = load_hex("ddt0mov");
+    at0 = ddt12("ddt1asm", "ddt2mon");
+    at100 = ddt12("ddt1asm-nextpage", "ddt2mon-nextpage");
+    if (mover.size > PRL_HEADER_SIZE || at0.size != at100.size || at0.size > 0xffff) {
+        fprintf(stderr, "error: DDT's parts don't fit together\n");
+        exit(1);
+    }
+
+    im.addr = 0x100;
+    im.size = PRL_FILE_SIZE(at0.size);
+    im.data = xmalloc(im.size);
+    if (!prl_file(mover.data, mover.size, at0.data, at100.data, at0.size, im.data, &bad)) {
+        fprintf(stderr, "error: DDT byte %04zx is %02x and %02x, which is not one page apart\n",
+                bad, at0.data[bad], at100.data[bad]);
+        exit(1);
+    }
+    free(mover.data);
+    free(at0.data);
+    free(at100.data);
+    return im;
+}
+
+static void build(const struct target *t) {
+    struct image im;
+
+    switch (t->kind) {
+    case PLM:
+        im = build_plm(t->name);
+        break;
+    case DRIASM:
+        im = build_driasm(t->name);
+        break;
+    case ASMCOM:
+        im = build_asm();
+        break;
+    case DDT:
+    default:
+        im = build_ddt();
+        break;
+    }
+    save(t, &im);
+    free(im.data);
+}
+
+int main(int argc, char **argv) {
+    const char *srcdir = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "C:o:x")) != -1) {
+        switch (c) {
+        case 'C':
+            srcdir = optarg;
+            break;
+        case 'o':
+            bindir = optarg;
+            break;
+        case 'x':
+            write_hex_too = true;
+            break;
+        default:
+            fprintf(stderr, "usage: cpmbuild [-C srcdir] [-o bindir] [-x] [target...]\n");
+            return 1;
+        }
+    }
+    if (srcdir && chdir(srcdir) < 0) {
+        fprintf(stderr, "error: unable to change to %s\n", srcdir);
+        return 1;
+    }
+    mkdir(bindir, 0777);
+
+    if (optind == argc) {
+        for (size_t i=0; i<TARGETS; i++)
+            build(&targets[i]);
+        return 0;
+    }
+
+    for (int i=optind; i<argc; i++) {
+        size_t j;
+
+        for (j=0; j<TARGETS; j++)
+            if (strcmp(argv[i], targets[j].name) == 0)
+                break;
+        if (j == TARGETS) {
+            fprintf(stderr, "error: no target %s\n", argv[i]);
+            return 1;
+        }
+        build(&targets[j]);
+    }
+    return 0;
+}
@@ -0,0 +1,913 @@
+/*
+ * cpmcache - run a build tool through a content-addressed cache
+ *
+ * See LICENSE for details.
+ *
+ * usage: cpmcache [-d dir] tool [argument...]
+ *        cpmcache [-d dir] -s         (report hits and misses)
+ *        cpmcache [-d dir] -z         (zero them)
+ *
+ * The cache lives in dir, or $CPMCACHE, or .cpmcache.
+ *
+ * The key is a hash of the tool's binary, its arguments, and the names and
+ * contents of its input files.  An input is any argument, or any part of a
+ * comma separated one, which names an existing file, or NAME.ASM for a NAME
+ * which doesn't (as DRI ASM takes them); the argument after "to" is the
+ * output, never an input.
+ *
+ * On a miss the tool is run, and every file it creates or changes whose name
+ * (up to the first dot) is the output's, or an input's if there's no "to",
+ * is stored along with what it printed.  On a hit they're put back and the
+ * printing is repeated, and the tool isn't run at all.  Runs which fail are
+ * never stored; asm, which has no exit status for one file, has failed unless
+ * it said "Assembly successful".
+ *
+ * A tool can read files its arguments don't name: asm's MACLIB, the ISIS-II
+ * tools' $INCLUDE.  So the tool is run under ptrace, with a seccomp filter
+ * which stops it at each open and openat (and at nothing else, so it runs at
+ * full speed otherwise), and every other file it opens for reading is
+ * stored in the entry with the hash of what it held.  A hit needs them all
+ * to hash the same still; if one doesn't, the entry is thrown away and the
+ * tool run again.  The system's files (/usr, /lib, /etc, ...) are left out.
+ * A run which can't be traced isn't stored: one where the filter or ptrace is
+ * refused, where an open can't be looked at, or which runs a program for
+ * another architecture (whose calls the filter lets through).
+ *
+ * The hash is 64 bit FNV-1a, which is plenty for telling builds apart but is
+ * no defence against anyone putting things into the cache deliberately.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <elf.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#if defined __x86_64__
+#define AUDIT_ARCH_NATIVE AUDIT_ARCH_X86_64
+#elif defined __aarch64__
+#define AUDIT_ARCH_NATIVE AUDIT_ARCH_AARCH64
+#elif defined __i386__
+#define AUDIT_ARCH_NATIVE AUDIT_ARCH_I386
+#else
+#error "no AUDIT_ARCH for this architecture"
+#endif
+
+#define FNV64_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV64_PRIME 0x100000001b3ULL
+
+#define MAX_FILES 64
+
+/* The kernel's struct ptrace_syscall_info, which glibc's <sys/ptrace.h>
+ * doesn't always have (and <linux/ptrace.h> can't be included with it). */
+#ifndef PTRACE_GET_SYSCALL_INFO
+#define PTRACE_GET_SYSCALL_INFO 0x420e
+#endif
+#define SYSCALL_INFO_SECCOMP 3
+
+struct syscall_info {
+    uint8_t op;
+    uint8_t pad[3];
+    uint32_t arch;
+    uint64_t instruction_pointer;
+    uint64_t stack_pointer;
+    struct {
+        uint64_t nr;
+        uint64_t args[6];
+        uint32_t ret_data;
+    } seccomp;
+};
+
+struct file {
+    char *path;
+    struct stat st;
+};
+
+struct files {
+    struct file f[MAX_FILES];
+    int count;
+};
+
+static const char *cachedir;
+static struct files inputs;
+static struct files dirs;       /* path and stem of each name outputs have */
+static uint64_t hash = FNV64_OFFSET_BASIS;
+
+/* What the tool opened to read, as it named them. */
+static char **opened;
+static int opened_count, opened_room;
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        fprintf(stderr, "cpmcache: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static char *xstrdup(const char *s) {
+    return strcpy(xmalloc(strlen(s) + 1), s);
+}
+
+static char *join(const char *a, const char *b) {
+    char *s = xmalloc(strlen(a) + strlen(b) + 2);
+    sprintf(s, "%s/%s", a, b);
+    return s;
+}
+
+static void add(struct files *fs, const char *path, const struct stat *st) {
+    if (fs->count == MAX_FILES) {
+        fprintf(stderr, "cpmcache: too many files\n");
+        exit(1);
+    }
+    fs->f[fs->count].path = xstrdup(path);
+    if (st)
+        fs->f[fs->count].st = *st;
+    fs->count++;
+}
+
+static void hash_bytes(const void *data, size_t length) {
+    const unsigned char *p = data;
+    uint64_t h = hash;
+
+    while (length--)
+        h = (h ^ *p++) * FNV64_PRIME;
+    hash = h;
+}
+
+static void hash_string(const char *s) {
+    hash_bytes(s, strlen(s) + 1);
+}
+
+static bool hash_contents(const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    uint64_t size;
+    void *p;
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    size = st.st_size;
+    hash_bytes(&size, sizeof(size));
+    if (size) {
+        p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        hash_bytes(p, size);
+        munmap(p, size);
+    }
+    close(fd);
+    return true;
+}
+
+static void hash_file(const char *path) {
+    if (!hash_contents(path)) {
+        fprintf(stderr, "cpmcache: unable to read %s\n", path);
+        exit(1);
+    }
+}
+
+/* The hash of just the file's contents, leaving the key's alone. */
+static bool file_hash(const char *path, uint64_t *h) {
+    uint64_t key = hash;
+    bool ok;
+
+    hash = FNV64_OFFSET_BASIS;
+    ok = hash_contents(path);
+    *h = hash;
+    hash = key;
+    return ok;
+}
+
+/* The tool's binary, looked for on the PATH if it's a bare name. */
+static char *find_tool(const char *tool) {
+    const char *path = getenv("PATH");
+
+    if (strchr(tool, '/') || !path)
+        return xstrdup(tool);
+    while (*path) {
+        size_t n = strcspn(path, ":");
+        char *dir = xmalloc(n + 1), *s;
+
+        memcpy(dir, path, n);
+        dir[n] = 0;
+        s = join(n ? dir : ".", tool);
+        free(dir);
+        if (access(s, X_OK) == 0)
+            return s;
+        free(s);
+        path += n;
+        if (*path)
+            path++;
+    }
+    return xstrdup(tool);
+}
+
+/* Remembers where outputs named after path will be. */
+static void add_stem(const char *path) {
+    const char *base = strrchr(path, '/');
+    char *dir = xstrdup(path);
+    char *s;
+
+    if (base) {
+        dir[base - path] = 0;
+        base++;
+    } else {
+        strcpy(dir, ".");
+        base = path;
+    }
+    s = xmalloc(strlen(dir) + strlen(base) + 2);
+    sprintf(s, "%s/%.*s", dir, (int) strcspn(base, "."), base);
+    add(&dirs, s, NULL);
+    free(s);
+    free(dir);
+}
+
+static bool is_file(const char *path, struct stat *st) {
+    return stat(path, st) == 0 && S_ISREG(st->st_mode);
+}
+
+static void find_inputs(char **args, int count) {
+    bool to = false;
+
+    for (int i=0; i<count; i++) {
+        char *copy, *piece, *save;
+
+        if (strcmp(args[i], "to") == 0) {
+            to = true;
+            continue;
+        }
+        if (to) {
+            /* The rest are options. */
+            dirs.count = 0;
+            add_stem(args[i]);
+            return;
+        }
+
+        copy = xstrdup(args[i]);
+        for (piece = strtok_r(copy, ",", &save); piece; piece = strtok_r(NULL, ",", &save)) {
+            struct stat st;
+            char *source;
+
+            if (is_file(piece, &st)) {
+                add(&inputs, piece, &st);
+                add_stem(piece);
+                continue;
+            }
+            source = xmalloc(strlen(piece) + 5);
+            sprintf(source, "%.*s.ASM", (int) strcspn(piece, "."), piece);
+            if (is_file(source, &st)) {
+                add(&inputs, source, &st);
+                add_stem(source);
+            }
+            free(source);
+        }
+        free(copy);
+    }
+}
+
+/* Every file in the output directories with an output's name. */
+static void scan(struct files *found) {
+    found->count = 0;
+    for (int i=0; i<dirs.count; i++) {
+        char *dir = xstrdup(dirs.f[i].path);
+        char *stem = strrchr(dir, '/');
+        struct dirent *e;
+        DIR *d;
+
+        *stem++ = 0;
+        d = opendir(dir);
+        if (!d) {
+            free(dir);
+            continue;
+        }
+        while ((e = readdir(d)) != NULL) {
+            size_t n = strcspn(e->d_name, ".");
+            struct stat st;
+            char *path;
+
+            if (n != strlen(stem) || strncasecmp(e->d_name, stem, n) != 0)
+                continue;
+            path = join(dir, e->d_name);
+            if (is_file(path, &st)) {
+                bool seen = false;
+                for (int j=0; j<found->count; j++)
+                    seen |= strcmp(found->f[j].path, path) == 0;
+                if (!seen)
+                    add(found, path, &st);
+            }
+            free(path);
+        }
+        closedir(d);
+        free(dir);
+    }
+}
+
+static bool changed(const struct file *f, const struct files *before) {
+    for (int i=0; i<inputs.count; i++)
+        if (inputs.f[i].st.st_dev == f->st.st_dev && inputs.f[i].st.st_ino == f->st.st_ino)
+            return false;
+    for (int i=0; i<before->count; i++) {
+        const struct stat *a = &before->f[i].st, *b = &f->st;
+        if (strcmp(before->f[i].path, f->path) == 0)
+            return a->st_ino != b->st_ino || a->st_size != b->st_size ||
+                   a->st_mtim.tv_sec != b->st_mtim.tv_sec ||
+                   a->st_mtim.tv_nsec != b->st_mtim.tv_nsec;
+    }
+    return true;
+}
+
+/* Copies a file, through a temporary one so nobody sees half of it. */
+static bool copy_file(const char *from, const char *to) {
+    char *tmp = xmalloc(strlen(to) + 16);
+    char buf[65536];
+    ssize_t n = 0;
+    int in, out;
+
+    sprintf(tmp, "%s.cpmcache%d", to, (int) getpid());
+    in = open(from, O_RDONLY);
+    out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (in >= 0 && out >= 0)
+        while ((n = read(in, buf, sizeof(buf))) > 0)
+            if (write(out, buf, n) != n) {
+                n = -1;
+                break;
+            }
+    if (in >= 0)
+        close(in);
+    if (out >= 0 && close(out) < 0)
+        n = -1;
+    if (in < 0 || out < 0 || n < 0 || rename(tmp, to) < 0) {
+        unlink(tmp);
+        free(tmp);
+        return false;
+    }
+    free(tmp);
+    return true;
+}
+
+static void replay(const char *path, FILE *fp) {
+    char buf[4096];
+    size_t n;
+    FILE *in = fopen(path, "rb");
+
+    if (!in)
+        return;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        fwrite(buf, 1, n, fp);
+    fclose(in);
+    fflush(fp);
+}
+
+/* Whether a line of a file has text in it. */
+static bool printed(const char *path, const char *text) {
+    char line[256];
+    FILE *in = fopen(path, "rb");
+    bool found = false;
+
+    while (in && !found && fgets(line, sizeof(line), in))
+        found = strstr(line, text) != NULL;
+    if (in)
+        fclose(in);
+    return found;
+}
+
+/* Adds to the hit and miss counts, and returns them. */
+static void count(unsigned long add_hits, unsigned long add_misses, bool zero,
+                  unsigned long *hits, unsigned long *misses) {
+    char *path = join(cachedir, "stats");
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    char buf[64];
+    ssize_t n;
+
+    *hits = *misses = 0;
+    if (fd < 0 || flock(fd, LOCK_EX) < 0) {
+        free(path);
+        return;
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    if (n > 0) {
+        buf[n] = 0;
+        sscanf(buf, "%lu %lu", hits, misses);
+    }
+    if (zero)
+        *hits = *misses = 0;
+    *hits += add_hits;
+    *misses += add_misses;
+    n = sprintf(buf, "%lu %lu\n", *hits, *misses);
+    if (ftruncate(fd, 0) < 0 || pwrite(fd, buf, n, 0) != n)
+        fprintf(stderr, "cpmcache: unable to write %s\n", path);
+    close(fd);
+    free(path);
+}
+
+static int report(bool zero) {
+    unsigned long hits, misses, entries = 0;
+    DIR *d;
+    struct dirent *e;
+
+    count(0, 0, zero, &hits, &misses);
+    d = opendir(cachedir);
+    if (d) {
+        while ((e = readdir(d)) != NULL)
+            if (strlen(e->d_name) == 16 && strspn(e->d_name, "0123456789abcdef") == 16)
+                entries++;
+        closedir(d);
+    }
+    printf("cpmcache: %lu hits, %lu misses", hits, misses);
+    if (hits + misses)
+        printf(" (%.1f%% hit rate)", 100.0 * hits / (hits + misses));
+    printf(", %lu entries in %s\n", entries, cachedir);
+    return 0;
+}
+
+static bool restore(const char *entry) {
+    char *manifest = join(entry, "MANIFEST");
+    FILE *fp = fopen(manifest, "r");
+    char line[4096];
+    int i = 0;
+    bool ok = true;
+
+    free(manifest);
+    if (!fp)
+        return false;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        char name[16], *from;
+
+        line[strcspn(line, "\n")] = 0;
+        sprintf(name, "%d", i++);
+        from = join(entry, name);
+        ok = copy_file(from, line);
+        free(from);
+    }
+    fclose(fp);
+    return ok;
+}
+
+static void remove_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *e;
+
+    while (d && (e = readdir(d)) != NULL) {
+        char *s = join(dir, e->d_name);
+        if (e->d_name[0] != '.')
+            unlink(s);
+        free(s);
+    }
+    if (d)
+        closedir(d);
+    rmdir(dir);
+}
+
+static bool same_file(const struct stat *st, const struct files *fs) {
+    for (int i=0; i<fs->count; i++)
+        if (fs->f[i].st.st_dev == st->st_dev && fs->f[i].st.st_ino == st->st_ino)
+            return true;
+    return false;
+}
+
+/* A file the tool read which the key doesn't already cover. */
+static bool is_dependency(const char *path, const struct files *outputs) {
+    static const char *const system[] = { "/usr/", "/lib", "/etc/", "/proc/", "/sys/", "/dev/" };
+    struct stat st;
+
+    for (size_t i=0; i < sizeof(system) / sizeof(*system); i++)
+        if (strncmp(path, system[i], strlen(system[i])) == 0)
+            return false;
+    if (strchr(path, '\n') || !is_file(path, &st))
+        return false;
+    return !same_file(&st, &inputs) && !same_file(&st, outputs);
+}
+
+/* The other files the tool read, each with its hash, one a line. */
+static bool write_deps(FILE *fp, const struct files *outputs) {
+    for (int i=0; i<opened_count; i++) {
+        uint64_t h;
+        bool seen = false;
+
+        for (int j=0; j<i; j++)
+            seen |= strcmp(opened[j], opened[i]) == 0;
+        if (seen || !is_dependency(opened[i], outputs))
+            continue;
+        if (!file_hash(opened[i], &h))
+            return false;
+        fprintf(fp, "%016llx %s\n", (unsigned long long) h, opened[i]);
+    }
+    return true;
+}
+
+/* Whether the files the tool read last time are as they were. */
+static bool deps_current(const char *entry) {
+    char *path = join(entry, "DEPS");
+    FILE *fp = fopen(path, "r");
+    char line[4096];
+    bool ok = true;
+
+    free(path);
+    if (!fp)
+        return false;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        unsigned long long want;
+        uint64_t h;
+        int n = 0;
+
+        line[strcspn(line, "\n")] = 0;
+        ok = sscanf(line, "%16llx %n", &want, &n) == 1 && n
+             && file_hash(line + n, &h) && h == want;
+    }
+    fclose(fp);
+    return ok;
+}
+
+static void store(const char *entry, const struct files *outputs,
+                  const char *out, const char *err) {
+    char *tmp = join(cachedir, "new.XXXXXX");
+    char *manifest;
+    FILE *fp;
+    bool ok;
+
+    if (!mkdtemp(tmp)) {
+        free(tmp);
+        return;
+    }
+    manifest = join(tmp, "MANIFEST");
+    fp = fopen(manifest, "w");
+    ok = fp != NULL;
+    for (int i=0; ok && i<outputs->count; i++) {
+        char name[16], *to;
+
+        sprintf(name, "%d", i);
+        to = join(tmp, name);
+        ok = copy_file(outputs->f[i].path, to);
+        fprintf(fp, "%s\n", outputs->f[i].path);
+        free(to);
+    }
+    if (fp && fclose(fp) != 0)
+        ok = false;
+    free(manifest);
+    manifest = join(tmp, "DEPS");
+    if (ok) {
+        fp = fopen(manifest, "w");
+        ok = fp && write_deps(fp, outputs);
+        if (fp && fclose(fp) != 0)
+            ok = false;
+    }
+    if (ok) {
+        char *s = join(tmp, "stdout");
+        ok = rename(out, s) == 0;
+        free(s);
+        s = join(tmp, "stderr");
+        ok = ok && rename(err, s) == 0;
+        free(s);
+    }
+    /* Someone else may have got there first, which is just as good. */
+    if (!ok || rename(tmp, entry) < 0)
+        remove_dir(tmp);
+    free(manifest);
+    free(tmp);
+}
+
+/* In the child: stops at each open and openat for the parent to look at,
+ * and at nothing else.  Another architecture's calls are numbered
+ * differently, so they're let through (see native_exec()).  seccomp's
+ * RET_TRACE fails the call if nobody is tracing, so this is only done once
+ * the parent is. */
+static bool trace_opens(void) {
+    static const int calls[] = {
+#ifdef __NR_open
+        __NR_open,
+#endif
+        __NR_openat,
+    };
+    enum { N = sizeof(calls) / sizeof(*calls) };
+    struct sock_filter filter[N + 5];
+    struct sock_fprog prog = { N + 5, filter };
+
+    filter[0] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                              offsetof(struct seccomp_data, arch));
+    filter[1] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                              AUDIT_ARCH_NATIVE, 0, N + 1);
+    filter[2] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                              offsetof(struct seccomp_data, nr));
+    for (int i=0; i<N; i++)
+        filter[3 + i] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                                      calls[i], N - i, 0);
+    filter[N + 3] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    filter[N + 4] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRACE);
+    return prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0
+        && prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) == 0;
+}
+
+/* A NUL terminated string from the tracee, read up to page boundaries so a
+ * short one at the end of its memory can still be read. */
+static bool read_string(pid_t pid, uint64_t addr, char *buf, size_t size) {
+    size_t got = 0;
+
+    while (got < size - 1) {
+        size_t n = 4096 - (addr + got) % 4096;
+        struct iovec local, remote;
+        ssize_t r;
+
+        if (n > size - 1 - got)
+            n = size - 1 - got;
+        local.iov_base = buf + got;
+        local.iov_len = n;
+        remote.iov_base = (void *) (uintptr_t) (addr + got);
+        remote.iov_len = n;
+        if ((r = process_vm_readv(pid, &local, 1, &remote, 1, 0)) <= 0)
+            return false;
+        if (memchr(buf + got, 0, r))
+            return true;
+        got += r;
+    }
+    return false;
+}
+
+/* Notes the file a tracee stopped at the open of, if it's for reading; false
+ * if the open couldn't be looked at. */
+static bool note_open(pid_t pid) {
+    struct syscall_info info;
+    char path[4096], *name;
+    uint64_t addr, flags;
+    int dirfd = AT_FDCWD;
+
+    memset(&info, 0, sizeof(info));
+    if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, (void *) sizeof(info), &info) <= 0
+        || info.op != SYSCALL_INFO_SECCOMP)
+        return false;
+    if (info.seccomp.nr == __NR_openat) {
+        dirfd = (int) info.seccomp.args[0];
+        addr = info.seccomp.args[1];
+        flags = info.seccomp.args[2];
+    } else {
+        addr = info.seccomp.args[0];
+        flags = info.seccomp.args[1];
+    }
+    if ((flags & O_ACCMODE) != O_RDONLY)
+        return true;
+    if (!read_string(pid, addr, path, sizeof(path)))
+        return false;
+
+    if (path[0] != '/' && dirfd != AT_FDCWD) {
+        char link[64], dir[4096];
+        ssize_t n;
+
+        sprintf(link, "/proc/%d/fd/%d", (int) pid, dirfd);
+        if ((n = readlink(link, dir, sizeof(dir) - 1)) < 0)
+            return false;
+        dir[n] = 0;
+        name = join(dir, path);
+    } else
+        name = xstrdup(path);
+
+    if (opened_count == opened_room) {
+        opened_room = opened_room ? opened_room * 2 : 64;
+        if (!(opened = realloc(opened, opened_room * sizeof(*opened)))) {
+            fprintf(stderr, "cpmcache: out of memory\n");
+            exit(1);
+        }
+    }
+    opened[opened_count++] = name;
+    return true;
+}
+
+/* The ELF class and machine at the start of a program. */
+static bool elf_machine(const char *path, unsigned char ident[EI_NIDENT], Elf32_Half *machine) {
+    Elf32_Ehdr h;                       /* the fields wanted are where Elf64's are */
+    int fd = open(path, O_RDONLY);
+    bool ok = fd >= 0 && read(fd, &h, sizeof(h)) == sizeof(h);
+
+    if (fd >= 0)
+        close(fd);
+    if (ok) {
+        memcpy(ident, h.e_ident, EI_NIDENT);
+        *machine = h.e_machine;
+    }
+    return ok;
+}
+
+/* Whether the program a tracee has just exec'd is for the architecture the
+ * filter knows the calls of. */
+static bool native_exec(pid_t pid) {
+    static unsigned char self_ident[EI_NIDENT];
+    static Elf32_Half self_machine;
+    static bool have_self;
+    unsigned char ident[EI_NIDENT];
+    Elf32_Half machine;
+    char exe[64];
+
+    if (!have_self && !(have_self = elf_machine("/proc/self/exe", self_ident, &self_machine)))
+        return false;
+    sprintf(exe, "/proc/%d/exe", (int) pid);
+    return elf_machine(exe, ident, &machine) && ident[EI_CLASS] == self_ident[EI_CLASS]
+        && machine == self_machine;
+}
+
+static int exit_status(int status) {
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+/* Runs the tool, its threads and anything it starts, noting the files they
+ * open; *traced is false if it couldn't be traced. */
+static int run(char **argv, const char *out, const char *err, bool *traced) {
+    int status, result = 127, refused[2];
+    pid_t pid;
+    char c;
+
+    /* The child says on this if the filter is refused, before the exec closes
+     * it. */
+    if (pipe2(refused, O_CLOEXEC) < 0) {
+        perror("cpmcache: pipe");
+        exit(1);
+    }
+    pid = fork();
+
+    if (pid < 0) {
+        perror("cpmcache: fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        int o = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        int e = open(err, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (o < 0 || e < 0 || dup2(o, 1) < 0 || dup2(e, 2) < 0)
+            _exit(127);
+        close(o);
+        close(e);
+        /* Untraced, the parent sees it exit without stopping first. */
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == 0) {
+            raise(SIGSTOP);
+            if (!trace_opens() && write(refused[1], "", 1) < 0)
+                _exit(127);
+        }
+        execvp(argv[0], argv);
+        fprintf(stderr, "cpmcache: unable to run %s\n", argv[0]);
+        _exit(127);
+    }
+
+    close(refused[1]);
+    *traced = false;
+    if (waitpid(pid, &status, 0) < 0)
+        status = 127 << 8;
+    if (!WIFSTOPPED(status)) {
+        close(refused[0]);
+        return exit_status(status);
+    }
+
+    *traced = true;
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *) (long) (PTRACE_O_TRACESECCOMP
+           | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK
+           | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL));
+    ptrace(PTRACE_CONT, pid, NULL, NULL);
+    for (;;) {
+        pid_t t = waitpid(-1, &status, __WALL);
+        int sig;
+
+        if (t < 0) {
+            if (errno == EINTR)
+                continue;
+            break;                      /* no more of them */
+        }
+        if (!WIFSTOPPED(status)) {
+            if (t == pid)
+                result = exit_status(status);
+            continue;
+        }
+        sig = WSTOPSIG(status);
+        if (status >> 16 == PTRACE_EVENT_SECCOMP && !note_open(t))
+            *traced = false;
+        if (status >> 16 == PTRACE_EVENT_EXEC && !native_exec(t))
+            *traced = false;
+        /* Events, and the stop a new thread or process starts with, aren't
+         * the tool's signals. */
+        if (status >> 16 || sig == SIGSTOP || sig == SIGTRAP)
+            sig = 0;
+        ptrace(PTRACE_CONT, t, NULL, (void *) (long) sig);
+    }
+    if (read(refused[0], &c, 1) == 1)
+        *traced = false;
+    close(refused[0]);
+    return result;
+}
+
+int main(int argc, char **argv) {
+    struct files before, after, outputs;
+    unsigned long hits, misses;
+    char key[17], *entry, *out, *err, *tool, *base;
+    int c, status;
+    bool traced;
+
+    cachedir = getenv("CPMCACHE");
+    if (!cachedir || !*cachedir)
+        cachedir = ".cpmcache";
+
+    while ((c = getopt(argc, argv, "+d:sz")) != -1) {
+        switch (c) {
+        case 'd':
+            cachedir = optarg;
+            break;
+        case 's':
+        case 'z':
+            mkdir(cachedir, 0777);
+            return report(c == 'z');
+        default:
+            goto usage;
+        }
+    }
+    if (optind == argc) {
+usage:
+        fprintf(stderr, "usage: cpmcache [-d dir] tool [argument...] | -s | -z\n");
+        return 1;
+    }
+    argv += optind;
+    argc -= optind;
+
+    if (mkdir(cachedir, 0777) < 0 && errno != EEXIST) {
+        fprintf(stderr, "cpmcache: unable to create %s\n", cachedir);
+        return 1;
+    }
+
+    hash_string("cpmcache 1");
+    tool = find_tool(argv[0]);
+    hash_file(tool);
+    free(tool);
+    for (int i=0; i<argc; i++)
+        hash_string(argv[i]);
+    find_inputs(argv + 1, argc - 1);
+    for (int i=0; i<inputs.count; i++) {
+        hash_string(inputs.f[i].path);
+        hash_file(inputs.f[i].path);
+    }
+    sprintf(key, "%016llx", (unsigned long long) hash);
+    entry = join(cachedir, key);
+
+    /* One whose other inputs have changed is no good, and is in the way. */
+    if (!deps_current(entry))
+        remove_dir(entry);
+    else if (restore(entry)) {
+        char *s = join(entry, "stdout");
+        replay(s, stdout);
+        free(s);
+        s = join(entry, "stderr");
+        replay(s, stderr);
+        free(s);
+        count(1, 0, false, &hits, &misses);
+        return 0;
+    }
+
+    out = join(cachedir, "stdout.XXXXXX");
+    err = join(cachedir, "stderr.XXXXXX");
+    c = mkstemp(out);
+    if (c >= 0)
+        close(c);
+    c = mkstemp(err);
+    if (c >= 0)
+        close(c);
+
+    scan(&before);
+    status = run(argv, out, err, &traced);
+    replay(out, stdout);
+    replay(err, stderr);
+    count(0, 1, false, &hits, &misses);
+
+    base = strrchr(argv[0], '/');
+    base = base ? base + 1 : argv[0];
+    if (status == 0 && traced && (strcmp(base, "asm") || printed(out, "Assembly successful"))) {
+        scan(&after);
+        outputs.count = 0;
+        for (int i=0; i<after.count; i++)
+            if (changed(&after.f[i], &before))
+                add(&outputs, after.f[i].path, &after.f[i].st);
+        store(entry, &outputs, out, err);
+    }
+    unlink(out);
+    unlink(err);
+    return status;
+}
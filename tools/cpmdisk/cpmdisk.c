@@ -0,0 +1,482 @@
+/*
+ * cpmdisk - CP/M 2.2 disk images, indexed for getting files in and out
+ * in bulk
+ *
+ * See LICENSE for details.
+ *
+ * The BDOS finds a file by reading the directory from the start (search
+ * and searchn in bdos.ASM), so doing that for each of n files is n times
+ * the directory.  Here the directory is read once, when the image is
+ * opened, into a copy in memory and a hash index by user and name of each
+ * file's entries; the allocation vector is built from it as initialize
+ * builds it, a bit a block, the top bit of the first byte for block 0,
+ * the directory's blocks set and then those of every entry in use.  So
+ * finding, reading, writing and deleting a file is a hash lookup and the
+ * file's own entries, and the free blocks and entries come off the vector
+ * and a list, not a search.
+ *
+ * A file's data goes straight to the image, but the directory is only
+ * written back, all of it in one go, when the image is closed.  Until then
+ * the image on disk is only consistent if nothing has been deleted or
+ * compacted, as the blocks a file is written to are otherwise free by the
+ * directory on disk too.
+ * The layout, skew and all, is mkdisk's (see ../mkdisk/mkdisk.c).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cpmdisk.h"
+
+#define EMPTY 0xe5
+#define FNV_OFFSET_BASIS 0x811c9dc5u
+#define FNV_PRIME 0x01000193u
+
+static void *allocate(void *p, size_t size) {
+    if (!(p = realloc(p, size ? size : 1))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static uint8_t *entry(const struct cpmdisk *d, unsigned n) {
+    return d->dir + n * 32;
+}
+
+static unsigned per_block(const struct cpmdisk *d) {
+    return d->layout.block_size / 128;
+}
+
+/* Block numbers are words if there are more than 256 blocks. */
+static unsigned pointers(const struct cpmdisk *d) {
+    return d->layout.def.dsm > 255 ? 8 : 16;
+}
+
+static unsigned pointer(const struct cpmdisk *d, const uint8_t *e, unsigned i) {
+    if (d->layout.def.dsm > 255)
+        return e[16 + i * 2] | e[17 + i * 2] << 8;
+    return e[16 + i];
+}
+
+static void set_pointer(const struct cpmdisk *d, uint8_t *e, unsigned i, unsigned block) {
+    if (d->layout.def.dsm > 255) {
+        e[16 + i * 2] = block & 0xff;
+        e[17 + i * 2] = block >> 8;
+    } else
+        e[16 + i] = block;
+}
+
+/* The logical extent, from EX and S2. */
+static unsigned extent(const uint8_t *e) {
+    return (e[14] & 0x3f) << 5 | (e[12] & 0x1f);
+}
+
+/* Records in the entry, and where in the file they start. */
+static unsigned entry_records(const struct cpmdisk *d, const uint8_t *e) {
+    return (e[12] & d->layout.def.exm) * 128 + (e[15] > 128 ? 128 : e[15]);
+}
+
+static size_t entry_start(const struct cpmdisk *d, const uint8_t *e) {
+    return (size_t) (extent(e) & ~d->layout.def.exm) * 128;
+}
+
+static bool block_used(const struct cpmdisk *d, unsigned n) {
+    return d->alv[n >> 3] & (0x80 >> (n & 7));
+}
+
+static void set_block(struct cpmdisk *d, unsigned n, bool used) {
+    if (block_used(d, n) != used) {
+        d->alv[n >> 3] ^= 0x80 >> (n & 7);
+        if (used)
+            d->free_block_count--;
+        else
+            d->free_block_count++;
+    }
+}
+
+/* As scandm: the blocks the entry has, if they're on the disk. */
+static void scandm(struct cpmdisk *d, const uint8_t *e, bool used) {
+    for (unsigned i=0; i<pointers(d); i++) {
+        unsigned block = pointer(d, e, i);
+        if (block && block <= d->layout.def.dsm)
+            set_block(d, block, used);
+    }
+}
+
+/* The first free block from where the last one was found, or 0 (which is
+ * always the directory's) if there are none. */
+static unsigned allocate_block(struct cpmdisk *d) {
+    for (unsigned i=0; i <= d->layout.def.dsm; i++) {
+        unsigned block = d->block_cursor;
+        if (++d->block_cursor > d->layout.def.dsm)
+            d->block_cursor = 0;
+        if (!block_used(d, block)) {
+            set_block(d, block, true);
+            return block;
+        }
+    }
+    return 0;
+}
+
+static uint32_t hash(unsigned user, const uint8_t name[11]) {
+    uint32_t h = (FNV_OFFSET_BASIS ^ user) * FNV_PRIME;
+    for (int i=0; i<11; i++)
+        h = (h ^ name[i]) * FNV_PRIME;
+    return h;
+}
+
+struct cpm_file *cpmdisk_find(struct cpmdisk *d, unsigned user, const uint8_t name[11]) {
+    for (int i = d->buckets[hash(user, name) & d->bucket_mask]; i >= 0; i = d->files[i].next)
+        if (d->files[i].user == user && !memcmp(d->files[i].name, name, 11))
+            return &d->files[i];
+    return NULL;
+}
+
+/* A new file, in the index, with no entries yet. */
+static struct cpm_file *add_file(struct cpmdisk *d, unsigned user, const uint8_t name[11]) {
+    int *bucket = &d->buckets[hash(user, name) & d->bucket_mask];
+    struct cpm_file *f;
+
+    if (d->file_count == d->file_room) {
+        d->file_room = d->file_room ? d->file_room * 2 : 64;
+        d->files = allocate(d->files, d->file_room * sizeof *d->files);
+    }
+    f = &d->files[d->file_count];
+    memset(f, 0, sizeof *f);
+    f->user = user;
+    memcpy(f->name, name, 11);
+    f->next = *bucket;
+    *bucket = d->file_count++;
+    return f;
+}
+
+static void add_entry(struct cpm_file *f, unsigned n) {
+    if (f->count == f->room) {
+        f->room = f->room ? f->room * 2 : 4;
+        f->entries = allocate(f->entries, f->room * sizeof *f->entries);
+    }
+    f->entries[f->count++] = n;
+}
+
+bool cpmdisk_open(struct cpmdisk *d, const char *filename,
+                  const struct layout *l, bool writable) {
+    unsigned dir_records, buckets;
+    struct stat st;
+    void *p;
+
+    memset(d, 0, sizeof *d);
+    d->layout = *l;
+    d->writable = writable;
+    d->fd = open(filename, writable ? O_RDWR : O_RDONLY);
+    if (d->fd < 0 || fstat(d->fd, &st) < 0) {
+        perror(filename);
+        return false;
+    }
+    if ((size_t) st.st_size < l->size) {
+        fprintf(stderr, "%s: too small for %s\n", filename, l->def.name);
+        close(d->fd);
+        return false;
+    }
+    p = mmap(NULL, l->size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+             writable ? MAP_SHARED : MAP_PRIVATE, d->fd, 0);
+    if (p == MAP_FAILED) {
+        perror(filename);
+        close(d->fd);
+        return false;
+    }
+    d->image = p;
+
+    d->entries = l->def.drm + 1;
+    dir_records = (d->entries + 3) / 4;
+    d->dir = allocate(NULL, dir_records * 128);
+    for (unsigned r=0; r<dir_records; r++)
+        memcpy(d->dir + r * 128, d->image + layout_record(l, r), 128);
+
+    d->alv = allocate(NULL, l->def.dsm / 8 + 1);
+    memset(d->alv, 0, l->def.dsm / 8 + 1);
+    d->free_block_count = l->def.dsm + 1;
+    for (unsigned i=0; i<l->dir_blocks; i++)
+        set_block(d, i, true);
+    d->block_cursor = l->dir_blocks;
+
+    for (buckets = 16; buckets < d->entries * 2; buckets *= 2)
+        ;
+    d->buckets = allocate(NULL, buckets * sizeof *d->buckets);
+    for (unsigned i=0; i<buckets; i++)
+        d->buckets[i] = -1;
+    d->bucket_mask = buckets - 1;
+
+    /* Free entries are taken from the end of the list, lowest first. */
+    d->free_entries = allocate(NULL, d->entries * sizeof *d->free_entries);
+    for (unsigned n = d->entries; n-- > 0; )
+        if (entry(d, n)[0] == EMPTY)
+            d->free_entries[d->free_count++] = n;
+
+    for (unsigned n=0; n<d->entries; n++) {
+        uint8_t *e = entry(d, n);
+        uint8_t name[11];
+        struct cpm_file *f;
+
+        if (e[0] == EMPTY)
+            continue;
+        scandm(d, e, true);
+        for (int i=0; i<11; i++)
+            name[i] = e[1 + i] & 0x7f;
+        if (!(f = cpmdisk_find(d, e[0], name)))
+            f = add_file(d, e[0], name);
+        add_entry(f, n);
+    }
+
+    /* Each file's entries by extent; there are rarely more than a few. */
+    for (unsigned i=0; i<d->file_count; i++) {
+        struct cpm_file *f = &d->files[i];
+        for (unsigned j=1; j<f->count; j++) {
+            unsigned n = f->entries[j], k = j;
+            for (; k > 0 && extent(entry(d, f->entries[k - 1])) > extent(entry(d, n)); k--)
+                f->entries[k] = f->entries[k - 1];
+            f->entries[k] = n;
+        }
+    }
+    return true;
+}
+
+size_t cpmdisk_records(const struct cpmdisk *d, const struct cpm_file *f) {
+    size_t records = 0;
+
+    for (unsigned i=0; i<f->count; i++) {
+        const uint8_t *e = entry(d, f->entries[i]);
+        size_t end = entry_start(d, e) + entry_records(d, e);
+        if (end > records)
+            records = end;
+    }
+    return records;
+}
+
+uint8_t *cpmdisk_read(const struct cpmdisk *d, const struct cpm_file *f, size_t *length) {
+    uint8_t *data;
+
+    *length = cpmdisk_records(d, f) * 128;
+    data = allocate(NULL, *length);
+    memset(data, 0, *length);
+    for (unsigned i=0; i<f->count; i++) {
+        const uint8_t *e = entry(d, f->entries[i]);
+        uint8_t *p = data + entry_start(d, e) * 128;
+        unsigned records = entry_records(d, e);
+
+        for (unsigned r=0; r<records; r++, p += 128) {
+            unsigned block = pointer(d, e, r / per_block(d));
+            if (block && block <= d->layout.def.dsm)
+                memcpy(p, d->image + layout_record(&d->layout, block * per_block(d) + r % per_block(d)), 128);
+        }
+    }
+    return data;
+}
+
+void cpmdisk_delete(struct cpmdisk *d, struct cpm_file *f) {
+    int *link = &d->buckets[hash(f->user, f->name) & d->bucket_mask];
+
+    for (unsigned i=0; i<f->count; i++) {
+        uint8_t *e = entry(d, f->entries[i]);
+        scandm(d, e, false);
+        e[0] = EMPTY;
+        d->free_entries[d->free_count++] = f->entries[i];
+    }
+    while (&d->files[*link] != f)
+        link = &d->files[*link].next;
+    *link = f->next;
+    f->count = 0;
+    f->deleted = true;
+    d->dirty = true;
+}
+
+void cpmdisk_name(const uint8_t name[11], bool lower, char out[13]) {
+    char *p = out;
+
+    for (int i=0; i<11; i++) {
+        if (i == 8)
+            *p++ = '.';
+        if (name[i] != ' ')
+            *p++ = lower ? tolower(name[i]) : name[i];
+    }
+    if (p[-1] == '.')
+        p--;
+    *p = 0;
+}
+
+bool cpmdisk_write(struct cpmdisk *d, unsigned user, const uint8_t name[11],
+                   const uint8_t *data, size_t length) {
+    unsigned per_entry = (d->layout.def.exm + 1) * 128;        /* records */
+    size_t records = (length + 127) / 128;
+    size_t blocks = (records + per_block(d) - 1) / per_block(d);
+    size_t entries = records ? (records + per_entry - 1) / per_entry : 1;
+    size_t free_blocks = d->free_block_count, free_entries = d->free_count;
+    struct cpm_file *f = cpmdisk_find(d, user, name);
+    char text[13];
+
+    if (!d->writable) {
+        cpmdisk_name(name, false, text);
+        fprintf(stderr, "%s: the disk is read only\n", text);
+        return false;
+    }
+    /* What it would have with the old one gone. */
+    if (f) {
+        free_entries += f->count;
+        for (unsigned i=0; i<f->count; i++) {
+            const uint8_t *e = entry(d, f->entries[i]);
+            for (unsigned j=0; j<pointers(d); j++) {
+                unsigned block = pointer(d, e, j);
+                free_blocks += block && block <= d->layout.def.dsm && block_used(d, block);
+            }
+        }
+    }
+    if (entries > free_entries || blocks > free_blocks) {
+        cpmdisk_name(name, false, text);
+        fprintf(stderr, "%s: the disk is full\n", text);
+        return false;
+    }
+    if (f)
+        cpmdisk_delete(d, f);
+
+    f = add_file(d, user, name);
+    for (size_t i=0; i<entries; i++) {
+        unsigned n = d->free_entries[--d->free_count];
+        uint8_t *e = entry(d, n);
+        size_t left = records - i * per_entry;
+        unsigned count = left < per_entry ? left : per_entry;
+        unsigned x = i * (d->layout.def.exm + 1) + (count ? (count - 1) / 128 : 0);
+
+        memset(e, 0, 32);
+        e[0] = user;
+        memcpy(e + 1, name, 11);
+        e[12] = x & 0x1f;
+        e[14] = x >> 5;
+        e[15] = count ? count - (count - 1) / 128 * 128 : 0;
+        for (unsigned j=0; j * per_block(d) < count; j++) {
+            unsigned block = allocate_block(d);
+            set_pointer(d, e, j, block);
+            for (unsigned k=0; k < per_block(d) && j * per_block(d) + k < count; k++) {
+                size_t r = i * per_entry + j * per_block(d) + k;
+                size_t bytes = length - r * 128 < 128 ? length - r * 128 : 128;
+                uint8_t *p = d->image + layout_record(&d->layout, block * per_block(d) + k);
+                memcpy(p, data + r * 128, bytes);
+                memset(p + bytes, 0x1a, 128 - bytes);
+            }
+        }
+        add_entry(f, n);
+    }
+    d->dirty = true;
+    return true;
+}
+
+struct placing {
+    unsigned first;                     /* entry */
+    unsigned file;
+};
+
+static int by_first(const void *a, const void *b) {
+    const struct placing *x = a, *y = b;
+    return (x->first > y->first) - (x->first < y->first);
+}
+
+void cpmdisk_compact(struct cpmdisk *d) {
+    const struct layout *l = &d->layout;
+    size_t dir_size = (d->entries + 3) / 4 * 128;
+    uint8_t *blocks = allocate(NULL, (size_t) (l->def.dsm + 1) * l->block_size);
+    uint8_t *dir = allocate(NULL, dir_size);
+    struct placing *order = allocate(NULL, d->file_count * sizeof *order);
+    unsigned files = 0, next_entry = 0, next_block = l->dir_blocks;
+
+    for (unsigned i=0; i<d->file_count; i++) {
+        struct cpm_file *f = &d->files[i];
+        if (f->deleted)
+            continue;
+        order[files].first = d->entries;
+        order[files].file = i;
+        for (unsigned j=0; j<f->count; j++)
+            if (f->entries[j] < order[files].first)
+                order[files].first = f->entries[j];
+        files++;
+    }
+    qsort(order, files, sizeof *order, by_first);
+
+    /* The blocks in use as they are, since one may be moved onto another
+     * before it's been moved itself. */
+    for (unsigned b = l->dir_blocks; b <= l->def.dsm; b++)
+        if (block_used(d, b))
+            for (unsigned k=0; k<per_block(d); k++)
+                memcpy(blocks + (size_t) b * l->block_size + k * 128,
+                       d->image + layout_record(l, b * per_block(d) + k), 128);
+
+    memset(d->alv, 0, l->def.dsm / 8 + 1);
+    d->free_block_count = l->def.dsm + 1;
+    for (unsigned i=0; i<l->dir_blocks; i++)
+        set_block(d, i, true);
+    memset(dir, EMPTY, dir_size);
+
+    for (unsigned i=0; i<files; i++) {
+        struct cpm_file *f = &d->files[order[i].file];
+        for (unsigned j=0; j<f->count; j++) {
+            uint8_t *e = dir + next_entry * 32;
+
+            memcpy(e, entry(d, f->entries[j]), 32);
+            for (unsigned k=0; k<pointers(d); k++) {
+                unsigned block = pointer(d, e, k);
+                /* A block two entries share is copied for each, while
+                 * there's room. */
+                if (!block || block > l->def.dsm || next_block > l->def.dsm) {
+                    set_pointer(d, e, k, 0);
+                    continue;
+                }
+                for (unsigned r=0; r<per_block(d); r++)
+                    memcpy(d->image + layout_record(l, next_block * per_block(d) + r),
+                           blocks + (size_t) block * l->block_size + r * 128, 128);
+                set_pointer(d, e, k, next_block);
+                set_block(d, next_block++, true);
+            }
+            f->entries[j] = next_entry++;
+        }
+    }
+
+    free(d->dir);
+    d->dir = dir;
+    d->free_count = 0;
+    for (unsigned n = d->entries; n-- > next_entry; )
+        d->free_entries[d->free_count++] = n;
+    d->block_cursor = next_block > l->def.dsm ? l->dir_blocks : next_block;
+    d->dirty = true;
+    free(blocks);
+    free(order);
+}
+
+unsigned cpmdisk_free_blocks(const struct cpmdisk *d) {
+    return d->free_block_count;
+}
+
+bool cpmdisk_close(struct cpmdisk *d) {
+    bool ok = true;
+
+    if (d->writable && d->dirty) {
+        for (unsigned r=0; r < (d->entries + 3) / 4; r++)
+            memcpy(d->image + layout_record(&d->layout, r), d->dir + r * 128, 128);
+        if (msync(d->image, d->layout.size, MS_SYNC) < 0) {
+            perror("msync");
+            ok = false;
+        }
+    }
+    munmap(d->image, d->layout.size);
+    close(d->fd);
+    for (unsigned i=0; i<d->file_count; i++)
+        free(d->files[i].entries);
+    free(d->files);
+    free(d->buckets);
+    free(d->free_entries);
+    free(d->alv);
+    free(d->dir);
+    return ok;
+}
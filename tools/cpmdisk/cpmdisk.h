@@ -0,0 +1,80 @@
+/*
+ * cpmdisk.h - CP/M 2.2 disk images, indexed for getting files in and out
+ * in bulk (libcpmdisk.a)
+ *
+ * See LICENSE for details.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "mkdisk.h"
+
+/* A file on the disk: its directory entries, by logical extent. */
+struct cpm_file {
+    uint8_t user;
+    uint8_t name[11];                   /* without the attribute bits */
+    unsigned *entries;
+    unsigned count, room;
+    int next;                           /* in its hash chain, or -1 */
+    bool deleted;
+};
+
+struct cpmdisk {
+    struct layout layout;
+    uint8_t *image;
+    int fd;
+    bool writable;
+    bool dirty;                         /* dir needs writing back */
+    unsigned entries;                   /* DRM + 1 */
+    uint8_t *dir;                       /* the directory, in logical order */
+    uint8_t *alv;                       /* a bit a block, as initialize */
+    unsigned free_block_count;
+    unsigned block_cursor;              /* where to look for a free block */
+    unsigned *free_entries;
+    unsigned free_count;
+    struct cpm_file *files;             /* in the order they're found, with
+                                           the deleted ones left in */
+    unsigned file_count, file_room;
+    int *buckets;
+    unsigned bucket_mask;
+};
+
+/* Maps the image, reads its directory into memory, and builds the index
+ * and the allocation vector; false, with a message, if it can't.  Nothing
+ * is written to it, if it's writable, until cpmdisk_close(). */
+extern bool cpmdisk_open(struct cpmdisk *d, const char *filename,
+                         const struct layout *l, bool writable);
+
+/* The file, or NULL; good until the next file is written. */
+extern struct cpm_file *cpmdisk_find(struct cpmdisk *d, unsigned user, const uint8_t name[11]);
+
+/* The size of the file in records, counting any holes in it. */
+extern size_t cpmdisk_records(const struct cpmdisk *d, const struct cpm_file *f);
+
+/* The whole file, with its holes zeroed, in memory to be freed; *length is
+ * a whole number of records. */
+extern uint8_t *cpmdisk_read(const struct cpmdisk *d, const struct cpm_file *f, size_t *length);
+
+/* NAME.EXT, without the padding, and lowercased if lower. */
+extern void cpmdisk_name(const uint8_t name[11], bool lower, char out[13]);
+
+/* Writes the file, replacing any of the same name; the last record is
+ * padded with ^Zs.  False, with a message and the disk unchanged, if it
+ * doesn't fit. */
+extern bool cpmdisk_write(struct cpmdisk *d, unsigned user, const uint8_t name[11],
+                          const uint8_t *data, size_t length);
+
+extern void cpmdisk_delete(struct cpmdisk *d, struct cpm_file *f);
+
+/* Moves the files to the front of the disk, in directory order, and their
+ * entries to the front of the directory, leaving the free blocks and
+ * entries in one run at the end. */
+extern void cpmdisk_compact(struct cpmdisk *d);
+
+extern unsigned cpmdisk_free_blocks(const struct cpmdisk *d);
+
+/* Writes the directory back, if it's changed, and unmaps the image; false,
+ * with a message, if it couldn't be written. */
+extern bool cpmdisk_close(struct cpmdisk *d);
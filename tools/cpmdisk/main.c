@@ -0,0 +1,217 @@
+/*
+ * cpmdisk - get files in and out of CP/M 2.2 disk images
+ *
+ * See LICENSE for details.
+ *
+ * usage: cpmdisk [-f format] [-d spt,bsh,blm,exm,dsm,drm,off[,skew[,tracks]]]
+ *                [-u user] image command [name...]
+ *
+ *   ls             the files, with their size, and what's free
+ *   get [name...]  copies the files named, or all of the user's, to the
+ *                  current directory, named in lower case
+ *   put file...    copies host files in, replacing any of the same name
+ *   rm name...     deletes them
+ *   compact        moves the files up to leave the free space in one run
+ *
+ * The formats are mkdisk's (see ../mkdisk), mds800 by default.  A name on
+ * the disk is NAME.EXT, or u:NAME.EXT for one in user u, otherwise the
+ * user given with -u (0 by default).  The image is opened once and however
+ * many files there are, its directory is written back once at the end (see
+ * cpmdisk.c).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cpmdisk.h"
+
+static void usage(void) {
+    fprintf(stderr, "usage: cpmdisk [-f format] [-d spt,bsh,blm,exm,dsm,drm,off[,skew[,tracks]]]\n"
+            "               [-u user] image ls|get|put|rm|compact [name...]\n");
+    exit(1);
+}
+
+/* [u:]NAME.EXT into user and name; false, with a message, if it isn't. */
+static bool parse_name(const char *text, unsigned *user, uint8_t name[11]) {
+    const char *colon = strchr(text, ':');
+    char *end;
+
+    if (colon) {
+        unsigned long u = strtoul(text, &end, 10);
+        if (end != colon || end == text || u > 15) {
+            fprintf(stderr, "%s: not a user number\n", text);
+            return false;
+        }
+        *user = u;
+        text = colon + 1;
+    }
+    if (strchr(text, '/') || !disk_name(text, name)) {
+        fprintf(stderr, "%s: not an 8.3 name\n", text);
+        return false;
+    }
+    return true;
+}
+
+static void list(struct cpmdisk *d) {
+    const struct layout *l = &d->layout;
+    char name[13];
+
+    for (unsigned i=0; i<d->file_count; i++) {
+        struct cpm_file *f = &d->files[i];
+        size_t records;
+        if (f->deleted)
+            continue;
+        records = cpmdisk_records(d, f);
+        cpmdisk_name(f->name, false, name);
+        printf("%2u:%-12s %6zu records %4zuK %3u entries\n", f->user, name, records,
+               (records * 128 + l->block_size - 1) / l->block_size * l->block_size / 1024,
+               f->count);
+    }
+    printf("%uK free, %u of %u entries\n", cpmdisk_free_blocks(d) * l->block_size / 1024,
+           d->free_count, d->entries);
+}
+
+static bool get(struct cpmdisk *d, const struct cpm_file *f) {
+    char name[13];
+    size_t length;
+    uint8_t *data = cpmdisk_read(d, f, &length);
+    FILE *fp;
+    bool ok;
+
+    cpmdisk_name(f->name, true, name);
+    if (!(fp = fopen(name, "wb"))) {
+        perror(name);
+        free(data);
+        return false;
+    }
+    ok = fwrite(data, 1, length, fp) == length;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok)
+        perror(name);
+    free(data);
+    return ok;
+}
+
+static bool put(struct cpmdisk *d, unsigned user, const char *filename) {
+    uint8_t name[11];
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    void *data = NULL;
+    bool ok;
+
+    if (!disk_name(filename, name)) {
+        fprintf(stderr, "%s: not an 8.3 name\n", filename);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(filename);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: not a file\n", filename);
+        close(fd);
+        return false;
+    }
+    if (st.st_size && (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        perror(filename);
+        close(fd);
+        return false;
+    }
+    close(fd);
+    ok = cpmdisk_write(d, user, name, data ? data : "", st.st_size);
+    if (data)
+        munmap(data, st.st_size);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    const struct diskdef *format = &diskdefs[0];
+    const char *dpb = NULL, *command;
+    struct diskdef def;
+    struct layout layout;
+    struct cpmdisk d;
+    unsigned user = 0;
+    bool ok = true, writable;
+    char *end;
+    int i;
+
+    for (i=1; i<argc && argv[i][0] == '-'; i++) {
+        if (i + 1 >= argc)
+            usage();
+        if (!strcmp(argv[i], "-f")) {
+            if (!(format = diskdef_find(argv[++i]))) {
+                fprintf(stderr, "%s: no such format\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-d"))
+            dpb = argv[++i];
+        else if (!strcmp(argv[i], "-u")) {
+            user = strtoul(argv[++i], &end, 10);
+            if (*end || !*argv[i] || user > 15)
+                usage();
+        } else
+            usage();
+    }
+    if (argc - i < 2)
+        usage();
+    command = argv[i + 1];
+    if (strcmp(command, "ls") && strcmp(command, "get") && strcmp(command, "put")
+        && strcmp(command, "rm") && strcmp(command, "compact"))
+        usage();
+    writable = strcmp(command, "ls") && strcmp(command, "get");
+
+    def = *format;
+    if (dpb) {
+        def = (struct diskdef) { .name = dpb, .first = 1 };
+        if (!diskdef_parse(dpb, &def)) {
+            fprintf(stderr, "%s: not spt,bsh,blm,exm,dsm,drm,off[,skew[,tracks]]\n", dpb);
+            return 1;
+        }
+    }
+    if (!layout_init(&layout, &def) || !cpmdisk_open(&d, argv[i], &layout, writable))
+        return 1;
+
+    if (!strcmp(command, "ls"))
+        list(&d);
+    else if (!strcmp(command, "compact"))
+        cpmdisk_compact(&d);
+    else if (!strcmp(command, "get") && i + 2 == argc) {
+        for (unsigned j=0; j<d.file_count; j++)
+            if (!d.files[j].deleted && d.files[j].user == user)
+                ok = get(&d, &d.files[j]) && ok;
+    } else {
+        for (i += 2; i<argc; i++) {
+            unsigned u = user;
+            uint8_t name[11];
+            struct cpm_file *f;
+
+            if (!strcmp(command, "put")) {
+                ok = put(&d, user, argv[i]) && ok;
+                continue;
+            }
+            if (!parse_name(argv[i], &u, name)) {
+                ok = false;
+                continue;
+            }
+            if (!(f = cpmdisk_find(&d, u, name))) {
+                fprintf(stderr, "%s: no such file\n", argv[i]);
+                ok = false;
+            } else if (!strcmp(command, "get"))
+                ok = get(&d, f) && ok;
+            else
+                cpmdisk_delete(&d, f);
+        }
+    }
+
+    if (!cpmdisk_close(&d))
+        return 1;
+    return !ok;
+}
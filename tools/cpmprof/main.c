@@ -0,0 +1,147 @@
+/*
+ * cpmprof - profile CP/M 2.2's BDOS and CCP
+ *
+ * See LICENSE for details.
+ *
+ * Boots bdos.sys and ccp.sys, as assembled, on run8080's 8080 core with a
+ * BIOS of our own (see ramdisk.c) whose drive A holds the files given,
+ * types the commands on stdin at the CCP, and reports where the T-states
+ * went (see profile.c): a flat profile and, with -g, a call graph, by the
+ * labels in the listings given with -l, and the calls of each BDOS
+ * function.  Console output goes to stdout and the report to stderr, or
+ * to the file given with -o.
+ *
+ * usage: cpmprof [-a] [-g] [-o report] [-l listing.PRN]... bdos.sys ccp.sys
+ *                [file...] < commands
+ *
+ * The BDOS goes where its jump to its entry says (its first page), the
+ * CCP 800H below it and the BIOS in the page after it, as they would in a
+ * real system.  -a takes indented labels in the listings as routines of
+ * their own.
+ *
+ * make -C src profile runs the commands in src/profile.in this way.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "i8080.h"
+#include "ramdisk.h"
+#include "profile.h"
+
+#define CCP_SIZE 0x800
+#define BIOS_SIZE 0x100
+
+static uint8_t mem[65536];
+
+static void usage(void) {
+    fprintf(stderr, "usage: cpmprof [-a] [-g] [-o report] [-l listing.PRN]... "
+            "bdos.sys ccp.sys [file...] < commands\n");
+    exit(1);
+}
+
+/* Reads a file of at most room bytes into buf, returning its size. */
+static size_t load(const char *filename, uint8_t *buf, size_t room) {
+    FILE *fp = fopen(filename, "rb");
+    size_t n;
+
+    if (!fp) {
+        perror(filename);
+        exit(1);
+    }
+    n = fread(buf, 1, room, fp);
+    if (ferror(fp)) {
+        perror(filename);
+        exit(1);
+    }
+    if (n == room && getc(fp) != EOF) {
+        fprintf(stderr, "%s: too big\n", filename);
+        exit(1);
+    }
+    fclose(fp);
+    return n;
+}
+
+int main(int argc, char **argv) {
+    static char outbuf[65536];
+    static uint8_t image[65536];
+    const char **listings = calloc(argc, sizeof *listings);
+    const char *report = NULL;
+    int listing_count = 0;
+    bool all = false, call_graph = false;
+    struct i8080 cpu;
+    uint16_t bdos, ccp;
+    unsigned bios;
+    size_t size;
+    FILE *fp = stderr;
+    int i;
+
+    for (i=1; i<argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-a"))
+            all = true;
+        else if (!strcmp(argv[i], "-g"))
+            call_graph = true;
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            report = argv[++i];
+        else if (!strcmp(argv[i], "-l") && i + 1 < argc)
+            listings[listing_count++] = argv[++i];
+        else
+            usage();
+    }
+    if (argc - i < 2)
+        usage();
+
+    size = load(argv[i], image, 0x2000);
+    if (size < 9 || image[6] != 0xc3) {
+        fprintf(stderr, "%s: not a BDOS (no jump at 6)\n", argv[i]);
+        return 1;
+    }
+    bdos = (image[8] << 8) & 0xff00;
+    bios = bdos + ((size + 0xff) & ~0xff);
+    if (bdos < CCP_SIZE + 0x100 || bios + BIOS_SIZE > 0x10000) {
+        fprintf(stderr, "%s: doesn't fit at %04XH\n", argv[i], bdos);
+        return 1;
+    }
+    ccp = bdos - CCP_SIZE;
+    memcpy(&mem[bdos], image, size);
+    load(argv[i + 1], &mem[ccp], CCP_SIZE);
+
+    i8080_reset(&cpu, mem);
+    bios_init(&cpu, ccp, bdos, bios);
+    for (i += 2; i < argc; i++)
+        if (!bios_add_file(argv[i]))
+            return 1;
+
+    /* What there are no listings for. */
+    profile_region(0, 0x100, "page0");
+    profile_label(0, "wboot");
+    profile_label(5, "bdos");
+    profile_region(0x100, ccp, "tpa");
+    profile_region(bios, bios + BIOS_SIZE, "bios");
+    for (i=0; i<BIOS_ENTRIES; i++)
+        profile_label(bios + i * 3, bios_names[i]);
+    for (i=0; i<listing_count; i++)
+        if (!profile_listing(listings[i], all))
+            return 1;
+
+    setvbuf(stdout, outbuf, _IOFBF, sizeof outbuf);
+    bios_boot(&cpu);
+    profile_start(&cpu, bdos + 6, bios + 3);
+    i8080_run(&cpu);
+    fflush(stdout);
+
+    if (report && !(fp = fopen(report, "w"))) {
+        perror(report);
+        return 1;
+    }
+    profile_report(fp, call_graph);
+    if (fp != stderr && fclose(fp)) {
+        perror(report);
+        return 1;
+    }
+    if (bios_stopped() == BIOS_HALT) {
+        fprintf(stderr, "cpmprof: HLT at %04X\n", (uint16_t) (cpu.pc - 1));
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,486 @@
+/*
+ * profile - T-states by routine, from a trace of every instruction
+ *
+ * See LICENSE for details.
+ *
+ * Each instruction's T-states go to the routine it's in, which is the
+ * nearest label at or below it in the region it's in; that's the flat
+ * profile.  A CALL (or RST) which is taken starts a call of the routine it
+ * lands in, and a RET ends the innermost call that would have returned to
+ * where it lands, along with any calls inside it which never returned (a
+ * BDOS error, which puts back the caller's stack pointer and returns).  A
+ * RET which matches no call is a jump, as when the BDOS pushes goback and
+ * jumps to a function; so a call's T-states run from its first instruction
+ * to the RET out of it, and the caller's CALL is the caller's.
+ *
+ * A routine's total is all the time spent in calls of it, not counting
+ * calls inside calls of itself twice, and the call graph has the same for
+ * each caller and callee (so recursive calls count as calls, but their time
+ * is the outer call's).  A BDOS call's T-states are those of the call
+ * which reached the BDOS's entry with its return address on the stack.
+ *
+ * Labels come from listings, where a label on a line with nothing listed
+ * against it (a DS, or a label on its own) takes the address of the next
+ * line which has one; that's right for code, which is all that matters.
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <ctype.h>
+#include "profile.h"
+
+#define MAX_FRAMES 1024
+#define BDOS_FUNCTIONS 41       /* 0 to 40; the rest are counted as one */
+
+struct edge {
+    int callee;
+    uint64_t calls, total;
+    struct edge *next;
+};
+
+struct symbol {
+    char *name;
+    uint16_t addr;
+    int region;
+    int order;                  /* of those at addr, the lowest is used */
+    uint64_t self, calls, total;
+    unsigned active;            /* calls of it in progress */
+    struct edge *edges;         /* what it calls */
+};
+
+struct region {
+    uint16_t start;
+    unsigned end;
+};
+
+struct frame {
+    uint16_t ret, sp;
+    int callee;
+    int function;               /* BDOS function, or -1 */
+    uint64_t start;
+    struct edge *edge;
+};
+
+static const char *const function_names[BDOS_FUNCTIONS + 1] = {
+    "system reset", "console input", "console output", "reader input",
+    "punch output", "list output", "direct console i/o", "get i/o byte",
+    "set i/o byte", "print string", "read console buffer", "console status",
+    "version number", "reset disk system", "select disk", "open file",
+    "close file", "search for first", "search for next", "delete file",
+    "read sequential", "write sequential", "make file", "rename file",
+    "login vector", "current disk", "set dma address", "allocation vector",
+    "write protect disk", "r/o vector", "set file attributes",
+    "disk parameters", "user code", "read random", "write random",
+    "file size", "set random record", "reset drive", "(38)", "(39)",
+    "write random, zero fill", "(other)",
+};
+
+static struct symbol *symbols;
+static int symbol_count, symbol_room;
+static struct region *regions;
+static int region_count;
+static char *module_name;
+
+static int owner[65536];
+static struct frame frames[MAX_FRAMES];
+static int depth;
+
+static struct {
+    uint64_t calls, total;
+} functions[BDOS_FUNCTIONS + 1];
+
+static struct i8080 *cpu;
+static uint16_t bdos_entry, wboot_entry;
+static uint16_t last_pc, last_sp;
+static uint8_t last_op;
+static uint64_t start_cycles, last_cycles, start_instructions;
+
+static void *allocate(size_t size) {
+    void *p = calloc(1, size);
+    if (!p) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void add_symbol(uint16_t addr, const char *module, const char *label, int order) {
+    struct symbol *s;
+
+    if (symbol_count == symbol_room) {
+        symbol_room = symbol_room ? symbol_room * 2 : 256;
+        symbols = realloc(symbols, symbol_room * sizeof *symbols);
+        if (!symbols) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    s = &symbols[symbol_count++];
+    memset(s, 0, sizeof *s);
+    s->name = allocate(strlen(module) + (label ? strlen(label) + 1 : 0) + 1);
+    strcpy(s->name, module);
+    if (label) {
+        strcat(s->name, ":");
+        strcat(s->name, label);
+    }
+    s->addr = addr;
+    s->region = region_count - 1;
+    s->order = order;
+}
+
+void profile_region(uint16_t start, unsigned end, const char *module) {
+    regions = realloc(regions, (region_count + 1) * sizeof *regions);
+    if (!regions) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    regions[region_count].start = start;
+    regions[region_count].end = end;
+    region_count++;
+    free(module_name);
+    module_name = allocate(strlen(module) + 1);
+    strcpy(module_name, module);
+    /* Any label at start is used rather than the module. */
+    add_symbol(start, module, NULL, INT_MAX);
+}
+
+void profile_label(uint16_t addr, const char *label) {
+    add_symbol(addr, module_name, label, symbol_count);
+}
+
+static bool is_hex(const char *p, int n) {
+    for (int i=0; i<n; i++)
+        if (!isxdigit((unsigned char) p[i]))
+            return false;
+    return true;
+}
+
+static unsigned hex(const char *p, int n) {
+    unsigned v = 0;
+    for (int i=0; i<n; i++)
+        v = (v << 4) | (isdigit((unsigned char) p[i]) ? p[i] - '0' : (tolower((unsigned char) p[i]) - 'a' + 10));
+    return v;
+}
+
+/* CALL, Ccc and RST: the instructions which start a call. */
+static bool is_call(uint8_t op) {
+    return op == 0xcd || op == 0xdd || op == 0xed || op == 0xfd ||
+           (op & 0xc7) == 0xc4 || (op & 0xc7) == 0xc7;
+}
+
+/* RET and Rcc. */
+static bool is_ret(uint8_t op) {
+    return op == 0xc9 || op == 0xd9 || (op & 0xc7) == 0xc0;
+}
+
+static bool is_name_char(char c) {
+    return isalnum((unsigned char) c) || c == '$' || c == '?' || c == '@' || c == '_';
+}
+
+/* A listing line is the address (or an EQU's value and a =) and up to five
+ * of the bytes in the first 16 columns, then the source; a leading blank
+ * in the source shows as one blank.  A label on a line of its own is at the
+ * next address listed, and one on a DS is just past the last.  An indented
+ * label which something in the listing CALLs is a routine all the same. */
+bool profile_listing(const char *filename, bool all) {
+    static uint8_t called[65536 / 8];
+    FILE *fp = fopen(filename, "rb");
+    char line[256], module[64];
+    const char *base = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+    struct label {
+        char name[sizeof line];
+        long addr;              /* -1 until the next address listed */
+        bool indented;
+    } *labels = NULL;
+    int label_count = 0;
+    long here = -1;
+    unsigned lo = 0x10000, hi = 0;
+    int i;
+
+    if (!fp) {
+        perror(filename);
+        return false;
+    }
+    for (i=0; base[i] && base[i] != '.' && i < (int) sizeof module - 1; i++)
+        module[i] = tolower((unsigned char) base[i]);
+    module[i] = 0;
+    memset(called, 0, sizeof called);
+
+    while (fgets(line, sizeof line, fp) && line[0] != 0x1a) {
+        bool listed = is_hex(line, 4) && line[4] == ' ' && line[5] != '=';
+        bool equ = is_hex(line, 4) && line[4] == ' ' && line[5] == '=';
+        unsigned addr = listed ? hex(line, 4) : 0;
+        char *p = line + 16;
+
+        if (listed) {
+            uint8_t code[5];
+            int bytes = 0;
+            for (; bytes < 5 && is_hex(line + 5 + bytes * 2, 2); bytes++)
+                code[bytes] = hex(line + 5 + bytes * 2, 2);
+            for (i=label_count - 1; i>=0 && labels[i].addr < 0; i--)
+                labels[i].addr = addr;
+            if (bytes == 3 && is_call(code[0])) {
+                uint16_t target = code[1] | (code[2] << 8);
+                called[target / 8] |= 1 << (target % 8);
+            }
+            here = addr + bytes;
+            if (addr < lo)
+                lo = addr;
+            if (addr + bytes > hi)
+                hi = addr + bytes;
+        }
+        if (equ || strlen(line) < 17)
+            continue;
+
+        /* A label is a name and a colon. */
+        if (*p == ' ')
+            p++;
+        if (!isalpha((unsigned char) *p) && *p != '?' && *p != '@')
+            continue;
+        for (i=0; is_name_char(p[i]); i++)
+            ;
+        if (p[i] != ':')
+            continue;
+
+        labels = realloc(labels, (label_count + 1) * sizeof *labels);
+        if (!labels) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        memcpy(labels[label_count].name, p, i);
+        labels[label_count].name[i] = 0;
+        labels[label_count].indented = p != line + 16;
+        p += i + 1;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (listed)
+            labels[label_count].addr = addr;
+        else if (*p && *p != ';' && *p != '\r' && *p != '\n')
+            labels[label_count].addr = here;
+        else
+            labels[label_count].addr = -1;
+        label_count++;
+    }
+    if (ferror(fp)) {
+        perror(filename);
+        fclose(fp);
+        free(labels);
+        return false;
+    }
+    fclose(fp);
+
+    if (hi > lo) {
+        profile_region(lo, hi, module);
+        for (i=0; i<label_count; i++) {
+            long addr = labels[i].addr;
+            if (addr >= 0 && (all || !labels[i].indented || (called[addr / 8] & (1 << (addr % 8)))))
+                profile_label(addr, labels[i].name);
+        }
+    }
+    free(labels);
+    return true;
+}
+
+static int by_region_and_addr(const void *a, const void *b) {
+    const struct symbol *x = a, *y = b;
+    if (x->region != y->region)
+        return x->region - y->region;
+    if (x->addr != y->addr)
+        return x->addr - y->addr;
+    /* Of several at one address, the one sorted last gets it. */
+    return y->order - x->order;
+}
+
+/* Ends the calls from frames[to] up, at now. */
+static void unwind(int to, uint64_t now) {
+    while (depth > to) {
+        struct frame *f = &frames[--depth];
+        uint64_t elapsed = now - f->start;
+
+        if (--symbols[f->callee].active == 0) {
+            symbols[f->callee].total += elapsed;
+            f->edge->total += elapsed;
+        }
+        if (f->function >= 0)
+            functions[f->function].total += elapsed;
+    }
+}
+
+static void call(int caller, int callee, uint16_t ret, uint16_t sp) {
+    struct edge *e;
+    struct frame *f;
+
+    for (e = symbols[caller].edges; e && e->callee != callee; e = e->next)
+        ;
+    if (!e) {
+        e = allocate(sizeof *e);
+        e->callee = callee;
+        e->next = symbols[caller].edges;
+        symbols[caller].edges = e;
+    }
+    e->calls++;
+    symbols[callee].calls++;
+
+    /* Too deep, so the oldest call is taken never to return. */
+    if (depth == MAX_FRAMES) {
+        symbols[frames[0].callee].active--;
+        memmove(frames, frames + 1, (MAX_FRAMES - 1) * sizeof *frames);
+        depth--;
+    }
+    f = &frames[depth++];
+    f->ret = ret;
+    f->sp = sp;
+    f->callee = callee;
+    f->function = -1;
+    f->start = cpu->cycles;
+    f->edge = e;
+    symbols[callee].active++;
+}
+
+static void trace(struct i8080 *c) {
+    uint16_t pc = c->pc;
+    uint16_t top = c->mem[c->sp] | (c->mem[(uint16_t) (c->sp + 1)] << 8);
+
+    symbols[owner[last_pc]].self += c->cycles - last_cycles;
+
+    /* Whether a CALL or RET was taken shows in the stack pointer. */
+    if (is_call(last_op) && c->sp == (uint16_t) (last_sp - 2))
+        call(owner[last_pc], owner[pc], top, c->sp);
+    else if (is_ret(last_op) && c->sp == (uint16_t) (last_sp + 2)) {
+        for (int i=depth - 1; i>=0; i--)
+            if (frames[i].ret == pc) {
+                unwind(i, c->cycles);
+                break;
+            }
+    }
+
+    if (pc == bdos_entry) {
+        int function = c->c < BDOS_FUNCTIONS ? c->c : BDOS_FUNCTIONS;
+        functions[function].calls++;
+        if (depth && frames[depth - 1].sp == c->sp && frames[depth - 1].function < 0)
+            frames[depth - 1].function = function;
+    }
+    if (pc == wboot_entry)
+        unwind(0, c->cycles);
+
+    last_pc = pc;
+    last_sp = c->sp;
+    last_op = c->mem[pc];
+    last_cycles = c->cycles;
+}
+
+void profile_start(struct i8080 *c, uint16_t bdos, uint16_t wboot) {
+    cpu = c;
+    bdos_entry = bdos;
+    wboot_entry = wboot;
+
+    /* Each region's routines in order, and each address to the last one
+     * at or below it; later regions cover earlier ones. */
+    add_symbol(0, "?", NULL, 0);
+    symbols[symbol_count - 1].region = -1;
+    qsort(symbols, symbol_count, sizeof *symbols, by_region_and_addr);
+    memset(owner, 0, sizeof owner);
+    for (int i=1; i<symbol_count; i++) {
+        struct region *r = &regions[symbols[i].region];
+        unsigned end = r->end;
+        if (i + 1 < symbol_count && symbols[i + 1].region == symbols[i].region)
+            end = symbols[i + 1].addr;
+        for (unsigned a=symbols[i].addr; a<end; a++)
+            owner[a] = i;
+    }
+
+    last_pc = c->pc;
+    last_sp = c->sp;
+    last_op = 0;
+    start_cycles = last_cycles = c->cycles;
+    start_instructions = c->instructions;
+    c->trace = trace;
+}
+
+static int by_self(const void *a, const void *b) {
+    const struct symbol *x = *(struct symbol *const *) a, *y = *(struct symbol *const *) b;
+    if (x->self != y->self)
+        return x->self < y->self ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+static int by_total(const void *a, const void *b) {
+    const struct symbol *x = *(struct symbol *const *) a, *y = *(struct symbol *const *) b;
+    if (x->total != y->total)
+        return x->total < y->total ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+void profile_report(FILE *fp, bool call_graph) {
+    struct symbol **sorted = allocate(symbol_count * sizeof *sorted);
+    uint64_t cycles, instructions;
+    int n = 0;
+
+    symbols[owner[last_pc]].self += cpu->cycles - last_cycles;
+    last_cycles = cpu->cycles;
+    unwind(0, cpu->cycles);
+    cycles = cpu->cycles - start_cycles;
+    instructions = cpu->instructions - start_instructions;
+
+    for (int i=0; i<symbol_count; i++)
+        if (symbols[i].self || symbols[i].calls)
+            sorted[n++] = &symbols[i];
+
+    fprintf(fp, "%llu instructions, %llu T-states\n\n",
+            (unsigned long long) instructions, (unsigned long long) cycles);
+
+    fprintf(fp, "Flat profile, by the T-states spent in each routine itself\n\n");
+    fprintf(fp, "  %%time          self      calls         total  routine\n");
+    qsort(sorted, n, sizeof *sorted, by_self);
+    for (int i=0; i<n; i++) {
+        struct symbol *s = sorted[i];
+        fprintf(fp, "  %5.1f  %12llu  %9llu  ", cycles ? 100.0 * s->self / cycles : 0.0,
+                (unsigned long long) s->self, (unsigned long long) s->calls);
+        if (s->calls)
+            fprintf(fp, "%12llu", (unsigned long long) s->total);
+        else
+            fprintf(fp, "%12s", "");
+        fprintf(fp, "  %s\n", s->name);
+    }
+
+    fprintf(fp, "\nBDOS functions, by the T-states from the call to the return\n\n");
+    fprintf(fp, "   fn  function                     calls         total      per call\n");
+    for (int i=0; i<=BDOS_FUNCTIONS; i++) {
+        if (!functions[i].calls)
+            continue;
+        if (i < BDOS_FUNCTIONS)
+            fprintf(fp, "  %3d", i);
+        else
+            fprintf(fp, "     ");
+        fprintf(fp, "  %-25s  %9llu  %12llu  %12llu\n", function_names[i],
+                (unsigned long long) functions[i].calls,
+                (unsigned long long) functions[i].total,
+                (unsigned long long) (functions[i].total / functions[i].calls));
+    }
+
+    if (call_graph) {
+        fprintf(fp, "\nCall graph, by the T-states spent in calls of each routine\n\n");
+        fprintf(fp, "                                       calls         total\n");
+        qsort(sorted, n, sizeof *sorted, by_total);
+        for (int i=0; i<n; i++) {
+            struct symbol *s = sorted[i];
+            int index = s - symbols;
+
+            if (!s->calls)
+                continue;
+            fprintf(fp, "\n");
+            for (int j=0; j<symbol_count; j++)
+                for (struct edge *e = symbols[j].edges; e; e = e->next)
+                    if (e->callee == index)
+                        fprintf(fp, "    from   %-24s  %9llu  %12llu\n", symbols[j].name,
+                                (unsigned long long) e->calls, (unsigned long long) e->total);
+            fprintf(fp, "%-35s  %9llu  %12llu\n", s->name,
+                    (unsigned long long) s->calls, (unsigned long long) s->total);
+            for (struct edge *e = s->edges; e; e = e->next)
+                fprintf(fp, "    calls  %-24s  %9llu  %12llu\n", symbols[e->callee].name,
+                        (unsigned long long) e->calls, (unsigned long long) e->total);
+        }
+    }
+    free(sorted);
+}
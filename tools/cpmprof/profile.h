@@ -0,0 +1,31 @@
+/*
+ * profile - T-states by routine, from a trace of every instruction
+ *
+ * See LICENSE for details.
+ */
+
+#pragma once
+#include <stdio.h>
+#include <stdbool.h>
+#include "i8080.h"
+
+/* Starts a region of memory, from start up to end, whose routines are
+ * named module:label; up to its first label it is one called module. */
+extern void profile_region(uint16_t start, unsigned end, const char *module);
+/* A routine starting at addr, in the last region started. */
+extern void profile_label(uint16_t addr, const char *label);
+
+/* Reads the labels from an asm listing (see ../asm/asm.c) into a region
+ * of their own, covering the code listed and named after the file; with
+ * all, indented labels start routines too, rather than being part of the
+ * one before.  False, with a message, if it can't be read. */
+extern bool profile_listing(const char *filename, bool all);
+
+/* Hooks cpu's trace.  BDOS calls are counted by function (the C register)
+ * as they reach bdos, and a warm boot (reaching wboot) ends the calls in
+ * progress, which will never return. */
+extern void profile_start(struct i8080 *cpu, uint16_t bdos, uint16_t wboot);
+
+/* Ends the calls still in progress and writes the flat profile and the
+ * BDOS functions, and with call_graph the call graph. */
+extern void profile_report(FILE *fp, bool call_graph);
@@ -0,0 +1,328 @@
+/*
+ * ramdisk - a CP/M 2.2 BIOS with a RAM disk, done by the host
+ *
+ * See LICENSE for details.
+ *
+ * As in run8080's bdos.c, each entry in the jump table is an HLT followed
+ * by a RET, and the trap does what the call asks and lets the RET return
+ * from it; so the BIOS costs the BDOS 10 T-states a call, whatever it does,
+ * and a profile is of the BDOS and CCP alone.
+ *
+ * The one drive, A, is laid out as an MDS-800 single density disk (77
+ * tracks of 26 128-byte sectors, two of them reserved, 1K blocks, 64
+ * directory entries), without the skew, so the BDOS has the directory and
+ * allocation work to do that it would on a real one.  Its contents are
+ * lost at the end of the run.
+ *
+ * A warm boot reloads the CCP and BDOS as they were at the start, as a
+ * real one reads them back from the reserved tracks, and goes on into the
+ * CCP.  The console is stdin and stdout: CONST always says there's nothing
+ * waiting, so input is only read when the BDOS asks for it, and the run
+ * stops when it runs out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "ramdisk.h"
+
+#define SECTORS 26
+#define TRACKS 77
+#define RESERVED 2
+#define BLOCK_SIZE 1024
+#define BLOCKS 243                      /* DSM + 1 */
+#define DIR_ENTRIES 64                  /* DRM + 1 */
+#define DIR_BLOCKS 2                    /* AL0 */
+
+/* What's after the jump table, as offsets from the start of the BIOS. */
+#define DPH_OFFSET    0x40
+#define DPB_OFFSET    0x50
+#define DIRBUF_OFFSET 0x60
+#define CSV_OFFSET    0xe0
+#define ALV_OFFSET    0xf0
+
+const char *const bios_names[BIOS_ENTRIES] = {
+    "boot", "wboot", "const", "conin", "conout", "list", "punch", "reader",
+    "home", "seldsk", "settrk", "setsec", "setdma", "read", "write",
+    "listst", "sectran",
+};
+
+static const uint8_t dpb[15] = {
+    SECTORS, 0,                         /* SPT */
+    3, 7, 0,                            /* BSH, BLM, EXM */
+    BLOCKS - 1, 0,                      /* DSM */
+    DIR_ENTRIES - 1, 0,                 /* DRM */
+    0xc0, 0x00,                         /* AL0, AL1 */
+    DIR_ENTRIES / 4, 0,                 /* CKS */
+    RESERVED, 0,                        /* OFF */
+};
+
+static uint8_t disk[TRACKS * SECTORS * 128];
+static unsigned next_block = DIR_BLOCKS;
+static unsigned next_entry;
+
+static uint8_t *mem;
+static uint16_t ccp_addr, bdos_addr, bios_addr;
+static uint8_t *system_image;
+static uint16_t track, sector, dma;
+static enum bios_stop stopped;
+
+static uint8_t *block(unsigned n) {
+    return &disk[RESERVED * SECTORS * 128 + n * BLOCK_SIZE];
+}
+
+/* The name of the file on the disk: the host's, uppercased, without its
+ * directory; false if it isn't 8.3. */
+static bool disk_name(const char *filename, uint8_t name[11]) {
+    const char *base = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+    const char *dot = strchr(base, '.');
+    size_t length = dot ? (size_t) (dot - base) : strlen(base);
+    size_t ext = dot ? strlen(dot + 1) : 0;
+
+    if (!length || length > 8 || ext > 3 || (dot && strchr(dot + 1, '.')))
+        return false;
+    memset(name, ' ', 11);
+    for (size_t i=0; i<length; i++)
+        name[i] = toupper((unsigned char) base[i]);
+    for (size_t i=0; i<ext; i++)
+        name[8 + i] = toupper((unsigned char) dot[1 + i]);
+    return true;
+}
+
+/* The whole file, or NULL with a message; *length is set to its size. */
+static uint8_t *read_file(const char *filename, size_t *length) {
+    FILE *fp = fopen(filename, "rb");
+    uint8_t *data = NULL;
+    size_t room = 0, n;
+
+    *length = 0;
+    if (!fp) {
+        perror(filename);
+        return NULL;
+    }
+    do {
+        if (*length == room) {
+            room = room ? room * 2 : 65536;
+            if (!(data = realloc(data, room))) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+        n = fread(data + *length, 1, room - *length, fp);
+        *length += n;
+    } while (n);
+    if (ferror(fp)) {
+        perror(filename);
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    return data;
+}
+
+/* The file goes into consecutive blocks, with a directory entry for each
+ * 16K (EXM 0, so each is one logical extent); the last record is padded
+ * with ^Zs. */
+bool bios_add_file(const char *filename) {
+    uint8_t name[11];
+    uint8_t *data;
+    size_t length;
+    unsigned records, blocks, extents;
+
+    if (!disk_name(filename, name)) {
+        fprintf(stderr, "%s: not an 8.3 name\n", filename);
+        return false;
+    }
+    for (unsigned i=0; i<next_entry; i++)
+        if (!memcmp(&block(0)[i * 32 + 1], name, 11)) {
+            fprintf(stderr, "%s: already on the disk\n", filename);
+            return false;
+        }
+    if (!(data = read_file(filename, &length)))
+        return false;
+
+    records = (length + 127) / 128;
+    blocks = (records + 7) / 8;
+    extents = records ? (records + 127) / 128 : 1;
+    if (next_entry + extents > DIR_ENTRIES || next_block + blocks > BLOCKS) {
+        fprintf(stderr, "%s: the disk is full\n", filename);
+        free(data);
+        return false;
+    }
+
+    memset(block(next_block), 0x1a, blocks * BLOCK_SIZE);
+    memcpy(block(next_block), data, length);
+    free(data);
+
+    for (unsigned i=0; i<extents; i++) {
+        uint8_t *entry = &block(0)[next_entry++ * 32];
+        unsigned left = records - i * 128;
+
+        memset(entry, 0, 32);
+        memcpy(entry + 1, name, 11);
+        entry[12] = i & 0x1f;
+        entry[14] = i >> 5;
+        entry[15] = left < 128 ? left : 128;
+        for (unsigned j=0; j < (entry[15] + 7u) / 8; j++)
+            entry[16 + j] = next_block++;
+    }
+    return true;
+}
+
+/* Page zero, the DMA address and the current disk, and into the CCP. */
+static void go_cpm(struct i8080 *cpu) {
+    mem[0] = 0xc3;
+    mem[1] = (bios_addr + 3) & 0xff;
+    mem[2] = (bios_addr + 3) >> 8;
+    mem[5] = 0xc3;
+    mem[6] = (bdos_addr + 6) & 0xff;
+    mem[7] = (bdos_addr + 6) >> 8;
+    dma = 0x80;
+    cpu->c = mem[4];
+    cpu->sp = 0x80;
+    cpu->pc = ccp_addr;
+}
+
+static void transfer(struct i8080 *cpu, bool write) {
+    uint8_t *p;
+
+    if (track >= TRACKS || sector >= SECTORS) {
+        cpu->a = 1;
+        return;
+    }
+    p = &disk[(track * SECTORS + sector) * 128];
+    for (int i=0; i<128; i++) {
+        if (write)
+            p[i] = mem[(uint16_t) (dma + i)];
+        else
+            mem[(uint16_t) (dma + i)] = p[i];
+    }
+    cpu->a = 0;
+}
+
+static bool bios(struct i8080 *cpu, int entry) {
+    uint16_t bc = (cpu->b << 8) | cpu->c;
+    uint16_t hl = 0;
+    int c;
+
+    switch (entry) {
+    case 0:                     /* BOOT */
+        mem[3] = mem[4] = 0;
+        go_cpm(cpu);
+        break;
+    case 1:                     /* WBOOT */
+        memcpy(&mem[ccp_addr], system_image, bios_addr - ccp_addr);
+        go_cpm(cpu);
+        break;
+    case 2:                     /* CONST */
+        cpu->a = 0;
+        break;
+    case 3:                     /* CONIN */
+        fflush(stdout);
+        if ((c = getchar()) == EOF) {
+            stopped = BIOS_EOF;
+            return false;
+        }
+        cpu->a = c == '\n' ? '\r' : c;
+        break;
+    case 4:                     /* CONOUT */
+        putchar(cpu->c);
+        break;
+    case 7:                     /* READER */
+        cpu->a = 0x1a;
+        break;
+    case 8:                     /* HOME */
+        track = 0;
+        break;
+    case 9:                     /* SELDSK */
+        if (cpu->c == 0)
+            hl = bios_addr + DPH_OFFSET;
+        cpu->h = hl >> 8;
+        cpu->l = hl;
+        break;
+    case 10:                    /* SETTRK */
+        track = bc;
+        break;
+    case 11:                    /* SETSEC */
+        sector = bc;
+        break;
+    case 12:                    /* SETDMA */
+        dma = bc;
+        break;
+    case 13:                    /* READ */
+        transfer(cpu, false);
+        break;
+    case 14:                    /* WRITE */
+        transfer(cpu, true);
+        break;
+    case 15:                    /* LISTST */
+        cpu->a = 0xff;
+        break;
+    case 16:                    /* SECTRAN: no skew */
+        cpu->h = cpu->b;
+        cpu->l = cpu->c;
+        break;
+    default:                    /* LIST, PUNCH */
+        break;
+    }
+    return true;
+}
+
+static bool trap(struct i8080 *cpu) {
+    uint16_t at = cpu->pc - 1;
+    if (at >= bios_addr && at < bios_addr + BIOS_ENTRIES * 3 && (at - bios_addr) % 3 == 0)
+        return bios(cpu, (at - bios_addr) / 3);
+    stopped = BIOS_HALT;
+    return false;
+}
+
+void bios_init(struct i8080 *cpu, uint16_t ccp, uint16_t bdos, uint16_t bios) {
+    uint16_t dph = bios + DPH_OFFSET;
+
+    mem = cpu->mem;
+    ccp_addr = ccp;
+    bdos_addr = bdos;
+    bios_addr = bios;
+    stopped = BIOS_RUNNING;
+
+    system_image = malloc(bios - ccp);
+    if (!system_image) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memcpy(system_image, &mem[ccp], bios - ccp);
+
+    /* HLT; RET for each entry. */
+    for (int i=0; i<BIOS_ENTRIES; i++) {
+        mem[bios + i * 3] = 0x76;
+        mem[bios + i * 3 + 1] = 0xc9;
+        mem[bios + i * 3 + 2] = 0x00;
+    }
+
+    /* Disk parameter header: no skew table, the DPB, CSV and ALV. */
+    memcpy(&mem[bios + DPB_OFFSET], dpb, sizeof dpb);
+    memset(&mem[dph], 0, 16);
+    mem[dph + 8] = (bios + DIRBUF_OFFSET) & 0xff;
+    mem[dph + 9] = (bios + DIRBUF_OFFSET) >> 8;
+    mem[dph + 10] = (bios + DPB_OFFSET) & 0xff;
+    mem[dph + 11] = (bios + DPB_OFFSET) >> 8;
+    mem[dph + 12] = (bios + CSV_OFFSET) & 0xff;
+    mem[dph + 13] = (bios + CSV_OFFSET) >> 8;
+    mem[dph + 14] = (bios + ALV_OFFSET) & 0xff;
+    mem[dph + 15] = (bios + ALV_OFFSET) >> 8;
+
+    memset(disk, 0xe5, sizeof disk);
+    next_block = DIR_BLOCKS;
+    next_entry = 0;
+
+    cpu->trap = trap;
+}
+
+void bios_boot(struct i8080 *cpu) {
+    bios(cpu, 0);
+}
+
+enum bios_stop bios_stopped(void) {
+    return stopped;
+}
@@ -0,0 +1,34 @@
+/*
+ * ramdisk - a CP/M 2.2 BIOS with a RAM disk, done by the host
+ *
+ * See LICENSE for details.
+ */
+
+#pragma once
+#include <stdbool.h>
+#include "i8080.h"
+
+/* The BIOS's 17 entry points, in jump table order. */
+#define BIOS_ENTRIES 17
+extern const char *const bios_names[BIOS_ENTRIES];
+
+/* Why the run stopped. */
+enum bios_stop {
+    BIOS_RUNNING,
+    BIOS_EOF,                   /* console input ran out */
+    BIOS_HALT,                  /* an HLT which wasn't one of ours */
+};
+
+/* Builds the BIOS at bios in cpu's memory, keeping the CCP and BDOS,
+ * already loaded at ccp and bdos below it, to reload at each warm boot, and
+ * formats the disk. */
+extern void bios_init(struct i8080 *cpu, uint16_t ccp, uint16_t bdos, uint16_t bios);
+
+/* Copies a host file onto the disk, as user 0; false, with a message, if
+ * it can't. */
+extern bool bios_add_file(const char *filename);
+
+/* Cold boots: page zero, and on into the CCP, as drive A. */
+extern void bios_boot(struct i8080 *cpu);
+
+extern enum bios_stop bios_stopped(void);
@@ -4,71 +4,88 @@
  * Copyright (C) 2024 by Ivo van Poorten
  * See LICENSE for details.
  *
- * usage: genhex file.com [start address in hexadecimal] > output.hex
+ * The encoder, as a library (see genhex.h); the program is in main.c.
+ *
+ * The output is built in memory with a table of digit pairs.
  */
 
-#include <stdio.h>
-#define BUFSIZE 16
+#include <stdlib.h>
+#include <string.h>
+#include "genhex.h"
+
+static char hex2[256][2];
+
+static void init_hex2(void) {
+    static const char *hex = "0123456789ABCDEF";
 
-static char *hex = "0123456789ABCDEF";
+    for (int v=0; v<256; v++) {
+        hex2[v][0] = hex[v>>4];
+        hex2[v][1] = hex[v&0xf];
+    }
+}
 
 static char *printx(char *p, unsigned char v) {
-    *p++ = hex[v>>4];
-    *p++ = hex[v&0xf];
-    return p;
+    memcpy(p, hex2[v], 2);
+    return p + 2;
 }
 
-int main(int argc, char **argv) {
-    int addr, nbytes;
-    unsigned char buffer[BUFSIZE];
-    char line[80];
+/* Space for the records of one input, without the EOF record. */
+static size_t hex_size(const struct genhex_input *in, int reclen) {
+    size_t records = (in->size + reclen - 1) / reclen;
+    return records * 12 + in->size * 2;
+}
 
-    if (argc == 1) {
-        fprintf(stderr, "usage: genhex file.dat [start address in hex]\n");
-        return 1;
-    }
-    FILE *f = fopen(argv[1], "rb");
-    if (!f) {
-        fprintf(stderr, "error: unable to open %s\n", argv[1]);
-        return 1;
-    }
-    if (argc > 2) {
-        sscanf(argv[2], "%x", &addr);
-    }
-    if (addr > 0xffff) {
-addr_error:
-        fprintf(stderr, "error: address > 0xffff\n");
-        return 1;
-    }
+static char *encode(char *p, const struct genhex_input *in, int reclen) {
+    const unsigned char *data = in->data;
+    size_t left = in->size;
+    unsigned long addr = in->addr;
 
-    line[0] = ':';
-    line[7] = line[8] = '0';
+    while (left) {
+        int nbytes = left < (size_t) reclen ? (int) left : reclen;
+        unsigned char chk = nbytes + (addr>>8) + (addr&0xff);
 
-    puts("");
-    while ((nbytes = fread(buffer, 1, 16, f)) != 0) {
-        unsigned char chk = nbytes;
-        char *p = line+1;
+        *p++ = ':';
         p = printx(p, nbytes);
         p = printx(p, addr>>8);
         p = printx(p, addr);
-        chk += addr>>8;
-        chk += addr&0xff;
-        p += 2;
+        *p++ = '0';
+        *p++ = '0';
 
         for (int i=0; i<nbytes; i++) {
-            p = printx(p, buffer[i]);
-            chk += buffer[i];
+            p = printx(p, data[i]);
+            chk += data[i];
         }
 
         chk = ~chk + 1;
         p = printx(p, chk);
-        *p = 0;
-        puts(line);
+        *p++ = '\n';
 
+        data += nbytes;
         addr += nbytes;
-        if (addr > 0xffff) goto addr_error;
+        left -= nbytes;
     }
-    puts(":00000001FF");
-    putchar(26);            // CP/M EOF
+    return p;
 }
 
+static const char eof_record[] = ":00000001FF\n\032";   // CP/M EOF
+
+char *genhex(const struct genhex_input *in, int count, int reclen, size_t *size) {
+    char *buf, *p;
+
+    if (!hex2[0][0])
+        init_hex2();
+
+    *size = 1 + sizeof(eof_record) - 1;
+    for (int i=0; i<count; i++)
+        *size += hex_size(&in[i], reclen);
+    buf = malloc(*size);
+    if (!buf)
+        return NULL;
+
+    p = buf;
+    *p++ = '\n';
+    for (int i=0; i<count; i++)
+        p = encode(p, &in[i], reclen);
+    memcpy(p, eof_record, sizeof(eof_record) - 1);
+    return buf;
+}
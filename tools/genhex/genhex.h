@@ -0,0 +1,26 @@
+/*
+ * genhex.h - the Intel hex encoder in genhex.c, as a library (libgenhex.a)
+ *
+ * Copyright (C) 2024 by Ivo van Poorten
+ * See LICENSE for details.
+ */
+
+#ifndef GENHEX_H
+#define GENHEX_H
+
+#include <stddef.h>
+
+#define GENHEX_RECORD_LENGTH 16
+
+struct genhex_input {
+    const unsigned char *data;
+    size_t size;
+    unsigned long addr;         /* addr + size must not be beyond 64K */
+};
+
+/* Returns a hex file holding count inputs, one after the other, with
+ * records of reclen (1 to 255) bytes, or NULL if out of memory.  The caller
+ * frees it. */
+char *genhex(const struct genhex_input *in, int count, int reclen, size_t *size);
+
+#endif
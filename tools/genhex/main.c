@@ -0,0 +1,181 @@
+/*
+ * Very simple 'genhex'
+ *
+ * Copyright (C) 2024 by Ivo van Poorten
+ * See LICENSE for details.
+ *
+ * usage: genhex [-r N] [-o dir] file.com [start address in hexadecimal]
+ *               [file [address]]... > output.hex
+ *
+ * -r N    bytes per record, 1 to 255 (default 16)
+ * -o dir  write each file to dir/file.hex instead of all of them, one after
+ *         the other, to stdout
+ *
+ * An argument after a file which is all hex digits is taken as its start
+ * address; the default is 0.
+ *
+ * Each input is mapped, encoded with genhex() (see genhex.c) and written in
+ * one go.
+ */
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "genhex.h"
+
+static int reclen = GENHEX_RECORD_LENGTH;
+
+static int is_address(const char *s) {
+    if (!*s) return 0;
+    for (; *s; s++)
+        if (!isxdigit((unsigned char) *s)) return 0;
+    return 1;
+}
+
+static void open_input(const char *name, struct genhex_input *in) {
+    struct stat st;
+    int fd = open(name, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "error: unable to open %s\n", name);
+        exit(1);
+    }
+    in->size = st.st_size;
+    in->data = NULL;
+    if (in->size) {
+        in->data = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (in->data == MAP_FAILED) {
+            fprintf(stderr, "error: unable to read %s\n", name);
+            exit(1);
+        }
+    }
+    close(fd);
+
+    if (in->addr + in->size > 0x10000) {
+        fprintf(stderr, "error: address > 0xffff\n");
+        exit(1);
+    }
+}
+
+static void write_all(int fd, const char *name, const char *buf, size_t size) {
+    while (size) {
+        ssize_t n = write(fd, buf, size);
+        if (n <= 0) {
+            fprintf(stderr, "error: unable to write %s\n", name);
+            exit(1);
+        }
+        buf += n;
+        size -= n;
+    }
+}
+
+/* Writes the inputs as one hex file. */
+static void write_hex(int fd, const char *name, const struct genhex_input *in, int count) {
+    size_t size;
+    char *buf = genhex(in, count, reclen, &size);
+
+    if (!buf) {
+        fprintf(stderr, "error: out of memory\n");
+        exit(1);
+    }
+    write_all(fd, name, buf, size);
+    free(buf);
+}
+
+static char *output_name(const char *dir, const char *file) {
+    const char *base = strrchr(file, '/');
+    const char *dot;
+    size_t len;
+    char *name;
+
+    base = base ? base + 1 : file;
+    dot = strrchr(base, '.');
+    len = dot ? (size_t) (dot - base) : strlen(base);
+    name = malloc(strlen(dir) + len + 6);
+    if (!name) {
+        fprintf(stderr, "error: out of memory\n");
+        exit(1);
+    }
+    sprintf(name, "%s/%.*s.hex", dir, (int) len, base);
+    return name;
+}
+
+int main(int argc, char **argv) {
+    const char *outdir = NULL;
+    struct genhex_input *inputs;
+    const char **names;
+    int count = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "r:o:")) != -1) {
+        switch (c) {
+        case 'r':
+            reclen = atoi(optarg);
+            if (reclen < 1 || reclen > 255) {
+                fprintf(stderr, "error: record length must be 1 to 255\n");
+                return 1;
+            }
+            break;
+        case 'o':
+            outdir = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind == argc) {
+usage:
+        fprintf(stderr, "usage: genhex [-r N] [-o dir] file.dat [start address in hex] [file [address]]...\n");
+        return 1;
+    }
+
+    inputs = calloc(argc - optind, sizeof(struct genhex_input));
+    names = calloc(argc - optind, sizeof(char *));
+    if (!inputs || !names) {
+        fprintf(stderr, "error: out of memory\n");
+        return 1;
+    }
+    for (int i=optind; i<argc; i++) {
+        struct genhex_input *in = &inputs[count];
+
+        names[count++] = argv[i];
+        if (i+1 < argc && is_address(argv[i+1])) {
+            in->addr = strtoul(argv[++i], NULL, 16);
+            if (in->addr > 0xffff) {
+                fprintf(stderr, "error: address > 0xffff\n");
+                return 1;
+            }
+        }
+    }
+
+    for (int i=0; i<count; i++)
+        open_input(names[i], &inputs[i]);
+
+    if (!outdir) {
+        write_hex(1, "stdout", inputs, count);
+        return 0;
+    }
+
+    for (int i=0; i<count; i++) {
+        char *name = output_name(outdir, names[i]);
+        int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+        if (fd < 0) {
+            fprintf(stderr, "error: unable to create %s\n", name);
+            return 1;
+        }
+        write_hex(fd, name, &inputs[i], 1);
+        if (close(fd) < 0) {
+            fprintf(stderr, "error: unable to write %s\n", name);
+            return 1;
+        }
+        free(name);
+    }
+    return 0;
+}
@@ -6,83 +6,152 @@
  * Copyright © 2024 Ivo van Poorten
  * See LICENSE for details.
  *
- * usage: ./genprlmap in1.com in2.com out.map
+ * The bitmap and file builder, as a library (see genprlmap.h); the program
+ * is in main.c.
  *
- * Assemble in1.com to 00000H
- * Assemble in2.com to 00100H
+ * Every byte which differs between the two images must be one more in the
+ * one at 0100H, i.e. the high byte of an address.
  */
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include "genprlmap.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
-static FILE *open_file(const char *filename, const char *mode) {
-    FILE *f = fopen(filename, mode);
-    if (!f) {
-        fprintf(stderr, "error: unable to open %s\n", filename);
-        exit(1);
+static unsigned char reversed[256];
+
+static void init_reversed(void) {
+    for (int v=0; v<256; v++)
+        for (int bit=0; bit<8; bit++)
+            if (v & (1 << bit))
+                reversed[v] |= 0x80 >> bit;
+}
+
+/* Sets the bits (first byte in the top bit) for len bytes starting at i. */
+static bool scalar_bits(const unsigned char *f, const unsigned char *g,
+                        unsigned char *map, size_t i, size_t len, size_t *bad) {
+    for (; len; len--, i++) {
+        if (f[i] != g[i]) {
+            if ((unsigned char) (f[i] + 1) != g[i]) {
+                *bad = i;
+                return false;
+            }
+            map[i/8] |= 0x80 >> (i%8);
+        }
     }
-    return f;
+    return true;
 }
 
-static int filesize(FILE *f) {
-    fseek(f, 0, SEEK_END);
-    int size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    return size;
+#ifdef __SSE2__
+/* Eight bitmap bytes from which of 64 bytes were the same (bit n for byte
+ * n): each byte's bits reversed, as the bitmap has the first in the top. */
+static void put_map64(unsigned char *map, uint64_t same) {
+    uint64_t m = ~same;
+    m = (m >> 1 & 0x5555555555555555ULL) | (m & 0x5555555555555555ULL) << 1;
+    m = (m >> 2 & 0x3333333333333333ULL) | (m & 0x3333333333333333ULL) << 2;
+    m = (m >> 4 & 0x0f0f0f0f0f0f0f0fULL) | (m & 0x0f0f0f0f0f0f0f0fULL) << 4;
+    memcpy(map, &m, 8);                         /* x86 is little endian */
 }
 
-static void output_bit(FILE *f, bool bit) {
-    static int mask = 0x80;
-    static int value = 0;
+/* Both map 64 bytes a step, up to the end or the first step with a byte
+ * that's neither the same nor one more, and return how far they got. */
+static size_t sse2_blocks(const unsigned char *f, const unsigned char *g,
+                          size_t size, unsigned char *map) {
+    const __m128i one = _mm_set1_epi8(1);
+    size_t i;
 
-    if (bit) {
-        value |= mask;
+    for (i=0; i + 64 <= size; i += 64) {
+        uint64_t same = 0, ok = 0;
+        for (int k=0; k<4; k++) {
+            __m128i a = _mm_loadu_si128((const __m128i *) (f + i + k * 16));
+            __m128i b = _mm_loadu_si128((const __m128i *) (g + i + k * 16));
+            __m128i eq = _mm_cmpeq_epi8(a, b);
+            same |= (uint64_t) _mm_movemask_epi8(eq) << (k * 16);
+            ok |= (uint64_t) _mm_movemask_epi8(_mm_or_si128(eq,
+                        _mm_cmpeq_epi8(_mm_add_epi8(a, one), b))) << (k * 16);
+        }
+        if (~ok)
+            break;
+        put_map64(map + i/8, same);
     }
+    return i;
+}
 
-    mask >>= 1;
+#ifdef __GNUC__
+#define HAVE_AVX2_BLOCKS
+__attribute__((target("avx2")))
+static size_t avx2_blocks(const unsigned char *f, const unsigned char *g,
+                          size_t size, unsigned char *map) {
+    const __m256i one = _mm256_set1_epi8(1);
+    size_t i;
 
-    if (!mask) {
-        fputc(value, f);
-        value = 0;
-        mask = 0x80;
+    for (i=0; i + 64 <= size; i += 64) {
+        uint64_t same = 0, ok = 0;
+        for (int k=0; k<2; k++) {
+            __m256i a = _mm256_loadu_si256((const __m256i *) (f + i + k * 32));
+            __m256i b = _mm256_loadu_si256((const __m256i *) (g + i + k * 32));
+            __m256i eq = _mm256_cmpeq_epi8(a, b);
+            same |= (uint64_t) (uint32_t) _mm256_movemask_epi8(eq) << (k * 32);
+            ok |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(eq,
+                        _mm256_cmpeq_epi8(_mm256_add_epi8(a, one), b))) << (k * 32);
+        }
+        if (~ok)
+            break;
+        put_map64(map + i/8, same);
     }
+    return i;
 }
+#endif
+#endif
 
-int main(int argc, char **argv) {
-    if (argc != 4) {
-        fprintf(stderr, "usage: genprlmap in1.com in2.com out.map\n");
-        return 1;
-    }
-    FILE *f = open_file(argv[1], "rb");
-    FILE *g = open_file(argv[2], "rb");
-
-    int fsize = filesize(f);
-    int gsize = filesize(g);
+bool prl_bitmap(const unsigned char *f, const unsigned char *g,
+                size_t size, unsigned char *map, size_t *bad) {
+    size_t i = 0;
 
-    if (fsize != gsize) {
-        fprintf(stderr, "error: file size mismatch\n");
-        return 1;
-    }
+    memset(map, 0, PRL_BITMAP_SIZE(size));
+    if (!reversed[1])
+        init_reversed();
 
-    FILE *h = open_file(argv[3], "wb");
+#ifdef __SSE2__
+    /* AVX2 if the CPU has it, checked at run time so the binary still runs
+     * on one which hasn't. */
+#ifdef HAVE_AVX2_BLOCKS
+    if (__builtin_cpu_supports("avx2"))
+        i = avx2_blocks(f, g, size, map);
+    else
+#endif
+        i = sse2_blocks(f, g, size, map);
 
-    for (int i=0; i<fsize; i++) {
-        int a = fgetc(f);
-        int b = fgetc(g);
+    /* What's left, or the step with the bad byte in it. */
+    const __m128i one = _mm_set1_epi8(1);
 
-        if (a != b) {
-            output_bit(h, 1);
-        } else {
-            output_bit(h, 0);
-        }
-    }
+    for (; i + 16 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (f + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (g + i));
+        unsigned same = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+        unsigned ok = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(a, b),
+                            _mm_cmpeq_epi8(_mm_add_epi8(a, one), b)));
 
-    for (int i=0; i<fsize%8; i++) {
-        output_bit(h, 0);
+        if (ok != 0xffff)
+            return scalar_bits(f, g, map, i, 16, bad);  /* to find it */
+        map[i/8] = reversed[~same & 0xff];
+        map[i/8 + 1] = reversed[(~same >> 8) & 0xff];
     }
+#endif
+    return scalar_bits(f, g, map, i, size - i, bad);
+}
 
-    fclose(f);
-    fclose(g);
-    fclose(h);
+bool prl_file(const unsigned char *header, size_t hsize,
+              const unsigned char *at0, const unsigned char *at100,
+              size_t size, unsigned char *out, size_t *bad) {
+    memset(out, 0, PRL_HEADER_SIZE);
+    if (header && hsize)
+        memcpy(out, header, hsize);
+    out[1] = size & 0xff;
+    out[2] = size >> 8;
+    if (size)
+        memcpy(out + PRL_HEADER_SIZE, at0, size);
+    return prl_bitmap(at0, at100, size, out + PRL_HEADER_SIZE + size, bad);
 }
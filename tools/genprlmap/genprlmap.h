@@ -0,0 +1,33 @@
+/*
+ * genprlmap.h - the PRL bitmap builder in genprlmap.c, as a library
+ * (libgenprlmap.a)
+ *
+ * Copyright © 2024 Ivo van Poorten
+ * See LICENSE for details.
+ */
+
+#ifndef GENPRLMAP_H
+#define GENPRLMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PRL_HEADER_SIZE 256
+#define PRL_BITMAP_SIZE(size) (((size) + 7) / 8)
+#define PRL_FILE_SIZE(size) (PRL_HEADER_SIZE + (size) + PRL_BITMAP_SIZE(size))
+
+/* Sets a bit in map (PRL_BITMAP_SIZE(size) bytes) for every byte which
+ * differs between the images at 0000H and 0100H.  Returns false, with *bad
+ * set to its offset, if a byte differs by anything but one page. */
+bool prl_bitmap(const unsigned char *at0, const unsigned char *at100,
+                size_t size, unsigned char *map, size_t *bad);
+
+/* Lays out a .PRL (or .SPR) in out, which is PRL_FILE_SIZE(size) bytes: the
+ * header page, starting with hsize (up to 256) bytes of header if it isn't
+ * NULL and with the code length at bytes 1-2, then the code, then the
+ * bitmap.  size must be less than 64K.  Returns as prl_bitmap() does. */
+bool prl_file(const unsigned char *header, size_t hsize,
+              const unsigned char *at0, const unsigned char *at100,
+              size_t size, unsigned char *out, size_t *bad);
+
+#endif
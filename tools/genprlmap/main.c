@@ -0,0 +1,128 @@
+/*
+ * genprlmap - Generate PRL bitmap for CP/M 2.2 relocator
+ *
+ * Used by DDT.COM
+ *
+ * Copyright © 2024 Ivo van Poorten
+ * See LICENSE for details.
+ *
+ * usage: ./genprlmap [-p | -H header.com] in1.com in2.com out
+ *
+ * Assemble in1.com to 00000H
+ * Assemble in2.com to 00100H
+ *
+ * Without options, out is just the bitmap.  With -p it's a complete .PRL
+ * (or .SPR, which is laid out the same): a 256 byte header with the code
+ * length at bytes 1-2, the code from in1.com, then the bitmap.  -H does the
+ * same but starts the header page with header.com, as DDT's mover does.
+ *
+ * Both images are mapped and compared with prl_bitmap() (see genprlmap.c).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "genprlmap.h"
+
+static const unsigned char *map_file(const char *filename, size_t *size) {
+    struct stat st;
+    void *p = NULL;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "error: unable to open %s\n", filename);
+        exit(1);
+    }
+    *size = st.st_size;
+    if (*size) {
+        p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "error: unable to read %s\n", filename);
+            exit(1);
+        }
+    }
+    close(fd);
+    return p;
+}
+
+int main(int argc, char **argv) {
+    const char *header_name = NULL;
+    bool prl = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "pH:")) != -1) {
+        switch (c) {
+        case 'p':
+            prl = true;
+            break;
+        case 'H':
+            prl = true;
+            header_name = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != 3) {
+usage:
+        fprintf(stderr, "usage: genprlmap [-p | -H header.com] in1.com in2.com out\n");
+        return 1;
+    }
+
+    size_t fsize, gsize;
+    const unsigned char *f = map_file(argv[optind], &fsize);
+    const unsigned char *g = map_file(argv[optind+1], &gsize);
+
+    if (fsize != gsize) {
+        fprintf(stderr, "error: file size mismatch\n");
+        return 1;
+    }
+    if (prl && fsize > 0xffff) {
+        fprintf(stderr, "error: %s is too big\n", argv[optind]);
+        return 1;
+    }
+
+    size_t total = prl ? PRL_FILE_SIZE(fsize) : PRL_BITMAP_SIZE(fsize);
+    unsigned char *out = malloc(total ? total : 1);
+    size_t bad;
+    bool ok;
+
+    if (!out) {
+        fprintf(stderr, "error: out of memory\n");
+        return 1;
+    }
+    if (prl) {
+        const unsigned char *h = NULL;
+        size_t hsize = 0;
+
+        if (header_name) {
+            h = map_file(header_name, &hsize);
+            if (hsize > PRL_HEADER_SIZE) {
+                fprintf(stderr, "error: %s is more than a page\n", header_name);
+                return 1;
+            }
+        }
+        ok = prl_file(h, hsize, f, g, fsize, out, &bad);
+    } else
+        ok = prl_bitmap(f, g, fsize, out, &bad);
+    if (!ok) {
+        fprintf(stderr, "error: byte %04zx is %02x and %02x, which is not one page apart\n",
+                bad, f[bad], g[bad]);
+        return 1;
+    }
+
+    int fd = open(argv[optind+2], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "error: unable to open %s\n", argv[optind+2]);
+        return 1;
+    }
+    if (write(fd, out, total) != (ssize_t) total || close(fd) < 0) {
+        fprintf(stderr, "error: unable to write %s\n", argv[optind+2]);
+        return 1;
+    }
+    return 0;
+}
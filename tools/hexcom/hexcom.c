@@ -1,118 +1,190 @@
-/*
- * load - convert a hex file to a com file
- *
- * Expanded to HEXCOM by John Elliott, 25-5-1998
- *
- * Compiles with gcc or Pacific C
- *
- */
-
-#include <stdio.h>
-#include <stdlib.h>
- 
-unsigned char   checksum;
-int L;
-
-FILE *fpout;
-
-unsigned char   getbyte () {
-    register int    c;
-    unsigned char   x;
-
-    c = getchar ();
-    if ('0' <= c && c <= '9')
-        x = c - '0';
-    else
-        if ('A' <= c && c <= 'F')
-            x = c - 'A' + 10;
-        else
-            goto funny;
-
-    x <<= 4;
-    c = getchar ();
-    if ('0' <= c && c <= '9')
-        x |= c - '0';
-    else
-        if ('A' <= c && c <= 'F')
-            x |= c - 'A' + 10;
-        else {
-    funny:
-            fprintf (stderr, "Funny hex letter %c\n", c);
-            exit (2);
-        }
-    checksum += x;
-    return x;
-}
-
-int main (int argc, char **argv) {
-    register unsigned   i, n;
-    char    c, buf[64];
-    unsigned    type;
-    unsigned int al, ah, addr = 0, naddr;
-
-        L = 0;
-        if (argc < 2) fpout = stdout;
-        else fpout = fopen(argv[1],"wb");
-    
-    do {
-        do {
-            c = getchar ();
-            if (c == EOF) {
-                fprintf (stderr, "Premature EOF colon missing\n");
-                exit (1);
-            }
-        } while (c != ':');
-
-        ++L;
-        checksum = 0;
-        n = getbyte ();         /* bytes / line */
-        ah = getbyte ();
-        al = getbyte ();
-
-        
-        switch (type = getbyte ()) 
-        {
-            case 0:
-                if (!n) /* MAC uses a line with no bytes as EOF */
-                {
-                        type = 1;
-                        break;
-                }
-                naddr = (ah << 8) | al;
-                if (!addr) addr = naddr;
-                else while (addr < naddr)  
-                {
-                        fwrite("", 1, 1, fpout);
-                        ++addr;
-                }
-                if (addr > naddr) 
-                {
-                        fprintf(stderr,"Line %d: Records out of sequence at %x > %x\n", L, naddr, addr);
-                        exit(1);
-                }
-
-                for (i = 0; i < n; i++)
-                    buf[i] = getbyte ();
-                fwrite (buf, 1, n, fpout);
-                break;
-
-                case 1:
-                break;
-                
-            default:
-                fprintf (stderr, "Line %d: Funny record type %d\n", L, type);
-                exit (1);
-        }
-
-        (void) getbyte ();
-        if (checksum != 0) 
-        {
-            fprintf (stderr, "Line %d: Checksum error", L);
-            exit (2);
-        }
-
-        addr += n;
-        
-    } while (type != 1);
-    exit(0);
-}
+/*
+ * load - convert a hex file to a com file
+ *
+ * Expanded to HEXCOM by John Elliott, 25-5-1998
+ *
+ * Compiles with gcc or Pacific C
+ *
+ * This is the loader itself, as a library (see hexcom.h); the program is
+ * in main.c.
+ *
+ * Each record is decoded and checksummed as a whole.  Records are loaded
+ * into a 64K image in whatever order they come, with a bitmap of which
+ * bytes (and, to skip empty space quickly, which pages) were loaded.
+ * Extended segment and linear address records (02, 04) are followed as long
+ * as the data stays within 64K; start address records (03, 05) are noted.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "hexcom.h"
+
+#define BAD 0x80                /* in hexval[], not a hex digit */
+
+static unsigned char hexval[256];
+
+void hex_init (struct hex_image *h) {
+    int c;
+
+    memset (h, 0, sizeof (*h));
+    h->low = 0x10000;
+
+    if (hexval[0] != BAD) {
+        memset (hexval, BAD, sizeof (hexval));
+        for (c = '0'; c <= '9'; c++)
+            hexval[c] = c - '0';
+        for (c = 'A'; c <= 'F'; c++)
+            hexval[c] = hexval[c - 'A' + 'a'] = c - 'A' + 10;
+    }
+}
+
+static void load (struct hex_image *h, unsigned long addr,
+                  const unsigned char *data, unsigned n) {
+    unsigned long a;
+
+    memcpy (h->data + addr, data, n);
+    for (a = addr; a < addr + n; a++) {
+        h->loaded[a >> 3] |= 1 << (a & 7);
+        h->pages[a >> 11] |= 1 << ((a >> 8) & 7);
+    }
+    if (addr < h->low) h->low = addr;
+    if (addr + n > h->high) h->high = addr + n;
+}
+
+int hex_is_loaded (const struct hex_image *h, unsigned long a) {
+    return h->loaded[a >> 3] & (1 << (a & 7));
+}
+
+static int page_loaded (const struct hex_image *h, unsigned long a) {
+    return h->pages[a >> 11] & (1 << ((a >> 8) & 7));
+}
+
+void hex_report_ranges (const struct hex_image *h, FILE *fp) {
+    unsigned long a = h->low, start;
+
+    while (a < h->high) {
+        if (!page_loaded (h, a)) {
+            a = (a | 0xff) + 1;
+            continue;
+        }
+        if (!hex_is_loaded (h, a)) {
+            a++;
+            continue;
+        }
+        start = a;
+        while (a < h->high && hex_is_loaded (h, a))
+            a++;
+        fprintf (fp, "%04lX-%04lX %6lu bytes\n", start, a - 1, a - start);
+    }
+}
+
+/* Decodes count bytes from the hex digits at p. */
+static int decode (struct hex_image *h, const unsigned char *p,
+                   unsigned char *out, unsigned count) {
+    while (count--) {
+        unsigned char hi = hexval[p[0]];
+        unsigned char lo = hexval[p[1]];
+        if ((hi | lo) & BAD) {
+            sprintf (h->error, "Funny hex letter %c\n", (hi & BAD) ? p[0] : p[1]);
+            return 2;
+        }
+        *out++ = (hi << 4) | lo;
+        p += 2;
+    }
+    return 0;
+}
+
+static int truncated (struct hex_image *h) {
+    sprintf (h->error, "Line %d: Premature EOF in record\n", h->line);
+    return 1;
+}
+
+int hex_load (struct hex_image *h, const unsigned char *text, size_t length) {
+    const unsigned char *p = text, *end = text + length;
+    unsigned char rec[4 + 255 + 1];
+    unsigned char checksum;
+    unsigned i, n, type;
+    unsigned long ext = 0, addr;
+    int status;
+
+    do {
+        p = memchr (p, ':', end - p);
+        if (!p) {
+            strcpy (h->error, "Premature EOF colon missing\n");
+            return 1;
+        }
+        p++;
+
+        ++h->line;
+        if (end - p < 2)
+            return truncated (h);
+        if ((status = decode (h, p, rec, 1)) != 0)
+            return status;
+        n = rec[0];             /* bytes / line */
+        if ((size_t) (end - p) < 2 * (5 + n))
+            return truncated (h);
+        if ((status = decode (h, p + 2, rec + 1, 4 + n)) != 0)
+            return status;
+        p += 2 * (5 + n);
+
+        checksum = 0;
+        for (i = 0; i < 5 + n; i++)
+            checksum += rec[i];
+        if (checksum != 0) {
+            sprintf (h->error, "Line %d: Checksum error", h->line);
+            return 2;
+        }
+
+        type = rec[3];
+        if (type >= 2 && type <= 5 && n != ((type == 2 || type == 4) ? 2 : 4)) {
+            sprintf (h->error, "Line %d: Bad length %u for record type %d\n", h->line, n, type);
+            return 1;
+        }
+
+        switch (type) {
+            case 0:
+                if (!n) /* MAC uses a line with no bytes as EOF */
+                {
+                        type = 1;
+                        break;
+                }
+                addr = ext + ((rec[1] << 8) | rec[2]);
+                if (addr + n > sizeof (h->data)) {
+                    sprintf (h->error, "Line %d: Record at %lx is beyond 64K\n", h->line, addr);
+                    return 1;
+                }
+                load (h, addr, rec + 4, n);
+                break;
+
+            case 1:
+                break;
+
+            case 2:             /* extended segment address */
+                ext = ((unsigned long) rec[4] << 12) | (rec[5] << 4);
+                break;
+
+            case 3:             /* start segment address, CS:IP */
+                h->start = ((((unsigned long) rec[4] << 8) | rec[5]) << 4)
+                    + ((rec[6] << 8) | rec[7]);
+                h->have_start = 1;
+                break;
+
+            case 4:             /* extended linear address */
+                ext = ((unsigned long) rec[4] << 24) | ((unsigned long) rec[5] << 16);
+                break;
+
+            case 5:             /* start linear address */
+                h->start = ((unsigned long) rec[4] << 24) | ((unsigned long) rec[5] << 16)
+                    | (rec[6] << 8) | rec[7];
+                h->have_start = 1;
+                break;
+
+            default:
+                sprintf (h->error, "Line %d: Funny record type %d\n", h->line, type);
+                return 1;
+        }
+    } while (type != 1);
+
+    return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * hexcom.h - the Intel hex loader in hexcom.c, as a library (libhexcom.a)
+ *
+ * See LICENSE for details.
+ */
+
+#ifndef HEXCOM_H
+#define HEXCOM_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+struct hex_image {
+    unsigned char data[0x10000];
+    unsigned char loaded[0x10000 / 8];  /* a bit per byte */
+    unsigned char pages[0x100 / 8];     /* a bit per 256 byte page */
+    unsigned long low, high;            /* what was loaded; high is one past,
+                                           and low >= high if nothing was */
+    unsigned long start;                /* from a type 03 or 05 record */
+    int have_start;
+    int line;                           /* record being loaded */
+    char error[80];
+};
+
+void hex_init (struct hex_image *h);
+
+/* Loads every record up to the EOF record from length bytes of hex text.
+ * Returns 0, or the exit status hexcom gives for the error (with h->error
+ * saying what it was, exactly as hexcom prints it). */
+int hex_load (struct hex_image *h, const unsigned char *text, size_t length);
+
+int hex_is_loaded (const struct hex_image *h, unsigned long addr);
+
+/* Writes a line for each run of loaded bytes. */
+void hex_report_ranges (const struct hex_image *h, FILE *fp);
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * hexcom - convert a hex file to a com file
+ *
+ * See LICENSE for details.
+ *
+ * The input is taken in one go (mapped if it's a file, read in large blocks
+ * if it's a pipe) and loaded with hex_load() (see hexcom.c).  The output is
+ * everything from the lowest loaded address to the highest, gaps zeroed,
+ * written in one go.
+ *
+ * usage: hexcom [-r] [file.com] < file.hex
+ *
+ * -r reports the ranges which were loaded, on stderr.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "hexcom.h"
+
+#define BLOCKSIZE 65536
+
+struct hex_image hex;
+
+FILE *fpout;
+
+/* Maps standard input if it's a file, or reads it all if it isn't. */
+const unsigned char *read_input (size_t *length) {
+    struct stat st;
+    unsigned char *buf = NULL;
+    size_t size = 0, used = 0, n;
+
+    if (fstat (0, &st) == 0 && S_ISREG (st.st_mode) && st.st_size > 0) {
+        void *p = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, 0, 0);
+        if (p != MAP_FAILED) {
+            *length = st.st_size;
+            return p;
+        }
+    }
+
+    do {
+        if (size - used < BLOCKSIZE) {
+            size = size ? size * 2 : BLOCKSIZE;
+            buf = realloc (buf, size);
+            if (!buf) {
+                fprintf (stderr, "Out of memory\n");
+                exit (1);
+            }
+        }
+        n = read (0, buf + used, size - used);
+        if (n == (size_t) -1) {
+            perror ("stdin");
+            exit (1);
+        }
+        used += n;
+    } while (n);
+
+    *length = used;
+    return buf;
+}
+
+int main (int argc, char **argv) {
+    const unsigned char *in;
+    size_t length;
+    int ranges = 0;
+    int status;
+
+    if (argc > 1 && strcmp (argv[1], "-r") == 0) {
+        ranges = 1;
+        argv++;
+        argc--;
+    }
+
+    if (argc < 2) fpout = stdout;
+    else fpout = fopen(argv[1],"wb");
+    if (!fpout) {
+        fprintf (stderr, "Cannot open %s\n", argv[1]);
+        exit (1);
+    }
+
+    hex_init (&hex);
+    in = read_input (&length);
+    status = hex_load (&hex, in, length);
+    if (status != 0) {
+        fputs (hex.error, stderr);
+        exit (status);
+    }
+
+    if (ranges) {
+        hex_report_ranges (&hex, stderr);
+        if (hex.have_start)
+            fprintf (stderr, "Start address %04lX\n", hex.start);
+    }
+
+    if (hex.high > hex.low
+        && fwrite (hex.data + hex.low, 1, hex.high - hex.low, fpout) != hex.high - hex.low) {
+        fprintf (stderr, "Error writing output\n");
+        exit (1);
+    }
+    if (fclose (fpout) != 0) {
+        fprintf (stderr, "Error writing output\n");
+        exit (1);
+    }
+    exit(0);
+}
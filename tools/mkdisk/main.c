@@ -0,0 +1,176 @@
+/*
+ * mkdisk - make a bootable CP/M 2.2 disk image
+ *
+ * See LICENSE for details.
+ *
+ * What SYSGEN and PIP would do on the machine, done on the host (see
+ * mkdisk.c): the cold start loader goes in the first sector, the system
+ * files after it, one after another, and the files into the directory, in
+ * the order given, each under its host name uppercased.
+ *
+ * usage: mkdisk [-f format] [-d spt,bsh,blm,exm,dsm,drm,off[,skew[,tracks]]]
+ *               [-b loader] [-s system]... [-u user] image [file...]
+ *
+ * The format is one of the disks the BIOSes in archive/ define (mds800 by
+ * default), or -d gives the DPB, with no skew and just enough tracks for
+ * DSM unless they're given too.  For the
+ * built system, -s ../bin/ccp.sys -s ../bin/bdos.sys -s bios.bin lays it
+ * out as BOOT-MDS-800.ASM loads it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mkdisk.h"
+
+struct input {
+    const uint8_t *data;
+    size_t length;
+};
+
+static const char *image_name;
+
+static void usage(void) {
+    fprintf(stderr, "usage: mkdisk [-f format] [-d spt,bsh,blm,exm,dsm,drm,off[,skew[,tracks]]]\n"
+            "              [-b loader] [-s system]... [-u user] image [file...]\n"
+            "formats:");
+    for (const struct diskdef *def = diskdefs; def->name; def++)
+        fprintf(stderr, " %s", def->name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+/* Maps the whole file; false, with a message, if it can't. */
+static bool map_input(const char *filename, struct input *in) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    void *p;
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(filename);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: not a file\n", filename);
+        close(fd);
+        return false;
+    }
+    in->length = st.st_size;
+    in->data = (const uint8_t *) "";
+    if (in->length) {
+        p = mmap(NULL, in->length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            perror(filename);
+            close(fd);
+            return false;
+        }
+        in->data = p;
+    }
+    close(fd);
+    return true;
+}
+
+/* Doesn't leave a half made image behind. */
+static void fail(void) {
+    if (image_name)
+        unlink(image_name);
+    exit(1);
+}
+
+static void unmap_input(struct input *in) {
+    if (in->length)
+        munmap((void *) in->data, in->length);
+}
+
+int main(int argc, char **argv) {
+    const char **systems = calloc(argc, sizeof *systems);
+    const char *loader = NULL;
+    const struct diskdef *format = &diskdefs[0];
+    struct diskdef def;
+    const char *dpb = NULL;
+    int system_count = 0;
+    unsigned user = 0;
+    struct layout layout;
+    struct disk disk;
+    struct input in;
+    size_t offset = 128;
+    char *end;
+    int i;
+
+    for (i=1; i<argc && argv[i][0] == '-'; i++) {
+        if (i + 1 >= argc)
+            usage();
+        if (!strcmp(argv[i], "-f")) {
+            if (!(format = diskdef_find(argv[++i]))) {
+                fprintf(stderr, "%s: no such format\n", argv[i]);
+                usage();
+            }
+        } else if (!strcmp(argv[i], "-d"))
+            dpb = argv[++i];
+        else if (!strcmp(argv[i], "-b"))
+            loader = argv[++i];
+        else if (!strcmp(argv[i], "-s"))
+            systems[system_count++] = argv[++i];
+        else if (!strcmp(argv[i], "-u")) {
+            user = strtoul(argv[++i], &end, 10);
+            if (*end || !*argv[i] || user > 15)
+                usage();
+        } else
+            usage();
+    }
+    if (i >= argc)
+        usage();
+
+    def = *format;
+    if (dpb) {
+        def = (struct diskdef) { .name = dpb, .first = 1 };
+        if (!diskdef_parse(dpb, &def)) {
+            fprintf(stderr, "%s: not spt,bsh,blm,exm,dsm,drm,off[,skew[,tracks]]\n", dpb);
+            return 1;
+        }
+    }
+    if (!layout_init(&layout, &def) || !disk_create(&disk, argv[i], &layout))
+        return 1;
+    image_name = argv[i];
+
+    if (loader) {
+        if (!map_input(loader, &in))
+            fail();
+        if (in.length > 128) {
+            fprintf(stderr, "%s: more than a sector\n", loader);
+            fail();
+        }
+        if (!disk_put_system(&disk, 0, in.data, in.length))
+            fail();
+        unmap_input(&in);
+    }
+    for (int j=0; j<system_count; j++) {
+        if (!map_input(systems[j], &in) || !disk_put_system(&disk, offset, in.data, in.length))
+            fail();
+        offset += in.length;
+        unmap_input(&in);
+    }
+
+    for (i++; i<argc; i++) {
+        uint8_t name[11];
+        if (!disk_name(argv[i], name)) {
+            fprintf(stderr, "%s: not an 8.3 name\n", argv[i]);
+            fail();
+        }
+        if (!map_input(argv[i], &in) || !disk_add_file(&disk, user, name, in.data, in.length))
+            fail();
+        unmap_input(&in);
+    }
+
+    if (!disk_close(&disk)) {
+        perror(image_name);
+        fail();
+    }
+    return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * mkdisk - CP/M 2.2 disk images, built on the host
+ *
+ * See LICENSE for details.
+ *
+ * An image is the disk's sectors in physical order, track by track, as
+ * they are on the medium (the usual raw image format).  The reserved
+ * tracks hold the cold start loader in their first sector and the system
+ * after it, unskewed, the way the loaders in archive/BOOT-*.ASM read them
+ * and SYSGEN (SKEW EQU 1) writes them.  The rest is the BDOS's: its
+ * logical sectors go through the skew table the BIOS's SECTRAN uses,
+ * worked out here as the DISKDEF macro does, so a file written here reads
+ * back through the BIOS.
+ *
+ * The image is built in place, in a mapped file: it's formatted, the
+ * system written, and each file copied into its blocks with its directory
+ * entries made as it goes, in the one pass.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "mkdisk.h"
+
+/* From the BIOSes in archive/: MDS-800's diskdef 0,1,26,6,1024,243,64,64,2
+ * (the IBM 3740 single density 8" disk), which is also CCS-2422's DP8S0,
+ * and CCS-2422's 5" DP5S0. */
+const struct diskdef diskdefs[] = {
+    { "mds800",  26, 3, 7, 0, 242, 63, 2, 6, 77, 1 },
+    { "ccs2422", 26, 3, 7, 0, 242, 63, 2, 6, 77, 1 },
+    { "ccs2422-5", 18, 3, 7, 0, 71, 63, 3, 4, 35, 1 },
+    { NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+};
+
+const struct diskdef *diskdef_find(const char *name) {
+    for (const struct diskdef *def = diskdefs; def->name; def++)
+        if (!strcmp(def->name, name))
+            return def;
+    return NULL;
+}
+
+bool diskdef_parse(const char *text, struct diskdef *def) {
+    unsigned *fields[] = {
+        &def->spt, &def->bsh, &def->blm, &def->exm, &def->dsm, &def->drm,
+        &def->off, &def->skew, &def->tracks,
+    };
+    const char *p = text;
+    char *end;
+    size_t i;
+
+    for (i=0; i < sizeof fields / sizeof *fields; i++) {
+        unsigned long n = strtoul(p, &end, 0);
+        if (end == p || !isdigit((unsigned char) *p) || n > 0xffff)
+            return false;
+        *fields[i] = n;
+        if (!*end)
+            break;
+        if (*end != ',')
+            return false;
+        p = end + 1;
+    }
+    /* The first seven are the DPB; skew and tracks may be left as were. */
+    return i >= 6 && i < sizeof fields / sizeof *fields;
+}
+
+static bool bad(const struct diskdef *def, const char *what) {
+    fprintf(stderr, "%s: %s\n", def->name ? def->name : "disk", what);
+    return false;
+}
+
+bool layout_init(struct layout *l, const struct diskdef *def) {
+    unsigned base = 0, next = 0, exm;
+    size_t data;
+
+    memset(l, 0, sizeof *l);
+    l->def = *def;
+    if (def->spt < 1 || def->spt > MAX_SPT)
+        return bad(def, "SPT out of range");
+    if (def->bsh < 3 || def->bsh > 7 || def->blm != (1u << def->bsh) - 1)
+        return bad(def, "BSH and BLM don't go together");
+    l->block_size = 128 << def->bsh;
+
+    /* What the BDOS wants: each directory entry 16 blocks or 8, and so a
+     * logical extent (16K) for each 16K it maps, less one. */
+    exm = def->dsm < 256 ? l->block_size / 1024 : l->block_size / 2048;
+    if (!exm || def->exm != exm - 1)
+        return bad(def, "EXM doesn't go with BSH and DSM");
+    if (def->dsm > 0xfffe)
+        return bad(def, "DSM out of range");
+    l->dir_blocks = ((def->drm + 1) * 32 + l->block_size - 1) / l->block_size;
+    if (l->dir_blocks > 16 || l->dir_blocks > def->dsm)
+        return bad(def, "DRM too big for the blocks");
+    if (def->skew >= def->spt || def->first > 255 || def->first + def->spt > 256)
+        return bad(def, "skew or first sector out of range");
+
+    l->track_size = def->spt * 128;
+    data = (size_t) (def->dsm + 1) * l->block_size;
+    if (!l->def.tracks)
+        l->def.tracks = def->off + (data + l->track_size - 1) / l->track_size;
+    if ((l->def.tracks - def->off) * l->track_size < data || l->def.tracks < def->off)
+        return bad(def, "too few tracks for DSM");
+    l->size = l->def.tracks * l->track_size;
+
+    /* As DISKDEF's skew table: every skew'th sector, round the track, and
+     * on to the next one each time it gets back to where it started. */
+    for (unsigned i=0; i<def->spt; i++) {
+        unsigned skew = def->skew ? def->skew : 1;
+        l->xlt[i] = next + def->first;
+        l->sector_offset[i] = next * 128;
+        next += skew;
+        if (next >= def->spt) {
+            next -= def->spt;
+            if (next == base)
+                next = ++base;
+        }
+    }
+    return true;
+}
+
+bool disk_name(const char *filename, uint8_t name[11]) {
+    const char *base = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+    const char *dot = strchr(base, '.');
+    size_t length = dot ? (size_t) (dot - base) : strlen(base);
+    size_t ext = dot ? strlen(dot + 1) : 0;
+
+    if (!length || length > 8 || ext > 3 || (dot && strchr(dot + 1, '.')))
+        return false;
+    memset(name, ' ', 11);
+    for (size_t i=0; i<length; i++)
+        name[i] = toupper((unsigned char) base[i]);
+    for (size_t i=0; i<ext; i++)
+        name[8 + i] = toupper((unsigned char) dot[1 + i]);
+    return true;
+}
+
+bool disk_create(struct disk *d, const char *filename, const struct layout *l) {
+    void *p;
+
+    d->layout = *l;
+    d->next_block = l->dir_blocks;
+    d->next_entry = 0;
+    d->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (d->fd < 0) {
+        perror(filename);
+        return false;
+    }
+    if (ftruncate(d->fd, l->size) < 0
+        || (p = mmap(NULL, l->size, PROT_READ | PROT_WRITE, MAP_SHARED, d->fd, 0)) == MAP_FAILED) {
+        perror(filename);
+        close(d->fd);
+        return false;
+    }
+    d->image = p;
+    memset(d->image, 0xe5, l->size);
+    return true;
+}
+
+bool disk_put_system(struct disk *d, size_t offset, const uint8_t *data, size_t length) {
+    if (offset + length > d->layout.def.off * d->layout.track_size) {
+        fprintf(stderr, "the system doesn't fit on %u reserved tracks\n", d->layout.def.off);
+        return false;
+    }
+    memcpy(d->image + offset, data, length);
+    return true;
+}
+
+/* Directory entry n, through the skew like the rest of the data area. */
+static uint8_t *dir_entry(struct disk *d, unsigned n) {
+    return d->image + layout_record(&d->layout, n / 4) + n % 4 * 32;
+}
+
+bool disk_add_file(struct disk *d, unsigned user, const uint8_t name[11],
+                   const uint8_t *data, size_t length) {
+    const struct layout *l = &d->layout;
+    unsigned per_block = l->block_size / 128;
+    bool wide = l->def.dsm > 255;
+    unsigned pointers = wide ? 8 : 16;
+    unsigned per_entry = (l->def.exm + 1) * 128;      /* records */
+    size_t records = (length + 127) / 128;
+    size_t blocks = (records + per_block - 1) / per_block;
+    size_t entries = records ? (records + per_entry - 1) / per_entry : 1;
+
+    for (unsigned i=0; i<d->next_entry; i++) {
+        uint8_t *e = dir_entry(d, i);
+        if (e[0] == user && !memcmp(e + 1, name, 11)) {
+            fprintf(stderr, "%.8s.%.3s: already on the disk\n", name, name + 8);
+            return false;
+        }
+    }
+    if (d->next_entry + entries > l->def.drm + 1
+        || d->next_block + blocks > l->def.dsm + 1) {
+        fprintf(stderr, "%.8s.%.3s: the disk is full\n", name, name + 8);
+        return false;
+    }
+
+    /* The data, a record at a time, since consecutive records needn't be
+     * next to each other in the image. */
+    for (size_t r=0; r<records; r++) {
+        uint8_t *p = d->image + layout_record(l, d->next_block * per_block + r);
+        size_t n = length - r * 128 < 128 ? length - r * 128 : 128;
+        memcpy(p, data + r * 128, n);
+        memset(p + n, 0x1a, 128 - n);
+    }
+
+    for (size_t i=0; i<entries; i++) {
+        uint8_t *e = dir_entry(d, d->next_entry++);
+        size_t left = records - i * per_entry;
+        unsigned n = left < per_entry ? left : per_entry;
+        unsigned extent = i * (l->def.exm + 1) + (n ? (n - 1) / 128 : 0);
+
+        memset(e, 0, 32);
+        e[0] = user;
+        memcpy(e + 1, name, 11);
+        e[12] = extent & 0x1f;
+        e[14] = extent >> 5;
+        e[15] = n ? n - (n - 1) / 128 * 128 : 0;
+        for (unsigned j=0; j < (n + per_block - 1) / per_block && j < pointers; j++) {
+            unsigned block = d->next_block++;
+            if (wide) {
+                e[16 + j * 2] = block & 0xff;
+                e[17 + j * 2] = block >> 8;
+            } else
+                e[16 + j] = block;
+        }
+    }
+    return true;
+}
+
+bool disk_close(struct disk *d) {
+    bool ok = munmap(d->image, d->layout.size) == 0;
+    ok = close(d->fd) == 0 && ok;
+    return ok;
+}
@@ -0,0 +1,84 @@
+/*
+ * mkdisk.h - CP/M 2.2 disk images, built on the host (libmkdisk.a)
+ *
+ * See LICENSE for details.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define MAX_SPT 256
+
+/* A disk as a BIOS describes it: the fields of its DPB that matter to the
+ * layout, its skew, and how many tracks the drive has. */
+struct diskdef {
+    const char *name;
+    unsigned spt;                       /* 128-byte sectors a track */
+    unsigned bsh, blm, exm;
+    unsigned dsm, drm;                  /* blocks and directory entries - 1 */
+    unsigned off;                       /* reserved (system) tracks */
+    unsigned skew;                      /* 0 for none */
+    unsigned tracks;                    /* 0 for just enough for DSM */
+    unsigned first;                     /* number of the first sector */
+};
+
+/* A definition with the sector translation worked out: where each
+ * logical sector of a track is, as an offset into the track. */
+struct layout {
+    struct diskdef def;
+    unsigned block_size;                /* 128 << bsh */
+    unsigned dir_blocks;                /* the bits in AL0, AL1 */
+    size_t track_size;
+    size_t size;                        /* of the image */
+    uint8_t xlt[MAX_SPT];               /* physical sector, as SECTRAN */
+    uint32_t sector_offset[MAX_SPT];
+};
+
+/* The built-in formats (see mkdisk.c), ending with one with no name. */
+extern const struct diskdef diskdefs[];
+
+extern const struct diskdef *diskdef_find(const char *name);
+
+/* Reads "spt,bsh,blm,exm,dsm,drm,off[,skew[,tracks]]" into def, leaving
+ * skew and tracks as they were if they aren't given. */
+extern bool diskdef_parse(const char *text, struct diskdef *def);
+
+/* Checks def and works out the layout; false, with a message, if the DPB
+ * is inconsistent or the disk can't hold it. */
+extern bool layout_init(struct layout *l, const struct diskdef *def);
+
+/* The 128-byte logical record of the data area (from the first track after
+ * the reserved ones), through the skew. */
+static inline size_t layout_record(const struct layout *l, unsigned record) {
+    return (l->def.off + record / l->def.spt) * l->track_size
+        + l->sector_offset[record % l->def.spt];
+}
+
+/* The host file name as a CP/M one, uppercased and without its directory;
+ * false if it isn't 8.3. */
+extern bool disk_name(const char *filename, uint8_t name[11]);
+
+struct disk {
+    struct layout layout;
+    uint8_t *image;
+    int fd;
+    unsigned next_block;
+    unsigned next_entry;
+};
+
+/* Creates the image file, mapped and formatted (all E5). */
+extern bool disk_create(struct disk *d, const char *filename, const struct layout *l);
+
+/* Writes length bytes to the reserved tracks at offset, in physical order,
+ * as the cold start loader reads them back (not through the skew). */
+extern bool disk_put_system(struct disk *d, size_t offset, const uint8_t *data, size_t length);
+
+/* Adds a file in the next free blocks, with its directory entries; the last
+ * record is padded with ^Zs. */
+extern bool disk_add_file(struct disk *d, unsigned user, const uint8_t name[11],
+                          const uint8_t *data, size_t length);
+
+/* Unmaps the image and closes it; false if it couldn't be written. */
+extern bool disk_close(struct disk *d);
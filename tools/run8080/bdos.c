@@ -0,0 +1,715 @@
+/*
+ * bdos - CP/M 2.2's BDOS and BIOS, done by the host
+ *
+ * See LICENSE for details.
+ *
+ * There's no BDOS or BIOS code in the machine: the entry at BDOS_ENTRY and
+ * each entry in the BIOS jump table is an HLT followed by a RET, and the
+ * trap does what the call asks and lets the RET return from it.  Page zero
+ * is set up as the CCP would leave it, so a program which jumps to 0 or
+ * returns to it ends the run.
+ *
+ * Files are the host's, in the current directory, whatever drive an FCB
+ * names.  A name matches a host file if it does ignoring case (new files
+ * are made lowercase), and names which aren't 8.3 aren't seen at all.  The
+ * guest's FCBs are copied in and out of an FCB (see ../asm/cpm.h), and the
+ * host files are kept open in a small table of them, keyed by name, so
+ * the FCB's position (extent, module, record) is all the guest needs to
+ * keep; a record is ((s2 * 32) + ex) * 128 + cr, as with EXM 0.
+ *
+ * The disk parameters reported are an MDS-800 single density disk's, so
+ * programs which work out free space (STAT) get sensible answers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "cpm.h"
+#include "bdos.h"
+
+#define FCB_SIZE 36             /* what the guest sees of an FCB */
+#define OPEN_FILES 16
+
+/* What's after the BDOS entry: the disk parameter header and the rest. */
+#define DPB_ADDR    0xfe10
+#define ALV_ADDR    0xfe20
+#define DPH_ADDR    0xfe40
+#define DIRBUF_ADDR 0xfe50
+#define CSV_ADDR    0xfed0
+
+static const uint8_t dpb[15] = {
+    26, 0,                      /* SPT */
+    3, 7, 0,                    /* BSH, BLM, EXM */
+    242, 0,                     /* DSM */
+    63, 0,                      /* DRM */
+    0xc0, 0x00,                 /* AL0, AL1 */
+    16, 0,                      /* CKS */
+    2, 0,                       /* OFF */
+};
+
+static uint8_t *mem;
+static uint16_t dma;
+static uint8_t current_disk;
+static uint8_t user_code;
+static enum bdos_stop stopped;
+
+/* Host files kept open, by name; fp is NULL in a free slot. */
+static FCB files[OPEN_FILES];
+static unsigned next_slot;
+
+/* The host directory, as it was when last read. */
+struct dir_entry {
+    uint8_t name[11];
+    char *host_name;
+    long records;
+};
+struct dir_list {
+    struct dir_entry *entries;
+    size_t count;
+};
+
+/* One for looking names up, and search first's, which search next goes
+ * on with whatever the program does to other files in between. */
+static struct dir_list dir, search_dir;
+static size_t search_index;
+static long search_extent;
+static uint8_t search_pattern[FCB_SIZE];
+
+static void get_fcb(uint16_t addr, FCB *fcb) {
+    uint8_t *p = (uint8_t *) fcb;
+    memset(fcb, 0, sizeof *fcb);
+    for (int i=0; i<FCB_SIZE; i++)
+        p[i] = mem[(uint16_t) (addr + i)];
+}
+
+static void put_fcb(uint16_t addr, const FCB *fcb) {
+    const uint8_t *p = (const uint8_t *) fcb;
+    for (int i=0; i<FCB_SIZE; i++)
+        mem[(uint16_t) (addr + i)] = p[i];
+}
+
+/* Converts a host file name to an FCB name; false if it isn't 8.3. */
+static bool host_to_fcb_name(const char *host, uint8_t name[11]) {
+    const char *dot = strchr(host, '.');
+    size_t base = dot ? (size_t) (dot - host) : strlen(host);
+    size_t ext = dot ? strlen(dot + 1) : 0;
+
+    if (!base || base > 8 || ext > 3 || (dot && strchr(dot + 1, '.')))
+        return false;
+    memset(name, ' ', 11);
+    for (size_t i=0; i<base; i++)
+        name[i] = toupper((unsigned char) host[i]);
+    for (size_t i=0; i<ext; i++)
+        name[8+i] = toupper((unsigned char) dot[1+i]);
+    for (int i=0; i<11; i++)
+        if (name[i] <= ' ' && name[i] != ' ')
+            return false;
+    return true;
+}
+
+/* The name a new file gets: lowercase, blanks dropped. */
+static char *fcb_to_host_name(const uint8_t name[11]) {
+    static char buf[13];
+    int j = 0;
+    for (int i=0; i<11; i++) {
+        if (i == 8 && name[8] != ' ')
+            buf[j++] = '.';
+        if (name[i] != ' ')
+            buf[j++] = tolower(name[i] & 0x7f);
+    }
+    buf[j] = 0;
+    return buf;
+}
+
+static bool name_matches(const uint8_t *pattern, const uint8_t name[11]) {
+    for (int i=0; i<11; i++)
+        if (pattern[i] != '?' && toupper(pattern[i] & 0x7f) != name[i])
+            return false;
+    return true;
+}
+
+static void free_dir(struct dir_list *list) {
+    for (size_t i=0; i<list->count; i++)
+        free(list->entries[i].host_name);
+    free(list->entries);
+    list->entries = NULL;
+    list->count = 0;
+}
+
+static void read_dir(struct dir_list *list) {
+    DIR *d = opendir(".");
+    struct dirent *de;
+    size_t size = 0;
+
+    free_dir(list);
+    if (!d)
+        return;
+    while ((de = readdir(d))) {
+        struct dir_entry e;
+        struct stat st;
+        if (!host_to_fcb_name(de->d_name, e.name))
+            continue;
+        if (stat(de->d_name, &st) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        e.records = (st.st_size + 127) / 128;
+        if (!(e.host_name = strdup(de->d_name)))
+            break;
+        if (list->count == size) {
+            size = size ? size * 2 : 64;
+            list->entries = realloc(list->entries, size * sizeof *list->entries);
+            if (!list->entries) {
+                perror("run8080");
+                exit(1);
+            }
+        }
+        list->entries[list->count++] = e;
+    }
+    closedir(d);
+}
+
+/* The host name of the first file the pattern matches, or NULL. */
+static const char *find_file(const uint8_t *pattern) {
+    read_dir(&dir);
+    for (size_t i=0; i<dir.count; i++)
+        if (name_matches(pattern, dir.entries[i].name))
+            return dir.entries[i].host_name;
+    return NULL;
+}
+
+static void forget_file(const uint8_t name[11]) {
+    for (int i=0; i<OPEN_FILES; i++) {
+        if (files[i].fp && !memcmp(files[i].f, name, 11)) {
+            fclose(files[i].fp);
+            files[i].fp = NULL;
+        }
+    }
+}
+
+/* The host file an FCB names, opened for update if it isn't already. */
+static FILE *file_for(const FCB *fcb) {
+    uint8_t name[11];
+    const char *host;
+    FCB *slot;
+
+    for (int i=0; i<11; i++)
+        name[i] = toupper(fcb->f[i] & 0x7f);
+    for (int i=0; i<OPEN_FILES; i++)
+        if (files[i].fp && !memcmp(files[i].f, name, 11))
+            return files[i].fp;
+
+    if (!(host = find_file(name)))
+        return NULL;
+    slot = &files[next_slot++ % OPEN_FILES];
+    if (slot->fp)
+        fclose(slot->fp);
+    memcpy(slot->f, name, 11);
+    if (!(slot->fp = fopen(host, "r+b")))
+        slot->fp = fopen(host, "rb");
+    return slot->fp;
+}
+
+static long file_records(FILE *fp) {
+    fseek(fp, 0, SEEK_END);
+    return (ftell(fp) + 127) / 128;
+}
+
+static long fcb_record(const FCB *fcb) {
+    return (((long) (fcb->s2 & 0x3f) * 32 + (fcb->ex & 0x1f)) * 128) + (fcb->cr & 0x7f);
+}
+
+static long random_record(const FCB *fcb) {
+    return fcb->r[0] | (fcb->r[1] << 8) | ((long) fcb->r[2] << 16);
+}
+
+/* Points the FCB at a record, with rc the records in its extent. */
+static void set_position(FCB *fcb, long record, long records) {
+    long extent = record / 128;
+    long in_extent = records - extent * 128;
+    fcb->cr = record % 128;
+    fcb->ex = extent % 32;
+    fcb->s2 = extent / 32;
+    fcb->rc = in_extent < 0 ? 0 : in_extent > 128 ? 128 : in_extent;
+}
+
+/* Fake allocation, so that programs which add up blocks get the size. */
+static void fill_allocation(FCB *fcb, long records) {
+    long blocks = (records - (fcb_record(fcb) & ~127L) + 7) / 8;
+    for (int i=0; i<16; i++)
+        fcb->d[i] = i < blocks ? 2 + (fcb->ex * 16 + i) % 241 : 0;
+}
+
+/* The record at the DMA address, which wraps round at 64K like the rest
+ * of the 8080's memory. */
+static void get_record(uint8_t record[128]) {
+    for (int i=0; i<128; i++)
+        record[i] = mem[(uint16_t) (dma + i)];
+}
+
+static void put_record(const uint8_t record[128]) {
+    for (int i=0; i<128; i++)
+        mem[(uint16_t) (dma + i)] = record[i];
+}
+
+static uint8_t read_record(FCB *fcb, long record) {
+    FILE *fp = file_for(fcb);
+    uint8_t buf[128];
+    long records;
+    size_t n;
+
+    if (!fp)
+        return 0xff;
+    records = file_records(fp);
+    set_position(fcb, record, records);
+    if (record >= records)
+        return record / 128 > (records - 1) / 128 ? 4 : 1;
+    fseek(fp, record * 128, SEEK_SET);
+    n = fread(buf, 1, 128, fp);
+    if (n < 128)
+        memset(buf + n, 0x1a, 128 - n);         /* CP/M pads the last record */
+    put_record(buf);
+    return 0;
+}
+
+static uint8_t write_record(FCB *fcb, long record) {
+    FILE *fp = file_for(fcb);
+    uint8_t buf[128];
+
+    if (!fp)
+        return 0xff;
+    get_record(buf);
+    fseek(fp, record * 128, SEEK_SET);
+    if (fwrite(buf, 128, 1, fp) != 1)
+        return 2;
+    set_position(fcb, record, file_records(fp));
+    return 0;
+}
+
+static uint8_t open_file(FCB *fcb) {
+    FILE *fp = file_for(fcb);
+    long records;
+    uint8_t cr = fcb->cr;
+
+    if (!fp)
+        return 0xff;
+    records = file_records(fp);
+    /* Like CP/M, open clears the module number and finds extent ex. */
+    fcb->s2 = 0;
+    set_position(fcb, (long) (fcb->ex & 0x1f) * 128, records);
+    fcb->cr = cr;
+    fill_allocation(fcb, records);
+    return 0;
+}
+
+static uint8_t make_file(FCB *fcb) {
+    uint8_t name[11];
+    const char *host;
+    FCB *slot;
+
+    for (int i=0; i<11; i++)
+        name[i] = toupper(fcb->f[i] & 0x7f);
+    forget_file(name);
+    slot = &files[next_slot++ % OPEN_FILES];
+    if (slot->fp)
+        fclose(slot->fp);
+    memcpy(slot->f, name, 11);
+    if (!(host = find_file(name)))
+        host = fcb_to_host_name(name);
+    if (!(slot->fp = fopen(host, "w+b")))
+        return 0xff;
+    fcb->ex = fcb->s2 = fcb->rc = 0;
+    memset(fcb->d, 0, 16);
+    return 0;
+}
+
+static uint8_t delete_files(const FCB *fcb) {
+    uint8_t result = 0xff;
+    read_dir(&dir);
+    for (size_t i=0; i<dir.count; i++) {
+        if (name_matches(fcb->f, dir.entries[i].name)) {
+            forget_file(dir.entries[i].name);
+            if (remove(dir.entries[i].host_name) == 0)
+                result = 0;
+        }
+    }
+    return result;
+}
+
+static uint8_t rename_file(const FCB *fcb, uint16_t addr) {
+    uint8_t to[11];
+    const char *from;
+    char *from_copy;
+    int failed;
+
+    for (int i=0; i<11; i++)
+        to[i] = toupper(mem[(uint16_t) (addr + 17 + i)] & 0x7f);
+    if (!(from = find_file(fcb->f)) || !(from_copy = strdup(from)))
+        return 0xff;
+    for (int i=0; i<OPEN_FILES; i++)
+        if (files[i].fp && name_matches(fcb->f, files[i].f)) {
+            fclose(files[i].fp);
+            files[i].fp = NULL;
+        }
+    failed = rename(from_copy, fcb_to_host_name(to));
+    free(from_copy);
+    return failed ? 0xff : 0;
+}
+
+/* Fills the DMA buffer with the next matching directory entry, one per
+ * extent, and returns its position in the "sector" (always 0). */
+static uint8_t search_next(void) {
+    const uint8_t *p = search_pattern;
+    while (search_index < search_dir.count) {
+        struct dir_entry *e = &search_dir.entries[search_index];
+        long extents = e->records ? (e->records + 127) / 128 : 1;
+        if (!name_matches(p + 1, e->name) || search_extent >= extents) {
+            search_index++;
+            search_extent = 0;
+            continue;
+        }
+
+        long extent = search_extent++;
+        if ((p[12] != '?' && (extent % 32) != (p[12] & 0x1f)) ||
+            (p[14] != '?' && (extent / 32) != (p[14] & 0x3f)))
+            continue;
+
+        FCB fcb;
+        memset(&fcb, 0, sizeof fcb);
+        memcpy(fcb.f, e->name, 11);
+        set_position(&fcb, extent * 128, e->records);
+        fill_allocation(&fcb, e->records);
+        fcb.dr = user_code;
+        fcb.cr = 0;
+        put_fcb(dma, &fcb);
+        for (int i=32; i<128; i++)
+            mem[(uint16_t) (dma + i)] = 0xe5;
+        return 0;
+    }
+    return 0xff;
+}
+
+static uint8_t search_first(uint16_t addr) {
+    for (int i=0; i<FCB_SIZE; i++)
+        search_pattern[i] = mem[(uint16_t) (addr + i)];
+    if (search_pattern[0] == '?')
+        memset(search_pattern + 12, '?', 3);
+    read_dir(&search_dir);
+    search_index = 0;
+    search_extent = 0;
+    return search_next();
+}
+
+/* Console input, with the run stopped at the end of it. */
+static int console_in(void) {
+    int c;
+    fflush(stdout);
+    if ((c = getchar()) == EOF) {
+        stopped = BDOS_EOF;
+        return -1;
+    }
+    return c == '\n' ? '\r' : c;
+}
+
+static void console_out(uint8_t c) {
+    putchar(c);
+}
+
+/* Function 10: reads a line into the buffer at addr, echoing it. */
+static bool read_buffer(uint16_t addr) {
+    uint8_t max = mem[addr];
+    uint8_t n = 0;
+    int c;
+
+    while ((c = console_in()) != '\r') {
+        if (c < 0) {
+            if (!n)
+                return false;
+            break;
+        }
+        if ((c == 8 || c == 0x7f) && n) {
+            n--;
+            continue;
+        }
+        if (n < max) {
+            mem[(uint16_t) (addr + 2 + n++)] = c;
+            console_out(c);
+        }
+    }
+    mem[(uint16_t) (addr + 1)] = n;
+    stopped = BDOS_RUNNING;
+    console_out('\r');
+    return true;
+}
+
+/* Returns false if the run is to stop. */
+static bool bdos(struct i8080 *cpu) {
+    uint16_t de = (cpu->d << 8) | cpu->e;
+    uint16_t result = 0;
+    int c;
+    FCB fcb;
+
+    get_fcb(de, &fcb);
+    switch (cpu->c) {
+    case 0:                     /* system reset */
+        stopped = BDOS_WBOOT;
+        return false;
+    case 1:                     /* console input */
+        if ((c = console_in()) < 0)
+            return false;
+        console_out(c);
+        result = c;
+        break;
+    case 2:                     /* console output */
+        console_out(cpu->e);
+        break;
+    case 3:                     /* reader input: there isn't one */
+        result = 0x1a;
+        break;
+    case 4:                     /* punch and list output go nowhere */
+    case 5:
+        break;
+    case 6:                     /* direct console I/O */
+        if (cpu->e == 0xff) {
+            if ((c = console_in()) < 0)
+                return false;
+            result = c;
+        } else if (cpu->e != 0xfe) {
+            console_out(cpu->e);
+        }
+        break;
+    case 7:                     /* get and set IOBYTE */
+        result = mem[3];
+        break;
+    case 8:
+        mem[3] = cpu->e;
+        break;
+    case 9:                     /* print string */
+        for (uint16_t p=de; mem[p] != '$'; p++)
+            console_out(mem[p]);
+        break;
+    case 10:                    /* read console buffer */
+        if (!read_buffer(de))
+            return false;
+        break;
+    case 11:                    /* console status: nothing's waiting */
+        break;
+    case 12:                    /* version: CP/M 2.2 */
+        result = 0x0022;
+        break;
+    case 13:                    /* reset disk system */
+        current_disk = 0;
+        dma = 0x80;
+        break;
+    case 14:                    /* select disk */
+        current_disk = cpu->e & 15;
+        break;
+    case 15:
+        result = open_file(&fcb);
+        put_fcb(de, &fcb);
+        break;
+    case 16:                    /* close */
+        if (file_for(&fcb))
+            fflush(file_for(&fcb));
+        else
+            result = 0xff;
+        break;
+    case 17:
+        result = search_first(de);
+        break;
+    case 18:
+        result = search_next();
+        break;
+    case 19:
+        result = delete_files(&fcb);
+        break;
+    case 20:
+        result = read_record(&fcb, fcb_record(&fcb));
+        if (result == 4)
+            result = 1;
+        if (!result)
+            set_position(&fcb, fcb_record(&fcb) + 1, file_records(file_for(&fcb)));
+        put_fcb(de, &fcb);
+        break;
+    case 21:
+        result = write_record(&fcb, fcb_record(&fcb));
+        if (!result)
+            set_position(&fcb, fcb_record(&fcb) + 1, file_records(file_for(&fcb)));
+        put_fcb(de, &fcb);
+        break;
+    case 22:
+        result = make_file(&fcb);
+        put_fcb(de, &fcb);
+        break;
+    case 23:
+        result = rename_file(&fcb, de);
+        break;
+    case 24:                    /* login vector: just A */
+        result = 1;
+        break;
+    case 25:
+        result = current_disk;
+        break;
+    case 26:
+        dma = de;
+        break;
+    case 27:
+        result = ALV_ADDR;
+        break;
+    case 28:                    /* write protect disk */
+    case 30:                    /* set file attributes */
+        break;
+    case 29:                    /* read-only vector */
+        break;
+    case 31:
+        result = DPB_ADDR;
+        break;
+    case 32:                    /* get or set user code */
+        if (cpu->e == 0xff)
+            result = user_code;
+        else
+            user_code = cpu->e & 15;
+        break;
+    case 33:                    /* read random */
+        if (fcb.r[2])
+            result = 6;
+        else
+            result = read_record(&fcb, random_record(&fcb));
+        put_fcb(de, &fcb);
+        break;
+    case 34:                    /* write random */
+    case 40:                    /* and with zero fill, which holes are */
+        if (fcb.r[2])
+            result = 6;
+        else
+            result = write_record(&fcb, random_record(&fcb));
+        put_fcb(de, &fcb);
+        break;
+    case 35:                    /* compute file size */
+        if (file_for(&fcb)) {
+            long records = file_records(file_for(&fcb));
+            fcb.r[0] = records;
+            fcb.r[1] = records >> 8;
+            fcb.r[2] = records >> 16;
+            put_fcb(de, &fcb);
+        }
+        break;
+    case 36:                    /* set random record */
+        fcb.r[0] = fcb_record(&fcb);
+        fcb.r[1] = fcb_record(&fcb) >> 8;
+        fcb.r[2] = fcb_record(&fcb) >> 16;
+        put_fcb(de, &fcb);
+        break;
+    case 37:                    /* reset drive */
+        break;
+    default:
+        result = 0xff;
+        break;
+    }
+
+    cpu->a = cpu->l = result;
+    cpu->b = cpu->h = result >> 8;
+    return true;
+}
+
+/* The BIOS entry points, for programs which call them directly. */
+static bool bios(struct i8080 *cpu, int entry) {
+    int c;
+    switch (entry) {
+    case 0:                     /* BOOT */
+    case 1:                     /* WBOOT */
+        stopped = BDOS_WBOOT;
+        return false;
+    case 2:                     /* CONST */
+        cpu->a = 0;
+        break;
+    case 3:                     /* CONIN */
+        if ((c = console_in()) < 0)
+            return false;
+        cpu->a = c;
+        break;
+    case 4:                     /* CONOUT */
+        console_out(cpu->c);
+        break;
+    case 7:                     /* READER */
+        cpu->a = 0x1a;
+        break;
+    case 8:                     /* HOME */
+        break;
+    case 9:                     /* SELDSK */
+        cpu->h = DPH_ADDR >> 8;
+        cpu->l = DPH_ADDR & 0xff;
+        break;
+    case 12:                    /* SETDMA */
+        dma = (cpu->b << 8) | cpu->c;
+        break;
+    case 13:                    /* READ and WRITE: there's no disk */
+    case 14:
+        cpu->a = 1;
+        break;
+    case 15:                    /* LISTST */
+        cpu->a = 0xff;
+        break;
+    case 16:                    /* SECTRAN: no skew */
+        cpu->h = cpu->b;
+        cpu->l = cpu->c;
+        break;
+    default:                    /* LIST, PUNCH, SETTRK, SETSEC */
+        break;
+    }
+    return true;
+}
+
+static bool trap(struct i8080 *cpu) {
+    uint16_t at = cpu->pc - 1;
+    if (at == BDOS_ENTRY)
+        return bdos(cpu);
+    if (at >= BIOS_BASE && at < BIOS_BASE + 17 * 3 && (at - BIOS_BASE) % 3 == 0)
+        return bios(cpu, (at - BIOS_BASE) / 3);
+    stopped = BDOS_HALT;
+    return false;
+}
+
+void bdos_init(struct i8080 *cpu) {
+    mem = cpu->mem;
+    dma = 0x80;
+    stopped = BDOS_RUNNING;
+
+    /* JMP WBOOT and JMP BDOS in page zero. */
+    mem[0] = 0xc3;
+    mem[1] = (BIOS_BASE + 3) & 0xff;
+    mem[2] = (BIOS_BASE + 3) >> 8;
+    mem[5] = 0xc3;
+    mem[6] = BDOS_ENTRY & 0xff;
+    mem[7] = BDOS_ENTRY >> 8;
+
+    /* HLT; RET for the BDOS and each BIOS entry. */
+    mem[BDOS_ENTRY] = 0x76;
+    mem[BDOS_ENTRY + 1] = 0xc9;
+    for (int i=0; i<17; i++) {
+        mem[BIOS_BASE + i * 3] = 0x76;
+        mem[BIOS_BASE + i * 3 + 1] = 0xc9;
+        mem[BIOS_BASE + i * 3 + 2] = 0x00;
+    }
+
+    /* Disk parameter header: no skew table, the DPB, CSV and ALV. */
+    memcpy(&mem[DPB_ADDR], dpb, sizeof dpb);
+    memset(&mem[ALV_ADDR], 0, 31);
+    mem[ALV_ADDR] = 0xc0;
+    memset(&mem[DPH_ADDR], 0, 16);
+    mem[DPH_ADDR + 8] = DIRBUF_ADDR & 0xff;
+    mem[DPH_ADDR + 9] = DIRBUF_ADDR >> 8;
+    mem[DPH_ADDR + 10] = DPB_ADDR & 0xff;
+    mem[DPH_ADDR + 11] = DPB_ADDR >> 8;
+    mem[DPH_ADDR + 12] = CSV_ADDR & 0xff;
+    mem[DPH_ADDR + 13] = CSV_ADDR >> 8;
+    mem[DPH_ADDR + 14] = ALV_ADDR & 0xff;
+    mem[DPH_ADDR + 15] = ALV_ADDR >> 8;
+
+    cpu->trap = trap;
+}
+
+enum bdos_stop bdos_stopped(void) {
+    return stopped;
+}
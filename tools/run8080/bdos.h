@@ -0,0 +1,25 @@
+/*
+ * bdos - CP/M 2.2's BDOS and BIOS, done by the host
+ *
+ * See LICENSE for details.
+ */
+
+#pragma once
+#include <stdbool.h>
+#include "i8080.h"
+
+/* Where the stubs go; the TPA is everything below BDOS_ENTRY. */
+#define BDOS_ENTRY 0xfe06
+#define BIOS_BASE  0xff00
+
+/* Why the run stopped. */
+enum bdos_stop {
+    BDOS_RUNNING,
+    BDOS_WBOOT,                 /* warm boot, system reset or a RET to 0 */
+    BDOS_EOF,                   /* console input ran out */
+    BDOS_HALT,                  /* an HLT which wasn't one of ours */
+};
+
+/* Builds page zero and the stubs in cpu's memory and hooks the trap. */
+extern void bdos_init(struct i8080 *cpu);
+extern enum bdos_stop bdos_stopped(void);
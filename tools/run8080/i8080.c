@@ -0,0 +1,488 @@
+/*
+ * i8080 - an Intel 8080 core
+ *
+ * See LICENSE for details.
+ *
+ * The instructions are dispatched with computed gotos (a GCC extension):
+ * each handler ends by jumping straight to the next one's, through a table
+ * indexed by opcode, which the host's branch predictor copes with far
+ * better than one shared switch.  The registers live in locals for the
+ * length of the run and are only written back to the struct at an HLT.
+ *
+ * The flags are kept as the 8080 pushes them.  Sign, zero and parity come
+ * from one table lookup on the result; carry and auxiliary carry are worked
+ * out from the operands, as the 8080 does (its AC after a subtraction is the
+ * carry out of bit 3 of the complemented addition, not a borrow, and ANA
+ * sets it from bit 3 of the operands).
+ */
+
+#include <stddef.h>
+#include "i8080.h"
+
+/* S, Z and P for each result, with bit 1, which always reads as 1. */
+static uint8_t szp[256];
+
+/* T-states by opcode; a conditional CALL or RET which is taken takes 6 more
+ * (HLT's are never counted, see halt: below). */
+const uint8_t i8080_cycles[256] = {
+     4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5,  7,  4,  /* 00 */
+     4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5,  7,  4,  /* 10 */
+     4, 10, 16,  5,  5,  5,  7,  4,  4, 10, 16,  5,  5,  5,  7,  4,  /* 20 */
+     4, 10, 13,  5, 10, 10, 10,  4,  4, 10, 13,  5,  5,  5,  7,  4,  /* 30 */
+     5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,  /* 40 */
+     5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,  /* 50 */
+     5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5,  /* 60 */
+     7,  7,  7,  7,  7,  7,  7,  7,  5,  5,  5,  5,  5,  5,  7,  5,  /* 70 */
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  /* 80 */
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  /* 90 */
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  /* A0 */
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  /* B0 */
+     5, 10, 10, 10, 11, 11,  7, 11,  5, 10, 10, 10, 11, 17,  7, 11,  /* C0 */
+     5, 10, 10, 10, 11, 11,  7, 11,  5, 10, 10, 10, 11, 17,  7, 11,  /* D0 */
+     5, 10, 10, 18, 11, 11,  7, 11,  5,  5, 10,  4, 11, 17,  7, 11,  /* E0 */
+     5, 10, 10,  4, 11, 11,  7, 11,  5,  5, 10,  4, 11, 17,  7, 11,  /* F0 */
+};
+
+static void init_tables(void) {
+    for (int i=0; i<256; i++) {
+        int bits = 0;
+        for (int j=0; j<8; j++)
+            bits += (i >> j) & 1;
+        szp[i] = (i & I8080_S) | (i ? 0 : I8080_Z) | ((bits & 1) ? 0 : I8080_P) | 0x02;
+    }
+}
+
+void i8080_reset(struct i8080 *cpu, uint8_t *mem) {
+    if (!szp[0])
+        init_tables();
+    cpu->a = cpu->b = cpu->c = cpu->d = cpu->e = cpu->h = cpu->l = 0;
+    cpu->f = 0x02;
+    cpu->sp = cpu->pc = 0;
+    cpu->inte = false;
+    cpu->mem = mem;
+    cpu->cycles = cpu->instructions = 0;
+    cpu->trap = NULL;
+    cpu->in = NULL;
+    cpu->out = NULL;
+    cpu->trace = NULL;
+    cpu->user = NULL;
+}
+
+uint16_t i8080_pop(struct i8080 *cpu) {
+    uint16_t v = cpu->mem[cpu->sp++];
+    return v | (cpu->mem[cpu->sp++] << 8);
+}
+
+void i8080_push(struct i8080 *cpu, uint16_t value) {
+    cpu->mem[--cpu->sp] = value >> 8;
+    cpu->mem[--cpu->sp] = value;
+}
+
+#define BC ((b << 8) | c)
+#define DE ((d << 8) | e)
+#define HL ((h << 8) | l)
+
+#define FETCH8() mem[pc++]
+#define FETCH16() (pc += 2, mem[(uint16_t) (pc - 2)] | (mem[(uint16_t) (pc - 1)] << 8))
+#define PUSH(v) do { mem[--sp] = (v) >> 8; mem[--sp] = (v); } while (0)
+#define POP(v) do { v = mem[sp++]; v |= mem[sp++] << 8; } while (0)
+
+#define DISPATCH() goto *table[mem[pc++]]
+#define NEXT(n) do { cycles += (n); instructions++; DISPATCH(); } while (0)
+
+#define JMP_IF(cond) do { addr = FETCH16(); if (cond) pc = addr; } while (0)
+#define CALL_IF(cond) do { \
+        addr = FETCH16(); \
+        if (cond) { PUSH(pc); pc = addr; NEXT(17); } \
+        NEXT(11); \
+    } while (0)
+#define RET_IF(cond) do { if (cond) { POP(pc); NEXT(11); } NEXT(5); } while (0)
+
+#define ADD(x, carry) do { \
+        v = (x); \
+        r = a + v + (carry); \
+        f = szp[r & 0xff] | ((a ^ v ^ r) & I8080_AC) | (r >> 8); \
+        a = r; \
+    } while (0)
+#define SUB(x, borrow) do { \
+        v = (x); \
+        r = a - v - (borrow); \
+        f = szp[r & 0xff] | (~(a ^ v ^ r) & I8080_AC) | ((r >> 8) & I8080_CY); \
+        a = r; \
+    } while (0)
+#define CMP(x) do { \
+        v = (x); \
+        r = a - v; \
+        f = szp[r & 0xff] | (~(a ^ v ^ r) & I8080_AC) | ((r >> 8) & I8080_CY); \
+    } while (0)
+#define ANA(x) do { v = (x); f = szp[a & v] | (((a | v) & 0x08) << 1); a &= v; } while (0)
+#define XRA(x) do { a ^= (x); f = szp[a]; } while (0)
+#define ORA(x) do { a |= (x); f = szp[a]; } while (0)
+#define INR(x) do { \
+        uint8_t *p_ = &(x); \
+        ++*p_; \
+        f = (f & I8080_CY) | szp[*p_] | ((*p_ & 0x0f) ? 0 : I8080_AC); \
+    } while (0)
+#define DCR(x) do { \
+        uint8_t *p_ = &(x); \
+        --*p_; \
+        f = (f & I8080_CY) | szp[*p_] | (((*p_ & 0x0f) == 0x0f) ? 0 : I8080_AC); \
+    } while (0)
+#define DAD(x) do { \
+        r = HL + (x); \
+        h = r >> 8; \
+        l = r; \
+        f = (f & ~I8080_CY) | (r >> 16); \
+    } while (0)
+#define XTHL() do { \
+        v = mem[sp]; mem[sp] = l; l = v; \
+        v = mem[(uint16_t) (sp + 1)]; mem[(uint16_t) (sp + 1)] = h; h = v; \
+    } while (0)
+
+/* Decimal adjust: add 6 to each digit which has overflowed or carried. */
+#define DAA() do { \
+        unsigned carry = f & I8080_CY; \
+        unsigned adjust = 0; \
+        if ((f & I8080_AC) || ((a & 0x0f) > 9)) \
+            adjust = 0x06; \
+        if (carry || (a > 0x99)) { \
+            adjust |= 0x60; \
+            carry = I8080_CY; \
+        } \
+        ADD(adjust, 0); \
+        f = (f & ~I8080_CY) | carry; \
+    } while (0)
+
+#define LOAD() do { \
+        a = cpu->a; f = cpu->f; b = cpu->b; c = cpu->c; \
+        d = cpu->d; e = cpu->e; h = cpu->h; l = cpu->l; \
+        sp = cpu->sp; pc = cpu->pc; inte = cpu->inte; \
+        cycles = cpu->cycles; instructions = cpu->instructions; \
+    } while (0)
+#define SAVE() do { \
+        cpu->a = a; cpu->f = f; cpu->b = b; cpu->c = c; \
+        cpu->d = d; cpu->e = e; cpu->h = h; cpu->l = l; \
+        cpu->sp = sp; cpu->pc = pc; cpu->inte = inte; \
+        cpu->cycles = cycles; cpu->instructions = instructions; \
+    } while (0)
+
+void i8080_run(struct i8080 *cpu) {
+    static const void *const dispatch[256] = {
+        &&op_00, &&op_01, &&op_02, &&op_03, &&op_04, &&op_05, &&op_06, &&op_07,
+        &&op_08, &&op_09, &&op_0a, &&op_0b, &&op_0c, &&op_0d, &&op_0e, &&op_0f,
+        &&op_10, &&op_11, &&op_12, &&op_13, &&op_14, &&op_15, &&op_16, &&op_17,
+        &&op_18, &&op_19, &&op_1a, &&op_1b, &&op_1c, &&op_1d, &&op_1e, &&op_1f,
+        &&op_20, &&op_21, &&op_22, &&op_23, &&op_24, &&op_25, &&op_26, &&op_27,
+        &&op_28, &&op_29, &&op_2a, &&op_2b, &&op_2c, &&op_2d, &&op_2e, &&op_2f,
+        &&op_30, &&op_31, &&op_32, &&op_33, &&op_34, &&op_35, &&op_36, &&op_37,
+        &&op_38, &&op_39, &&op_3a, &&op_3b, &&op_3c, &&op_3d, &&op_3e, &&op_3f,
+        &&op_40, &&op_41, &&op_42, &&op_43, &&op_44, &&op_45, &&op_46, &&op_47,
+        &&op_48, &&op_49, &&op_4a, &&op_4b, &&op_4c, &&op_4d, &&op_4e, &&op_4f,
+        &&op_50, &&op_51, &&op_52, &&op_53, &&op_54, &&op_55, &&op_56, &&op_57,
+        &&op_58, &&op_59, &&op_5a, &&op_5b, &&op_5c, &&op_5d, &&op_5e, &&op_5f,
+        &&op_60, &&op_61, &&op_62, &&op_63, &&op_64, &&op_65, &&op_66, &&op_67,
+        &&op_68, &&op_69, &&op_6a, &&op_6b, &&op_6c, &&op_6d, &&op_6e, &&op_6f,
+        &&op_70, &&op_71, &&op_72, &&op_73, &&op_74, &&op_75, &&op_76, &&op_77,
+        &&op_78, &&op_79, &&op_7a, &&op_7b, &&op_7c, &&op_7d, &&op_7e, &&op_7f,
+        &&op_80, &&op_81, &&op_82, &&op_83, &&op_84, &&op_85, &&op_86, &&op_87,
+        &&op_88, &&op_89, &&op_8a, &&op_8b, &&op_8c, &&op_8d, &&op_8e, &&op_8f,
+        &&op_90, &&op_91, &&op_92, &&op_93, &&op_94, &&op_95, &&op_96, &&op_97,
+        &&op_98, &&op_99, &&op_9a, &&op_9b, &&op_9c, &&op_9d, &&op_9e, &&op_9f,
+        &&op_a0, &&op_a1, &&op_a2, &&op_a3, &&op_a4, &&op_a5, &&op_a6, &&op_a7,
+        &&op_a8, &&op_a9, &&op_aa, &&op_ab, &&op_ac, &&op_ad, &&op_ae, &&op_af,
+        &&op_b0, &&op_b1, &&op_b2, &&op_b3, &&op_b4, &&op_b5, &&op_b6, &&op_b7,
+        &&op_b8, &&op_b9, &&op_ba, &&op_bb, &&op_bc, &&op_bd, &&op_be, &&op_bf,
+        &&op_c0, &&op_c1, &&op_c2, &&op_c3, &&op_c4, &&op_c5, &&op_c6, &&op_c7,
+        &&op_c8, &&op_c9, &&op_ca, &&op_cb, &&op_cc, &&op_cd, &&op_ce, &&op_cf,
+        &&op_d0, &&op_d1, &&op_d2, &&op_d3, &&op_d4, &&op_d5, &&op_d6, &&op_d7,
+        &&op_d8, &&op_d9, &&op_da, &&op_db, &&op_dc, &&op_dd, &&op_de, &&op_df,
+        &&op_e0, &&op_e1, &&op_e2, &&op_e3, &&op_e4, &&op_e5, &&op_e6, &&op_e7,
+        &&op_e8, &&op_e9, &&op_ea, &&op_eb, &&op_ec, &&op_ed, &&op_ee, &&op_ef,
+        &&op_f0, &&op_f1, &&op_f2, &&op_f3, &&op_f4, &&op_f5, &&op_f6, &&op_f7,
+        &&op_f8, &&op_f9, &&op_fa, &&op_fb, &&op_fc, &&op_fd, &&op_fe, &&op_ff,
+    };
+    /* With a trace hook, every opcode goes through traced: first. */
+    static const void *const tracing[256] = { [0 ... 255] = &&traced };
+    const void *const *table = cpu->trace ? tracing : dispatch;
+    uint8_t *mem = cpu->mem;
+    uint8_t a, f, b, c, d, e, h, l;
+    uint16_t sp, pc, addr;
+    unsigned v, r;
+    bool inte;
+    uint64_t cycles, instructions;
+
+    LOAD();
+    DISPATCH();
+
+    op_00:  /* NOP */      NEXT(4);
+    op_01:  /* LXI B */    c = FETCH8(); b = FETCH8(); NEXT(10);
+    op_02:  /* STAX B */   mem[BC] = a; NEXT(7);
+    op_03:  /* INX B */    if (!++c) b++; NEXT(5);
+    op_04:  /* INR B */    INR(b); NEXT(5);
+    op_05:  /* DCR B */    DCR(b); NEXT(5);
+    op_06:  /* MVI B */    b = FETCH8(); NEXT(7);
+    op_07:  /* RLC */      f = (f & ~I8080_CY) | (a >> 7); a = (a << 1) | (a >> 7); NEXT(4);
+    op_08:  /* NOP (undocumented) */ NEXT(4);
+    op_09:  /* DAD B */    DAD((b << 8) | c); NEXT(10);
+    op_0a:  /* LDAX B */   a = mem[BC]; NEXT(7);
+    op_0b:  /* DCX B */    if (!c--) b--; NEXT(5);
+    op_0c:  /* INR C */    INR(c); NEXT(5);
+    op_0d:  /* DCR C */    DCR(c); NEXT(5);
+    op_0e:  /* MVI C */    c = FETCH8(); NEXT(7);
+    op_0f:  /* RRC */      f = (f & ~I8080_CY) | (a & 1); a = (a >> 1) | (a << 7); NEXT(4);
+    op_10:  /* NOP (undocumented) */ NEXT(4);
+    op_11:  /* LXI D */    e = FETCH8(); d = FETCH8(); NEXT(10);
+    op_12:  /* STAX D */   mem[DE] = a; NEXT(7);
+    op_13:  /* INX D */    if (!++e) d++; NEXT(5);
+    op_14:  /* INR D */    INR(d); NEXT(5);
+    op_15:  /* DCR D */    DCR(d); NEXT(5);
+    op_16:  /* MVI D */    d = FETCH8(); NEXT(7);
+    op_17:  /* RAL */      v = a; a = (a << 1) | (f & I8080_CY); f = (f & ~I8080_CY) | (v >> 7); NEXT(4);
+    op_18:  /* NOP (undocumented) */ NEXT(4);
+    op_19:  /* DAD D */    DAD((d << 8) | e); NEXT(10);
+    op_1a:  /* LDAX D */   a = mem[DE]; NEXT(7);
+    op_1b:  /* DCX D */    if (!e--) d--; NEXT(5);
+    op_1c:  /* INR E */    INR(e); NEXT(5);
+    op_1d:  /* DCR E */    DCR(e); NEXT(5);
+    op_1e:  /* MVI E */    e = FETCH8(); NEXT(7);
+    op_1f:  /* RAR */      v = a & 1; a = (a >> 1) | (f << 7); f = (f & ~I8080_CY) | v; NEXT(4);
+    op_20:  /* NOP (undocumented) */ NEXT(4);
+    op_21:  /* LXI H */    l = FETCH8(); h = FETCH8(); NEXT(10);
+    op_22:  /* SHLD */     addr = FETCH16(); mem[addr] = l; mem[(uint16_t) (addr + 1)] = h; NEXT(16);
+    op_23:  /* INX H */    if (!++l) h++; NEXT(5);
+    op_24:  /* INR H */    INR(h); NEXT(5);
+    op_25:  /* DCR H */    DCR(h); NEXT(5);
+    op_26:  /* MVI H */    h = FETCH8(); NEXT(7);
+    op_27:  /* DAA */      DAA(); NEXT(4);
+    op_28:  /* NOP (undocumented) */ NEXT(4);
+    op_29:  /* DAD H */    DAD((h << 8) | l); NEXT(10);
+    op_2a:  /* LHLD */     addr = FETCH16(); l = mem[addr]; h = mem[(uint16_t) (addr + 1)]; NEXT(16);
+    op_2b:  /* DCX H */    if (!l--) h--; NEXT(5);
+    op_2c:  /* INR L */    INR(l); NEXT(5);
+    op_2d:  /* DCR L */    DCR(l); NEXT(5);
+    op_2e:  /* MVI L */    l = FETCH8(); NEXT(7);
+    op_2f:  /* CMA */      a = ~a; NEXT(4);
+    op_30:  /* NOP (undocumented) */ NEXT(4);
+    op_31:  /* LXI SP */   sp = FETCH16(); NEXT(10);
+    op_32:  /* STA */      mem[FETCH16()] = a; NEXT(13);
+    op_33:  /* INX SP */   sp++; NEXT(5);
+    op_34:  /* INR M */    INR(mem[HL]); NEXT(10);
+    op_35:  /* DCR M */    DCR(mem[HL]); NEXT(10);
+    op_36:  /* MVI M */    mem[HL] = FETCH8(); NEXT(10);
+    op_37:  /* STC */      f |= I8080_CY; NEXT(4);
+    op_38:  /* NOP (undocumented) */ NEXT(4);
+    op_39:  /* DAD SP */   DAD(sp); NEXT(10);
+    op_3a:  /* LDA */      a = mem[FETCH16()]; NEXT(13);
+    op_3b:  /* DCX SP */   sp--; NEXT(5);
+    op_3c:  /* INR A */    INR(a); NEXT(5);
+    op_3d:  /* DCR A */    DCR(a); NEXT(5);
+    op_3e:  /* MVI A */    a = FETCH8(); NEXT(7);
+    op_3f:  /* CMC */      f ^= I8080_CY; NEXT(4);
+    op_40:  /* MOV B,B */  NEXT(5);
+    op_41:  /* MOV B,C */  b = c; NEXT(5);
+    op_42:  /* MOV B,D */  b = d; NEXT(5);
+    op_43:  /* MOV B,E */  b = e; NEXT(5);
+    op_44:  /* MOV B,H */  b = h; NEXT(5);
+    op_45:  /* MOV B,L */  b = l; NEXT(5);
+    op_46:  /* MOV B,M */  b = mem[HL]; NEXT(7);
+    op_47:  /* MOV B,A */  b = a; NEXT(5);
+    op_48:  /* MOV C,B */  c = b; NEXT(5);
+    op_49:  /* MOV C,C */  NEXT(5);
+    op_4a:  /* MOV C,D */  c = d; NEXT(5);
+    op_4b:  /* MOV C,E */  c = e; NEXT(5);
+    op_4c:  /* MOV C,H */  c = h; NEXT(5);
+    op_4d:  /* MOV C,L */  c = l; NEXT(5);
+    op_4e:  /* MOV C,M */  c = mem[HL]; NEXT(7);
+    op_4f:  /* MOV C,A */  c = a; NEXT(5);
+    op_50:  /* MOV D,B */  d = b; NEXT(5);
+    op_51:  /* MOV D,C */  d = c; NEXT(5);
+    op_52:  /* MOV D,D */  NEXT(5);
+    op_53:  /* MOV D,E */  d = e; NEXT(5);
+    op_54:  /* MOV D,H */  d = h; NEXT(5);
+    op_55:  /* MOV D,L */  d = l; NEXT(5);
+    op_56:  /* MOV D,M */  d = mem[HL]; NEXT(7);
+    op_57:  /* MOV D,A */  d = a; NEXT(5);
+    op_58:  /* MOV E,B */  e = b; NEXT(5);
+    op_59:  /* MOV E,C */  e = c; NEXT(5);
+    op_5a:  /* MOV E,D */  e = d; NEXT(5);
+    op_5b:  /* MOV E,E */  NEXT(5);
+    op_5c:  /* MOV E,H */  e = h; NEXT(5);
+    op_5d:  /* MOV E,L */  e = l; NEXT(5);
+    op_5e:  /* MOV E,M */  e = mem[HL]; NEXT(7);
+    op_5f:  /* MOV E,A */  e = a; NEXT(5);
+    op_60:  /* MOV H,B */  h = b; NEXT(5);
+    op_61:  /* MOV H,C */  h = c; NEXT(5);
+    op_62:  /* MOV H,D */  h = d; NEXT(5);
+    op_63:  /* MOV H,E */  h = e; NEXT(5);
+    op_64:  /* MOV H,H */  NEXT(5);
+    op_65:  /* MOV H,L */  h = l; NEXT(5);
+    op_66:  /* MOV H,M */  h = mem[HL]; NEXT(7);
+    op_67:  /* MOV H,A */  h = a; NEXT(5);
+    op_68:  /* MOV L,B */  l = b; NEXT(5);
+    op_69:  /* MOV L,C */  l = c; NEXT(5);
+    op_6a:  /* MOV L,D */  l = d; NEXT(5);
+    op_6b:  /* MOV L,E */  l = e; NEXT(5);
+    op_6c:  /* MOV L,H */  l = h; NEXT(5);
+    op_6d:  /* MOV L,L */  NEXT(5);
+    op_6e:  /* MOV L,M */  l = mem[HL]; NEXT(7);
+    op_6f:  /* MOV L,A */  l = a; NEXT(5);
+    op_70:  /* MOV M,B */  mem[HL] = b; NEXT(7);
+    op_71:  /* MOV M,C */  mem[HL] = c; NEXT(7);
+    op_72:  /* MOV M,D */  mem[HL] = d; NEXT(7);
+    op_73:  /* MOV M,E */  mem[HL] = e; NEXT(7);
+    op_74:  /* MOV M,H */  mem[HL] = h; NEXT(7);
+    op_75:  /* MOV M,L */  mem[HL] = l; NEXT(7);
+    op_76:  /* HLT */      goto halt;
+    op_77:  /* MOV M,A */  mem[HL] = a; NEXT(7);
+    op_78:  /* MOV A,B */  a = b; NEXT(5);
+    op_79:  /* MOV A,C */  a = c; NEXT(5);
+    op_7a:  /* MOV A,D */  a = d; NEXT(5);
+    op_7b:  /* MOV A,E */  a = e; NEXT(5);
+    op_7c:  /* MOV A,H */  a = h; NEXT(5);
+    op_7d:  /* MOV A,L */  a = l; NEXT(5);
+    op_7e:  /* MOV A,M */  a = mem[HL]; NEXT(7);
+    op_7f:  /* MOV A,A */  NEXT(5);
+    op_80:  /* ADD B */    ADD(b, 0); NEXT(4);
+    op_81:  /* ADD C */    ADD(c, 0); NEXT(4);
+    op_82:  /* ADD D */    ADD(d, 0); NEXT(4);
+    op_83:  /* ADD E */    ADD(e, 0); NEXT(4);
+    op_84:  /* ADD H */    ADD(h, 0); NEXT(4);
+    op_85:  /* ADD L */    ADD(l, 0); NEXT(4);
+    op_86:  /* ADD M */    ADD(mem[HL], 0); NEXT(7);
+    op_87:  /* ADD A */    ADD(a, 0); NEXT(4);
+    op_88:  /* ADC B */    ADD(b, f & I8080_CY); NEXT(4);
+    op_89:  /* ADC C */    ADD(c, f & I8080_CY); NEXT(4);
+    op_8a:  /* ADC D */    ADD(d, f & I8080_CY); NEXT(4);
+    op_8b:  /* ADC E */    ADD(e, f & I8080_CY); NEXT(4);
+    op_8c:  /* ADC H */    ADD(h, f & I8080_CY); NEXT(4);
+    op_8d:  /* ADC L */    ADD(l, f & I8080_CY); NEXT(4);
+    op_8e:  /* ADC M */    ADD(mem[HL], f & I8080_CY); NEXT(7);
+    op_8f:  /* ADC A */    ADD(a, f & I8080_CY); NEXT(4);
+    op_90:  /* SUB B */    SUB(b, 0); NEXT(4);
+    op_91:  /* SUB C */    SUB(c, 0); NEXT(4);
+    op_92:  /* SUB D */    SUB(d, 0); NEXT(4);
+    op_93:  /* SUB E */    SUB(e, 0); NEXT(4);
+    op_94:  /* SUB H */    SUB(h, 0); NEXT(4);
+    op_95:  /* SUB L */    SUB(l, 0); NEXT(4);
+    op_96:  /* SUB M */    SUB(mem[HL], 0); NEXT(7);
+    op_97:  /* SUB A */    SUB(a, 0); NEXT(4);
+    op_98:  /* SBB B */    SUB(b, f & I8080_CY); NEXT(4);
+    op_99:  /* SBB C */    SUB(c, f & I8080_CY); NEXT(4);
+    op_9a:  /* SBB D */    SUB(d, f & I8080_CY); NEXT(4);
+    op_9b:  /* SBB E */    SUB(e, f & I8080_CY); NEXT(4);
+    op_9c:  /* SBB H */    SUB(h, f & I8080_CY); NEXT(4);
+    op_9d:  /* SBB L */    SUB(l, f & I8080_CY); NEXT(4);
+    op_9e:  /* SBB M */    SUB(mem[HL], f & I8080_CY); NEXT(7);
+    op_9f:  /* SBB A */    SUB(a, f & I8080_CY); NEXT(4);
+    op_a0:  /* ANA B */    ANA(b); NEXT(4);
+    op_a1:  /* ANA C */    ANA(c); NEXT(4);
+    op_a2:  /* ANA D */    ANA(d); NEXT(4);
+    op_a3:  /* ANA E */    ANA(e); NEXT(4);
+    op_a4:  /* ANA H */    ANA(h); NEXT(4);
+    op_a5:  /* ANA L */    ANA(l); NEXT(4);
+    op_a6:  /* ANA M */    ANA(mem[HL]); NEXT(7);
+    op_a7:  /* ANA A */    ANA(a); NEXT(4);
+    op_a8:  /* XRA B */    XRA(b); NEXT(4);
+    op_a9:  /* XRA C */    XRA(c); NEXT(4);
+    op_aa:  /* XRA D */    XRA(d); NEXT(4);
+    op_ab:  /* XRA E */    XRA(e); NEXT(4);
+    op_ac:  /* XRA H */    XRA(h); NEXT(4);
+    op_ad:  /* XRA L */    XRA(l); NEXT(4);
+    op_ae:  /* XRA M */    XRA(mem[HL]); NEXT(7);
+    op_af:  /* XRA A */    XRA(a); NEXT(4);
+    op_b0:  /* ORA B */    ORA(b); NEXT(4);
+    op_b1:  /* ORA C */    ORA(c); NEXT(4);
+    op_b2:  /* ORA D */    ORA(d); NEXT(4);
+    op_b3:  /* ORA E */    ORA(e); NEXT(4);
+    op_b4:  /* ORA H */    ORA(h); NEXT(4);
+    op_b5:  /* ORA L */    ORA(l); NEXT(4);
+    op_b6:  /* ORA M */    ORA(mem[HL]); NEXT(7);
+    op_b7:  /* ORA A */    ORA(a); NEXT(4);
+    op_b8:  /* CMP B */    CMP(b); NEXT(4);
+    op_b9:  /* CMP C */    CMP(c); NEXT(4);
+    op_ba:  /* CMP D */    CMP(d); NEXT(4);
+    op_bb:  /* CMP E */    CMP(e); NEXT(4);
+    op_bc:  /* CMP H */    CMP(h); NEXT(4);
+    op_bd:  /* CMP L */    CMP(l); NEXT(4);
+    op_be:  /* CMP M */    CMP(mem[HL]); NEXT(7);
+    op_bf:  /* CMP A */    CMP(a); NEXT(4);
+    op_c0:  /* RNZ */      RET_IF(!(f & I8080_Z));
+    op_c1:  /* POP B */    c = mem[sp++]; b = mem[sp++]; NEXT(10);
+    op_c2:  /* JNZ */      JMP_IF(!(f & I8080_Z)); NEXT(10);
+    op_c3:  /* JMP */      pc = FETCH16(); NEXT(10);
+    op_c4:  /* CNZ */      CALL_IF(!(f & I8080_Z));
+    op_c5:  /* PUSH B */   mem[--sp] = b; mem[--sp] = c; NEXT(11);
+    op_c6:  /* ADI */      ADD(FETCH8(), 0); NEXT(7);
+    op_c7:  /* RST 0 */    PUSH(pc); pc = 0; NEXT(11);
+    op_c8:  /* RZ */       RET_IF(f & I8080_Z);
+    op_c9:  /* RET */      POP(pc); NEXT(10);
+    op_ca:  /* JZ */       JMP_IF(f & I8080_Z); NEXT(10);
+    op_cb:  /* JMP (undocumented) */ pc = FETCH16(); NEXT(10);
+    op_cc:  /* CZ */       CALL_IF(f & I8080_Z);
+    op_cd:  /* CALL */     addr = FETCH16(); PUSH(pc); pc = addr; NEXT(17);
+    op_ce:  /* ACI */      ADD(FETCH8(), f & I8080_CY); NEXT(7);
+    op_cf:  /* RST 1 */    PUSH(pc); pc = 8; NEXT(11);
+    op_d0:  /* RNC */      RET_IF(!(f & I8080_CY));
+    op_d1:  /* POP D */    e = mem[sp++]; d = mem[sp++]; NEXT(10);
+    op_d2:  /* JNC */      JMP_IF(!(f & I8080_CY)); NEXT(10);
+    op_d3:  /* OUT */      v = FETCH8(); if (cpu->out) cpu->out(cpu, v, a); NEXT(10);
+    op_d4:  /* CNC */      CALL_IF(!(f & I8080_CY));
+    op_d5:  /* PUSH D */   mem[--sp] = d; mem[--sp] = e; NEXT(11);
+    op_d6:  /* SUI */      SUB(FETCH8(), 0); NEXT(7);
+    op_d7:  /* RST 2 */    PUSH(pc); pc = 16; NEXT(11);
+    op_d8:  /* RC */       RET_IF(f & I8080_CY);
+    op_d9:  /* RET (undocumented) */ POP(pc); NEXT(10);
+    op_da:  /* JC */       JMP_IF(f & I8080_CY); NEXT(10);
+    op_db:  /* IN */       v = FETCH8(); a = cpu->in ? cpu->in(cpu, v) : 0xff; NEXT(10);
+    op_dc:  /* CC */       CALL_IF(f & I8080_CY);
+    op_dd:  /* CALL (undocumented) */ addr = FETCH16(); PUSH(pc); pc = addr; NEXT(17);
+    op_de:  /* SBI */      SUB(FETCH8(), f & I8080_CY); NEXT(7);
+    op_df:  /* RST 3 */    PUSH(pc); pc = 24; NEXT(11);
+    op_e0:  /* RPO */      RET_IF(!(f & I8080_P));
+    op_e1:  /* POP H */    l = mem[sp++]; h = mem[sp++]; NEXT(10);
+    op_e2:  /* JPO */      JMP_IF(!(f & I8080_P)); NEXT(10);
+    op_e3:  /* XTHL */     XTHL(); NEXT(18);
+    op_e4:  /* CPO */      CALL_IF(!(f & I8080_P));
+    op_e5:  /* PUSH H */   mem[--sp] = h; mem[--sp] = l; NEXT(11);
+    op_e6:  /* ANI */      ANA(FETCH8()); NEXT(7);
+    op_e7:  /* RST 4 */    PUSH(pc); pc = 32; NEXT(11);
+    op_e8:  /* RPE */      RET_IF(f & I8080_P);
+    op_e9:  /* PCHL */     pc = HL; NEXT(5);
+    op_ea:  /* JPE */      JMP_IF(f & I8080_P); NEXT(10);
+    op_eb:  /* XCHG */     v = d; d = h; h = v; v = e; e = l; l = v; NEXT(4);
+    op_ec:  /* CPE */      CALL_IF(f & I8080_P);
+    op_ed:  /* CALL (undocumented) */ addr = FETCH16(); PUSH(pc); pc = addr; NEXT(17);
+    op_ee:  /* XRI */      XRA(FETCH8()); NEXT(7);
+    op_ef:  /* RST 5 */    PUSH(pc); pc = 40; NEXT(11);
+    op_f0:  /* RP */       RET_IF(!(f & I8080_S));
+    op_f1:  /* POP PSW */  f = (mem[sp++] & 0xd7) | 0x02; a = mem[sp++]; NEXT(10);
+    op_f2:  /* JP */       JMP_IF(!(f & I8080_S)); NEXT(10);
+    op_f3:  /* DI */       inte = false; NEXT(4);
+    op_f4:  /* CP */       CALL_IF(!(f & I8080_S));
+    op_f5:  /* PUSH PSW */ mem[--sp] = a; mem[--sp] = f; NEXT(11);
+    op_f6:  /* ORI */      ORA(FETCH8()); NEXT(7);
+    op_f7:  /* RST 6 */    PUSH(pc); pc = 48; NEXT(11);
+    op_f8:  /* RM */       RET_IF(f & I8080_S);
+    op_f9:  /* SPHL */     sp = HL; NEXT(5);
+    op_fa:  /* JM */       JMP_IF(f & I8080_S); NEXT(10);
+    op_fb:  /* EI */       inte = true; NEXT(4);
+    op_fc:  /* CM */       CALL_IF(f & I8080_S);
+    op_fd:  /* CALL (undocumented) */ addr = FETCH16(); PUSH(pc); pc = addr; NEXT(17);
+    op_fe:  /* CPI */      CMP(FETCH8()); NEXT(7);
+    op_ff:  /* RST 7 */    PUSH(pc); pc = 56; NEXT(11);
+
+traced:
+    pc--;
+    SAVE();
+    cpu->trace(cpu);
+    LOAD();
+    goto *dispatch[mem[pc++]];
+
+halt:
+    /* An HLT costs nothing when it's a trap which does the work. */
+    SAVE();
+    if (!cpu->trap || !cpu->trap(cpu))
+        return;
+    LOAD();
+    DISPATCH();
+}
@@ -0,0 +1,52 @@
+/*
+ * i8080 - an Intel 8080 core
+ *
+ * See LICENSE for details.
+ *
+ * The processor's state, and a loop which runs it until something stops it.
+ * The only way out of the loop is an HLT: the core calls the trap hook with
+ * the state written back, and that either services it (CP/M's BDOS and BIOS
+ * entry points are HLT instructions, see bdos.c) and says carry on, or says
+ * stop.  Without a hook, HLT just stops.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+/* The bits of the flag register. */
+#define I8080_S  0x80
+#define I8080_Z  0x40
+#define I8080_AC 0x10
+#define I8080_P  0x04
+#define I8080_CY 0x01
+
+struct i8080 {
+    uint8_t a, f, b, c, d, e, h, l;
+    uint16_t sp, pc;
+    bool inte;                  /* interrupts enabled (nothing uses it) */
+    uint8_t *mem;               /* 64K, and a byte for jit.c's words at FFFFH */
+
+    uint64_t cycles;            /* T-states */
+    uint64_t instructions;
+
+    /* Called at an HLT, with pc just past it; returns false to stop. */
+    bool (*trap)(struct i8080 *cpu);
+    /* I/O ports; without them IN reads 0FFH and OUT does nothing. */
+    uint8_t (*in)(struct i8080 *cpu, uint8_t port);
+    void (*out)(struct i8080 *cpu, uint8_t port, uint8_t value);
+    /* Called before each instruction, with pc at it, for a profiler; the
+     * core runs a good deal slower with it. */
+    void (*trace)(struct i8080 *cpu);
+    void *user;
+};
+
+extern void i8080_reset(struct i8080 *cpu, uint8_t *mem);
+extern void i8080_run(struct i8080 *cpu);
+
+/* T-states by opcode, for a conditional CALL or RET not taken. */
+extern const uint8_t i8080_cycles[256];
+
+/* Helpers for trap handlers. */
+extern uint16_t i8080_pop(struct i8080 *cpu);
+extern void i8080_push(struct i8080 *cpu, uint16_t value);
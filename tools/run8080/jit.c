@@ -0,0 +1,896 @@
+/*
+ * jit - run 8080 code translated to x86-64
+ *
+ * See LICENSE for details.
+ *
+ * Guest code is translated a block at a time, from an address up to the
+ * first unconditional transfer (or BLOCK_INSNS instructions), with the
+ * conditional ones as exits from the middle.  The host code for each block
+ * is kept in a table indexed by guest address, and an exit looks the next
+ * block up in it and jumps straight there, so the C side only sees misses,
+ * HLTs (the traps), IN and OUT, and stores into translated code.
+ *
+ * The 8080's registers stay in the x86's legacy byte registers: A in AL,
+ * the flags in AH, B and C in CH and CL, D and E in DH and DL, H and L in
+ * BH and BL, and SP in SI.  The upper halves of those registers are kept
+ * zero, so that RBP, the guest's memory, plus any of them is a guest byte
+ * (hence the extra byte after the 64K).  Nothing which touches AH, BH, CH
+ * or DH can have a REX prefix, so the rest of the state lives in R8-R15
+ * and is only used by instructions which don't: R10 and R11 are the
+ * instruction and T-state counts, R13 the block table and R14 the map of
+ * which guest bytes have been translated.
+ *
+ * The flags are lazy.  The 8080's flag byte is laid out as the x86's low
+ * flags are, so after the same operation LAHF gives it, except AC, which
+ * is the complement after a subtraction and is cleared or worked out
+ * separately after a logical operation; SAHF gives it back to a
+ * conditional jump or a carry in.  A backwards pass over the block finds
+ * the flags which are never looked at (every flag is, at an exit) and
+ * their LAHFs aren't emitted, and AC's fix-up is only done when something
+ * looks at it.
+ *
+ * A store into a byte which has been translated leaves the block, and the
+ * blocks on the page it hit are thrown away (DDT relocates itself).  Traps
+ * can write over code too (a BDOS read of an overlay), so after each one
+ * the pages with code on them are compared against what was translated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "jit.h"
+
+#if defined(__x86_64__)
+
+#include <cpuid.h>
+#include <sys/mman.h>
+
+#define CODE_SIZE (16 << 20)
+#define BLOCK_INSNS 64
+#define BLOCK_BYTES (BLOCK_INSNS * 3)
+#define INSN_CODE 192           /* more host code than any instruction needs */
+
+#define ALL_FLAGS (I8080_S | I8080_Z | I8080_AC | I8080_P | I8080_CY)
+#define M 6                     /* the register field for memory */
+
+enum exit_reason { EXIT_LOOKUP, EXIT_HALT, EXIT_IO, EXIT_SMC };
+
+/* What's still to be done to AC in AH before anything looks at it. */
+enum fixup { FIXUP_NONE, FIXUP_FLIP, FIXUP_CLEAR };
+
+static struct i8080 *cpu;
+static uint8_t *code, *code_end, *p;
+static uint8_t *exit_stub;
+static int (*enter)(void *block);
+
+static void *blocks[65536];
+static uint8_t block_length[65536];
+static uint8_t code_map[65536 + 1];
+static uint8_t shadow[65536];
+static bool page_has_code[256];
+
+/* DAA's result (A in the low byte, the flags in the high) by A, CY and AC,
+ * as they are in AX. */
+static uint16_t daa_table[0x1200];
+
+/* While translating: whether the x86's SF, ZF, PF and CF are the 8080's
+ * flags, what AH's AC is waiting for, and the counts up to here. */
+static bool flags_in_eflags;
+static enum fixup fixup;
+static unsigned cycles, count;
+
+/* The x86 byte registers holding B, C, D, E, H, L and A. */
+static const uint8_t reg8[8] = { 5, 1, 6, 2, 7, 3, 0, 0 };
+/* The x86 registers holding BC, DE, HL and SP. */
+static const uint8_t reg16[4] = { 1, 2, 3, 6 };
+/* The x86 condition codes for NZ, Z, NC, C, PO, PE, P and M. */
+static const uint8_t x86_cc[8] = { 0x5, 0x4, 0x3, 0x2, 0xb, 0xa, 0x9, 0x8 };
+
+static void emit(const uint8_t *bytes, size_t n) {
+    memcpy(p, bytes, n);
+    p += n;
+}
+
+#define EMIT(...) do { \
+        static const uint8_t bytes_[] = { __VA_ARGS__ }; \
+        emit(bytes_, sizeof bytes_); \
+    } while (0)
+
+static void emit8(unsigned v) {
+    *p++ = v;
+}
+
+static void emit32(uint32_t v) {
+    memcpy(p, &v, 4);
+    p += 4;
+}
+
+static void emit64(uint64_t v) {
+    memcpy(p, &v, 8);
+    p += 8;
+}
+
+/* ModRM for x86 register reg and guest register g, M being [RBP+RBX]. */
+static void modrm_guest(int reg, int g) {
+    if (g == M) {
+        emit8(0x44 | reg << 3);
+        emit8(0x1d);
+        emit8(0);
+    } else {
+        emit8(0xc0 | reg << 3 | reg8[g]);
+    }
+}
+
+/* ModRM for reg and [RBP+index]. */
+static void modrm_index(int reg, int index) {
+    emit8(0x44 | reg << 3);
+    emit8(index << 3 | 5);
+    emit8(0);
+}
+
+/* ModRM for reg and [RBP+addr]. */
+static void modrm_abs(int reg, uint16_t addr) {
+    emit8(0x85 | reg << 3);
+    emit32(addr);
+}
+
+static uint8_t *jump8(int opcode) {
+    emit8(opcode);
+    emit8(0);
+    return p - 1;
+}
+
+static void land8(uint8_t *at) {
+    *at = p - (at + 1);
+}
+
+static uint8_t *jcc32(int cc) {
+    emit8(0x0f);
+    emit8(0x80 | cc);
+    emit32(0);
+    return p - 4;
+}
+
+static void land32(uint8_t *at) {
+    int32_t rel = p - (at + 4);
+    memcpy(at, &rel, 4);
+}
+
+static void jump_to(const uint8_t *target) {
+    emit8(0xe9);
+    emit32(target - (p + 4));
+}
+
+static void flags_to_eflags(void) {
+    if (!flags_in_eflags)
+        EMIT(0x9e);                             /* SAHF */
+    flags_in_eflags = true;
+}
+
+/* Emits AC's fix-up, for a path which leaves; the state doesn't change. */
+static void emit_fixup(void) {
+    if (fixup == FIXUP_FLIP)
+        EMIT(0x80, 0xf4, 0x10);                 /* XOR AH,10H */
+    else if (fixup == FIXUP_CLEAR)
+        EMIT(0x80, 0xe4, 0xef);                 /* AND AH,0EFH */
+}
+
+static void carry_to_ah(void) {
+    EMIT(0xd0, 0xdc, 0xd0, 0xc4);               /* RCR AH,1; ROL AH,1 */
+}
+
+/* Leaves for pc, going straight to its block if it has one. */
+static void emit_exit(enum exit_reason reason, uint16_t pc, unsigned n_cycles, unsigned n_insns) {
+    emit_fixup();
+    EMIT(0x4d, 0x8d, 0x9b);                     /* LEA R11,[R11+n_cycles] */
+    emit32(n_cycles);
+    EMIT(0x4d, 0x8d, 0x92);                     /* LEA R10,[R10+n_insns] */
+    emit32(n_insns);
+    if (reason == EXIT_LOOKUP) {
+        EMIT(0x4d, 0x8b, 0x85);                 /* MOV R8,[R13+pc*8] */
+        emit32(pc * 8);
+        EMIT(0x4d, 0x85, 0xc0,                  /* TEST R8,R8 */
+             0x74, 0x03,                        /* JZ $+3 */
+             0x41, 0xff, 0xe0);                 /* JMP R8 */
+    }
+    emit8(0xbf);                                /* MOV EDI,pc */
+    emit32(pc);
+    EMIT(0x41, 0xb9);                           /* MOV R9D,reason */
+    emit32(reason);
+    jump_to(exit_stub);
+}
+
+/* The same for the pc in EDI. */
+static void emit_exit_indirect(unsigned n_cycles, unsigned n_insns) {
+    emit_fixup();
+    EMIT(0x4d, 0x8d, 0x9b);
+    emit32(n_cycles);
+    EMIT(0x4d, 0x8d, 0x92);
+    emit32(n_insns);
+    EMIT(0x4d, 0x8b, 0x44, 0xfd, 0x00,          /* MOV R8,[R13+RDI*8] */
+         0x4d, 0x85, 0xc0, 0x74, 0x03, 0x41, 0xff, 0xe0,
+         0x45, 0x31, 0xc9);                     /* XOR R9D,R9D */
+    jump_to(exit_stub);
+}
+
+/* Leaves for next if the store just done, at [index] (or at addr if index
+ * is negative), hit translated code. */
+static void check_store(int index, uint16_t addr, bool word, uint16_t next) {
+    uint8_t *skip;
+
+    if (word)
+        emit8(0x66);
+    emit8(0x41);
+    emit8(word ? 0x83 : 0x80);                  /* CMP [R14+...],0 */
+    if (index < 0) {
+        emit8(0xbe);
+        emit32(addr);
+    } else {
+        emit8(0x3c);
+        emit8(index << 3 | 6);
+    }
+    emit8(0);
+    skip = jump8(0x74);
+    emit_exit(EXIT_SMC, next, cycles, count);
+    land8(skip);
+}
+
+static void sp_add(int n) {
+    EMIT(0x8d, 0x76);                           /* LEA ESI,[RSI+n] */
+    emit8(n);
+    EMIT(0x0f, 0xb7, 0xf6);                     /* MOVZX ESI,SI */
+}
+
+/* Pushes ret and leaves for target, extra T-states on. */
+static void emit_call(uint16_t target, uint16_t ret, unsigned extra) {
+    bool in_eflags = flags_in_eflags;
+
+    sp_add(-2);
+    EMIT(0x66, 0xc7, 0x44, 0x35, 0x00);         /* MOV WORD [RBP+RSI],ret */
+    emit8(ret);
+    emit8(ret >> 8);
+    cycles += extra;
+    check_store(6, 0, true, target);
+    emit_exit(EXIT_LOOKUP, target, cycles, count);
+    cycles -= extra;
+    flags_in_eflags = in_eflags;
+}
+
+static void emit_ret(unsigned extra) {
+    EMIT(0x0f, 0xb7);                           /* MOVZX EDI,WORD [RBP+RSI] */
+    modrm_index(7, 6);
+    sp_add(2);
+    emit_exit_indirect(cycles + extra, count);
+}
+
+static int length_of(uint8_t op) {
+    if ((op & 0xc7) == 0x06 || (op & 0xc7) == 0xc6 || op == 0xd3 || op == 0xdb)
+        return 2;
+    if ((op & 0xcf) == 0x01 || (op & 0xe7) == 0x22 || (op & 0xc7) == 0xc2 ||
+        (op & 0xc7) == 0xc4 || op == 0xc3 || op == 0xcb || (op & 0xcf) == 0xcd)
+        return 3;
+    return 1;
+}
+
+static uint8_t flags_written(uint8_t op) {
+    if ((op & 0xc0) == 0x80 || (op & 0xc7) == 0xc6 || op == 0x27 || op == 0xf1)
+        return ALL_FLAGS;
+    if ((op & 0xc6) == 0x04)                    /* INR, DCR */
+        return ALL_FLAGS & ~I8080_CY;
+    if ((op & 0xe7) == 0x07 || (op & 0xcf) == 0x09 || op == 0x37 || op == 0x3f)
+        return I8080_CY;
+    return 0;
+}
+
+static uint8_t flags_read(uint8_t op) {
+    if ((op & 0xe8) == 0x88 || (op & 0xef) == 0xce || op == 0x17 || op == 0x1f || op == 0x3f)
+        return I8080_CY;
+    if (op == 0x27)
+        return I8080_CY | I8080_AC;
+    /* PUSH PSW, and the conditionals, which leave when taken */
+    if (op == 0xf5 || (op & 0xc7) == 0xc0 || (op & 0xc7) == 0xc2 || (op & 0xc7) == 0xc4)
+        return ALL_FLAGS;
+    return 0;
+}
+
+/* Instructions which store, and may leave just after. */
+static bool stores(uint8_t op) {
+    return ((op & 0xf8) == 0x70 && op != 0x76) || op == 0x34 || op == 0x35 || op == 0x36 ||
+        op == 0x02 || op == 0x12 || op == 0x22 || op == 0x32 || (op & 0xcf) == 0xc5 || op == 0xe3;
+}
+
+static bool ends_block(uint8_t op) {
+    return op == 0xc3 || op == 0xcb || op == 0xc9 || op == 0xd9 || op == 0xe9 ||
+        (op & 0xcf) == 0xcd || (op & 0xc7) == 0xc7 ||
+        op == 0x76 || op == 0xd3 || op == 0xdb;
+}
+
+static void translate_alu(int operation, int src, bool immediate, uint8_t imm, uint8_t need) {
+    static const uint8_t rm_op[8] = { 0x02, 0x12, 0x2a, 0x1a, 0x22, 0x32, 0x0a, 0x3a };
+    static const uint8_t imm_op[8] = { 0x04, 0x14, 0x2c, 0x1c, 0x24, 0x34, 0x0c, 0x3c };
+
+    if (operation == 1 || operation == 3)       /* ADC, SBB */
+        flags_to_eflags();
+    if (operation == 4 && (need & I8080_AC)) {
+        /* EDI = (A | v) & 8, moved up to where AC is in AH */
+        if (immediate) {
+            EMIT(0x89, 0xc7, 0x81, 0xcf);       /* MOV EDI,EAX; OR EDI,imm */
+            emit32(imm);
+        } else {
+            EMIT(0x0f, 0xb6);                   /* MOVZX EDI,src */
+            modrm_guest(7, src);
+            EMIT(0x09, 0xc7);                   /* OR EDI,EAX */
+        }
+        EMIT(0x83, 0xe7, 0x08, 0xc1, 0xe7, 0x09);
+    }
+
+    if (immediate) {
+        emit8(imm_op[operation]);
+        emit8(imm);
+    } else {
+        emit8(rm_op[operation]);
+        modrm_guest(0, src);
+    }
+    flags_in_eflags = true;
+    fixup = FIXUP_NONE;
+    if (!need)
+        return;
+
+    EMIT(0x9f);                                 /* LAHF */
+    if (!(need & I8080_AC))
+        return;
+    switch (operation) {
+    case 2:
+    case 3:
+    case 7:
+        fixup = FIXUP_FLIP;
+        break;
+    case 4:
+        EMIT(0x80, 0xe4, 0xef, 0x09, 0xf8);     /* AND AH,0EFH; OR EAX,EDI */
+        flags_in_eflags = false;
+        break;
+    case 5:
+    case 6:
+        fixup = FIXUP_CLEAR;
+        break;
+    }
+}
+
+/* Translates the instruction at pc, with live the flags looked at after it;
+ * returns true if it ends the block. */
+static bool translate_insn(uint16_t pc, uint8_t live) {
+    const uint8_t *mem = cpu->mem;
+    uint8_t op = mem[pc];
+    uint16_t next = pc + length_of(op);
+    uint8_t imm8 = mem[(uint16_t) (pc + 1)];
+    uint16_t imm16 = imm8 | mem[(uint16_t) (pc + 2)] << 8;
+    uint8_t need = flags_written(op) & live;
+    int dst = (op >> 3) & 7, src = op & 7, rp = (op >> 4) & 3;
+    uint8_t *at;
+    bool in_eflags;
+
+    if (op == 0x76) {                           /* HLT: the trap */
+        emit_exit(EXIT_HALT, next, cycles, count);
+        return true;
+    }
+    if (op == 0xd3 || op == 0xdb) {            /* OUT, IN: done by the C side */
+        emit_exit(EXIT_IO, pc, cycles, count);
+        return true;
+    }
+    cycles += i8080_cycles[op];
+    count++;
+
+    /* The undocumented opcodes are all other instructions' */
+    if (op == 0xcb)
+        op = 0xc3;
+    else if (op == 0xd9)
+        op = 0xc9;
+    else if ((op & 0xcf) == 0xcd)
+        op = 0xcd;
+
+    switch (op >> 6) {
+    case 1:                                     /* MOV */
+        if (dst == M) {
+            emit8(0x88);
+            modrm_guest(reg8[src], M);
+            check_store(3, 0, false, next);
+            flags_in_eflags = false;
+        } else if (dst != src) {
+            emit8(0x8a);
+            modrm_guest(reg8[dst], src);
+        }
+        return false;
+    case 2:
+        translate_alu(dst, src, false, 0, need);
+        return false;
+    }
+
+    if ((op & 0xc7) == 0xc6) {
+        translate_alu(dst, 0, true, imm8, need);
+        return false;
+    }
+
+    if ((op & 0xc6) == 0x04) {                  /* INR, DCR */
+        if (need && (live & I8080_CY))
+            flags_to_eflags();
+        emit8(0xfe);
+        modrm_guest(op & 1, dst);
+        if (need) {
+            EMIT(0x9f);
+            flags_in_eflags = true;
+            fixup = ((op & 1) && (need & I8080_AC)) ? FIXUP_FLIP : FIXUP_NONE;
+        }
+        if (dst == M) {
+            check_store(3, 0, false, next);
+            flags_in_eflags = false;
+        }
+        return false;
+    }
+
+    if ((op & 0xc7) == 0x06) {                  /* MVI */
+        if (dst == M) {
+            emit8(0xc6);
+            modrm_guest(0, M);
+            emit8(imm8);
+            check_store(3, 0, false, next);
+            flags_in_eflags = false;
+        } else {
+            emit8(0xb0 | reg8[dst]);
+            emit8(imm8);
+        }
+        return false;
+    }
+
+    if ((op & 0xc7) == 0xc2 || (op & 0xc7) == 0xc4 || (op & 0xc7) == 0xc0) {
+        /* Jcc, Ccc and Rcc: the taken path leaves */
+        flags_to_eflags();
+        in_eflags = flags_in_eflags;
+        at = jcc32(x86_cc[dst] ^ 1);
+        if ((op & 7) == 2)
+            emit_exit(EXIT_LOOKUP, imm16, cycles, count);
+        else if ((op & 7) == 4)
+            emit_call(imm16, next, 6);
+        else
+            emit_ret(6);
+        land32(at);
+        flags_in_eflags = in_eflags;
+        return false;
+    }
+
+    if ((op & 0xc7) == 0xc7) {                  /* RST */
+        emit_call(op & 0x38, next, 0);
+        return true;
+    }
+
+    if ((op & 0xcf) == 0xc5) {                  /* PUSH */
+        if (rp == 3) {
+            emit_fixup();
+            fixup = FIXUP_NONE;
+            EMIT(0x89, 0xc7, 0x66, 0xc1, 0xc7, 0x08);   /* MOV EDI,EAX; ROL DI,8 */
+        }
+        sp_add(-2);
+        EMIT(0x66, 0x89);
+        modrm_index(rp == 3 ? 7 : reg16[rp], 6);
+        check_store(6, 0, true, next);
+        flags_in_eflags = false;
+        return false;
+    }
+
+    if ((op & 0xcf) == 0xc1) {                  /* POP */
+        if (rp == 3) {
+            EMIT(0x0f, 0xb7);                   /* MOVZX EAX,WORD [RBP+RSI] */
+            modrm_index(0, 6);
+            EMIT(0x66, 0xc1, 0xc0, 0x08,        /* ROL AX,8 */
+                 0x80, 0xe4, 0xd7,              /* AND AH,0D7H */
+                 0x80, 0xcc, 0x02);             /* OR AH,2 */
+            fixup = FIXUP_NONE;
+            flags_in_eflags = false;
+        } else {
+            EMIT(0x66, 0x8b);
+            modrm_index(reg16[rp], 6);
+        }
+        sp_add(2);
+        return false;
+    }
+
+    if ((op & 0xcf) == 0x01) {                  /* LXI */
+        emit8(0xb8 | reg16[rp]);
+        emit32(imm16);
+        return false;
+    }
+
+    if ((op & 0xc7) == 0x03) {                  /* INX, DCX */
+        int r = reg16[rp];
+        emit8(0x8d);                            /* LEA r,[r+1] (or -1) */
+        emit8(0x40 | r << 3 | r);
+        emit8(op & 8 ? 0xff : 0x01);
+        emit8(0x0f);                            /* MOVZX r,r */
+        emit8(0xb7);
+        emit8(0xc0 | r << 3 | r);
+        return false;
+    }
+
+    if ((op & 0xcf) == 0x09) {                  /* DAD */
+        EMIT(0x66, 0x01);
+        emit8(0xc0 | reg16[rp] << 3 | 3);
+        if (need)
+            carry_to_ah();
+        flags_in_eflags = false;
+        return false;
+    }
+
+    switch (op) {
+    case 0x00:
+    case 0x08:
+    case 0x10:
+    case 0x18:
+    case 0x20:
+    case 0x28:
+    case 0x30:
+    case 0x38:
+        return false;
+
+    case 0x02:                                  /* STAX */
+    case 0x12:
+        emit8(0x88);
+        modrm_index(0, reg16[rp]);
+        check_store(reg16[rp], 0, false, next);
+        flags_in_eflags = false;
+        return false;
+    case 0x0a:                                  /* LDAX */
+    case 0x1a:
+        emit8(0x8a);
+        modrm_index(0, reg16[rp]);
+        return false;
+    case 0x22:                                  /* SHLD */
+        EMIT(0x66, 0x89);
+        modrm_abs(3, imm16);
+        check_store(-1, imm16, true, next);
+        flags_in_eflags = false;
+        return false;
+    case 0x2a:                                  /* LHLD */
+        EMIT(0x66, 0x8b);
+        modrm_abs(3, imm16);
+        return false;
+    case 0x32:                                  /* STA */
+        emit8(0x88);
+        modrm_abs(0, imm16);
+        check_store(-1, imm16, false, next);
+        flags_in_eflags = false;
+        return false;
+    case 0x3a:                                  /* LDA */
+        emit8(0x8a);
+        modrm_abs(0, imm16);
+        return false;
+
+    case 0x07:                                  /* RLC */
+        EMIT(0xd0, 0xc0);
+        if (need)
+            carry_to_ah();
+        return false;
+    case 0x0f:                                  /* RRC */
+        EMIT(0xd0, 0xc8);
+        if (need)
+            carry_to_ah();
+        return false;
+    case 0x17:                                  /* RAL */
+        flags_to_eflags();
+        EMIT(0xd0, 0xd0);
+        if (need)
+            carry_to_ah();
+        return false;
+    case 0x1f:                                  /* RAR */
+        flags_to_eflags();
+        EMIT(0xd0, 0xd8);
+        if (need)
+            carry_to_ah();
+        return false;
+
+    case 0x27:                                  /* DAA */
+        emit_fixup();
+        fixup = FIXUP_NONE;
+        EMIT(0x89, 0xc7,                        /* MOV EDI,EAX */
+             0x81, 0xe7, 0xff, 0x11, 0x00, 0x00, /* AND EDI,11FFH */
+             0x49, 0xb8);                       /* MOV R8,daa_table */
+        emit64((uintptr_t) daa_table);
+        EMIT(0x66, 0x41, 0x8b, 0x04, 0x78);     /* MOV AX,[R8+RDI*2] */
+        flags_in_eflags = false;
+        return false;
+    case 0x2f:                                  /* CMA */
+        EMIT(0xf6, 0xd0);
+        return false;
+    case 0x37:                                  /* STC */
+        if (need) {
+            EMIT(0x80, 0xcc, 0x01);
+            flags_in_eflags = false;
+        }
+        return false;
+    case 0x3f:                                  /* CMC */
+        if (need) {
+            EMIT(0x80, 0xf4, 0x01);
+            flags_in_eflags = false;
+        }
+        return false;
+
+    case 0xc3:                                  /* JMP */
+        emit_exit(EXIT_LOOKUP, imm16, cycles, count);
+        return true;
+    case 0xcd:                                  /* CALL */
+        emit_call(imm16, next, 0);
+        return true;
+    case 0xc9:                                  /* RET */
+        emit_ret(0);
+        return true;
+    case 0xe9:                                  /* PCHL */
+        EMIT(0x89, 0xdf);                       /* MOV EDI,EBX */
+        emit_exit_indirect(cycles, count);
+        return true;
+
+    case 0xe3:                                  /* XTHL */
+        EMIT(0x0f, 0xb7);                       /* MOVZX EDI,WORD [RBP+RSI] */
+        modrm_index(7, 6);
+        EMIT(0x66, 0x89);                       /* MOV [RBP+RSI],BX */
+        modrm_index(3, 6);
+        EMIT(0x89, 0xfb);                       /* MOV EBX,EDI */
+        check_store(6, 0, true, next);
+        flags_in_eflags = false;
+        return false;
+    case 0xeb:                                  /* XCHG */
+        EMIT(0x87, 0xd3);
+        return false;
+    case 0xf9:                                  /* SPHL */
+        EMIT(0x89, 0xde);
+        return false;
+    case 0xf3:                                  /* DI */
+    case 0xfb:                                  /* EI */
+        EMIT(0x49, 0xb8);
+        emit64((uintptr_t) &cpu->inte);
+        EMIT(0x41, 0xc6, 0x00);
+        emit8(op == 0xfb);
+        return false;
+    }
+
+    fprintf(stderr, "jit: opcode %02X not translated\n", op);
+    abort();
+}
+
+static void flush_all(void);
+
+static void *translate(uint16_t start) {
+    struct {
+        uint16_t pc;
+        uint8_t live;
+    } insn[BLOCK_INSNS];
+    int n = 0;
+    uint16_t pc = start;
+    unsigned bytes = 0;
+    uint8_t live = ALL_FLAGS;
+    bool ended = false;
+    void *block;
+
+    if (code_end - p < BLOCK_INSNS * INSN_CODE)
+        flush_all();
+
+    for (;;) {
+        uint8_t op = cpu->mem[pc];
+        insn[n++].pc = pc;
+        bytes += length_of(op);
+        pc += length_of(op);
+        if (ends_block(op) || n == BLOCK_INSNS || bytes + 3 > BLOCK_BYTES)
+            break;
+    }
+
+    for (int i=n-1; i>=0; i--) {
+        uint8_t op = cpu->mem[insn[i].pc];
+        if (stores(op))
+            live = ALL_FLAGS;
+        insn[i].live = live;
+        live = flags_read(op) | (live & ~flags_written(op));
+    }
+
+    for (unsigned i=0; i<bytes; i++) {
+        uint16_t a = start + i;
+        if (!page_has_code[a >> 8]) {
+            memcpy(&shadow[a & 0xff00], &cpu->mem[a & 0xff00], 256);
+            page_has_code[a >> 8] = true;
+        }
+        code_map[a] = 1;
+        shadow[a] = cpu->mem[a];
+    }
+
+    block = p;
+    flags_in_eflags = false;
+    fixup = FIXUP_NONE;
+    cycles = count = 0;
+    for (int i=0; i<n && !ended; i++)
+        ended = translate_insn(insn[i].pc, insn[i].live);
+    if (!ended)
+        emit_exit(EXIT_LOOKUP, pc, cycles, count);
+
+    blocks[start] = block;
+    block_length[start] = bytes;
+    return block;
+}
+
+static void invalidate_page(int page) {
+    unsigned lo = page << 8;
+    unsigned from = lo >= BLOCK_BYTES ? lo - BLOCK_BYTES : 0;
+
+    for (unsigned a=from; a<lo+256; a++)
+        if (blocks[a] && a + block_length[a] > lo)
+            blocks[a] = NULL;
+    memset(&code_map[lo], 0, 256);
+    page_has_code[page] = false;
+}
+
+/* Throws away the blocks on any page whose translated bytes have changed. */
+static void check_code(void) {
+    for (int page=0; page<256; page++) {
+        const uint8_t *m = &cpu->mem[page << 8];
+        uint8_t *s = &shadow[page << 8];
+        if (!page_has_code[page] || !memcmp(m, s, 256))
+            continue;
+        for (int i=0; i<256; i++) {
+            if (code_map[(page << 8) + i] && m[i] != s[i]) {
+                invalidate_page(page);
+                break;
+            }
+        }
+        memcpy(s, m, 256);
+    }
+}
+
+/* The stubs between C and translated code.  Entry saves the registers C
+ * wants kept, loads the 8080's state and jumps to the block; the exit
+ * stub is jumped to with the pc in EDI and the reason in R9D, and stores
+ * it all back. */
+static void emit_stubs(void) {
+    uint8_t o_a = offsetof(struct i8080, a), o_b = offsetof(struct i8080, b);
+    uint8_t o_d = offsetof(struct i8080, d), o_h = offsetof(struct i8080, h);
+    uint8_t o_sp = offsetof(struct i8080, sp), o_pc = offsetof(struct i8080, pc);
+    uint8_t o_cycles = offsetof(struct i8080, cycles);
+    uint8_t o_insns = offsetof(struct i8080, instructions);
+
+    _Static_assert(offsetof(struct i8080, f) == offsetof(struct i8080, a) + 1, "AF");
+    _Static_assert(offsetof(struct i8080, instructions) < 128, "disp8");
+
+    p = code;
+    enter = (int (*)(void *)) p;
+    EMIT(0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57,
+         0x49, 0x89, 0xfc,                      /* MOV R12,RDI */
+         0x49, 0xb8);                           /* MOV R8,cpu */
+    emit64((uintptr_t) cpu);
+    EMIT(0x41, 0x0f, 0xb7, 0x40); emit8(o_a);   /* MOVZX EAX,WORD [R8+a] */
+    EMIT(0x41, 0x0f, 0xb7, 0x48); emit8(o_b);   /* MOVZX ECX,WORD [R8+b] */
+    EMIT(0x66, 0xc1, 0xc1, 0x08);               /* ROL CX,8 */
+    EMIT(0x41, 0x0f, 0xb7, 0x50); emit8(o_d);
+    EMIT(0x66, 0xc1, 0xc2, 0x08);
+    EMIT(0x41, 0x0f, 0xb7, 0x58); emit8(o_h);
+    EMIT(0x66, 0xc1, 0xc3, 0x08);
+    EMIT(0x41, 0x0f, 0xb7, 0x70); emit8(o_sp);  /* MOVZX ESI,WORD [R8+sp] */
+    EMIT(0x4d, 0x8b, 0x58); emit8(o_cycles);    /* MOV R11,[R8+cycles] */
+    EMIT(0x4d, 0x8b, 0x50); emit8(o_insns);     /* MOV R10,[R8+instructions] */
+    EMIT(0x48, 0xbd); emit64((uintptr_t) cpu->mem);     /* MOV RBP,mem */
+    EMIT(0x49, 0xbd); emit64((uintptr_t) blocks);       /* MOV R13,blocks */
+    EMIT(0x49, 0xbe); emit64((uintptr_t) code_map);     /* MOV R14,code_map */
+    EMIT(0x41, 0xff, 0xe4);                     /* JMP R12 */
+
+    exit_stub = p;
+    EMIT(0x49, 0xb8);
+    emit64((uintptr_t) cpu);
+    EMIT(0x66, 0x41, 0x89, 0x40); emit8(o_a);   /* MOV [R8+a],AX */
+    EMIT(0x66, 0xc1, 0xc1, 0x08);
+    EMIT(0x66, 0x41, 0x89, 0x48); emit8(o_b);   /* MOV [R8+b],CX */
+    EMIT(0x66, 0xc1, 0xc2, 0x08);
+    EMIT(0x66, 0x41, 0x89, 0x50); emit8(o_d);
+    EMIT(0x66, 0xc1, 0xc3, 0x08);
+    EMIT(0x66, 0x41, 0x89, 0x58); emit8(o_h);
+    EMIT(0x66, 0x41, 0x89, 0x70); emit8(o_sp);  /* MOV [R8+sp],SI */
+    EMIT(0x66, 0x41, 0x89, 0x78); emit8(o_pc);  /* MOV [R8+pc],DI */
+    EMIT(0x4d, 0x89, 0x58); emit8(o_cycles);
+    EMIT(0x4d, 0x89, 0x50); emit8(o_insns);
+    EMIT(0x44, 0x89, 0xc8,                      /* MOV EAX,R9D */
+         0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b, 0xc3);
+}
+
+static void flush_all(void) {
+    memset(blocks, 0, sizeof blocks);
+    memset(code_map, 0, sizeof code_map);
+    memset(page_has_code, 0, sizeof page_has_code);
+    emit_stubs();
+}
+
+static void init_daa_table(void) {
+    for (unsigned i=0; i<sizeof daa_table / sizeof *daa_table; i++) {
+        unsigned a = i & 0xff, cy = (i >> 8) & 1, ac = (i >> 12) & 1;
+        unsigned adjust = 0, r, f, bits = 0;
+        if (ac || (a & 0x0f) > 9)
+            adjust = 0x06;
+        if (cy || a > 0x99) {
+            adjust |= 0x60;
+            cy = 1;
+        }
+        r = a + adjust;
+        for (int j=0; j<8; j++)
+            bits += (r >> j) & 1;
+        f = (r & 0x80) | ((r & 0xff) ? 0 : I8080_Z) | ((bits & 1) ? 0 : I8080_P) | 0x02;
+        f |= ((a ^ adjust ^ r) & I8080_AC) | cy;
+        daa_table[i] = (r & 0xff) | f << 8;
+    }
+}
+
+/* Translation needs LAHF and SAHF, which the first x86-64s lacked, and
+ * memory it can run. */
+static bool init(struct i8080 *c) {
+    static bool tried, ok;
+    unsigned eax, ebx, ecx, edx;
+
+    if (!tried) {
+        tried = true;
+        if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || !(ecx & 1))
+            return false;
+        code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED)
+            return false;
+        code_end = code + CODE_SIZE;
+        init_daa_table();
+        ok = true;
+    }
+    if (ok) {
+        cpu = c;
+        flush_all();
+    }
+    return ok;
+}
+
+static void do_io(void) {
+    uint8_t op = cpu->mem[cpu->pc];
+    uint8_t port = cpu->mem[(uint16_t) (cpu->pc + 1)];
+
+    if (op == 0xdb)
+        cpu->a = cpu->in ? cpu->in(cpu, port) : 0xff;
+    else if (cpu->out)
+        cpu->out(cpu, port, cpu->a);
+    cpu->pc += 2;
+    cpu->cycles += 10;
+    cpu->instructions++;
+}
+
+void i8080_jit_run(struct i8080 *c) {
+    /* A trace hook needs every instruction, which only the core gives it. */
+    if (c->trace || !init(c)) {
+        i8080_run(c);
+        return;
+    }
+
+    for (;;) {
+        void *block = blocks[cpu->pc];
+        if (!block)
+            block = translate(cpu->pc);
+        switch (enter(block)) {
+        case EXIT_LOOKUP:
+            break;
+        case EXIT_SMC:
+            check_code();
+            break;
+        case EXIT_IO:
+            do_io();
+            break;
+        case EXIT_HALT:
+            if (!cpu->trap || !cpu->trap(cpu))
+                return;
+            check_code();
+            break;
+        }
+    }
+}
+
+#else
+
+void i8080_jit_run(struct i8080 *cpu) {
+    i8080_run(cpu);
+}
+
+#endif
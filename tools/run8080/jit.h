@@ -0,0 +1,12 @@
+/*
+ * jit - run 8080 code translated to x86-64
+ *
+ * See LICENSE for details.
+ */
+
+#pragma once
+#include "i8080.h"
+
+/* As i8080_run(), with the same results, counts included; it is
+ * i8080_run() on hosts it can't translate for, and with a trace hook. */
+extern void i8080_jit_run(struct i8080 *cpu);
@@ -0,0 +1,146 @@
+/*
+ * run8080 - run a CP/M program
+ *
+ * See LICENSE for details.
+ *
+ * The program is loaded at 100H with page zero set up as the CCP would
+ * leave it: the command tail at 80H and the first two arguments parsed
+ * into the FCBs at 5CH and 6CH.  BDOS calls are done by the host (see
+ * bdos.c) and console output goes to stdout, buffered, so a run can be
+ * diffed against a transcript; console input comes from stdin, and the
+ * run ends when that runs out, as well as when the program warm boots.
+ *
+ * usage: run8080 [-s] [-j] prog.com [args]
+ *
+ * -s reports the instructions, T-states and time taken, and the emulated
+ * MIPS, on stderr.
+ *
+ * -j runs the program translated to x86-64 code (see jit.c) rather than
+ * interpreted; the results, counts included, are the same.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "i8080.h"
+#include "bdos.h"
+#include "jit.h"
+
+static uint8_t mem[65536 + 1];
+
+static void usage(void) {
+    fprintf(stderr, "usage: run8080 [-s] [-j] prog.com [args]\n");
+    exit(1);
+}
+
+static void load_program(const char *filename) {
+    FILE *fp = fopen(filename, "rb");
+    size_t n, room = BDOS_ENTRY - 0x100;
+
+    if (!fp) {
+        perror(filename);
+        exit(1);
+    }
+    n = fread(&mem[0x100], 1, room, fp);
+    if (n == room && getc(fp) != EOF) {
+        fprintf(stderr, "%s: too big for the TPA\n", filename);
+        exit(1);
+    }
+    fclose(fp);
+}
+
+/* Parses [d:]name[.ext] into the FCB at addr, as the CCP does. */
+static void parse_fcb(uint16_t addr, const char *arg) {
+    uint8_t *fcb = &mem[addr];
+    int i;
+
+    memset(fcb, 0, 16);
+    memset(fcb + 1, ' ', 11);
+    if (!arg)
+        return;
+    if (arg[0] && arg[1] == ':') {
+        fcb[0] = toupper((unsigned char) arg[0]) - 'A' + 1;
+        arg += 2;
+    }
+    for (i=0; *arg && *arg != '.'; arg++)
+        if (i < 8)
+            fcb[1 + i++] = *arg == '*' ? '?' : toupper((unsigned char) *arg);
+    if (i < 8 && arg[-1] == '*')
+        memset(fcb + 1 + i, '?', 8 - i);
+    if (*arg == '.')
+        arg++;
+    for (i=0; *arg; arg++)
+        if (i < 3)
+            fcb[9 + i++] = *arg == '*' ? '?' : toupper((unsigned char) *arg);
+    if (i && i < 3 && arg[-1] == '*')
+        memset(fcb + 9 + i, '?', 3 - i);
+}
+
+/* The command tail: the arguments, uppercased, each after a blank. */
+static void set_tail(int argc, char **argv) {
+    unsigned n = 0;
+    for (int i=0; i<argc; i++) {
+        mem[0x81 + n++] = ' ';
+        for (const char *p = argv[i]; *p && n < 126; p++)
+            mem[0x81 + n++] = toupper((unsigned char) *p);
+        if (n >= 126)
+            break;
+    }
+    mem[0x80] = n;
+    mem[0x81 + n] = 0;
+}
+
+int main(int argc, char **argv) {
+    static char outbuf[65536];
+    struct i8080 cpu;
+    struct timespec start, end;
+    bool stats = false, translate = false;
+    int i;
+
+    for (i=1; i<argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-s"))
+            stats = true;
+        else if (!strcmp(argv[i], "-j"))
+            translate = true;
+        else
+            usage();
+    }
+    if (i == argc)
+        usage();
+
+    setvbuf(stdout, outbuf, _IOFBF, sizeof outbuf);
+    i8080_reset(&cpu, mem);
+    bdos_init(&cpu);
+    load_program(argv[i]);
+    set_tail(argc - i - 1, argv + i + 1);
+    parse_fcb(0x5c, i + 1 < argc ? argv[i + 1] : NULL);
+    parse_fcb(0x6c, i + 2 < argc ? argv[i + 2] : NULL);
+
+    /* A RET from the program goes to 0, and so warm boots. */
+    cpu.sp = BDOS_ENTRY & 0xff00;
+    i8080_push(&cpu, 0);
+    cpu.pc = 0x100;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (translate)
+        i8080_jit_run(&cpu);
+    else
+        i8080_run(&cpu);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fflush(stdout);
+
+    if (stats) {
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "%llu instructions, %llu T-states, %.3f s, %.1f MIPS\n",
+                (unsigned long long) cpu.instructions, (unsigned long long) cpu.cycles,
+                seconds, seconds > 0 ? cpu.instructions / seconds / 1e6 : 0.0);
+    }
+    if (bdos_stopped() == BDOS_HALT) {
+        fprintf(stderr, "run8080: HLT at %04X\n", (uint16_t) (cpu.pc - 1));
+        return 1;
+    }
+    return 0;
+}